@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "http-sm/http.h"
+#include "http-sm/websocket.h"
+#include "http-private.h"
+
+// Open a large number of idle WebSocket connections over loopback and report how much the
+// server's resident set grows per connection.
+//
+// Usage: bench_websocket-conns [connections] [port]
+//
+// Both ends live on this machine, so the open file limit has to allow for them. Connections
+// come from several loopback addresses, since one address runs out of ephemeral ports.
+
+#define DEFAULT_CONNECTIONS 100000
+#define DEFAULT_PORT 9099
+#define CONNECTIONS_PER_ADDRESS 25000
+
+static int idle_open(struct websocket_connection *conn, struct http_request *request)
+{
+    return 1;
+}
+
+enum http_cgi_state cgi_not_found(struct http_request *request)
+{
+    http_begin_response(request, 404, "text/plain");
+    http_set_content_length(request, 0);
+    http_end_header(request);
+    http_end_body(request);
+
+    return HTTP_CGI_DONE;
+}
+
+struct http_url_handler http_url_tab[] = {
+    {NULL, NULL, NULL},
+};
+
+// The client never answers pings, so keepalive is turned off
+struct websocket_url_handler websocket_url_tab[] = {
+    {"/idle", idle_open, NULL, NULL, NULL, NULL, -1, -1, -1},
+    {NULL, NULL, NULL, NULL, NULL},
+};
+
+static long rss_kb(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+
+    FILE *f = fopen(path, "r");
+    if(!f) {
+        return -1;
+    }
+
+    char line[128];
+    long kb = -1;
+    while(fgets(line, sizeof(line), f)) {
+        if(sscanf(line, "VmRSS: %ld kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+
+    return kb;
+}
+
+static int open_connection(int n, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_in local = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(0x7F000001 + n / CONNECTIONS_PER_ADDRESS),
+    };
+    struct sockaddr_in remote = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(0x7F000001),
+    };
+
+    if((bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0) || (connect(fd, (struct sockaddr *)&remote, sizeof(remote)) < 0)) {
+        close(fd);
+        return -1;
+    }
+
+    const char *request = "GET /idle HTTP/1.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+
+    if(http_write_all(fd, request, strlen(request)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Read up to the end of the response header
+    char buf[256];
+    int len = 0;
+    while(len < sizeof(buf) - 1) {
+        int ret = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if(ret <= 0) {
+            break;
+        }
+        len += ret;
+        buf[len] = 0;
+        if(strstr(buf, "\r\n\r\n")) {
+            break;
+        }
+    }
+
+    if((len < 12) || (strncmp(buf, "HTTP/1.1 101", 12) != 0)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    int connections = (argc > 1) ? atoi(argv[1]) : DEFAULT_CONNECTIONS;
+    int port = (argc > 2) ? atoi(argv[2]) : DEFAULT_PORT;
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    if(connections > (long)rl.rlim_cur - 64) {
+        printf("Open file limit is %ld, using %ld connections\n", (long)rl.rlim_cur, (long)rl.rlim_cur - 64);
+        connections = rl.rlim_cur - 64;
+    }
+
+    fflush(stdout);
+
+    pid_t server = fork();
+    if(server < 0) {
+        perror("fork");
+        return 1;
+    } else if(server == 0) {
+        if(!freopen("/dev/null", "w", stdout)) {
+            return 1;
+        }
+        http_server_main(port);
+        return 1;
+    }
+
+    // Wait for the server to listen
+    int fd = -1;
+    for(int i = 0; (i < 100) && (fd < 0); i++) {
+        usleep(10000);
+        fd = open_connection(0, port);
+    }
+    if(fd < 0) {
+        printf("Could not connect to the server on port %d\n", port);
+        kill(server, SIGTERM);
+        return 1;
+    }
+
+    long rss_before = rss_kb(server);
+    int opened = 1;
+
+    while(opened < connections) {
+        if(open_connection(opened, port) < 0) {
+            printf("Connection %d failed: %s\n", opened, strerror(errno));
+            break;
+        }
+        opened++;
+
+        if(opened % 10000 == 0) {
+            printf("%d connections, server RSS %ld kB\n", opened, rss_kb(server));
+        }
+    }
+
+    sleep(1);
+    long rss_after = rss_kb(server);
+
+    printf("\n");
+    printf("sizeof(struct websocket_connection): %d bytes, budget %d bytes\n", (int)sizeof(struct websocket_connection), WEBSOCKET_CONNECTION_BUDGET);
+    printf("Idle connections:                    %d\n", opened);
+    printf("Server RSS:                          %ld kB -> %ld kB\n", rss_before, rss_after);
+    if(opened > 1) {
+        printf("Per connection:                      %.0f bytes\n", (rss_after - rss_before) * 1024.0 / (opened - 1));
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+
+    return (opened == connections) ? 0 : 1;
+}
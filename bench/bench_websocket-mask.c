@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http-private.h"
+
+// Compare websocket_mask() with the old byte-at-a-time loop
+
+static void mask_bytewise(uint8_t *buf, size_t len, const uint8_t *mask, uint64_t offset)
+{
+    for(size_t i = 0; i < len; i++) {
+        buf[i] ^= mask[(offset++) % 4];
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double run(void (*fn)(uint8_t *, size_t, const uint8_t *, uint64_t), uint8_t *buf, size_t len, size_t total)
+{
+    const uint8_t mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    size_t iterations = total / len;
+    uint64_t offset = 0;
+
+    double start = now();
+    for(size_t i = 0; i < iterations; i++) {
+        // Odd start offsets exercise the mask rotation
+        fn(buf + (i & 1), len, mask, offset);
+        offset += len;
+    }
+    double elapsed = now() - start;
+
+    return (double)iterations * len / elapsed / (1024 * 1024);
+}
+
+int main(int argc, char *argv[])
+{
+    const size_t sizes[] = { 16, 125, 1024, 16 * 1024, 1024 * 1024 };
+    const size_t total = (argc > 1) ? strtoul(argv[1], NULL, 10) << 20 : 512 << 20;
+
+    uint8_t *buf = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1] + 1);
+    if(!buf) {
+        return 1;
+    }
+    memset(buf, 0xAA, sizes[sizeof(sizes) / sizeof(sizes[0]) - 1] + 1);
+
+    printf("%10s %14s %14s %8s\n", "size", "bytewise MB/s", "kernel MB/s", "speedup");
+
+    for(int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double old = run(mask_bytewise, buf, sizes[i], total);
+        double new = run(websocket_mask, buf, sizes[i], total);
+        printf("%10zu %14.0f %14.0f %7.1fx\n", sizes[i], old, new, new / old);
+    }
+
+    free(buf);
+    return 0;
+}
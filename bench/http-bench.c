@@ -0,0 +1,743 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "http-sm/http.h"
+#include "http-sm/websocket.h"
+#include "http-private.h"
+
+// Load generator built on the client. Keeps a number of connections busy with one request each
+// and reports requests per second, throughput and latency percentiles.
+//
+// Usage: http-bench [-c connections] [-d seconds] [-n requests] [-t timeout] [-m message size] url
+//
+// An http:// url is fetched with GET over keep-alive connections, which are opened again whenever
+// the server closes them. The time to connect then counts towards the latency of the request.
+// A ws:// url sends binary messages and waits for each to be echoed, as /ws-echo on bin/http-test
+// does. WebSocket connections are all opened before the run starts.
+
+#define DEFAULT_CONNECTIONS 10
+#define DEFAULT_SECONDS 10
+#define DEFAULT_TIMEOUT_SECS 10
+#define DEFAULT_MESSAGE_SIZE 64
+
+// Latencies are kept in microseconds, in buckets that are exact below 256 and within 1/128 above
+#define HIST_SUB_BITS 8
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB + (64 - HIST_SUB_BITS) * (HIST_SUB / 2))
+
+enum bench_stage {
+    BENCH_CONNECT,
+    BENCH_WRITE,
+    BENCH_READ_HEAD,
+    BENCH_READ_BODY,
+};
+
+struct bench_conn {
+    struct http_request request;
+    struct websocket_connection *ws;
+    enum bench_stage stage;
+    int written;
+    uint64_t start;
+    // Bytes left of a body with a length
+    long long body_left;
+    struct http_chunk_decoder chunk;
+};
+
+struct bench {
+    const char *host;
+    int port;
+    const char *path;
+    int websocket;
+    int connections;
+    long long max_requests;
+    uint64_t timeout_us;
+    int message_size;
+
+    struct http_address address;
+    char *request_text;
+    int request_length;
+    uint8_t *message;
+
+    int epoll_fd;
+    struct bench_conn *conns;
+    long long started;
+    long long completed;
+    long long errors;
+    long long timeouts;
+    long long non_2xx;
+    long long bytes;
+    uint64_t hist[HIST_BUCKETS];
+    uint64_t max_latency;
+};
+
+static volatile sig_atomic_t interrupted;
+
+// The library includes the server, which looks for these
+enum http_cgi_state cgi_not_found(struct http_request *request)
+{
+    return HTTP_CGI_DONE;
+}
+
+struct http_url_handler http_url_tab[] = {
+    {NULL, NULL, NULL},
+};
+
+struct websocket_url_handler websocket_url_tab[] = {
+    {NULL, NULL, NULL, NULL, NULL},
+};
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void on_interrupt(int sig)
+{
+    interrupted = 1;
+}
+
+static int hist_index(uint64_t v)
+{
+    if(v < HIST_SUB) {
+        return v;
+    }
+
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - HIST_SUB_BITS + 1;
+
+    return HIST_SUB + (shift - 1) * (HIST_SUB / 2) + (int)((v >> shift) - HIST_SUB / 2);
+}
+
+// The highest value that falls into bucket i
+static uint64_t hist_value(int i)
+{
+    if(i < HIST_SUB) {
+        return i;
+    }
+
+    int shift = (i - HIST_SUB) / (HIST_SUB / 2) + 1;
+    uint64_t sub = (i - HIST_SUB) % (HIST_SUB / 2) + HIST_SUB / 2;
+
+    return ((sub + 1) << shift) - 1;
+}
+
+static void hist_record(struct bench *b, uint64_t us)
+{
+    b->hist[hist_index(us)]++;
+    if(us > b->max_latency) {
+        b->max_latency = us;
+    }
+}
+
+static uint64_t hist_percentile(const struct bench *b, double percentile)
+{
+    uint64_t total = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++) {
+        total += b->hist[i];
+    }
+
+    if(total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+    if(rank < 1) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for(int i = 0; i < HIST_BUCKETS; i++) {
+        seen += b->hist[i];
+        if(seen >= rank) {
+            uint64_t v = hist_value(i);
+            return (v < b->max_latency) ? v : b->max_latency;
+        }
+    }
+
+    return b->max_latency;
+}
+
+// Split [http|ws]://host[:port][/path] into its parts. The path points into url.
+static int parse_url(struct bench *b, char *url)
+{
+    char *p;
+
+    if(strncmp(url, "http://", 7) == 0) {
+        p = url + 7;
+        b->port = 80;
+    } else if(strncmp(url, "ws://", 5) == 0) {
+        p = url + 5;
+        b->port = 80;
+        b->websocket = 1;
+    } else {
+        return -1;
+    }
+
+    char *slash = strchr(p, '/');
+    size_t host_length = slash ? slash - p : strlen(p);
+    char *host = strndup(p, host_length);
+    if(!host) {
+        return -1;
+    }
+
+    char *colon = strchr(host, ':');
+    if(colon) {
+        *colon = 0;
+        b->port = atoi(colon + 1);
+    }
+
+    if(!*host || (b->port <= 0) || (b->port > 65535)) {
+        free(host);
+        return -1;
+    }
+
+    b->host = host;
+    b->path = slash ? slash : "/";
+
+    return 0;
+}
+
+static void bench_close(struct bench *b, struct bench_conn *c)
+{
+    if(c->request.fd >= 0) {
+        epoll_ctl(b->epoll_fd, EPOLL_CTL_DEL, c->request.fd, NULL);
+        close(c->request.fd);
+        c->request.fd = -1;
+    }
+
+    http_free(&c->request);
+    free(c->request.recv_buf);
+    c->request.recv_buf = 0;
+    http_reset_response(&c->request);
+    c->request.state = HTTP_STATE_CLIENT_IDLE;
+}
+
+static int bench_wait(struct bench *b, struct bench_conn *c, uint32_t events, int op)
+{
+    struct epoll_event ev = {
+        .events = events,
+        .data.u32 = c - b->conns,
+    };
+
+    return epoll_ctl(b->epoll_fd, op, c->request.fd, &ev);
+}
+
+static int bench_connect(struct bench *b, struct bench_conn *c)
+{
+    int fd = socket(b->address.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(fd < 0) {
+        return -1;
+    }
+
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    if((connect(fd, (struct sockaddr *)&b->address.addr, b->address.length) < 0) && (errno != EINPROGRESS)) {
+        close(fd);
+        return -1;
+    }
+
+    c->request.fd = fd;
+    c->stage = BENCH_CONNECT;
+
+    return bench_wait(b, c, EPOLLOUT, EPOLL_CTL_ADD);
+}
+
+static int bench_more(struct bench *b, uint64_t end)
+{
+    if(interrupted) {
+        return 0;
+    }
+
+    if(b->max_requests && (b->started >= b->max_requests)) {
+        return 0;
+    }
+
+    return !end || (now_us() < end);
+}
+
+static void bench_start(struct bench *b, struct bench_conn *c)
+{
+    b->started++;
+    c->start = now_us();
+    c->written = 0;
+
+    if(c->request.fd < 0) {
+        if(bench_connect(b, c) < 0) {
+            b->errors++;
+            bench_close(b, c);
+        }
+        return;
+    }
+
+    c->stage = BENCH_WRITE;
+    bench_wait(b, c, EPOLLOUT, EPOLL_CTL_MOD);
+}
+
+static void bench_websocket_start(struct bench *b, struct bench_conn *c)
+{
+    b->started++;
+    c->start = now_us();
+
+    if(websocket_send(c->ws, b->message, b->message_size, WEBSOCKET_FRAME_OPCODE_BIN) < 0) {
+        b->errors++;
+        websocket_disconnect(c->ws);
+        c->ws = NULL;
+    }
+}
+
+static void bench_done(struct bench *b, struct bench_conn *c)
+{
+    b->completed++;
+    hist_record(b, now_us() - c->start);
+
+    if((c->request.status < 200) || (c->request.status > 299)) {
+        b->non_2xx++;
+    }
+
+    if(c->request.flags & HTTP_FLAG_CONNECTION_CLOSE) {
+        bench_close(b, c);
+    } else {
+        http_free(&c->request);
+        http_reset_response(&c->request);
+        c->request.state = HTTP_STATE_CLIENT_IDLE;
+    }
+}
+
+static void bench_fail(struct bench *b, struct bench_conn *c)
+{
+    b->errors++;
+    bench_close(b, c);
+}
+
+// Read what there is of the body. Returns 1 once it is complete, 0 if more has to come and -1 on errors.
+static int bench_read_body(struct bench *b, struct bench_conn *c)
+{
+    char buf[16384];
+
+    for(;;) {
+        int count = sizeof(buf);
+        int chunked = c->request.flags & HTTP_FLAG_READ_CHUNKED;
+
+        // Reading no further than the end keeps the next response in the buffer
+        if(!chunked && (c->request.read_content_length >= 0)) {
+            if(c->body_left == 0) {
+                return 1;
+            }
+            if(c->body_left < count) {
+                count = c->body_left;
+            }
+        }
+
+        int n = http_recv(&c->request, buf, count);
+
+        if(n < 0) {
+            return ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) ? 0 : -1;
+        } else if(n == 0) {
+            // Without a length or chunks the body ends when the server closes the connection
+            if(!chunked && (c->request.read_content_length < 0)) {
+                c->request.flags |= HTTP_FLAG_CONNECTION_CLOSE;
+                return 1;
+            }
+            return -1;
+        }
+
+        b->bytes += n;
+
+        if(chunked) {
+            if(http_chunk_skip(&c->chunk, buf, n) < 0) {
+                return -1;
+            } else if(http_chunk_done(&c->chunk)) {
+                return 1;
+            }
+        } else if(c->request.read_content_length >= 0) {
+            c->body_left -= n;
+        }
+    }
+}
+
+static void bench_event(struct bench *b, struct bench_conn *c)
+{
+    if(c->stage == BENCH_CONNECT) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if((getsockopt(c->request.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) || err) {
+            bench_fail(b, c);
+            return;
+        }
+
+        c->stage = BENCH_WRITE;
+    }
+
+    if(c->stage == BENCH_WRITE) {
+        while(c->written < b->request_length) {
+            int n = write(c->request.fd, b->request_text + c->written, b->request_length - c->written);
+            if(n < 0) {
+                if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+                    return;
+                }
+                bench_fail(b, c);
+                return;
+            }
+            c->written += n;
+        }
+
+        c->stage = BENCH_READ_HEAD;
+        bench_wait(b, c, EPOLLIN, EPOLL_CTL_MOD);
+        return;
+    }
+
+    if(c->stage == BENCH_READ_HEAD) {
+        int ret = http_recv_response_header(&c->request);
+
+        if(ret == 0) {
+            return;
+        } else if(ret < 0) {
+            bench_fail(b, c);
+            return;
+        }
+
+        // These never have a body, whatever their headers say
+        if((c->request.status == 204) || (c->request.status == 304)) {
+            c->request.flags &= ~HTTP_FLAG_READ_CHUNKED;
+            c->request.read_content_length = 0;
+        }
+
+        b->bytes += c->request.recv_buf->head;
+        c->stage = BENCH_READ_BODY;
+        c->body_left = (c->request.read_content_length > 0) ? c->request.read_content_length : 0;
+        http_chunk_init(&c->chunk);
+    }
+
+    int ret = bench_read_body(b, c);
+
+    if(ret < 0) {
+        bench_fail(b, c);
+    } else if(ret > 0) {
+        bench_done(b, c);
+    }
+}
+
+static void bench_websocket_event(struct bench *b, struct bench_conn *c)
+{
+    // The echo is small, so the rest of a frame that has begun to come is waited for
+    if(websocket_next_frame(c->ws) < 0) {
+        b->errors++;
+        websocket_disconnect(c->ws);
+        c->ws = NULL;
+        return;
+    }
+
+    uint8_t buf[4096];
+    int n;
+
+    while(c->ws->state == WEBSOCKET_STATE_BODY) {
+        if((n = websocket_read(c->ws, buf, sizeof(buf))) <= 0) {
+            b->errors++;
+            websocket_disconnect(c->ws);
+            c->ws = NULL;
+            return;
+        }
+        b->bytes += n;
+    }
+
+    b->completed++;
+    hist_record(b, now_us() - c->start);
+}
+
+static int bench_websocket_open(struct bench *b)
+{
+    int open = 0;
+
+    for(int i = 0; i < b->connections; i++) {
+        struct bench_conn *c = &b->conns[i];
+
+        c->ws = websocket_connect(b->host, b->port, b->path);
+        if(!c->ws) {
+            fprintf(stderr, "WebSocket connection %d to %s:%d%s failed\n", i, b->host, b->port, b->path);
+            continue;
+        }
+
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.u32 = i,
+        };
+        epoll_ctl(b->epoll_fd, EPOLL_CTL_ADD, c->ws->fd, &ev);
+        open++;
+    }
+
+    return open;
+}
+
+// Count the requests that have been waiting too long as errors and give up their connections
+static void bench_expire(struct bench *b, uint64_t now, uint64_t end)
+{
+    for(int i = 0; i < b->connections; i++) {
+        struct bench_conn *c = &b->conns[i];
+        int open = b->websocket ? (c->ws != NULL) : (c->request.fd >= 0);
+
+        if(!open || (c->start == 0) || (now - c->start < b->timeout_us)) {
+            continue;
+        }
+
+        b->timeouts++;
+        c->start = 0;
+
+        if(b->websocket) {
+            websocket_disconnect(c->ws);
+            c->ws = NULL;
+        } else {
+            bench_close(b, c);
+            if(bench_more(b, end)) {
+                bench_start(b, c);
+            }
+        }
+    }
+}
+
+static void bench_run(struct bench *b, uint64_t end)
+{
+    struct epoll_event events[64];
+    uint64_t last_expire = now_us();
+
+    for(;;) {
+        int active = 0;
+
+        for(int i = 0; i < b->connections; i++) {
+            struct bench_conn *c = &b->conns[i];
+
+            if(b->websocket) {
+                active += (c->ws != NULL) && c->start;
+            } else {
+                active += (c->request.fd >= 0) && c->start;
+            }
+        }
+
+        if(!active) {
+            break;
+        }
+
+        int n = epoll_wait(b->epoll_fd, events, sizeof(events) / sizeof(events[0]), 100);
+
+        if((n < 0) && (errno != EINTR)) {
+            perror("epoll_wait");
+            break;
+        }
+
+        for(int i = 0; i < n; i++) {
+            struct bench_conn *c = &b->conns[events[i].data.u32];
+
+            if(b->websocket) {
+                if(!c->ws || !c->start) {
+                    continue;
+                }
+                bench_websocket_event(b, c);
+                c->start = 0;
+                if(c->ws && bench_more(b, end)) {
+                    bench_websocket_start(b, c);
+                }
+                continue;
+            }
+
+            if((c->request.fd < 0) || !c->start) {
+                continue;
+            }
+
+            long long done = b->completed + b->errors;
+            bench_event(b, c);
+
+            // A finished request, successful or not, makes room for the next one
+            if(b->completed + b->errors != done) {
+                c->start = 0;
+                if(bench_more(b, end)) {
+                    bench_start(b, c);
+                }
+            }
+        }
+
+        uint64_t now = now_us();
+
+        if(now - last_expire >= 100000) {
+            bench_expire(b, now, end);
+            last_expire = now;
+        }
+
+        // Requests still out when the time is up are not waited for
+        if(end && (now >= end + b->timeout_us)) {
+            break;
+        }
+
+        if(interrupted) {
+            break;
+        }
+    }
+}
+
+static void bench_report(const struct bench *b, double seconds)
+{
+    printf("  %lld requests in %.2fs, %.2f MB read\n", b->completed, seconds, b->bytes / (1024.0 * 1024.0));
+
+    if(b->errors || b->timeouts || b->non_2xx) {
+        printf("  Errors: %lld, timeouts: %lld, non-2xx responses: %lld\n", b->errors, b->timeouts, b->non_2xx);
+    }
+
+    printf("Requests/sec: %12.2f\n", seconds > 0 ? b->completed / seconds : 0.0);
+    printf("Transfer/sec: %12.2f MB\n", seconds > 0 ? b->bytes / seconds / (1024.0 * 1024.0) : 0.0);
+
+    printf("Latency   p50 %8.3fms  p90 %8.3fms  p99 %8.3fms  p99.9 %8.3fms  max %8.3fms\n",
+           hist_percentile(b, 50.0) / 1000.0, hist_percentile(b, 90.0) / 1000.0, hist_percentile(b, 99.0) / 1000.0,
+           hist_percentile(b, 99.9) / 1000.0, b->max_latency / 1000.0);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-c connections] [-d seconds] [-n requests] [-t timeout] [-m message size] url\n", name);
+    fprintf(stderr, "  url is http://host[:port]/path, or ws://host[:port]/path to time echoed WebSocket messages\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static struct bench bench;
+    struct bench *b = &bench;
+    int seconds = -1;
+    int timeout = DEFAULT_TIMEOUT_SECS;
+    int opt;
+
+    b->connections = DEFAULT_CONNECTIONS;
+    b->message_size = DEFAULT_MESSAGE_SIZE;
+
+    while((opt = getopt(argc, argv, "c:d:n:t:m:h")) != -1) {
+        switch(opt) {
+        case 'c':
+            b->connections = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 'n':
+            b->max_requests = atoll(optarg);
+            break;
+        case 't':
+            timeout = atoi(optarg);
+            break;
+        case 'm':
+            b->message_size = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if((optind != argc - 1) || (parse_url(b, argv[optind]) < 0) || (b->connections <= 0) || (timeout <= 0) ||
+       (b->message_size < 0) || (b->max_requests < 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // A request count alone runs until it is reached, otherwise the duration ends the run
+    if((seconds < 0) && !b->max_requests) {
+        seconds = DEFAULT_SECONDS;
+    }
+
+    b->timeout_us = (uint64_t)timeout * 1000000;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_interrupt);
+
+    b->conns = calloc(b->connections, sizeof(*b->conns));
+    b->epoll_fd = epoll_create1(0);
+    if(!b->conns || (b->epoll_fd < 0)) {
+        perror("http-bench");
+        return 1;
+    }
+
+    for(int i = 0; i < b->connections; i++) {
+        http_request_init(&b->conns[i].request);
+        b->conns[i].request.host = (char *)b->host;
+        b->conns[i].request.port = b->port;
+        b->conns[i].request.fd = -1;
+    }
+
+    if(b->websocket) {
+        b->message = malloc(b->message_size + 1);
+        if(!b->message) {
+            perror("http-bench");
+            return 1;
+        }
+        for(int i = 0; i < b->message_size; i++) {
+            b->message[i] = 'a' + i % 26;
+        }
+
+        if(bench_websocket_open(b) == 0) {
+            return 1;
+        }
+    } else {
+        if(http_resolve(b->host, b->port, &b->address, 1, http_clock()) < 1) {
+            fprintf(stderr, "Could not resolve %s\n", b->host);
+            return 1;
+        }
+
+        const char *fmt = "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: " HTTP_USER_AGENT "\r\nConnection: keep-alive\r\n\r\n";
+        b->request_length = snprintf(NULL, 0, fmt, b->path, b->host, b->port);
+        b->request_text = malloc(b->request_length + 1);
+        if(!b->request_text) {
+            perror("http-bench");
+            return 1;
+        }
+        snprintf(b->request_text, b->request_length + 1, fmt, b->path, b->host, b->port);
+    }
+
+    if(seconds >= 0) {
+        printf("Running %ds test @ %s\n", seconds, argv[optind]);
+    } else {
+        printf("Running %lld requests @ %s\n", b->max_requests, argv[optind]);
+    }
+    printf("  %d connections\n", b->connections);
+
+    uint64_t begin = now_us();
+    uint64_t end = (seconds >= 0) ? begin + (uint64_t)seconds * 1000000 : 0;
+
+    for(int i = 0; i < b->connections && bench_more(b, end); i++) {
+        if(!b->websocket) {
+            bench_start(b, &b->conns[i]);
+        } else if(b->conns[i].ws) {
+            bench_websocket_start(b, &b->conns[i]);
+        }
+    }
+
+    bench_run(b, end);
+
+    double elapsed = (now_us() - begin) / 1e6;
+
+    bench_report(b, elapsed);
+
+    for(int i = 0; i < b->connections; i++) {
+        if(b->websocket) {
+            websocket_disconnect(b->conns[i].ws);
+        } else {
+            bench_close(b, &b->conns[i]);
+        }
+    }
+
+    close(b->epoll_fd);
+    free(b->conns);
+    free(b->request_text);
+    free(b->message);
+
+    return (b->completed > 0) ? 0 : 1;
+}
@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "http-config.h"
 
@@ -10,6 +11,161 @@
 #define HTTP_USER_AGENT "esp8266-http/0.1"
 #endif
 
+// Idle client connections kept for reuse, in total and to any one host:port
+#ifndef HTTP_CLIENT_POOL_SIZE
+#ifdef __XTENSA__
+#define HTTP_CLIENT_POOL_SIZE 2
+#else
+#define HTTP_CLIENT_POOL_SIZE 8
+#endif
+#endif
+
+#ifndef HTTP_CLIENT_POOL_PER_HOST
+#define HTTP_CLIENT_POOL_PER_HOST 2
+#endif
+
+// Seconds an idle client connection is kept before it is closed
+#ifndef HTTP_CLIENT_POOL_IDLE_SECS
+#define HTTP_CLIENT_POOL_IDLE_SECS 30
+#endif
+
+// Host names the client remembers the addresses of, and how many addresses for each
+#ifndef HTTP_DNS_CACHE_SIZE
+#ifdef __XTENSA__
+#define HTTP_DNS_CACHE_SIZE 2
+#else
+#define HTTP_DNS_CACHE_SIZE 8
+#endif
+#endif
+
+#ifndef HTTP_DNS_MAX_ADDRESSES
+#ifdef __XTENSA__
+#define HTTP_DNS_MAX_ADDRESSES 2
+#else
+#define HTTP_DNS_MAX_ADDRESSES 4
+#endif
+#endif
+
+// Seconds a lookup is remembered, and a failed one, so a name server that is down is not asked on every request
+#ifndef HTTP_DNS_CACHE_TTL
+#define HTTP_DNS_CACHE_TTL 60
+#endif
+
+#ifndef HTTP_DNS_NEGATIVE_TTL
+#define HTTP_DNS_NEGATIVE_TTL 5
+#endif
+
+// Look up names for the requests that run in the server loop on a helper thread. Without it, a name that
+// is not cached yet is looked up with a blocking getaddrinfo in the server loop.
+#ifndef HTTP_DNS_THREAD
+#ifdef __XTENSA__
+#define HTTP_DNS_THREAD 0
+#else
+#define HTTP_DNS_THREAD 1
+#endif
+#endif
+
+// Client requests that run in the server loop at the same time, the longest body they collect,
+// and the seconds they may take
+#ifndef HTTP_CLIENT_ASYNC_MAX
+#ifdef __XTENSA__
+#define HTTP_CLIENT_ASYNC_MAX 2
+#else
+#define HTTP_CLIENT_ASYNC_MAX 8
+#endif
+#endif
+
+#ifndef HTTP_CLIENT_ASYNC_MAX_BODY
+#ifdef __XTENSA__
+#define HTTP_CLIENT_ASYNC_MAX_BODY 1024
+#else
+#define HTTP_CLIENT_ASYNC_MAX_BODY (64 * 1024)
+#endif
+#endif
+
+#ifndef HTTP_CLIENT_ASYNC_TIMEOUT_SECS
+#define HTTP_CLIENT_ASYNC_TIMEOUT_SECS 10
+#endif
+
+// Lets cgi_proxy pass requests on to another server. Bodies are moved with splice, which only Linux has.
+#ifndef HTTP_SERVER_PROXY
+#if defined(__linux__) && !defined(__XTENSA__)
+#define HTTP_SERVER_PROXY 1
+#else
+#define HTTP_SERVER_PROXY 0
+#endif
+#endif
+
+// Requests cgi_proxy passes on at the same time, and the seconds the upstream server may keep one waiting
+#ifndef HTTP_SERVER_PROXY_MAX
+#define HTTP_SERVER_PROXY_MAX 16
+#endif
+
+#ifndef HTTP_SERVER_PROXY_TIMEOUT_SECS
+#define HTTP_SERVER_PROXY_TIMEOUT_SECS 30
+#endif
+
+// Longest request head, less the request line, that cgi_proxy can pass on. Requests with more get 431.
+#ifndef HTTP_SERVER_PROXY_HEADERS_LEN
+#define HTTP_SERVER_PROXY_HEADERS_LEN 8192
+#endif
+
+// Milliseconds the client waits for one address to answer. A host with several addresses gets a new
+// connection attempt every HTTP_CLIENT_CONNECT_DELAY_MS while the earlier ones are still going (RFC 8305).
+#ifndef HTTP_CLIENT_CONNECT_TIMEOUT_MS
+#define HTTP_CLIENT_CONNECT_TIMEOUT_MS 5000
+#endif
+
+#ifndef HTTP_CLIENT_CONNECT_DELAY_MS
+#define HTTP_CLIENT_CONNECT_DELAY_MS 250
+#endif
+
+// Milliseconds a blocking client request may take, see timeout_ms in struct http_request
+#ifndef HTTP_CLIENT_TIMEOUT_MS
+#define HTTP_CLIENT_TIMEOUT_MS 30000
+#endif
+
+// Longest response head the client reads, and how many of its headers it keeps
+#ifndef HTTP_CLIENT_HEAD_LEN
+#ifdef __XTENSA__
+#define HTTP_CLIENT_HEAD_LEN 1024
+#else
+#define HTTP_CLIENT_HEAD_LEN 4096
+#endif
+#endif
+
+#ifndef HTTP_CLIENT_MAX_HEADERS
+#ifdef __XTENSA__
+#define HTTP_CLIENT_MAX_HEADERS 16
+#else
+#define HTTP_CLIENT_MAX_HEADERS 32
+#endif
+#endif
+
+// Requests http_batch sends ahead of the responses it has read. Bounded so neither side
+// blocks on a full socket buffer while the other is still writing.
+#ifndef HTTP_CLIENT_PIPELINE_DEPTH
+#ifdef __XTENSA__
+#define HTTP_CLIENT_PIPELINE_DEPTH 2
+#else
+#define HTTP_CLIENT_PIPELINE_DEPTH 8
+#endif
+#endif
+
+// Lets the client ask for gzip compressed responses, needs zlib
+#ifndef HTTP_CLIENT_GZIP
+#ifdef __XTENSA__
+#define HTTP_CLIENT_GZIP 0
+#else
+#define HTTP_CLIENT_GZIP 1
+#endif
+#endif
+
+// Idle inflate streams kept for reuse, each holds on to a 32 kB window
+#ifndef HTTP_CLIENT_GZIP_POOL_SIZE
+#define HTTP_CLIENT_GZIP_POOL_SIZE 2
+#endif
+
 enum http_state
 {
     HTTP_STATE_CLIENT                  = 0x80,
@@ -66,6 +222,8 @@ enum http_method
     HTTP_METHOD_POST = 2,
     HTTP_METHOD_DELETE = 3,
     HTTP_METHOD_UNSUPPORTED = 4,
+    // Only sent by the client
+    HTTP_METHOD_PUT = 5,
 };
 
 enum http_status
@@ -77,8 +235,11 @@ enum http_status
     HTTP_STATUS_NOT_FOUND             = 404,
     HTTP_STATUS_METHOD_NOT_ALLOWED    = 405,
     HTTP_STATUS_URI_TOO_LONG          = 414,
+    HTTP_STATUS_HEADERS_TOO_LARGE     = 431,
     HTTP_STATUS_INTERNAL_SERVER_ERROR = 500,
+    HTTP_STATUS_BAD_GATEWAY           = 502,
     HTTP_STATUS_SERVICE_UNAVAILABLE   = 503,
+    HTTP_STATUS_GATEWAY_TIMEOUT       = 504,
     HTTP_STATUS_VERSION_NOT_SUPPORTED = 505,
 
     HTTP_STATUS_ERROR                 =  -1,
@@ -86,10 +247,16 @@ enum http_status
 
 enum http_flags
 {
-    HTTP_FLAG_ACCEPT_GZIP   = 0x01,
-    HTTP_FLAG_READ_CHUNKED  = 0x02,
-    HTTP_FLAG_WRITE_CHUNKED = 0x04,
-    HTTP_FLAG_WEBSOCKET     = 0x08,
+    // Set on a client request before it is sent to ask for a gzip compressed response
+    HTTP_FLAG_ACCEPT_GZIP      = 0x01,
+    HTTP_FLAG_READ_CHUNKED     = 0x02,
+    HTTP_FLAG_WRITE_CHUNKED    = 0x04,
+    HTTP_FLAG_WEBSOCKET        = 0x08,
+    HTTP_FLAG_CONNECTION_CLOSE = 0x10,
+    HTTP_FLAG_WAIT             = 0x20,
+    HTTP_FLAG_READ_GZIP        = 0x40,
+    // Reads of a client request give up at request->deadline, see http_client_set_deadline
+    HTTP_FLAG_DEADLINE         = 0x80,
 };
 
 enum http_cgi_state
@@ -97,10 +264,23 @@ enum http_cgi_state
     HTTP_CGI_DONE,
     HTTP_CGI_MORE,
     HTTP_CGI_NOT_FOUND,
+    // The handler started client requests with http_async_get, and is called again when they are done
+    HTTP_CGI_WAIT,
+    // The handler sent a response the client can tell the end of, with Connection: keep-alive, so the
+    // connection waits for the next request instead of being closed
+    HTTP_CGI_KEEP_ALIVE,
 };
 
 
 struct http_request;
+struct http_gzip;
+struct http_recv_buffer;
+
+// A header of a response to a client request. Both point into the response head.
+struct http_header {
+    const char *name;
+    const char *value;
+};
 
 typedef enum http_cgi_state (*http_url_handler_func)(struct http_request*);
 
@@ -127,6 +307,15 @@ struct http_request
     // This is only used by the client for outgoing requests
     uint16_t port;
     char *content_type;
+    // Inflate state while a gzip compressed body is read
+    struct http_gzip *gzip;
+    // The response head, and what was read of the body with it
+    struct http_recv_buffer *recv_buf;
+    // Milliseconds the client may take to connect, send the request and read the response.
+    // 0 waits for as long as the connection lasts.
+    int timeout_ms;
+    // When the time of a blocking client request is up
+    uint32_t deadline;
 
     // Theses are only used by the server for incoming requests
     uint8_t method;
@@ -134,7 +323,12 @@ struct http_request
     int error;
 
     char *websocket_key;
+    char *websocket_extensions;
     char *etag;
+    time_t if_modified_since;
+    // The header lines as they came, each ending in \r\n, kept for cgi_proxy to pass on
+    char *headers;
+    int headers_length;
 
     char *query;
     char **query_list;
@@ -144,6 +338,68 @@ struct http_request
     void *cgi_data;
 };
 
+// Where an incremental decoder is in a chunked body, see http_chunk_frame
+struct http_chunk_decoder {
+    // Bytes of data left in the current chunk
+    int length;
+    uint8_t state;
+};
+
+struct http_async;
+struct http_connector;
+
+typedef void (*http_async_done_func)(struct http_async *async);
+
+// A client request run by the server loop. When cb_done is called, request.status is
+// the status of the response, or 0 if the request failed, and body holds body_length bytes.
+// The host is looked up on a helper thread, or with HTTP_DNS_THREAD 0 in the server loop, which then
+// blocks for a name that is not cached yet.
+struct http_async {
+    struct http_request request;
+    http_async_done_func cb_done;
+    void *arg;
+    // The server request whose handler waits for this one, if any
+    struct http_request *owner;
+
+    char *body;
+    int body_length;
+    int body_size;
+
+    // The request header, written as the socket takes it
+    char *out;
+    int out_length;
+    int out_index;
+
+    uint32_t deadline;
+    int received;
+    // The connection attempts while there is no request.fd yet
+    struct http_connector *connector;
+    int poll_fd;
+    uint8_t poll_events;
+    uint8_t stage;
+    uint8_t pooled;
+    uint8_t reusable;
+    struct http_chunk_decoder chunk;
+};
+
+// Writes the body of a client request with http_write_bytes. Returns a negative value on errors.
+typedef int (*http_body_writer)(struct http_request *request, void *arg);
+
+// One request of a batch. body is sent with POST and PUT, and may be NULL.
+struct http_batch_request {
+    const char *path;
+    const char *query;
+    uint8_t method;
+    const char *body;
+    int body_length;
+};
+
+// Called with the response header of request index, in order. A request that got no
+// response is reported with response->status 0.
+typedef void (*http_batch_status_func)(int index, struct http_request *response, void *arg);
+// Called with each piece of the body of the response to request index
+typedef void (*http_batch_body_func)(int index, const char *data, int len, void *arg);
+
 struct http_url_handler {
     const char *url;
     http_url_handler_func handler;
@@ -152,6 +408,35 @@ struct http_url_handler {
 
 extern struct http_url_handler http_url_tab[];
 
+enum http_cache_flags
+{
+    HTTP_CACHE_PUBLIC    = 0x01,
+    HTTP_CACHE_PRIVATE   = 0x02,
+    HTTP_CACHE_IMMUTABLE = 0x04,
+    HTTP_CACHE_NO_STORE  = 0x08,
+};
+
+// Cache-Control policy for responses from cgi_fs. The url is a glob pattern
+// where '*' matches any sequence of characters, e.g. "/assets/*" or "*.js".
+// A negative max_age sends "no-cache". The first matching entry is used and
+// the table is terminated by an entry with a NULL url.
+struct http_cache_policy {
+    const char *url;
+    long max_age;
+    uint8_t flags;
+};
+
+extern struct http_cache_policy http_cache_policy_tab[];
+
+// Where cgi_proxy passes requests on to, given as the cgi_arg of its http_url_tab entry.
+// strip is taken off the front of the path if it is there, and may be NULL. host is looked up the way
+// it is for http_async_get.
+struct http_proxy_target {
+    const char *host;
+    int port;
+    const char *strip;
+};
+
 int http_server_main(int port);
 int http_begin_response(struct http_request *request, int status, const char *content_type);
 int http_end_body(struct http_request *request);
@@ -175,6 +460,15 @@ int http_close(struct http_request *request);
 
 void http_request_init(struct http_request *request);
 int http_get_request(struct http_request *request);
+int http_post_request(struct http_request *request, const char *body, int length);
+int http_post_request_stream(struct http_request *request, int length, http_body_writer writer, void *arg);
+int http_post_request_file(struct http_request *request, int fd, long offset, long length);
+const char *http_get_header(struct http_request *request, const char *name);
+int http_get_headers(struct http_request *request, const struct http_header **headers);
+void http_client_pool_clear(void);
+int http_batch(const char *host, int port, const struct http_batch_request *requests, int count,
+               http_batch_status_func cb_status, http_batch_body_func cb_body, void *arg);
+struct http_async *http_async_get(struct http_request *owner, const char *host, int port, const char *path, http_async_done_func cb_done, void *arg);
 
 int http_urldecode(char *dest, const char* src, int max_len);
 int http_urlencode(char *dest, const char* src, int max_len);
@@ -187,6 +481,15 @@ unsigned http_base64_decode_length(const char *buf, unsigned len);
 unsigned http_base64_encode(char *dest, const char *src, unsigned len);
 unsigned http_base64_decode(char *dest, const char *src, unsigned len);
 
+#define HTTP_DATE_LEN 29
+
+int http_format_date(char *dest, time_t t);
+time_t http_parse_date(const char *str);
+
 enum http_cgi_state cgi_fs(struct http_request* request);
 
+#if HTTP_SERVER_PROXY
+enum http_cgi_state cgi_proxy(struct http_request* request);
+#endif
+
 #endif
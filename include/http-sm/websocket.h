@@ -1,9 +1,150 @@
 #ifndef HTTP_SM_WEBSOCKET_H_
 #define HTTP_SM_WEBSOCKET_H_
 
+#ifndef WEBSOCKET_BUFFER_LEN
+#define WEBSOCKET_BUFFER_LEN 128
+#endif
+
+// Largest frame payload that is accepted. Frames that do not fit in the connection buffer are collected in a separate allocation.
+#ifndef WEBSOCKET_MAX_FRAME_LEN
+#ifdef __XTENSA__
+#define WEBSOCKET_MAX_FRAME_LEN 4096
+#else
+#define WEBSOCKET_MAX_FRAME_LEN (1024 * 1024)
+#endif
+#endif
+
+// Bytes of user space memory an idle connection may use, see struct websocket_connection
+#ifndef WEBSOCKET_CONNECTION_BUDGET
+#define WEBSOCKET_CONNECTION_BUDGET (160 + WEBSOCKET_BUFFER_LEN)
+#endif
+
+#ifndef WEBSOCKET_OUT_QUEUE_LEN
+#define WEBSOCKET_OUT_QUEUE_LEN 16
+#endif
+
+// Bytes that may wait in the out queue of one connection before its overflow policy kicks in
+#ifndef WEBSOCKET_OUT_QUEUE_BYTES
+#ifdef __XTENSA__
+#define WEBSOCKET_OUT_QUEUE_BYTES 4096
+#else
+#define WEBSOCKET_OUT_QUEUE_BYTES (64 * 1024)
+#endif
+#endif
+
+// Keepalive defaults in seconds, used when a websocket_url_handler leaves a setting at 0. 0 here disables it.
+#ifndef WEBSOCKET_PING_INTERVAL
+#define WEBSOCKET_PING_INTERVAL 30
+#endif
+
+#ifndef WEBSOCKET_PONG_TIMEOUT
+#define WEBSOCKET_PONG_TIMEOUT 10
+#endif
+
+#ifndef WEBSOCKET_IDLE_TIMEOUT
+#define WEBSOCKET_IDLE_TIMEOUT 0
+#endif
+
+// Slots in the keepalive timer wheel, one per second
+#ifndef WEBSOCKET_TIMER_SLOTS
+#define WEBSOCKET_TIMER_SLOTS 64
+#endif
+
+// Longest message put together for a cb_message_full handler, unless the handler sets max_message_len
+#ifndef WEBSOCKET_MAX_MESSAGE_LEN
+#ifdef __XTENSA__
+#define WEBSOCKET_MAX_MESSAGE_LEN 4096
+#else
+#define WEBSOCKET_MAX_MESSAGE_LEN (1024 * 1024)
+#endif
+#endif
+
+// Message buffers kept for reuse, and the largest buffer that is kept
+#ifndef WEBSOCKET_MESSAGE_POOL_SIZE
+#define WEBSOCKET_MESSAGE_POOL_SIZE 4
+#endif
+
+#ifndef WEBSOCKET_MESSAGE_POOL_MAX_LEN
+#ifdef __XTENSA__
+#define WEBSOCKET_MESSAGE_POOL_MAX_LEN 1024
+#else
+#define WEBSOCKET_MESSAGE_POOL_MAX_LEN (64 * 1024)
+#endif
+#endif
+
+// Threads running handlers that set threaded, 0 runs them in the server loop
+#ifndef WEBSOCKET_WORKER_THREADS
+#ifdef __XTENSA__
+#define WEBSOCKET_WORKER_THREADS 0
+#else
+#define WEBSOCKET_WORKER_THREADS 4
+#endif
+#endif
+
+// Messages a connection may have waiting for a worker before it is closed
+#ifndef WEBSOCKET_WORKER_MAX_JOBS
+#define WEBSOCKET_WORKER_MAX_JOBS 64
+#endif
+
+// Default for websocket_connection.overflow_policy
+#ifndef WEBSOCKET_OVERFLOW_POLICY
+#define WEBSOCKET_OVERFLOW_POLICY WEBSOCKET_OVERFLOW_DROP_NEWEST
+#endif
+
+// Channels with subscribers at the same time. The table of channels grows up to this as they are made,
+// and a channel is dropped when its last subscriber leaves.
+#ifndef WEBSOCKET_MAX_CHANNELS
+#ifdef __XTENSA__
+#define WEBSOCKET_MAX_CHANNELS 8
+#else
+#define WEBSOCKET_MAX_CHANNELS 1024
+#endif
+#endif
+
+// permessage-deflate (RFC 7692), needs zlib
+#ifndef WEBSOCKET_DEFLATE
+#ifdef __XTENSA__
+#define WEBSOCKET_DEFLATE 0
+#else
+#define WEBSOCKET_DEFLATE 1
+#endif
+#endif
+
+#ifndef WEBSOCKET_DEFLATE_WINDOW_BITS
+#define WEBSOCKET_DEFLATE_WINDOW_BITS 15
+#endif
+
+#ifndef WEBSOCKET_DEFLATE_MEM_LEVEL
+#define WEBSOCKET_DEFLATE_MEM_LEVEL 8
+#endif
+
+#ifndef WEBSOCKET_DEFLATE_LEVEL
+#define WEBSOCKET_DEFLATE_LEVEL 6
+#endif
+
+// Always ask for no context takeover, so that zlib state is only held while a message is in flight
+#ifndef WEBSOCKET_DEFLATE_NO_CONTEXT_TAKEOVER
+#define WEBSOCKET_DEFLATE_NO_CONTEXT_TAKEOVER 0
+#endif
+
+// Number of idle zlib streams kept for reuse
+#ifndef WEBSOCKET_DEFLATE_POOL_SIZE
+#define WEBSOCKET_DEFLATE_POOL_SIZE 4
+#endif
+
+// Messages shorter than this are sent uncompressed
+#ifndef WEBSOCKET_DEFLATE_MIN_LEN
+#define WEBSOCKET_DEFLATE_MIN_LEN 64
+#endif
+
+#ifndef WEBSOCKET_DEFLATE_MAX_INFLATED_LEN
+#define WEBSOCKET_DEFLATE_MAX_INFLATED_LEN (1024 * 1024)
+#endif
+
 enum websocket_frame_bits
 {
     WEBSOCKET_FRAME_FIN  = 0x80,
+    WEBSOCKET_FRAME_RSV1 = 0x40,
     WEBSOCKET_FRAME_MASK = 0x80,
     WEBSOCKET_FRAME_LEN  = 0x7F,
     WEBSOCKET_FRAME_LEN_16BIT  = 0x7E,
@@ -52,23 +193,103 @@ enum websocket_state
     WEBSOCKET_STATE_MASK = 0x80,
 };
 
+// What to do when a frame does not fit in the out queue of a slow reader. Compressed frames of a
+// permessage-deflate connection with context takeover are never dropped, the connection is closed instead.
+enum websocket_overflow_policy {
+    WEBSOCKET_OVERFLOW_DROP_NEWEST,
+    WEBSOCKET_OVERFLOW_DROP_OLDEST,
+    // Only the latest frame is interesting, drop everything still waiting
+    WEBSOCKET_OVERFLOW_COALESCE,
+    // Close the connection with status 1008
+    WEBSOCKET_OVERFLOW_CLOSE,
+};
+
 struct websocket_url_handler;
+struct websocket_frame_buf;
+struct websocket_deflate;
+struct websocket_message;
+struct websocket_channel_list;
+
+// An entry in the keepalive timer wheel
+struct websocket_timer {
+    struct websocket_timer *next;
+    struct websocket_timer **pprev;
+    uint32_t expires;
+};
 
+// Frame parsing state comes first, so handling a frame touches as few cache lines as possible.
+// Everything that is only needed while data is waiting to go out, or while a large frame is
+// coming in, is allocated out of line. An idle connection costs one allocation of this struct,
+// which has to stay within WEBSOCKET_CONNECTION_BUDGET.
 struct websocket_connection {
     int fd;
+    uint8_t state;
+    uint8_t frame_opcode;
+    uint8_t frame_mask[4];
+    // Set for connections made with websocket_connect, whose frames are masked
+    uint8_t client;
+    // Messages handed to a worker that it has not finished with
+    uint16_t jobs;
+    // Set while the connection is on the server's list of connections to look at
+    uint8_t dirty;
+    // Events the server is waiting for on fd
+    uint8_t poll_events;
 
     uint64_t frame_length;
     uint64_t frame_index;
-    uint8_t frame_opcode;
-    uint8_t frame_mask[4];
-    enum websocket_state state;
+
+    // Bytes read from the socket but not yet consumed
+    uint16_t buf_index;
+    uint16_t buf_length;
+
+    // One of enum websocket_overflow_policy, may be changed in cb_open
+    uint8_t overflow_policy;
+    // Set when the close policy was hit, the server loop then closes the connection
+    uint8_t out_overflow;
+    // Set between websocket_send_begin and websocket_send_end
+    uint8_t send_fragmented;
+    uint8_t ping_outstanding;
+
+    // Keepalive, in seconds of the server clock
+    uint32_t last_rx;
+    uint32_t last_data;
+    uint32_t ping_sent;
+
+    // Unmasked payload of a frame too large for buf, collected across reads
+    uint32_t payload_length;
+    uint8_t *payload;
+
+    struct websocket_timer timer;
+
+    // The channels it is subscribed to, NULL while it is on none
+    struct websocket_channel_list *channels;
+
+    // Frames waiting for the socket to become writable, NULL when nothing is waiting
+    struct websocket_out_queue *out;
+
+    // Fragmented message being put together for cb_message_full, or NULL
+    struct websocket_message *message;
+
+    // Negotiated permessage-deflate state, or NULL
+    struct websocket_deflate *deflate;
+
+    void *cb_data;
 
     struct websocket_url_handler *handler;
+
+    // Server bookkeeping
+    struct websocket_connection *next;
+    struct websocket_connection **pprev;
+    struct websocket_connection *dirty_next;
+
+    uint8_t buf[WEBSOCKET_BUFFER_LEN];
 };
 
 typedef int (*websocket_url_handler_func_open)(struct websocket_connection*, struct http_request*);
 typedef void (*websocket_url_handler_func_close)(struct websocket_connection*);
 typedef void (*websocket_url_handler_func_message)(struct websocket_connection*);
+typedef void (*websocket_url_handler_func_write)(struct websocket_connection*);
+typedef void (*websocket_url_handler_func_message_full)(struct websocket_connection*, const uint8_t *data, size_t len, enum websocket_frame_opcode opcode);
 
 struct websocket_url_handler {
     const char *url;
@@ -76,6 +297,25 @@ struct websocket_url_handler {
     websocket_url_handler_func_close cb_close;
     websocket_url_handler_func_message cb_message;
     void *data;
+    // Called while a fragmented message is being sent, when the socket is writable and the fragments
+    // sent before have gone out
+    websocket_url_handler_func_write cb_write;
+
+    // Keepalive in seconds. 0 selects the WEBSOCKET_* default and a negative value disables it.
+    // A ping is sent when nothing was received for ping_interval, and the connection is closed
+    // if nothing arrives within pong_timeout after that, or if no message arrives for idle_timeout.
+    int ping_interval;
+    int pong_timeout;
+    int idle_timeout;
+
+    // Called with whole messages instead of cb_message. Fragments are put together and text is
+    // checked to be valid UTF-8 first. data is only valid during the call.
+    websocket_url_handler_func_message_full cb_message_full;
+    // Longest message for cb_message_full, 0 selects WEBSOCKET_MAX_MESSAGE_LEN
+    size_t max_message_len;
+    // Run cb_message_full on a worker thread. Messages from one connection are handled in order, one
+    // at a time. The handler must answer with websocket_reply and not touch the connection otherwise.
+    uint8_t threaded;
 };
 
 extern struct websocket_url_handler websocket_url_tab[];
@@ -84,4 +324,22 @@ int websocket_read(struct websocket_connection *conn, void *buf_, size_t count);
 int websocket_send(struct websocket_connection *conn, const void *buf_, size_t count, enum websocket_frame_opcode opcode);
 void websocket_close(struct websocket_connection *conn, uint8_t *buf, int len);
 
+int websocket_send_begin(struct websocket_connection *conn, const void *buf, size_t count, enum websocket_frame_opcode opcode);
+int websocket_send_continue(struct websocket_connection *conn, const void *buf, size_t count);
+int websocket_send_end(struct websocket_connection *conn, const void *buf, size_t count);
+
+int websocket_subscribe(struct websocket_connection *conn, const char *channel);
+void websocket_unsubscribe(struct websocket_connection *conn, const char *channel);
+int websocket_publish(const char *channel, const void *buf, size_t count, enum websocket_frame_opcode opcode);
+
+// Send a message from a threaded handler. It goes out from the server loop, after any earlier replies.
+int websocket_reply(struct websocket_connection *conn, const void *buf, size_t count, enum websocket_frame_opcode opcode);
+
+// Client side. The connection is blocking and is not handled by the server loop. websocket_next_frame
+// waits for the next frame that is not a ping, answering pings on the way, and returns its opcode.
+// Its payload is then read with websocket_read.
+struct websocket_connection *websocket_connect(const char *host, int port, const char *path);
+int websocket_next_frame(struct websocket_connection *conn);
+void websocket_disconnect(struct websocket_connection *conn);
+
 #endif
@@ -2,8 +2,11 @@
 #define HTTP_CONFIG_H_
 
 #define HTTP_SERVER_MAX_CONNECTIONS 3
+// WebSocket connections are allocated as they are opened, this only limits how many
+#ifndef WEBSOCKET_SERVER_MAX_CONNECTIONS
 #define WEBSOCKET_SERVER_MAX_CONNECTIONS 3
-#define HTTP_LINE_LEN 64
+#endif
+#define HTTP_LINE_LEN 128
 
 #define HTTP_SERVER_TIMEOUT_SECS  4
 #define HTTP_SERVER_TIMEOUT_USECS (500 * 1000)
@@ -17,11 +17,11 @@
 
 #include "http-sm/http.h"
 #include "http-sm/websocket.h"
+#include "http-sm/sha1.h"
 #include "http-private.h"
 #include "log.h"
 
 #define CLOCKID CLOCK_REALTIME
-#define SIG SIGUSR1
 timer_t timerid;
 
 const char *simple_response = "This is a response from \'cgi_simple\'";
@@ -86,6 +86,71 @@ enum http_cgi_state cgi_stream(struct http_request* request)
     }
 }
 
+static int server_port = 8080;
+
+#if HTTP_SERVER_PROXY
+// /proxy/simple is passed on to /simple of this same server
+static struct http_proxy_target proxy_self = {"localhost", 8080, "/proxy"};
+#endif
+
+struct aggregate_state {
+    int done;
+    char body[2][128];
+};
+
+static void aggregate_done(struct http_async *async)
+{
+    struct aggregate_state *state = async->owner->cgi_data;
+    int i = (intptr_t)async->arg;
+
+    snprintf(state->body[i], sizeof(state->body[i]), "%d %s", async->request.status, async->body ? async->body : "");
+    state->done++;
+}
+
+// Fetches /simple and /query from this server at the same time, and answers when both are done
+enum http_cgi_state cgi_aggregate(struct http_request* request)
+{
+    if(request->method != HTTP_METHOD_GET) {
+        return HTTP_CGI_NOT_FOUND;
+    }
+
+    struct aggregate_state *state = request->cgi_data;
+
+    if(!state) {
+        state = calloc(1, sizeof(*state));
+        if(!state) {
+            return HTTP_CGI_NOT_FOUND;
+        }
+        request->cgi_data = state;
+
+        if(!http_async_get(request, "localhost", server_port, "/simple", aggregate_done, (void *)0)) {
+            snprintf(state->body[0], sizeof(state->body[0]), "not started");
+            state->done++;
+        }
+        if(!http_async_get(request, "localhost", server_port, "/query?a=1", aggregate_done, (void *)1)) {
+            snprintf(state->body[1], sizeof(state->body[1]), "not started");
+            state->done++;
+        }
+
+        return HTTP_CGI_WAIT;
+    }
+
+    http_begin_response(request, 200, "text/plain");
+    http_end_header(request);
+
+    for(int i = 0; i < 2; i++) {
+        http_write_string(request, state->body[i]);
+        http_write_string(request, "\r\n");
+    }
+
+    http_end_body(request);
+
+    free(state);
+    request->cgi_data = NULL;
+
+    return HTTP_CGI_DONE;
+}
+
 enum http_cgi_state cgi_query(struct http_request* request)
 {
     if(request->method != HTTP_METHOD_GET) {
@@ -180,23 +245,16 @@ enum http_cgi_state cgi_exit(struct http_request* request)
     exit(0);
 }
 
-struct websocket_connection* ws_time_conn = 0;
-
 int ws_time_open(struct websocket_connection* conn, struct http_request* request)
 {
-    if(ws_time_conn == NULL) {
-        LOG("WS: new connection %d", request->fd);
-        ws_time_conn = conn;
-        return 1;
-    } else {
-        LOG("WS: only supports one connection");
-        return 0;
-    }
+    LOG("WS: new connection %d", request->fd);
+    // A slow reader only needs the current time
+    conn->overflow_policy = WEBSOCKET_OVERFLOW_COALESCE;
+    return websocket_subscribe(conn, "time") == 0;
 }
 
 void ws_time_close(struct websocket_connection* conn)
 {
-    ws_time_conn = 0;
     LOG("WS: closing %d", conn->fd);
 }
 
@@ -224,8 +282,36 @@ void ws_echo_message(struct websocket_connection* conn)
     free(str);
 }
 
+void ws_message_full(struct websocket_connection* conn, const uint8_t *data, size_t len, enum websocket_frame_opcode opcode)
+{
+    websocket_send(conn, data, len, opcode);
+
+    if(opcode == WEBSOCKET_FRAME_OPCODE_TEXT) {
+        LOG("Message: %.*s", (int)len, data);
+    } else {
+        LOG("Binary message of length %d", (int)len);
+    }
+}
+
+// Runs on a worker thread. Hashes the message many times over to stand in for real work.
+void ws_work_message(struct websocket_connection* conn, const uint8_t *data, size_t len, enum websocket_frame_opcode opcode)
+{
+    uint8_t hash[21];
+    http_sha1(hash, (const char *)data, len);
+    for(int i = 0; i < 10000; i++) {
+        http_sha1(hash, (const char *)hash, 20);
+    }
+
+    char hex[41];
+    for(int i = 0; i < 20; i++) {
+        sprintf(hex + 2 * i, "%02x", hash[i]);
+    }
+
+    websocket_reply(conn, hex, 40, WEBSOCKET_FRAME_OPCODE_TEXT);
+}
+
 struct websocket_connection* ws_in_conn = 0;
-struct websocket_connection* ws_out_conn = 0;
+int ws_out_count = 0;
 
 int ws_in_open(struct websocket_connection* conn, struct http_request* request)
 {
@@ -244,9 +330,10 @@ void ws_in_close(struct websocket_connection* conn)
 
 int ws_out_open(struct websocket_connection* conn, struct http_request* request)
 {
-    if(ws_out_conn == 0) {
+    if(websocket_subscribe(conn, "out") == 0) {
         LOG("WS: new out connection %d", request->fd);
-        ws_out_conn = conn;
+        conn->overflow_policy = WEBSOCKET_OVERFLOW_CLOSE;
+        ws_out_count++;
         return 1;
     }
     return 0;
@@ -254,7 +341,7 @@ int ws_out_open(struct websocket_connection* conn, struct http_request* request)
 
 void ws_out_close(struct websocket_connection* conn)
 {
-    ws_out_conn = 0;
+    ws_out_count--;
 }
 
 void ws_in_message(struct websocket_connection* conn)
@@ -265,8 +352,8 @@ void ws_in_message(struct websocket_connection* conn)
     if(n > 0) {
         str[n] = 0;
 
-        if(ws_out_conn) {
-            websocket_send(ws_out_conn, str, n, conn->frame_opcode);
+        if(ws_out_count > 0) {
+            websocket_publish("out", str, n, conn->frame_opcode & WEBSOCKET_FRAME_OPCODE);
         } else {
             char *msg = "There is no out connection";
             websocket_send(conn, msg, strlen(msg), WEBSOCKET_FRAME_OPCODE_TEXT | WEBSOCKET_FRAME_FIN);
@@ -276,23 +363,93 @@ void ws_in_message(struct websocket_connection* conn)
     free(str);
 }
 
+struct ws_stream_state {
+    int line;
+    int num_lines;
+};
+
+int ws_stream_open(struct websocket_connection* conn, struct http_request* request)
+{
+    conn->cb_data = calloc(1, sizeof(struct ws_stream_state));
+    return conn->cb_data != NULL;
+}
+
+void ws_stream_close(struct websocket_connection* conn)
+{
+    free(conn->cb_data);
+    conn->cb_data = NULL;
+}
+
+// Streams the requested number of lines as one fragmented text message
+void ws_stream_message(struct websocket_connection* conn)
+{
+    struct ws_stream_state *state = conn->cb_data;
+    char buf[16];
+    int n = websocket_read(conn, buf, sizeof(buf) - 1);
+
+    if(n > 0 && !conn->send_fragmented) {
+        buf[n] = 0;
+        state->line = 0;
+        state->num_lines = strtol(buf, NULL, 10);
+        websocket_send_begin(conn, "", 0, WEBSOCKET_FRAME_OPCODE_TEXT);
+    }
+}
+
+void ws_stream_write(struct websocket_connection* conn)
+{
+    struct ws_stream_state *state = conn->cb_data;
+    char buf[128];
+    int len = 0;
+    int first = state->line;
+    int ret;
+
+    while((state->line < state->num_lines) && (len < sizeof(buf) - 16)) {
+        len += snprintf(buf + len, sizeof(buf) - len, "line %d\n", state->line++);
+    }
+
+    if(state->line < state->num_lines) {
+        ret = websocket_send_continue(conn, buf, len);
+    } else {
+        ret = websocket_send_end(conn, buf, len);
+    }
+
+    // Not sent, the same lines go again on the next call
+    if(ret < 0) {
+        state->line = first;
+    }
+}
 
 struct http_url_handler http_url_tab[] = {
     {"/simple", cgi_simple, NULL},
     {"/stream", cgi_stream, NULL},
     {"/query", cgi_query, NULL},
     {"/post", cgi_post, NULL},
+    {"/aggregate", cgi_aggregate, NULL},
     {"/wildcard/*", cgi_simple, NULL},
+#if HTTP_SERVER_PROXY
+    {"/proxy/*", cgi_proxy, &proxy_self},
+#endif
     {"/exit", cgi_exit, NULL},
     {"*", cgi_fs, NULL},
     {NULL, NULL, NULL}
 };
 
+struct http_cache_policy http_cache_policy_tab[] = {
+    {"*.min.js", 31536000, HTTP_CACHE_PUBLIC | HTTP_CACHE_IMMUTABLE},
+    {"/private/*", 60, HTTP_CACHE_PRIVATE},
+    {NULL, -1, 0}
+};
+
 struct websocket_url_handler websocket_url_tab[] = {
     {"/ws-echo", ws_echo_open, NULL, ws_echo_message, NULL},
-    {"/ws-time", ws_time_open, ws_time_close, NULL, NULL},
+    // Echoes whole messages, however they were fragmented
+    {"/ws-message", ws_echo_open, NULL, NULL, NULL, NULL, 0, 0, 0, ws_message_full, 0},
+    {"/ws-work", ws_echo_open, NULL, NULL, NULL, NULL, 0, 0, 0, ws_work_message, 0, 1},
+    // Push only, so dead peers are found with pings
+    {"/ws-time", ws_time_open, ws_time_close, NULL, NULL, NULL, 4, 2, 0},
     {"/ws-in", ws_in_open, ws_in_close, ws_in_message, NULL},
     {"/ws-out", ws_out_open, ws_out_close, NULL, NULL},
+    {"/ws-stream", ws_stream_open, ws_stream_close, ws_stream_message, NULL, ws_stream_write},
     {NULL, NULL, NULL, NULL, NULL}
 };
 
@@ -482,6 +639,42 @@ static void test_not_found_request(void **states)
     http_close(&request);
 }
 
+static void test_websocket_client_echo(void **states)
+{
+    struct websocket_connection *conn = websocket_connect("localhost", http_port, "/ws-message");
+    assert_non_null(conn);
+
+    char message[300];
+    for(int i = 0; i < sizeof(message); i++) {
+        message[i] = 'a' + i % 26;
+    }
+
+    assert_int_equal(websocket_send_begin(conn, message, 100, WEBSOCKET_FRAME_OPCODE_TEXT), 100);
+    assert_int_equal(websocket_send(conn, "ping", 4, WEBSOCKET_FRAME_OPCODE_PING), 4);
+    assert_int_equal(websocket_send_end(conn, message + 100, sizeof(message) - 100), sizeof(message) - 100);
+
+    // The pong comes first
+    assert_int_equal(websocket_next_frame(conn), WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_PONG);
+    assert_int_equal(websocket_next_frame(conn), WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_TEXT);
+    assert_int_equal(conn->frame_length, sizeof(message));
+
+    char buf[sizeof(message)];
+    int n = 0;
+    while(n < sizeof(buf)) {
+        int ret = websocket_read(conn, buf + n, sizeof(buf) - n);
+        assert_true(ret > 0);
+        n += ret;
+    }
+    assert_memory_equal(buf, message, sizeof(message));
+
+    websocket_disconnect(conn);
+}
+
+static void test_websocket_client_is_refused_on_unknown_path(void **states)
+{
+    assert_null(websocket_connect("localhost", http_port, "/not_found"));
+}
+
 static void test_that_server_can_handle_a_timeout(void **states)
 {
     struct http_request request;
@@ -506,20 +699,20 @@ const struct CMUnitTest tests[] = {
     cmocka_unit_test(test_query_request_with_arg),
     cmocka_unit_test(test_wildcard_request),
     cmocka_unit_test(test_not_found_request),
+    cmocka_unit_test(test_websocket_client_echo),
+    cmocka_unit_test(test_websocket_client_is_refused_on_unknown_path),
     cmocka_unit_test(test_that_server_can_handle_a_timeout),
 };
 
-static void sig_handler(int sig, siginfo_t *si, void *uc)
+// Runs on a timer thread, not in the server loop
+static void time_tick(union sigval sv)
 {
-    if(si->si_value.sival_ptr != &timerid){
-        printf("Stray signal\n");
-    } else {
-        if(ws_time_conn) {
-            time_t t = time(0);
-            const char *s = asctime(localtime(&t));
-            websocket_send(ws_time_conn, s, strlen(s), WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_TEXT);
-        }
-    }
+    char s[32];
+    time_t t = time(0);
+    struct tm tm;
+
+    asctime_r(localtime_r(&t, &tm), s);
+    websocket_publish("time", s, strlen(s), WEBSOCKET_FRAME_OPCODE_TEXT);
 }
 
 int main(int argc, char *argv[])
@@ -531,18 +724,17 @@ int main(int argc, char *argv[])
             if(argc > 2) {
                 port = strtol(argv[2], NULL, 10);
             }
+            server_port = port;
+#if HTTP_SERVER_PROXY
+            proxy_self.port = port;
+#endif
 
             struct sigevent sev;
             struct itimerspec its;
-            struct sigaction sa;
-
-            sa.sa_flags = SA_SIGINFO;
-            sa.sa_sigaction = sig_handler;
-            sigemptyset(&sa.sa_mask);
-            sigaction(SIG, &sa, NULL);
 
-            sev.sigev_notify = SIGEV_SIGNAL;
-            sev.sigev_signo = SIG;
+            memset(&sev, 0, sizeof(sev));
+            sev.sigev_notify = SIGEV_THREAD;
+            sev.sigev_notify_function = time_tick;
             sev.sigev_value.sival_ptr = &timerid;
             timer_create(CLOCKID, &sev, &timerid);
             /* Start the timer */
@@ -561,6 +753,10 @@ int main(int argc, char *argv[])
 
         srand(time(0));
         http_port = 1024 + (rand() % 1024);
+        server_port = http_port;
+#if HTTP_SERVER_PROXY
+        proxy_self.port = http_port;
+#endif
 
         if(child < 0) {
             perror("fork");
@@ -0,0 +1,658 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __XTENSA__
+#include "lwip/lwip/sockets.h"
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+
+#include "http-sm/http.h"
+#include "http-private.h"
+#include "log.h"
+
+#if HTTP_SERVER_EPOLL
+#include <sys/epoll.h>
+#endif
+
+enum http_async_stage {
+    HTTP_ASYNC_FREE,
+    // Waiting for the lookup of the host on the helper thread
+    HTTP_ASYNC_RESOLVE,
+    HTTP_ASYNC_CONNECT,
+    HTTP_ASYNC_WRITE,
+    HTTP_ASYNC_READ_HEADER,
+    HTTP_ASYNC_READ_BODY,
+    // Finished, waiting for the server loop to call cb_done
+    HTTP_ASYNC_DONE,
+};
+
+static struct http_async http_async_slots[HTTP_CLIENT_ASYNC_MAX];
+
+static void http_async_close_fd(struct http_async *async)
+{
+    if(async->connector) {
+        http_connector_close(async->connector);
+        free(async->connector);
+        async->connector = NULL;
+    }
+
+    if(async->request.fd >= 0) {
+        close(async->request.fd);
+        async->request.fd = -1;
+    }
+    async->poll_fd = -1;
+}
+
+static void http_async_fail(struct http_async *async)
+{
+    async->request.status = 0;
+    async->reusable = 0;
+    async->stage = HTTP_ASYNC_DONE;
+}
+
+// Look the host up and move the connection attempts on. Returns 1 once connected, 0 while waiting and -1 when
+// none of the addresses could be connected to.
+static int http_async_connecting(struct http_async *async)
+{
+    struct http_connector *c = async->connector;
+    int fd;
+
+    if(async->stage == HTTP_ASYNC_RESOLVE) {
+        struct http_address addrs[HTTP_DNS_MAX_ADDRESSES];
+
+        int count = http_resolve_nowait(async->request.host, async->request.port, addrs, HTTP_DNS_MAX_ADDRESSES, http_clock());
+        if(count == 0) {
+            return 0;
+        }
+
+        http_connector_init(c, addrs, count);
+        async->stage = HTTP_ASYNC_CONNECT;
+    }
+
+    int ret = http_connector_poll(c, &fd);
+
+    if(ret < 0) {
+        LOG("Could not connect to %s:%d", async->request.host, async->request.port);
+    } else if(ret > 0) {
+        if(c->index > 0) {
+            http_resolve_prefer(async->request.host, async->request.port, &c->addrs[c->index]);
+        }
+
+#if HTTP_SERVER_EPOLL
+        // The attempt is in the loop's epoll set already
+        if(c->polled & (1 << c->index)) {
+            async->poll_fd = fd;
+            async->poll_events = EPOLLOUT;
+        }
+#endif
+        async->request.fd = fd;
+        async->stage = HTTP_ASYNC_WRITE;
+
+        free(c);
+        async->connector = NULL;
+    }
+
+    return ret;
+}
+
+// Start connecting to the host. Returns -1 if it failed already.
+static int http_async_connect(struct http_async *async)
+{
+    async->connector = malloc(sizeof(*async->connector));
+    if(!async->connector) {
+        return -1;
+    }
+
+    http_connector_init(async->connector, NULL, 0);
+    async->stage = HTTP_ASYNC_RESOLVE;
+
+    return (http_async_connecting(async) < 0) ? -1 : 0;
+}
+
+// Start over on a new connection, after a pooled one turned out to be closed
+static void http_async_retry(struct http_async *async)
+{
+    char *host = async->request.host;
+    char *path = async->request.path;
+    uint16_t port = async->request.port;
+
+    LOG("Request to %s:%d on a pooled connection failed", host, port);
+
+    http_async_close_fd(async);
+    free(async->request.line);
+    http_free(&async->request);
+    memset(&async->request, 0, sizeof(async->request));
+    http_request_init(&async->request);
+
+    async->request.host = host;
+    async->request.path = path;
+    async->request.port = port;
+    async->request.fd = -1;
+    async->pooled = 0;
+    async->out_index = 0;
+    async->received = 0;
+    async->body_length = 0;
+
+    if(http_async_connect(async) < 0) {
+        http_async_fail(async);
+    }
+}
+
+static void http_async_error(struct http_async *async)
+{
+    // Nothing came back, so the server may have closed the pooled connection before it saw the request
+    if(async->pooled && !async->received) {
+        http_async_retry(async);
+    } else {
+        http_async_fail(async);
+    }
+}
+
+static void http_async_complete(struct http_async *async, int reusable)
+{
+    async->reusable = reusable && !(async->request.flags & HTTP_FLAG_CONNECTION_CLOSE);
+    async->stage = HTTP_ASYNC_DONE;
+}
+
+static int http_async_append(struct http_async *async, const char *data, int len)
+{
+    if(len > HTTP_CLIENT_ASYNC_MAX_BODY - async->body_length) {
+        LOG("Response from %s is longer than %d bytes", async->request.host, HTTP_CLIENT_ASYNC_MAX_BODY);
+        return -1;
+    }
+
+    if(async->body_length + len > async->body_size) {
+        int size = async->body_size ? 2 * async->body_size : 256;
+        if(size < async->body_length + len) {
+            size = async->body_length + len;
+        }
+        if(size > HTTP_CLIENT_ASYNC_MAX_BODY) {
+            size = HTTP_CLIENT_ASYNC_MAX_BODY;
+        }
+
+        // One more for a terminating zero, so text bodies can be used as strings
+        char *p = realloc(async->body, size + 1);
+        if(!p) {
+            return -1;
+        }
+        async->body = p;
+        async->body_size = size;
+    }
+
+    memcpy(async->body + async->body_length, data, len);
+    async->body_length += len;
+    async->body[async->body_length] = 0;
+
+    return 0;
+}
+
+// Decode a piece of a chunked body. Returns 1 after the last chunk, -1 on errors and 0 otherwise.
+static int http_async_chunked(struct http_async *async, const char *data, int len)
+{
+    struct http_chunk_decoder *d = &async->chunk;
+
+    while((len > 0) && !http_chunk_done(d)) {
+        int n;
+
+        if(d->state == HTTP_CHUNK_DATA) {
+            n = (len < d->length) ? len : d->length;
+            if(http_async_append(async, data, n) < 0) {
+                return -1;
+            }
+            http_chunk_data(d, n);
+        } else if((n = http_chunk_frame(d, data, len)) < 0) {
+            return -1;
+        }
+
+        data += n;
+        len -= n;
+    }
+
+    return http_chunk_done(d);
+}
+
+static void http_async_body(struct http_async *async, const char *data, int len)
+{
+    struct http_request *request = &async->request;
+
+    if(request->flags & HTTP_FLAG_READ_CHUNKED) {
+        int ret = http_async_chunked(async, data, len);
+        if(ret < 0) {
+            http_async_fail(async);
+        } else if(ret > 0) {
+            http_async_complete(async, 1);
+        }
+    } else if(request->read_content_length >= 0) {
+        int n = (len < request->read_content_length) ? len : request->read_content_length;
+        if(http_async_append(async, data, n) < 0) {
+            http_async_fail(async);
+            return;
+        }
+        request->read_content_length -= n;
+
+        if(!request->read_content_length) {
+            http_async_complete(async, 1);
+        }
+    } else if(http_async_append(async, data, len) < 0) {
+        http_async_fail(async);
+    }
+}
+
+static void http_async_read(struct http_async *async)
+{
+    struct http_request *request = &async->request;
+    char buf[256];
+
+    int n = read(request->fd, buf, sizeof(buf));
+
+    if(n < 0) {
+        if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+            http_async_error(async);
+        }
+        return;
+    }
+
+    if(n == 0) {
+        // Without a length or chunks, the body is whatever comes before the server closes the connection
+        if((async->stage == HTTP_ASYNC_READ_BODY) && (request->read_content_length < 0) && !(request->flags & HTTP_FLAG_READ_CHUNKED)) {
+            http_async_complete(async, 0);
+        } else {
+            LOG("Connection to %s closed before the response was complete", request->host);
+            http_async_error(async);
+        }
+        return;
+    }
+
+    async->received += n;
+
+    int i = 0;
+    if(async->stage == HTTP_ASYNC_READ_HEADER) {
+        while((i < n) && (request->state & (HTTP_STATE_READ | HTTP_STATE_READ_NL))) {
+            http_parse_header(request, buf[i++]);
+        }
+
+        if(http_is_error(request)) {
+            http_async_fail(async);
+            return;
+        }
+
+        if(request->state & (HTTP_STATE_READ | HTTP_STATE_READ_NL)) {
+            return;
+        }
+
+        free(request->line);
+        request->line = 0;
+        request->line_length = 0;
+
+        async->stage = HTTP_ASYNC_READ_BODY;
+        http_chunk_init(&async->chunk);
+
+        if(!(request->flags & HTTP_FLAG_READ_CHUNKED) && (request->read_content_length == 0)) {
+            http_async_complete(async, 1);
+            return;
+        }
+    }
+
+    if(i < n) {
+        http_async_body(async, buf + i, n - i);
+    }
+}
+
+static void http_async_write(struct http_async *async)
+{
+    int n = write(async->request.fd, async->out + async->out_index, async->out_length - async->out_index);
+
+    if(n < 0) {
+        if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+            http_async_error(async);
+        }
+        return;
+    }
+
+    async->out_index += n;
+
+    if(async->out_index == async->out_length) {
+        async->request.line = malloc(HTTP_LINE_LEN);
+        if(!async->request.line) {
+            http_async_fail(async);
+            return;
+        }
+
+        async->request.line_length = HTTP_LINE_LEN;
+        async->request.line_index = 0;
+        async->request.state = HTTP_STATE_CLIENT_READ_VERSION;
+        async->stage = HTTP_ASYNC_READ_HEADER;
+    }
+}
+
+void http_async_handle_events(struct http_async *async, int readable, int writable)
+{
+    // One of the attempts is writable, the one that connected is writable too
+    if((async->stage == HTTP_ASYNC_CONNECT) && writable) {
+        if(http_async_connecting(async) < 0) {
+            http_async_fail(async);
+            return;
+        }
+    }
+
+    if((async->stage == HTTP_ASYNC_WRITE) && writable) {
+        http_async_write(async);
+    } else if(((async->stage == HTTP_ASYNC_READ_HEADER) || (async->stage == HTTP_ASYNC_READ_BODY)) && readable) {
+        http_async_read(async);
+    }
+}
+
+static int http_async_format(struct http_async *async, const char *host, int port, const char *path)
+{
+    const char *format = (port == 80) ?
+        "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: %s\r\nConnection: keep-alive\r\n\r\n" :
+        "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: %s\r\nConnection: keep-alive\r\n\r\n";
+
+    int len = (port == 80) ?
+        snprintf(NULL, 0, format, path, host, HTTP_USER_AGENT) :
+        snprintf(NULL, 0, format, path, host, port, HTTP_USER_AGENT);
+
+    async->out = malloc(len + 1);
+    if(!async->out) {
+        return -1;
+    }
+
+    if(port == 80) {
+        snprintf(async->out, len + 1, format, path, host, HTTP_USER_AGENT);
+    } else {
+        snprintf(async->out, len + 1, format, path, host, port, HTTP_USER_AGENT);
+    }
+
+    async->out_length = len;
+    async->out_index = 0;
+
+    return 0;
+}
+
+static char *http_async_strdup(const char *s)
+{
+    char *p = malloc(strlen(s) + 1);
+    if(p) {
+        strcpy(p, s);
+    }
+    return p;
+}
+
+static void http_async_release(struct http_async *async)
+{
+    free(async->request.host);
+    free(async->request.path);
+    free(async->request.line);
+    http_free(&async->request);
+    free(async->out);
+    free(async->body);
+
+    memset(async, 0, sizeof(*async));
+    async->request.fd = -1;
+    async->poll_fd = -1;
+    async->stage = HTTP_ASYNC_FREE;
+}
+
+// Start a GET request in the server loop. cb_done is called from the loop when it is done, also when it failed.
+// A handler that passes its request as owner and returns HTTP_CGI_WAIT is called again after that.
+// Returns NULL if too many requests are running already. Nothing here blocks, unless HTTP_DNS_THREAD is 0 and
+// the host has not been looked up yet.
+struct http_async *http_async_get(struct http_request *owner, const char *host, int port, const char *path, http_async_done_func cb_done, void *arg)
+{
+    struct http_async *async = NULL;
+
+    for(int i = 0; i < HTTP_CLIENT_ASYNC_MAX; i++) {
+        if(http_async_slots[i].stage == HTTP_ASYNC_FREE) {
+            async = &http_async_slots[i];
+            break;
+        }
+    }
+
+    if(!async) {
+        LOG("No room for a request to %s", host);
+        return NULL;
+    }
+
+    if(port <= 0) {
+        port = 80;
+    }
+
+    memset(async, 0, sizeof(*async));
+    http_request_init(&async->request);
+    async->request.fd = -1;
+    async->request.port = port;
+    async->request.host = http_async_strdup(host);
+    async->request.path = http_async_strdup(path);
+    async->poll_fd = -1;
+    async->cb_done = cb_done;
+    async->arg = arg;
+    async->owner = owner;
+    async->deadline = http_clock() + HTTP_CLIENT_ASYNC_TIMEOUT_SECS;
+
+    if(!async->request.host || !async->request.path || (http_async_format(async, host, port, path) < 0)) {
+        http_async_release(async);
+        return NULL;
+    }
+
+    // Failures are reported through cb_done from the loop, never before this returns
+    int fd = http_client_pool_take(host, port);
+    if(fd >= 0) {
+        http_set_nonblock(fd, 1);
+        async->request.fd = fd;
+        async->pooled = 1;
+        async->stage = HTTP_ASYNC_WRITE;
+    } else if(http_async_connect(async) < 0) {
+        http_async_fail(async);
+    }
+
+    return async;
+}
+
+int http_async_pending(struct http_request *owner)
+{
+    int count = 0;
+
+    for(int i = 0; i < HTTP_CLIENT_ASYNC_MAX; i++) {
+        if((http_async_slots[i].stage != HTTP_ASYNC_FREE) && (http_async_slots[i].owner == owner)) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// Move on the requests that wait for time to pass or for a lookup, and fail the ones that took too long
+void http_async_expire(uint32_t now)
+{
+    for(int i = 0; i < HTTP_CLIENT_ASYNC_MAX; i++) {
+        struct http_async *async = &http_async_slots[i];
+
+        if(((async->stage == HTTP_ASYNC_RESOLVE) || (async->stage == HTTP_ASYNC_CONNECT)) && (http_async_connecting(async) < 0)) {
+            http_async_fail(async);
+        }
+
+        if((async->stage != HTTP_ASYNC_FREE) && (async->stage != HTTP_ASYNC_DONE) && ((int32_t)(now - async->deadline) >= 0)) {
+            LOG("Request to %s timed out", async->request.host);
+            http_async_fail(async);
+        }
+    }
+}
+
+// Seconds until the loop has to wake up for the requests, or -1 if they only wait for their sockets
+int http_async_timer_next(uint32_t now)
+{
+    int next = -1;
+
+    for(int i = 0; i < HTTP_CLIENT_ASYNC_MAX; i++) {
+        struct http_async *async = &http_async_slots[i];
+
+        if(async->stage == HTTP_ASYNC_DONE) {
+            return 0;
+        } else if(async->stage != HTTP_ASYNC_FREE) {
+            int left = (int32_t)(async->deadline - now);
+            if(left < 0) {
+                left = 0;
+            }
+            if((next < 0) || (left < next)) {
+                next = left;
+            }
+        }
+    }
+
+    return next;
+}
+
+// Milliseconds until a connection attempt is due or times out, or -1 if there is none
+int http_async_connect_next(uint32_t now)
+{
+    int next = -1;
+
+    for(int i = 0; i < HTTP_CLIENT_ASYNC_MAX; i++) {
+        struct http_async *async = &http_async_slots[i];
+
+        if(async->stage == HTTP_ASYNC_CONNECT) {
+            int left = http_connector_timer_next(async->connector, now);
+            if((left >= 0) && ((next < 0) || (left < next))) {
+                next = left;
+            }
+        }
+    }
+
+    return next;
+}
+
+// Hand finished requests to their callbacks, and let the handlers that waited for them run again
+void http_async_dispatch(struct http_server *server)
+{
+    for(int i = 0; i < HTTP_CLIENT_ASYNC_MAX; i++) {
+        struct http_async *async = &http_async_slots[i];
+
+        if(async->stage != HTTP_ASYNC_DONE) {
+            continue;
+        }
+
+        if(async->connector) {
+            http_async_close_fd(async);
+        } else if(async->request.fd >= 0) {
+#if HTTP_SERVER_EPOLL
+            // A pooled connection stays open, so it has to leave the loop's epoll set by hand
+            if(server && (async->poll_fd == async->request.fd)) {
+                http_poll_set(server, EPOLL_CTL_DEL, async->request.fd, 0, NULL);
+            }
+#endif
+            if(async->reusable) {
+                http_set_nonblock(async->request.fd, 0);
+                if(http_client_pool_put(async->request.host, async->request.port, async->request.fd) == 0) {
+                    async->request.fd = -1;
+                }
+            }
+            http_async_close_fd(async);
+        }
+
+        if(async->cb_done) {
+            async->cb_done(async);
+        }
+
+        struct http_request *owner = async->owner;
+        http_async_release(async);
+
+        if(owner && !http_async_pending(owner)) {
+            owner->flags &= ~HTTP_FLAG_WAIT;
+        }
+    }
+}
+
+static int http_async_events(struct http_async *async)
+{
+    switch(async->stage) {
+    case HTTP_ASYNC_CONNECT:
+    case HTTP_ASYNC_WRITE:
+        return 2;
+    case HTTP_ASYNC_READ_HEADER:
+    case HTTP_ASYNC_READ_BODY:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+int http_async_create_select_sets(fd_set *set_read, fd_set *set_write, int *maxfd)
+{
+    int num = 0;
+
+    for(int i = 0; i < HTTP_CLIENT_ASYNC_MAX; i++) {
+        struct http_async *async = &http_async_slots[i];
+        int events = http_async_events(async);
+
+        if(async->connector) {
+            num += http_connector_create_select_sets(async->connector, set_write, maxfd);
+            continue;
+        } else if(!events || (async->request.fd < 0)) {
+            continue;
+        }
+
+        FD_SET(async->request.fd, (events == 1) ? set_read : set_write);
+        if(async->request.fd > *maxfd) {
+            *maxfd = async->request.fd;
+        }
+        num++;
+    }
+
+    return num;
+}
+
+void http_async_handle_select(fd_set *set_read, fd_set *set_write)
+{
+    for(int i = 0; i < HTTP_CLIENT_ASYNC_MAX; i++) {
+        struct http_async *async = &http_async_slots[i];
+        int fd = async->request.fd;
+
+        if(async->connector) {
+            if(http_connector_isset(async->connector, set_write)) {
+                http_async_handle_events(async, 0, 1);
+            }
+        } else if(http_async_events(async) && (fd >= 0)) {
+            http_async_handle_events(async, FD_ISSET(fd, set_read), FD_ISSET(fd, set_write));
+        }
+    }
+}
+
+int http_async_owns(void *ptr)
+{
+    return (ptr >= (void *)http_async_slots) && (ptr < (void *)(http_async_slots + HTTP_CLIENT_ASYNC_MAX));
+}
+
+#if HTTP_SERVER_EPOLL
+void http_async_poll_update(struct http_server *server)
+{
+    for(int i = 0; i < HTTP_CLIENT_ASYNC_MAX; i++) {
+        struct http_async *async = &http_async_slots[i];
+        int events = http_async_events(async);
+
+        if(async->connector) {
+            http_poll_connector(server, async->connector, async);
+            continue;
+        } else if(!events || (async->request.fd < 0)) {
+            continue;
+        }
+
+        uint8_t poll_events = (events == 1) ? EPOLLIN : EPOLLOUT;
+
+        // A connection taken from the pool, or opened after another failed, is not in the set yet
+        if(async->poll_fd != async->request.fd) {
+            if(http_poll_set(server, EPOLL_CTL_ADD, async->request.fd, poll_events, async) == 0) {
+                async->poll_fd = async->request.fd;
+                async->poll_events = poll_events;
+            }
+        } else if(async->poll_events != poll_events) {
+            http_poll_set(server, EPOLL_CTL_MOD, async->request.fd, poll_events, async);
+            async->poll_events = poll_events;
+        }
+    }
+}
+#endif
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __XTENSA__
+#include "lwip/lwip/sockets.h"
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "http-sm/http.h"
+#include "http-private.h"
+#include "log.h"
+
+// Hold back partial packets while a window of requests is written, so they go out together
+static void http_batch_cork(int fd, int cork)
+{
+#ifdef TCP_CORK
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+#endif
+}
+
+static int http_batch_send(struct http_request *conn, const struct http_batch_request *req)
+{
+    conn->path = (char *)req->path;
+    conn->query = (char *)req->query;
+    conn->method = req->method;
+
+    if(http_begin_request(conn) <= 0) {
+        return -1;
+    }
+
+    if((req->method == HTTP_METHOD_POST) || (req->method == HTTP_METHOD_PUT)) {
+        char len[12];
+        snprintf(len, sizeof(len), "%d", req->body ? req->body_length : 0);
+        http_write_header(conn, "Content-Length", len);
+    }
+
+    http_write_header(conn, "Connection", "keep-alive");
+    http_end_header(conn);
+
+    if(req->body && (req->body_length > 0) && (http_write_bytes(conn, req->body, req->body_length) < 0)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Whether request sent can go out before the responses to requests done to sent - 1 have been read.
+// Nothing is sent after a request that is not idempotent, so a failed connection can not have taken
+// more than that one with it, and nothing at or after lost, which is reported as failed.
+static int http_batch_can_send(const struct http_batch_request *requests, int count, int sent, int done, int lost)
+{
+    if((sent >= count) || (sent - done >= HTTP_CLIENT_PIPELINE_DEPTH) || ((lost >= 0) && (sent >= lost))) {
+        return 0;
+    }
+
+    return (sent == done) || http_method_is_idempotent(requests[sent - 1].method);
+}
+
+static int http_batch_read_body(struct http_request *conn, int index, http_batch_body_func cb_body, void *arg)
+{
+    char buf[256];
+    int n;
+
+    if(conn->flags & HTTP_FLAG_READ_CHUNKED) {
+        while(conn->state != HTTP_STATE_CLIENT_IDLE) {
+            n = http_read(conn, buf, sizeof(buf));
+            if((n < 0) || ((n == 0) && (conn->state != HTTP_STATE_CLIENT_IDLE))) {
+                return -1;
+            }
+            if((n > 0) && cb_body) {
+                cb_body(index, buf, n, arg);
+            }
+        }
+    } else if(conn->read_content_length >= 0) {
+        while(conn->read_content_length > 0) {
+            n = http_read(conn, buf, sizeof(buf));
+            if(n <= 0) {
+                return -1;
+            }
+            if(cb_body) {
+                cb_body(index, buf, n, arg);
+            }
+        }
+        conn->state = HTTP_STATE_CLIENT_IDLE;
+    } else {
+        // Without a length the body ends when the server closes the connection
+        while((n = http_recv(conn, buf, sizeof(buf))) > 0) {
+            if(cb_body) {
+                cb_body(index, buf, n, arg);
+            }
+        }
+        conn->flags |= HTTP_FLAG_CONNECTION_CLOSE;
+
+        if(n < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Send count requests to host:port on one keep-alive connection, writing up to HTTP_CLIENT_PIPELINE_DEPTH
+// of them before reading the responses in order. Nothing is sent after a POST until its response has been
+// read. Requests that were sent but not answered when the server closes the connection are sent again on
+// a new one, except for a POST, which the server may have acted on: it is reported with status 0.
+// Returns the number of requests that got a response.
+int http_batch(const char *host, int port, const struct http_batch_request *requests, int count,
+               http_batch_status_func cb_status, http_batch_body_func cb_body, void *arg)
+{
+    struct http_request conn;
+    memset(&conn, 0, sizeof(conn));
+    http_request_init(&conn);
+    conn.host = (char *)host;
+    conn.port = port;
+    conn.fd = -1;
+
+    int sent = 0;
+    int done = 0;
+    int fresh = 0;
+    int answered = 0;
+    int lost = -1;
+    int failed = 0;
+
+    while(done < count) {
+        if(done == lost) {
+            LOG("Request %d was not answered and is not sent again", done);
+            http_reset_response(&conn);
+            if(cb_status) {
+                cb_status(done, &conn, arg);
+            }
+            done++;
+            failed++;
+            lost = -1;
+            continue;
+        }
+
+        if(conn.fd < 0) {
+            sent = done;
+            answered = 0;
+
+            conn.fd = http_client_pool_take(host, port);
+            fresh = (conn.fd < 0);
+
+            if(fresh && (http_open_request_socket(&conn) < 0)) {
+                ERROR("http_open_request_socket failed");
+                conn.fd = -1;
+                break;
+            }
+        }
+
+        // A batch may take longer than one request, so each response gets the timeout of its own
+        http_client_set_deadline(&conn, http_clock_ms());
+
+        if(http_batch_can_send(requests, count, sent, done, lost)) {
+            int err = 0;
+
+            http_batch_cork(conn.fd, 1);
+            while(http_batch_can_send(requests, count, sent, done, lost)) {
+                if((err = http_batch_send(&conn, &requests[sent])) < 0) {
+                    break;
+                }
+                sent++;
+            }
+            http_batch_cork(conn.fd, 0);
+
+            // A request that was cut off leaves nothing to read reliably after it
+            if(err < 0) {
+                LOG("Sending request %d failed", sent);
+                conn.flags |= HTTP_FLAG_CONNECTION_CLOSE;
+                break;
+            }
+        }
+
+        http_free(&conn);
+        http_reset_response(&conn);
+
+        if(http_read_response_header(&conn) < 0) {
+            http_reset_response(&conn);
+
+            // A pooled connection may have been closed by the server, and one that answered before may have
+            // reached its request limit. Anything else would only fail again.
+            if(!fresh || answered) {
+                // Only the last request in flight can be one that must not be sent twice (RFC 7230 6.3.1)
+                if((sent > done) && !http_method_is_idempotent(requests[sent - 1].method)) {
+                    lost = sent - 1;
+                }
+                LOG("Connection to %s:%d closed after %d responses, reconnecting", host, port, answered);
+                continue;
+            }
+            break;
+        }
+
+        conn.state = HTTP_STATE_CLIENT_READ_BODY;
+
+        if(cb_status) {
+            cb_status(done, &conn, arg);
+        }
+
+        int err = http_batch_read_body(&conn, done, cb_body, arg);
+
+        done++;
+        answered++;
+
+        if(err < 0) {
+            // The status has been reported already, so this request is not sent again
+            LOG("Reading the body of response %d failed", done - 1);
+            conn.flags |= HTTP_FLAG_CONNECTION_CLOSE;
+            http_close(&conn);
+            http_reset_response(&conn);
+            break;
+        }
+
+        if(conn.flags & HTTP_FLAG_CONNECTION_CLOSE) {
+            http_close(&conn);
+            http_reset_response(&conn);
+        }
+    }
+
+    if(conn.fd >= 0) {
+        // Requests still in flight would leave their responses on the connection
+        if(sent > done) {
+            conn.flags |= HTTP_FLAG_CONNECTION_CLOSE;
+        }
+        http_close(&conn);
+    }
+
+    http_reset_response(&conn);
+
+    for(int i = done; i < count; i++) {
+        if(cb_status) {
+            cb_status(i, &conn, arg);
+        }
+    }
+
+    return done - failed;
+}
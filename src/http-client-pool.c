@@ -0,0 +1,177 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __XTENSA__
+#include "lwip/lwip/sockets.h"
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+
+#include "http-sm/http.h"
+#include "http-private.h"
+#include "log.h"
+
+struct http_client_pool_entry {
+    char *host;
+    uint16_t port;
+    int fd;
+    uint32_t since;
+};
+
+// Connections to servers that answered with keep-alive, waiting for the next request. Free entries have fd -1.
+static struct http_client_pool_entry http_client_pool[HTTP_CLIENT_POOL_SIZE];
+static int http_client_pool_initialized;
+
+static void http_client_pool_init(void)
+{
+    if(!http_client_pool_initialized) {
+        for(int i = 0; i < HTTP_CLIENT_POOL_SIZE; i++) {
+            http_client_pool[i].host = NULL;
+            http_client_pool[i].fd = -1;
+        }
+        http_client_pool_initialized = 1;
+    }
+}
+
+static void http_client_pool_drop(struct http_client_pool_entry *entry)
+{
+    close(entry->fd);
+    free(entry->host);
+    entry->host = NULL;
+    entry->fd = -1;
+}
+
+static int http_client_pool_match(const struct http_client_pool_entry *entry, const char *host, int port)
+{
+    return (entry->fd >= 0) && (entry->port == port) && (strcmp(entry->host, host) == 0);
+}
+
+// An idle connection has nothing to read, so anything else means the server closed it or broke the protocol
+static int http_client_pool_alive(int fd)
+{
+    char c;
+    int ret = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return (ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+}
+
+void http_client_pool_evict(uint32_t now)
+{
+    http_client_pool_init();
+
+    for(int i = 0; i < HTTP_CLIENT_POOL_SIZE; i++) {
+        struct http_client_pool_entry *entry = &http_client_pool[i];
+
+        if((entry->fd >= 0) && (now - entry->since >= HTTP_CLIENT_POOL_IDLE_SECS)) {
+            LOG("Closing idle connection %d to %s:%d", entry->fd, entry->host, entry->port);
+            http_client_pool_drop(entry);
+        }
+    }
+}
+
+// Take an idle connection to host:port out of the pool. Returns -1 if there is none.
+int http_client_pool_take(const char *host, int port)
+{
+    if(!host) {
+        return -1;
+    }
+
+    http_client_pool_evict(http_clock());
+
+    // The most recently used connection is the least likely to have been closed by the server
+    struct http_client_pool_entry *best = NULL;
+
+    for(int i = 0; i < HTTP_CLIENT_POOL_SIZE; i++) {
+        struct http_client_pool_entry *entry = &http_client_pool[i];
+
+        if(!http_client_pool_match(entry, host, port)) {
+            continue;
+        }
+
+        if(!http_client_pool_alive(entry->fd)) {
+            LOG("Pooled connection %d to %s:%d was closed", entry->fd, host, port);
+            http_client_pool_drop(entry);
+        } else if(!best || ((int32_t)(entry->since - best->since) >= 0)) {
+            best = entry;
+        }
+    }
+
+    if(!best) {
+        return -1;
+    }
+
+    int fd = best->fd;
+    free(best->host);
+    best->host = NULL;
+    best->fd = -1;
+
+    return fd;
+}
+
+// Keep a connection for the next request to host:port. Returns -1 if it was not kept, and the caller still owns it.
+int http_client_pool_put(const char *host, int port, int fd)
+{
+    if(!host || (fd < 0)) {
+        return -1;
+    }
+
+    uint32_t now = http_clock();
+    http_client_pool_evict(now);
+
+    struct http_client_pool_entry *slot = NULL;
+    struct http_client_pool_entry *oldest = NULL;
+    int count = 0;
+
+    for(int i = 0; i < HTTP_CLIENT_POOL_SIZE; i++) {
+        struct http_client_pool_entry *entry = &http_client_pool[i];
+
+        if(entry->fd < 0) {
+            if(!slot) {
+                slot = entry;
+            }
+        } else {
+            if(http_client_pool_match(entry, host, port)) {
+                count++;
+            }
+            if(!oldest || ((int32_t)(entry->since - oldest->since) < 0)) {
+                oldest = entry;
+            }
+        }
+    }
+
+    if(count >= HTTP_CLIENT_POOL_PER_HOST) {
+        return -1;
+    }
+
+    // A full pool makes room by closing the connection that has been idle the longest
+    if(!slot) {
+        slot = oldest;
+        http_client_pool_drop(slot);
+    }
+
+    slot->host = malloc(strlen(host) + 1);
+    if(!slot->host) {
+        return -1;
+    }
+    strcpy(slot->host, host);
+
+    slot->port = port;
+    slot->fd = fd;
+    slot->since = now;
+
+    return 0;
+}
+
+void http_client_pool_clear(void)
+{
+    http_client_pool_init();
+
+    for(int i = 0; i < HTTP_CLIENT_POOL_SIZE; i++) {
+        if(http_client_pool[i].fd >= 0) {
+            http_client_pool_drop(&http_client_pool[i]);
+        }
+    }
+}
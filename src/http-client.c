@@ -1,23 +1,356 @@
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
+#ifdef __XTENSA__
+#include "lwip/lwip/sockets.h"
+#else
+#include <sys/socket.h>
+#include <sys/time.h>
+#endif
+
+#if defined(__linux__) && !defined(__XTENSA__)
+#include <sys/sendfile.h>
+#endif
+
 #include "http-sm/http.h"
 #include "http-private.h"
 #include "log.h"
 
-int http_get_request(struct http_request *request)
+// Find the blank line that ends a response head in data, looking from from on.
+// Returns the index of the first byte after it, or -1.
+static int http_find_head_end(const char *data, int from, int length)
 {
-    int err;
+    for(int i = (from > 3) ? from - 3 : 0; i + 3 < length; i++) {
+        if((data[i] == '\r') && (data[i + 1] == '\n') && (data[i + 2] == '\r') && (data[i + 3] == '\n')) {
+            return i + 4;
+        }
+    }
 
-    err = http_open_request_socket(request);
-    if(err < 0) {
-        ERROR("http_open_request_socket failed");
+    return -1;
+}
+
+// Split a header line at its colon and keep it in the index of the buffer
+static void http_index_header(struct http_recv_buffer *b, char *line)
+{
+    char *value = strchr(line, ':');
+
+    if(!value) {
+        LOG("Header line without colon '%s'", line);
+        return;
+    }
+
+    if(b->header_count == HTTP_CLIENT_MAX_HEADERS) {
+        LOG("More than %d headers, dropping '%s'", HTTP_CLIENT_MAX_HEADERS, line);
+        return;
+    }
+
+    *value++ = 0;
+    while((*value == ' ') || (*value == '\t')) {
+        value++;
+    }
+
+    char *end = value + strlen(value);
+    while((end > value) && ((end[-1] == ' ') || (end[-1] == '\t'))) {
+        *--end = 0;
+    }
+
+    b->headers[b->header_count].name = line;
+    b->headers[b->header_count].value = value;
+    b->header_count++;
+}
+
+// Parse the status line and headers in the first head bytes of the buffer, in place
+static void http_parse_response_head(struct http_request *request, struct http_recv_buffer *b)
+{
+    char *end = b->data + b->head - 2;
+
+    for(char *p = b->data; p < end; p++) {
+        if((p[0] == '\r') && (p[1] == '\n')) {
+            *p = 0;
+        }
+    }
+
+    char *line = b->data;
+    char *next = line + strlen(line) + 2;
+    char *status = strchr(line, ' ');
+
+    if(!status) {
+        LOG("Bad status line '%s'", line);
         request->state = HTTP_STATE_CLIENT_ERROR;
-        return err;
+        return;
+    }
+
+    *status++ = 0;
+    if(strcmp(line, "HTTP/1.1") != 0) {
+        LOG("Unexpected HTTP version '%s'", line);
+    }
+
+    char *p;
+    request->status = strtol(status, &p, 10);
+    if((p == status) || (*p && (*p != ' '))) {
+        LOG("Error reading response code '%s'", status);
+    }
+
+    for(line = next; line < end; line = next) {
+        next = line + strlen(line) + 2;
+
+#ifdef LOG_VERBOSE
+        LOG("%s", line);
+#endif
+        http_parse_header_line(request, line);
+
+        if(http_is_error(request)) {
+            return;
+        }
+
+        http_index_header(b, line);
+    }
+
+    request->state = HTTP_STATE_CLIENT_IDLE;
+}
+
+// Read what has come of a response head into the receive buffer of the request, also on a socket
+// that does not block. Whatever comes after the head is left in the buffer for reading the body.
+// Returns 1 once the head is read and parsed, 0 if the rest of it has not come yet and -1 on errors.
+int http_recv_response_header(struct http_request *request)
+{
+    struct http_recv_buffer *b = request->recv_buf;
+
+    if(request->state != HTTP_STATE_CLIENT_READ_VERSION) {
+        if(!b) {
+            b = malloc(sizeof(*b));
+
+            if(!b) {
+                ERROR("Malloc failed while allocating receive buffer");
+                request->state = HTTP_STATE_CLIENT_ERROR;
+                return -1;
+            }
+
+            b->index = 0;
+            b->length = 0;
+            request->recv_buf = b;
+        }
+
+        // What was read after the previous response, such as a pipelined response, starts this one
+        int length = b->length - b->index;
+        memmove(b->data, b->data + b->index, length);
+        b->head = 0;
+        b->index = 0;
+        b->length = length;
+        b->header_count = 0;
+
+        request->state = HTTP_STATE_CLIENT_READ_VERSION;
+    }
+
+    int end = http_find_head_end(b->data, 0, b->length);
+
+    while(end < 0) {
+        if(b->length == sizeof(b->data)) {
+            LOG("Response head longer than %d bytes", (int)sizeof(b->data));
+            request->state = HTTP_STATE_CLIENT_ERROR;
+            return -1;
+        }
+
+        if((request->flags & HTTP_FLAG_DEADLINE) && (http_arm_deadline(request, 0) < 0)) {
+            request->state = HTTP_STATE_CLIENT_ERROR;
+            return -1;
+        }
+
+        int ret = read(request->fd, b->data + b->length, sizeof(b->data) - b->length);
+
+        if((ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) {
+            return 0;
+        } else if(ret <= 0) {
+            request->state = HTTP_STATE_CLIENT_ERROR;
+            return -1;
+        }
+
+        end = http_find_head_end(b->data, b->length, b->length + ret);
+        b->length += ret;
+    }
+
+    b->head = end;
+    b->index = end;
+
+    http_parse_response_head(request, b);
+
+    return http_is_error(request) ? -1 : 1;
+}
+
+// Read the status line and headers of a response, in as few reads as it takes
+int http_read_response_header(struct http_request *request)
+{
+    int ret;
+
+    do {
+        ret = http_recv_response_header(request);
+    } while((ret == 0) && (errno == EINTR));
+
+    // A socket that blocks only comes back without the head when its timeout has passed
+    if(ret == 0) {
+        LOG("Timed out reading response from %s:%d", request->host, request->port);
+        request->state = HTTP_STATE_CLIENT_ERROR;
+    }
+
+    if(ret <= 0) {
+        http_close(request);
+        return -1;
+    }
+
+    return 0;
+}
+
+// The value of the response header name, or NULL if the response did not have it. It stays valid
+// until the next response is read or the request is closed.
+const char *http_get_header(struct http_request *request, const char *name)
+{
+    struct http_recv_buffer *b = request->recv_buf;
+
+    if(!b) {
+        return NULL;
+    }
+
+    for(int i = 0; i < b->header_count; i++) {
+        if(strcasecmp(b->headers[i].name, name) == 0) {
+            return b->headers[i].value;
+        }
+    }
+
+    return NULL;
+}
+
+// Point headers at all headers of the response, in the order they came, and return how many there are
+int http_get_headers(struct http_request *request, const struct http_header **headers)
+{
+    struct http_recv_buffer *b = request->recv_buf;
+
+    if(!b) {
+        *headers = NULL;
+        return 0;
+    }
+
+    *headers = b->headers;
+    return b->header_count;
+}
+
+// Let reads and writes on the socket of a request wait no longer than what is left of its timeout,
+// counted from start. Each read of the response waits only for what is left by then. Returns -1 if
+// there is nothing left.
+int http_client_set_deadline(struct http_request *request, uint32_t start)
+{
+    if(request->timeout_ms) {
+        request->deadline = start + request->timeout_ms;
+        request->flags |= HTTP_FLAG_DEADLINE;
+    } else {
+        request->flags &= ~HTTP_FLAG_DEADLINE;
     }
 
-    err = http_begin_request(request);
+    return http_arm_deadline(request, 1);
+}
+
+// What follows the header of a request: data, or length bytes of fd from offset, or whatever
+// writer writes. A negative length sends the body in chunks.
+struct http_request_body {
+    const char *data;
+    int fd;
+    long offset;
+    long length;
+    http_body_writer writer;
+    void *arg;
+};
+
+// Copy the file with sendfile where the kernel supports it for fd, and with read and write elsewhere
+static int http_send_file(int sock, int fd, long offset, long length)
+{
+#if defined(__linux__) && !defined(__XTENSA__)
+    off_t off = offset;
+
+    while(length > 0) {
+        ssize_t n = sendfile(sock, fd, &off, length);
+
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            } else if(((errno == EINVAL) || (errno == ENOSYS)) && (off == offset)) {
+                break;
+            }
+            ERROR("sendfile failed");
+            return -1;
+        } else if(n == 0) {
+            LOG("File ended %ld bytes early", length);
+            return -1;
+        }
+
+        length -= n;
+    }
+
+    offset = off;
+#endif
+
+    char buf[256];
+
+    while(length > 0) {
+        int n = pread(fd, buf, (length < sizeof(buf)) ? length : sizeof(buf), offset);
+
+        if(n <= 0) {
+            ERROR("Reading the file failed");
+            return -1;
+        }
+
+        if(http_write_all(sock, buf, n) < 0) {
+            return -1;
+        }
+
+        offset += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+static int http_send_body(struct http_request *request, const struct http_request_body *body)
+{
+    if(body->length < 0) {
+        request->line = malloc(HTTP_LINE_LEN);
+        if(!request->line) {
+            ERROR("Malloc failed while allocating line");
+            return -1;
+        }
+
+        request->line_length = HTTP_LINE_LEN;
+        request->chunk_length = 0;
+        request->flags |= HTTP_FLAG_WRITE_CHUNKED;
+
+        int ret = body->writer(request, body->arg);
+        http_end_body(request);
+
+        return ret;
+    } else if(body->writer) {
+        return body->writer(request, body->arg);
+    } else if(body->data) {
+        return (http_write_all(request->fd, body->data, body->length) < 0) ? -1 : 0;
+    } else {
+        return http_send_file(request->fd, body->fd, body->offset, body->length);
+    }
+}
+
+// Send the request header and body, and read the response header on request->fd. Once more than the
+// request line may have reached the server, sent is set.
+static int http_send_request(struct http_request *request, const struct http_request_body *body, uint32_t start, int *sent)
+{
+    *sent = 0;
+
+    if(http_client_set_deadline(request, start) < 0) {
+        request->state = HTTP_STATE_CLIENT_ERROR;
+        http_close(request);
+        return -1;
+    }
+
+    int err = http_begin_request(request);
     if(err < 0) {
         ERROR("http_begin_request failed");
         request->state = HTTP_STATE_CLIENT_ERROR;
@@ -25,47 +358,154 @@ int http_get_request(struct http_request *request)
         return err;
     }
 
+    *sent = 1;
+
+    if(body && (body->length < 0)) {
+        http_write_header(request, "Transfer-Encoding", "chunked");
+    } else if(body) {
+        char buf[24];
+        snprintf(buf, sizeof(buf), "%ld", body->length);
+        http_write_header(request, "Content-Length", buf);
+    }
+
+    http_write_header(request, "Connection", "keep-alive");
     http_end_header(request);
 
-    const int line_length = HTTP_LINE_LEN;
-    request->line = malloc(line_length);
+    if(body && (http_send_body(request, body) < 0)) {
+        ERROR("Sending the request body failed");
+        request->state = HTTP_STATE_CLIENT_ERROR;
+        http_close(request);
+        return -1;
+    }
 
-    if(!request->line) {
-        ERROR("Malloc failed while allocating line");
+    // The body can take long to send, the response gets what is left
+    if(http_client_set_deadline(request, start) < 0) {
         request->state = HTTP_STATE_CLIENT_ERROR;
         http_close(request);
         return -1;
     }
 
-    request->line_length = line_length;
-    request->state = HTTP_STATE_CLIENT_READ_VERSION;
+    return http_read_response_header(request);
+}
 
-    while(request->state & (HTTP_STATE_READ | HTTP_STATE_READ_NL)) {
-        int c;
-        int ret = read(request->fd, &c, 1);
+// Forget what was read from a connection that failed, so the request can be sent again
+void http_reset_response(struct http_request *request)
+{
+    request->flags &= ~(HTTP_FLAG_READ_CHUNKED | HTTP_FLAG_READ_GZIP | HTTP_FLAG_WEBSOCKET | HTTP_FLAG_CONNECTION_CLOSE);
+    request->read_content_length = -1;
+    request->chunk_length = 0;
+    request->poke = -1;
+    request->status = 0;
+    request->error = 0;
+    request->content_type = 0;
+    request->websocket_key = 0;
+}
 
-        if(ret <= 0) {
-            free(request->line);
-            request->line = 0;
-            request->line_length = 0;
-            request->state = HTTP_STATE_CLIENT_ERROR;
-            http_close(request);
+static int http_run_request(struct http_request *request, const struct http_request_body *body)
+{
+    uint32_t start = http_clock_ms();
+    int sent;
+    int err;
+
+    // A connection left open by an earlier request to the same server saves the handshake. A body from
+    // a writer can only be sent once, so it gets a new connection that is less likely to fail.
+    int fd = (body && body->writer) ? -1 : http_client_pool_take(request->host, request->port);
+
+    if(fd >= 0) {
+        request->fd = fd;
 
+        if(http_send_request(request, body, start, &sent) >= 0) {
+            request->state = HTTP_STATE_CLIENT_READ_BODY;
+            return 1;
+        }
+
+        // The server may have closed it just as it was taken, or it may have acted on the request before
+        // the connection failed. Only a request that does no harm when repeated is sent again (RFC 7230 6.3.1).
+        if(sent && !http_method_is_idempotent(request->method)) {
+            LOG("Request to %s:%d on a pooled connection failed after it was sent", request->host, request->port);
             return -1;
-        } else {
-            http_parse_header(request, c);
         }
+
+        // Try once more on a new connection
+        LOG("Request to %s:%d on a pooled connection failed", request->host, request->port);
+        http_reset_response(request);
     }
 
-    free(request->line);
-    request->line = 0;
-    request->line_length = 0;
+    err = http_open_request_socket(request);
+    if(err < 0) {
+        ERROR("http_open_request_socket failed");
+        request->state = HTTP_STATE_CLIENT_ERROR;
+        return err;
+    }
 
-    if(http_is_error(request)) {
-        http_close(request);
+    if(http_send_request(request, body, start, &sent) < 0) {
         return -1;
     }
 
     request->state = HTTP_STATE_CLIENT_READ_BODY;
     return 1;
 }
+
+int http_get_request(struct http_request *request)
+{
+    return http_run_request(request, NULL);
+}
+
+// The request is sent with PUT if that is its method, and with POST otherwise
+static void http_set_body_method(struct http_request *request)
+{
+    if(request->method != HTTP_METHOD_PUT) {
+        request->method = HTTP_METHOD_POST;
+    }
+}
+
+// Send length bytes of body with the request
+int http_post_request(struct http_request *request, const char *body, int length)
+{
+    const struct http_request_body b = {
+        .data = body ? body : "",
+        .length = body ? length : 0,
+    };
+
+    if(b.length < 0) {
+        return -1;
+    }
+
+    http_set_body_method(request);
+    return http_run_request(request, &b);
+}
+
+// Send what writer writes as the body. With a negative length the body is sent in chunks,
+// otherwise writer has to write exactly length bytes.
+int http_post_request_stream(struct http_request *request, int length, http_body_writer writer, void *arg)
+{
+    const struct http_request_body b = {
+        .length = length,
+        .writer = writer,
+        .arg = arg,
+    };
+
+    if(!writer) {
+        return -1;
+    }
+
+    http_set_body_method(request);
+    return http_run_request(request, &b);
+}
+
+// Send length bytes of the file fd from offset as the body, without copying them through user space
+int http_post_request_file(struct http_request *request, int fd, long offset, long length)
+{
+    const struct http_request_body b = {
+        .fd = fd,
+        .offset = offset,
+        .length = length,
+    };
+
+    if(length < 0) {
+        return -1;
+    }
+
+    http_set_body_method(request);
+    return http_run_request(request, &b);
+}
@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __XTENSA__
+#include "lwip/lwip/sockets.h"
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <poll.h>
+#endif
+
+#include "http-sm/http.h"
+#include "http-private.h"
+#include "log.h"
+
+// Start connecting to addr without waiting for it. Returns the socket, or -1 if the attempt failed at once,
+// and sets *connected if it did not have to wait.
+static int http_connect_start(const struct http_address *addr, int *connected)
+{
+    const struct sockaddr *sa = (const struct sockaddr *)&addr->addr;
+
+    int s = socket(sa->sa_family, SOCK_STREAM, 0);
+    if(s < 0) {
+        ERROR("socket failed");
+        return -1;
+    }
+
+    http_set_nonblock(s, 1);
+
+    if(connect(s, sa, addr->length) == 0) {
+        *connected = 1;
+        return s;
+    } else if(errno == EINPROGRESS) {
+        return s;
+    }
+
+    LOG("connect failed: %s", strerror(errno));
+    close(s);
+    return -1;
+}
+
+// Milliseconds from now until t, or 0 if it has passed
+static int http_connect_until(uint32_t now, uint32_t t)
+{
+    int left = (int32_t)(t - now);
+    return (left < 0) ? 0 : left;
+}
+
+// Connect to whichever of count addresses answers first. The attempts start in order, each
+// HTTP_CLIENT_CONNECT_DELAY_MS after the one before, or as soon as all the earlier ones have failed.
+// Each gets HTTP_CLIENT_CONNECT_TIMEOUT_MS, and all of them together timeout_ms unless that is 0.
+// Returns the connected socket, in blocking mode, and the index of its address in *index, or -1.
+int http_connect(const struct http_address *addrs, int count, int timeout_ms, int *index)
+{
+    struct http_connector c;
+    uint32_t start = http_clock_ms();
+    int fd = -1;
+    int ret;
+
+    http_connector_init(&c, addrs, count);
+
+    while((ret = http_connector_poll(&c, &fd)) == 0) {
+        uint32_t now = http_clock_ms();
+
+        if(timeout_ms && ((int32_t)(now - start) >= timeout_ms)) {
+            LOG("Connecting timed out after %d ms", timeout_ms);
+            http_connector_close(&c);
+            return -1;
+        }
+
+        int wait = http_connector_timer_next(&c, now);
+        if(timeout_ms && (http_connect_until(now, start + timeout_ms) < wait)) {
+            wait = http_connect_until(now, start + timeout_ms);
+        }
+
+        // Sleep until one of the attempts is writable or the next timer is due, http_connector_poll sees which
+        struct pollfd fds[HTTP_DNS_MAX_ADDRESSES];
+
+        for(int i = 0; i < c.started; i++) {
+            fds[i].fd = c.attempts[i].fd;
+            fds[i].events = POLLOUT;
+            fds[i].revents = 0;
+        }
+
+        if((poll(fds, c.started, wait) < 0) && (errno != EINTR)) {
+            ERROR("poll failed");
+            http_connector_close(&c);
+            return -1;
+        }
+    }
+
+    if(ret < 0) {
+        return -1;
+    }
+
+    http_set_nonblock(fd, 0);
+    *index = c.index;
+
+    return fd;
+}
+
+void http_connector_init(struct http_connector *c, const struct http_address *addrs, int count)
+{
+    if(count > HTTP_DNS_MAX_ADDRESSES) {
+        count = HTTP_DNS_MAX_ADDRESSES;
+    }
+
+    if(count > 0) {
+        memcpy(c->addrs, addrs, count * sizeof(*addrs));
+    }
+
+    c->count = (count > 0) ? count : 0;
+    c->started = 0;
+    c->index = 0;
+    c->polled = 0;
+    c->next_start = http_clock_ms();
+}
+
+// The attempt at index connected, so the others are given up
+static int http_connector_won(struct http_connector *c, int index, int *fd)
+{
+    *fd = c->attempts[index].fd;
+    c->attempts[index].fd = -1;
+    c->index = index;
+
+    http_connector_close(c);
+
+    return 1;
+}
+
+// Move the attempts on without waiting: look at the ones that are running, give up on the ones that took
+// too long, and start the next one when it is due. Returns 1 and the socket, still not blocking, in *fd once
+// one of them has connected, 0 while they are going and -1 when all of them failed.
+int http_connector_poll(struct http_connector *c, int *fd)
+{
+    struct pollfd fds[HTTP_DNS_MAX_ADDRESSES];
+    uint32_t now = http_clock_ms();
+    int running = 0;
+
+    for(int i = 0; i < c->started; i++) {
+        // poll skips the attempts that are over, their fd is -1
+        fds[i].fd = c->attempts[i].fd;
+        fds[i].events = POLLOUT;
+        fds[i].revents = 0;
+    }
+
+    if((c->started > 0) && (poll(fds, c->started, 0) < 0) && (errno != EINTR)) {
+        ERROR("poll failed");
+        http_connector_close(c);
+        return -1;
+    }
+
+    for(int i = 0; i < c->started; i++) {
+        struct http_connect_attempt *a = &c->attempts[i];
+
+        if(a->fd < 0) {
+            continue;
+        }
+
+        if(fds[i].revents) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+
+            if((getsockopt(a->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) || err) {
+                LOG("Connecting to address %d failed: %s", i, strerror(err));
+                close(a->fd);
+                a->fd = -1;
+                continue;
+            }
+
+            return http_connector_won(c, i, fd);
+        }
+
+        if(http_connect_until(now, a->started + HTTP_CLIENT_CONNECT_TIMEOUT_MS) == 0) {
+            LOG("Connecting to address %d timed out", i);
+            close(a->fd);
+            a->fd = -1;
+            continue;
+        }
+
+        running++;
+    }
+
+    // An address that is not answering only holds up the next one for a moment
+    while((c->started < c->count) && (!running || ((int32_t)(now - c->next_start) >= 0))) {
+        struct http_connect_attempt *a = &c->attempts[c->started];
+        int connected = 0;
+
+        a->fd = http_connect_start(&c->addrs[c->started], &connected);
+        a->started = now;
+        c->started++;
+        c->next_start = now + HTTP_CLIENT_CONNECT_DELAY_MS;
+
+        if(connected) {
+            return http_connector_won(c, c->started - 1, fd);
+        } else if(a->fd >= 0) {
+            running++;
+        }
+    }
+
+    return running ? 0 : -1;
+}
+
+// Milliseconds until http_connector_poll has to look at the attempts even if none of them became
+// writable, or -1 if there is nothing to wait for
+int http_connector_timer_next(const struct http_connector *c, uint32_t now)
+{
+    int next = -1;
+
+    for(int i = 0; i < c->started; i++) {
+        if(c->attempts[i].fd >= 0) {
+            int left = http_connect_until(now, c->attempts[i].started + HTTP_CLIENT_CONNECT_TIMEOUT_MS);
+            if((next < 0) || (left < next)) {
+                next = left;
+            }
+        }
+    }
+
+    if((next >= 0) && (c->started < c->count)) {
+        int left = http_connect_until(now, c->next_start);
+        if(left < next) {
+            next = left;
+        }
+    }
+
+    return next;
+}
+
+void http_connector_close(struct http_connector *c)
+{
+    for(int i = 0; i < c->started; i++) {
+        if(c->attempts[i].fd >= 0) {
+            close(c->attempts[i].fd);
+            c->attempts[i].fd = -1;
+        }
+    }
+
+    c->count = c->started;
+}
+
+int http_connector_create_select_sets(const struct http_connector *c, fd_set *set_write, int *maxfd)
+{
+    int num = 0;
+
+    for(int i = 0; i < c->started; i++) {
+        int fd = c->attempts[i].fd;
+
+        if(fd >= 0) {
+            FD_SET(fd, set_write);
+            if(fd > *maxfd) {
+                *maxfd = fd;
+            }
+            num++;
+        }
+    }
+
+    return num;
+}
+
+// Whether one of the attempts became writable
+int http_connector_isset(const struct http_connector *c, fd_set *set_write)
+{
+    for(int i = 0; i < c->started; i++) {
+        if((c->attempts[i].fd >= 0) && FD_ISSET(c->attempts[i].fd, set_write)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "http-sm/http.h"
+#include "http-private.h"
+#include "log.h"
+
+#if HTTP_CLIENT_GZIP
+
+#include <zlib.h>
+
+// Compressed bytes read from the socket at a time
+#define HTTP_GZIP_INPUT_LEN 512
+
+// Inflate state for one response body, with the compressed bytes it has not used yet
+struct http_gzip {
+    z_stream z;
+    uint8_t in[HTTP_GZIP_INPUT_LEN];
+    // The compressed body has been read to its end
+    uint8_t eof;
+    struct http_gzip *next;
+};
+
+static struct http_gzip *http_gzip_pool;
+static int http_gzip_pool_count;
+
+static struct http_gzip *http_gzip_acquire(void)
+{
+    struct http_gzip *g = http_gzip_pool;
+
+    if(g) {
+        http_gzip_pool = g->next;
+        http_gzip_pool_count--;
+        return g;
+    }
+
+    g = calloc(1, sizeof(*g));
+    if(!g) {
+        return NULL;
+    }
+
+    // Adding 16 to the window bits makes zlib expect a gzip header and trailer
+    int ret = inflateInit2(&g->z, 16 + MAX_WBITS);
+    if(ret != Z_OK) {
+        LOG("Could not init zlib stream: %d", ret);
+        free(g);
+        return NULL;
+    }
+
+    return g;
+}
+
+void http_gzip_free(struct http_request *request)
+{
+    struct http_gzip *g = request->gzip;
+
+    if(!g) {
+        return;
+    }
+
+    request->gzip = 0;
+
+    if(http_gzip_pool_count < HTTP_CLIENT_GZIP_POOL_SIZE) {
+        inflateReset(&g->z);
+        g->z.avail_in = 0;
+        g->eof = 0;
+        g->next = http_gzip_pool;
+        http_gzip_pool = g;
+        http_gzip_pool_count++;
+    } else {
+        inflateEnd(&g->z);
+        free(g);
+    }
+}
+
+// Read what is left of the body after the gzip trailer, so the connection ends up where a plain body would leave it
+static void http_gzip_end(struct http_request *request)
+{
+    if(request->gzip->eof) {
+        request->state = HTTP_STATE_CLIENT_IDLE;
+    } else {
+        char buf[64];
+        while((request->state == HTTP_STATE_CLIENT_READ_BODY) && (http_read_body(request, buf, sizeof(buf)) > 0)) {
+        }
+    }
+
+    http_gzip_free(request);
+}
+
+// Fill buf with inflated bytes of a body sent with Content-Encoding: gzip. The request stays in
+// HTTP_STATE_CLIENT_READ_BODY until the last of them has been returned.
+int http_gzip_read(struct http_request *request, void *buf, size_t count)
+{
+    if(request->state != HTTP_STATE_CLIENT_READ_BODY) {
+        return 0;
+    }
+
+    if(!request->gzip) {
+        request->gzip = http_gzip_acquire();
+        if(!request->gzip) {
+            ERROR("Could not allocate inflate stream");
+            return -1;
+        }
+    }
+
+    struct http_gzip *g = request->gzip;
+
+    g->z.next_out = buf;
+    g->z.avail_out = count;
+
+    while(g->z.avail_out > 0) {
+        if(g->z.avail_in == 0) {
+            int n = g->eof ? 0 : http_read_body(request, g->in, sizeof(g->in));
+
+            if(n < 0) {
+                return -1;
+            }
+
+            // The compressed body ending does not end the request, the caller still has to get the rest
+            if(request->state == HTTP_STATE_CLIENT_IDLE) {
+                g->eof = 1;
+                request->state = HTTP_STATE_CLIENT_READ_BODY;
+            }
+
+            if(n == 0) {
+                LOG("Body ended before the end of the gzip stream");
+                request->state = HTTP_STATE_CLIENT_ERROR;
+                http_gzip_free(request);
+                return -1;
+            }
+
+            g->z.next_in = g->in;
+            g->z.avail_in = n;
+        }
+
+        int ret = inflate(&g->z, Z_NO_FLUSH);
+
+        if(ret == Z_STREAM_END) {
+            int num = count - g->z.avail_out;
+            http_gzip_end(request);
+            return num;
+        } else if(ret != Z_OK) {
+            LOG("zlib error %d", ret);
+            request->state = HTTP_STATE_CLIENT_ERROR;
+            http_gzip_free(request);
+            return -1;
+        }
+    }
+
+    return count;
+}
+
+#endif
@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -6,12 +8,68 @@
 #include "http-private.h"
 #include "log.h"
 
+// The timeout of a client request covers the whole response, so each read gets only what is left of it
+static int http_recv_socket(struct http_request *request, void *buf, size_t count)
+{
+    if((request->flags & HTTP_FLAG_DEADLINE) && (http_arm_deadline(request, 0) < 0)) {
+        return -1;
+    }
+
+    return read(request->fd, buf, count);
+}
+
+// Read what came in with the head of a response before reading the socket. Small reads by a client
+// fill the buffer, so a chunk header does not take a read for every byte.
+int http_recv(struct http_request *request, void *buf, size_t count)
+{
+    struct http_recv_buffer *b = request->recv_buf;
+
+    if(!b) {
+        return http_recv_socket(request, buf, count);
+    }
+
+    if((b->index == b->length) && (count < sizeof(b->data) - b->head)) {
+        int n = http_recv_socket(request, b->data + b->head, sizeof(b->data) - b->head);
+        if(n <= 0) {
+            return n;
+        }
+        b->index = b->head;
+        b->length = b->head + n;
+    }
+
+    if(b->index == b->length) {
+        return http_recv_socket(request, buf, count);
+    }
+
+    int n = (count < b->length - b->index) ? count : b->length - b->index;
+    memcpy(buf, b->data + b->index, n);
+    b->index += n;
+
+    return n;
+}
+
+static int http_recv_all(struct http_request *request, void *buf_, size_t count)
+{
+    char *buf = buf_;
+    size_t num = 0;
+    while(num < count) {
+        int ret = http_recv(request, buf + num, count - num);
+        if(ret < 0) {
+            return -1;
+        } else if(ret == 0) {
+            break;
+        }
+        num += ret;
+    }
+    return num;
+}
+
 static int read_chunk_header(struct http_request *request)
 {
     char c;
     int ret;
     for(;;) {
-        ret = read(request->fd, &c, 1);
+        ret = http_recv(request, &c, 1);
         if(ret < 0) {
             ERROR("Read failed in chunk header");
             return -1;
@@ -31,7 +89,7 @@ static int read_chunk_header(struct http_request *request)
     }
 
     for(;;) {
-        ret = read(request->fd, &c, 1);
+        ret = http_recv(request, &c, 1);
         if(ret < 0) {
             ERROR("Read failed before newline");
             return -1;
@@ -52,7 +110,7 @@ static int read_chunk_footer(struct http_request *request)
     int ret;
 
     for(;;) {
-        ret = read(request->fd, &c, 1);
+        ret = http_recv(request, &c, 1);
         if(ret < 0) {
             ERROR("Read failed in chunk header");
             return -1;
@@ -67,7 +125,7 @@ static int read_chunk_footer(struct http_request *request)
     }
 
     for(;;) {
-        ret = read(request->fd, &c, 1);
+        ret = http_recv(request, &c, 1);
         if(ret < 0) {
             ERROR("Read failed before newline");
             return -1;
@@ -83,7 +141,8 @@ static int read_chunk_footer(struct http_request *request)
     return 1;
 }
 
-int http_read(struct http_request *request, void *buf_, size_t count)
+// Read the body as it was sent, without the chunk framing
+int http_read_body(struct http_request *request, void *buf_, size_t count)
 {
     uint8_t *buf = buf_;
 
@@ -106,7 +165,7 @@ int http_read(struct http_request *request, void *buf_, size_t count)
             }
 
             int num_to_read = (count < request->chunk_length) ? count : request->chunk_length;
-            int n = read(request->fd, buf, num_to_read);
+            int n = http_recv(request, buf, num_to_read);
 
             if(n < 0) {
                 ERROR("Read failed in body (chunked)");
@@ -132,7 +191,7 @@ int http_read(struct http_request *request, void *buf_, size_t count)
     } else {
         if((count > 0) && (request->read_content_length > 0)) {
             int num_to_read = (count < request->read_content_length) ? count : request->read_content_length;
-            int n = http_read_all(request->fd, buf, num_to_read);
+            int n = http_recv_all(request, buf, num_to_read);
 
             if(n < 0) {
                 ERROR("Read failed in reading body");
@@ -150,6 +209,17 @@ int http_read(struct http_request *request, void *buf_, size_t count)
     return num;
 }
 
+int http_read(struct http_request *request, void *buf, size_t count)
+{
+#if HTTP_CLIENT_GZIP
+    if(request->flags & HTTP_FLAG_READ_GZIP) {
+        return http_gzip_read(request, buf, count);
+    }
+#endif
+
+    return http_read_body(request, buf, count);
+}
+
 int http_getc(struct http_request *request)
 {
     if(request->state != HTTP_STATE_SERVER_READ_BODY && request->state != HTTP_STATE_CLIENT_READ_BODY) {
@@ -204,7 +274,7 @@ int http_write_all(int fd, const char *str, int len)
 {
     int num = 0;
     while(num < len) {
-        int n = write(fd, str, len);
+        int n = write(fd, str, len - num);
         if(n < 0) {
             return -1;
         }
@@ -214,6 +284,49 @@ int http_write_all(int fd, const char *str, int len)
     return num;
 }
 
+// Block until a non-blocking socket can be written to. poll, as the fd can be above FD_SETSIZE in an epoll server.
+static int http_wait_writable(int fd)
+{
+    struct pollfd p = { .fd = fd, .events = POLLOUT };
+    int ret;
+
+    do {
+        ret = poll(&p, 1, -1);
+    } while((ret < 0) && (errno == EINTR));
+
+    return ret;
+}
+
+// Write all buffers with as few syscalls as possible. The iov array is modified.
+int http_writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    int num = 0;
+    while(iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            } else if(((errno == EAGAIN) || (errno == EWOULDBLOCK)) && (http_wait_writable(fd) > 0)) {
+                continue;
+            }
+            return -1;
+        }
+        num += n;
+
+        // Skip past what was written
+        while((iovcnt > 0) && (n >= iov->iov_len)) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return num;
+}
+
 static int write_chunk(int fd, const char *data, int len)
 {
     char buf[16];
@@ -279,6 +392,8 @@ int http_begin_request(struct http_request *request)
 {
     if(request->method == HTTP_METHOD_POST) {
         http_write_string(request, "POST ");
+    } else if(request->method == HTTP_METHOD_PUT) {
+        http_write_string(request, "PUT ");
     } else {
         http_write_string(request, "GET ");
     }
@@ -307,6 +422,12 @@ int http_begin_request(struct http_request *request)
 
     http_write_header(request, "User-Agent", HTTP_USER_AGENT);
 
+#if HTTP_CLIENT_GZIP
+    if(request->flags & HTTP_FLAG_ACCEPT_GZIP) {
+        http_write_header(request, "Accept-Encoding", "gzip");
+    }
+#endif
+
     return 1;
 }
 
@@ -339,6 +460,12 @@ int http_end_body(struct http_request *request)
         const char *final_chunk = "0\r\n\r\n";
         http_write_all(request->fd, final_chunk, strlen(final_chunk));
         free(request->line);
+
+        // A client goes on to read the response with the same request
+        request->line = 0;
+        request->line_length = 0;
+        request->chunk_length = 0;
+        request->flags &= ~HTTP_FLAG_WRITE_CHUNKED;
     }
     return 0;
 }
@@ -22,6 +22,160 @@ static void http_parse_header_next_state(struct http_request *request, int state
     request->line_index = 0;
 }
 
+// Handle one header line of a request or response, such as "Content-Length: 5"
+#if HTTP_SERVER_PROXY
+// Keep the line as it came, before the ones below change it in place
+static void http_parse_keep_header(struct http_request *request, const char *line)
+{
+    int len = strlen(line);
+
+    if(request->headers_length + len + 3 > HTTP_SERVER_PROXY_HEADERS_LEN) {
+        LOG("Request header too long");
+        request->error = HTTP_STATUS_HEADERS_TOO_LARGE;
+        http_parse_header_next_state(request, HTTP_STATE_ERROR);
+        return;
+    }
+
+    char *headers = realloc(request->headers, request->headers_length + len + 3);
+    if(!headers) {
+        request->error = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        http_parse_header_next_state(request, HTTP_STATE_ERROR);
+        return;
+    }
+
+    memcpy(headers + request->headers_length, line, len);
+    strcpy(headers + request->headers_length + len, "\r\n");
+    request->headers = headers;
+    request->headers_length += len + 2;
+}
+#endif
+
+void http_parse_header_line(struct http_request *request, char *line)
+{
+    char *val;
+
+    if(http_is_server(request)) {
+#if HTTP_SERVER_PROXY
+        http_parse_keep_header(request, line);
+        if(http_is_error(request)) {
+            return;
+        }
+#endif
+
+        if((val = cmp_str_prefix(line, "Host: ")) != 0) {
+            request->host = malloc(strlen(val) + 1);
+
+            if(!request->host) {
+                http_parse_header_next_state(request, HTTP_STATE_ERROR);
+                request->error = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+                return;
+            }
+
+            strcpy(request->host, val);
+        } else if((val = cmp_str_prefix(line, "Accept-Encoding: ")) != 0) {
+            if(strstr(val, "gzip") != 0) {
+                request->flags |= HTTP_FLAG_ACCEPT_GZIP;
+            }
+        } else if((val = cmp_str_prefix(line, "Upgrade: ")) != 0) {
+            if(strstr(val, "websocket") != 0) {
+                request->flags |= HTTP_FLAG_WEBSOCKET;
+            }
+        } else if((val = cmp_str_prefix(line, "Sec-WebSocket-Key: ")) != 0) {
+            request->websocket_key = malloc(strlen(val) + 1);
+
+            if(!request->websocket_key) {
+                http_parse_header_next_state(request, HTTP_STATE_ERROR);
+                request->error = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+                return;
+            }
+
+            strcpy(request->websocket_key, val);
+        } else if((val = cmp_str_prefix(line, "Sec-WebSocket-Extensions: ")) != 0) {
+            // Several headers are the same as one comma separated list
+            int old_len = request->websocket_extensions ? strlen(request->websocket_extensions) : 0;
+            char *ext = realloc(request->websocket_extensions, old_len + strlen(val) + 3);
+
+            if(!ext) {
+                http_parse_header_next_state(request, HTTP_STATE_ERROR);
+                request->error = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+                return;
+            }
+
+            if(old_len > 0) {
+                strcpy(ext + old_len, ", ");
+                old_len += 2;
+            }
+            strcpy(ext + old_len, val);
+            request->websocket_extensions = ext;
+        } else if((val = cmp_str_prefix(line, "If-None-Match: ")) != 0) {
+            if(*val++ == '\"') {
+                int len = strlen(val) - 1;
+                if(val[len] == '\"') {
+                    val[len] = 0;
+                    request->etag = malloc(len + 1);
+                    strcpy(request->etag, val);
+                }
+            }
+        } else if((val = cmp_str_prefix(line, "If-Modified-Since: ")) != 0) {
+            request->if_modified_since = http_parse_date(val);
+        } else if((val = cmp_str_prefix(line, "Connection: ")) != 0) {
+            if(strstr(val, "close") != 0) {
+                request->flags |= HTTP_FLAG_CONNECTION_CLOSE;
+            }
+        }
+    } else {
+        if((val = cmp_str_prefix(line, "Content-Type: ")) != 0) {
+            request->content_type = malloc(strlen(val) + 1);
+
+            if(!request->content_type) {
+                http_parse_header_next_state(request, HTTP_STATE_ERROR);
+                request->error = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+                return;
+            }
+
+            strcpy(request->content_type, val);
+        } else if((val = cmp_str_prefix(line, "Upgrade: ")) != 0) {
+            if(strstr(val, "websocket") != 0) {
+                request->flags |= HTTP_FLAG_WEBSOCKET;
+            }
+        } else if((val = cmp_str_prefix(line, "Sec-WebSocket-Accept: ")) != 0) {
+            // A client keeps the accept value where a server keeps the key
+            request->websocket_key = malloc(strlen(val) + 1);
+
+            if(!request->websocket_key) {
+                http_parse_header_next_state(request, HTTP_STATE_ERROR);
+                return;
+            }
+
+            strcpy(request->websocket_key, val);
+        } else if((val = cmp_str_prefix(line, "Connection: ")) != 0) {
+            if(strstr(val, "close") != 0) {
+                request->flags |= HTTP_FLAG_CONNECTION_CLOSE;
+            }
+        } else if((val = cmp_str_prefix(line, "Content-Encoding: ")) != 0) {
+            // A body the client did not ask to be compressed is passed on as it is
+            if((request->flags & HTTP_FLAG_ACCEPT_GZIP) && (strstr(val, "gzip") != 0)) {
+                request->flags |= HTTP_FLAG_READ_GZIP;
+            }
+        }
+    }
+
+    if((val = cmp_str_prefix(line, "Transfer-Encoding: ")) != 0) {
+        if(strstr(val, "chunked") != 0) {
+            request->flags |= HTTP_FLAG_READ_CHUNKED;
+        }
+    } else if((val = cmp_str_prefix(line, "Content-Length: ")) != 0) {
+        char *p;
+        request->read_content_length = strtol(val, &p, 10);
+        if(!p || *p) {
+            http_parse_header_next_state(request, HTTP_STATE_ERROR);
+            request->error = HTTP_STATUS_BAD_REQUEST;
+            LOG("Error parsing content length '%s'", val);
+            return;
+        }
+    }
+}
+
 void http_parse_header(struct http_request *request, char c)
 {
     if(request->state & HTTP_STATE_READ_NL) {
@@ -143,75 +297,10 @@ void http_parse_header(struct http_request *request, char c)
             if(request->line_index == 0) {
                 http_parse_header_next_state(request, HTTP_STATE_IDLE | HTTP_STATE_READ_NL);
             } else {
+                http_parse_header_line(request, request->line);
 
-                char *val;
-
-                if(http_is_server(request)) {
-                    if((val = cmp_str_prefix(request->line, "Host: ")) != 0) {
-                        request->host = malloc(strlen(val) + 1);
-
-                        if(!request->host) {
-                            http_parse_header_next_state(request, HTTP_STATE_ERROR);
-                            request->error = HTTP_STATUS_INTERNAL_SERVER_ERROR;
-                            return;
-                        }
-
-                        strcpy(request->host, val);
-                    } else if((val = cmp_str_prefix(request->line, "Accept-Encoding: ")) != 0) {
-                        if(strstr(val, "gzip") != 0) {
-                            request->flags |= HTTP_FLAG_ACCEPT_GZIP;
-                        }
-                    } else if((val = cmp_str_prefix(request->line, "Upgrade: ")) != 0) {
-                        if(strstr(val, "websocket") != 0) {
-                            request->flags |= HTTP_FLAG_WEBSOCKET;
-                        }
-                    } else if((val = cmp_str_prefix(request->line, "Sec-WebSocket-Key: ")) != 0) {
-                        request->websocket_key = malloc(strlen(val) + 1);
-
-                        if(!request->websocket_key) {
-                            http_parse_header_next_state(request, HTTP_STATE_ERROR);
-                            request->error = HTTP_STATUS_INTERNAL_SERVER_ERROR;
-                            return;
-                        }
-
-                        strcpy(request->websocket_key, val);
-                    } else if((val = cmp_str_prefix(request->line, "If-None-Match: ")) != 0) {
-                        if(*val++ == '\"') {
-                            int len = strlen(val) - 1;
-                            if(val[len] == '\"') {
-                                val[len] = 0;
-                                request->etag = malloc(len + 1);
-                                strcpy(request->etag, val);
-                            }
-                        }
-                    }
-                } else {
-                    if((val = cmp_str_prefix(request->line, "Content-Type: ")) != 0) {
-                        request->content_type = malloc(strlen(val) + 1);
-
-                        if(!request->content_type) {
-                            http_parse_header_next_state(request, HTTP_STATE_ERROR);
-                            request->error = HTTP_STATUS_INTERNAL_SERVER_ERROR;
-                            return;
-                        }
-
-                        strcpy(request->content_type, val);
-                    }
-                }
-
-                if((val = cmp_str_prefix(request->line, "Transfer-Encoding: ")) != 0) {
-                    if(strstr(val, "chunked") != 0) {
-                        request->flags |= HTTP_FLAG_READ_CHUNKED;
-                    }
-                } else if((val = cmp_str_prefix(request->line, "Content-Length: ")) != 0) {
-                    char *p;
-                    request->read_content_length = strtol(val, &p, 10);
-                    if(!p || *p) {
-                        http_parse_header_next_state(request, HTTP_STATE_ERROR);
-                        request->error = HTTP_STATUS_BAD_REQUEST;
-                        LOG("Error parsing content length '%s'", val);
-                        return;
-                    }
+                if(http_is_error(request)) {
+                    return;
                 }
 
                 http_parse_header_next_state(request, HTTP_STATE_READ| HTTP_STATE_HEADER | HTTP_STATE_READ_NL);
@@ -5,33 +5,231 @@
 #include "lwip/lwip/sockets.h"
 #else
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #endif
 
 #include "http-sm/http.h"
 #include "http-sm/websocket.h"
 
+// Wait with epoll instead of select, which can not handle more than FD_SETSIZE descriptors
+#ifndef HTTP_SERVER_EPOLL
+#if defined(__linux__) && !defined(__XTENSA__)
+#define HTTP_SERVER_EPOLL 1
+#else
+#define HTTP_SERVER_EPOLL 0
+#endif
+#endif
+
+// Events returned by one epoll_wait
+#ifndef HTTP_SERVER_EPOLL_EVENTS
+#define HTTP_SERVER_EPOLL_EVENTS 64
+#endif
+
 struct http_server {
     struct http_request request[HTTP_SERVER_MAX_CONNECTIONS];
-    struct websocket_connection websocket_connection[WEBSOCKET_SERVER_MAX_CONNECTIONS];
+    // Open WebSocket connections, allocated as they are accepted
+    struct websocket_connection *websocket_connections;
+    int websocket_count;
     int fd;
+#if HTTP_SERVER_EPOLL
+    int epoll_fd;
+    uint8_t listen_events;
+    // The fd each request slot has registered, and for which events
+    int request_poll_fd[HTTP_SERVER_MAX_CONNECTIONS];
+    uint8_t request_events[HTTP_SERVER_MAX_CONNECTIONS];
+#endif
+};
+
+// The client reads the head of a response in as few reads as it can. Small reads of the body are
+// served from the rest of the buffer, after the head, which stays for the headers to point into.
+struct http_recv_buffer {
+    int head;
+    int index;
+    int length;
+    int header_count;
+    struct http_header headers[HTTP_CLIENT_MAX_HEADERS];
+    char data[HTTP_CLIENT_HEAD_LEN];
 };
 
 int http_hex_to_int(char c);
+uint32_t http_clock(void);
+uint32_t http_clock_ms(void);
+void http_set_nonblock(int fd, int nonblock);
+
+enum http_chunk_state {
+    HTTP_CHUNK_SIZE_START,
+    HTTP_CHUNK_SIZE,
+    HTTP_CHUNK_EXTENSION,
+    HTTP_CHUNK_DATA,
+    HTTP_CHUNK_DATA_END,
+    HTTP_CHUNK_TRAILER,
+    HTTP_CHUNK_TRAILER_LINE,
+    HTTP_CHUNK_END,
+};
+
+void http_chunk_init(struct http_chunk_decoder *d);
+int http_chunk_frame(struct http_chunk_decoder *d, const char *data, int len);
+void http_chunk_data(struct http_chunk_decoder *d, int n);
+int http_chunk_skip(struct http_chunk_decoder *d, const char *data, int len);
+
+#define http_chunk_done(d) ((d)->state == HTTP_CHUNK_END)
 
 void http_parse_header(struct http_request *request, char c);
+void http_parse_header_line(struct http_request *request, char *line);
 int http_begin_request(struct http_request *request);
+int http_read_response_header(struct http_request *request);
+int http_recv_response_header(struct http_request *request);
+int http_client_set_deadline(struct http_request *request, uint32_t start);
+int http_arm_deadline(struct http_request *request, int write);
+void http_reset_response(struct http_request *request);
+// Sending these twice does no more than sending them once (RFC 7231 4.2.2)
+#define http_method_is_idempotent(method) ((method) != HTTP_METHOD_POST)
+int http_read_body(struct http_request *request, void *buf, size_t count);
+int http_recv(struct http_request *request, void *buf, size_t count);
+
+#if HTTP_CLIENT_GZIP
+int http_gzip_read(struct http_request *request, void *buf, size_t count);
+void http_gzip_free(struct http_request *request);
+#endif
+
+// An address a host name resolved to, ready for connect
+struct http_address {
+#ifdef __XTENSA__
+    struct sockaddr_in addr;
+#else
+    struct sockaddr_storage addr;
+#endif
+    socklen_t length;
+};
+
+// Finds at most max addresses for host:port. Returns how many were found, or -1 if the lookup failed.
+typedef int (*http_resolver)(const char *host, int port, struct http_address *addrs, int max);
+
+void http_set_resolver(http_resolver resolver);
+int http_resolve(const char *host, int port, struct http_address *addrs, int max, uint32_t now);
+void http_resolve_prefer(const char *host, int port, const struct http_address *addr);
+void http_resolve_clear(void);
+
+int http_resolve_nowait(const char *host, int port, struct http_address *addrs, int max, uint32_t now);
+
+struct http_connect_attempt {
+    int fd;
+    uint32_t started;
+};
 
+// Connecting to whichever address of a host answers first without blocking, the way http_connect does.
+// The server loop waits for the attempts to become writable, and for http_connector_timer_next.
+struct http_connector {
+    struct http_address addrs[HTTP_DNS_MAX_ADDRESSES];
+    struct http_connect_attempt attempts[HTTP_DNS_MAX_ADDRESSES];
+    uint32_t next_start;
+    uint8_t count;
+    uint8_t started;
+    // The address that answered
+    uint8_t index;
+    // Bit mask of the attempts in the server loop's epoll set
+    uint8_t polled;
+};
+
+int http_connect(const struct http_address *addrs, int count, int timeout_ms, int *index);
+void http_connector_init(struct http_connector *c, const struct http_address *addrs, int count);
+int http_connector_poll(struct http_connector *c, int *fd);
+int http_connector_timer_next(const struct http_connector *c, uint32_t now);
+void http_connector_close(struct http_connector *c);
+int http_connector_create_select_sets(const struct http_connector *c, fd_set *set_write, int *maxfd);
+int http_connector_isset(const struct http_connector *c, fd_set *set_write);
 int http_open_request_socket(struct http_request *request);
 
+int http_async_pending(struct http_request *owner);
+void http_async_expire(uint32_t now);
+int http_async_timer_next(uint32_t now);
+int http_async_connect_next(uint32_t now);
+void http_async_dispatch(struct http_server *server);
+int http_async_create_select_sets(fd_set *set_read, fd_set *set_write, int *maxfd);
+void http_async_handle_select(fd_set *set_read, fd_set *set_write);
+int http_async_owns(void *ptr);
+void http_async_handle_events(struct http_async *async, int readable, int writable);
+#if HTTP_SERVER_EPOLL
+void http_async_poll_update(struct http_server *server);
+#endif
+
+#if HTTP_SERVER_PROXY
+// A request cgi_proxy passes on to its upstream server, see http-server-proxy.c
+struct http_proxy {
+    // The upstream side, a client request on a socket that does not block
+    struct http_request upstream;
+    const struct http_proxy_target *target;
+    // The server request it answers
+    struct http_request *owner;
+
+    // Bytes move between the sockets through this pipe, which stays with the slot
+    int pipe[2];
+    int pipe_bytes;
+
+    // The request head, written as the upstream socket takes it
+    char *out;
+    int out_length;
+    int out_index;
+
+    // Bytes of the request body still to come from the client
+    int body_left;
+    // Bytes of the response body still to come from upstream, -1 if it ends when upstream closes
+    int response_left;
+
+    uint32_t deadline;
+    int poll_fd;
+    uint8_t poll_events;
+    // What the handler waits for on the upstream socket, 1 to read and 2 to write
+    uint8_t wait;
+    uint8_t stage;
+    uint8_t pooled;
+    uint8_t reusable;
+    // The client connection is kept for its next request
+    uint8_t keep_alive;
+    uint8_t timed_out;
+    uint8_t has_pipe;
+    uint8_t has_body;
+    struct http_chunk_decoder chunk;
+    struct http_connector connector;
+};
+
+int http_proxy_pending(struct http_request *owner);
+void http_proxy_expire(uint32_t now);
+int http_proxy_timer_next(uint32_t now);
+int http_proxy_connect_next(uint32_t now);
+void http_proxy_dispatch(struct http_server *server);
+int http_proxy_create_select_sets(fd_set *set_read, fd_set *set_write, int *maxfd);
+void http_proxy_handle_select(fd_set *set_read, fd_set *set_write);
+int http_proxy_owns(void *ptr);
+void http_proxy_handle_events(struct http_proxy *proxy, int readable, int writable);
+#if HTTP_SERVER_EPOLL
+void http_proxy_poll_update(struct http_server *server);
+#endif
+#endif
+
+int http_client_pool_take(const char *host, int port);
+int http_client_pool_put(const char *host, int port, int fd);
+void http_client_pool_evict(uint32_t now);
+
 int http_open_listen_socket(int port);
 
 int http_create_select_sets(struct http_server *server, fd_set *set_read, fd_set *set_write, int *maxfd);
 
+#if HTTP_SERVER_EPOLL
+int http_poll_init(struct http_server *server);
+int http_poll_set(struct http_server *server, int op, int fd, uint32_t events, void *ptr);
+void http_poll_connector(struct http_server *server, struct http_connector *c, void *ptr);
+int http_poll_update_requests(struct http_server *server);
+void websocket_poll_update(struct http_server *server, struct websocket_connection *conn);
+#endif
+
 int http_accept_new_connection(struct http_server *server);
 
 void http_response_init(struct http_request *request);
 
 int http_server_match_url(const char *server_url, const char *request_url);
+int http_server_match_glob(const char *pattern, const char *str);
 const char *http_status_string(enum http_status status);
 
 void http_free(struct http_request *request);
@@ -40,13 +238,131 @@ void http_free(struct http_request *request);
 #define http_is_client(request)   ((request)->state & HTTP_STATE_CLIENT)
 
 int http_write_all(int fd, const char *str, int len);
+int http_writev_all(int fd, struct iovec *iov, int iovcnt);
 int http_read_all(int fd, void *buf_, size_t count);
 
 int websocket_init(struct http_server *server, struct http_request *request);
-void websocket_send_response(struct http_request *request);
+#define WEBSOCKET_ACCEPT_LEN 29
+
+void websocket_accept_key(const char *key, char *accept);
+void websocket_send_response(struct http_request *request, const char *extensions);
 void websocket_read_frame_header(struct websocket_connection *conn);
-void websocket_flush(struct websocket_connection *conn);
+void websocket_set_nodelay(struct websocket_connection *conn);
 void websocket_parse_frame_header(struct websocket_connection *conn, uint8_t c);
-int websocket_is_readable(struct websocket_connection *conn);
+int websocket_parse_frame_header_buf(struct websocket_connection *conn, const uint8_t *buf, int len);
+void websocket_mask(uint8_t *buf, size_t len, const uint8_t *mask, uint64_t offset);
+void websocket_random(uint8_t *buf, size_t len);
+void websocket_set_nonblock(struct websocket_connection *conn);
+int websocket_frame_ready(struct websocket_connection *conn);
+int websocket_start_payload(struct websocket_connection *conn);
+int websocket_read_payload(struct websocket_connection *conn);
+int websocket_frame_data(struct websocket_connection *conn, const uint8_t **data);
+
+int websocket_utf8_valid(const uint8_t *buf, size_t len);
+
+// A fragmented message being put together, see websocket-message.c
+struct websocket_message {
+    uint8_t opcode;
+    size_t length;
+    size_t size;
+    uint8_t *data;
+    struct websocket_message *next;
+};
+
+void websocket_message_frame(struct websocket_connection *conn);
+int websocket_worker_submit(struct websocket_connection *conn, const uint8_t *data, size_t len, uint8_t opcode);
+void websocket_worker_dispatch(struct http_server *server);
+void websocket_message_free(struct websocket_connection *conn);
+
+// A frame that is encoded once and shared between the out queues of several connections
+struct websocket_frame_buf {
+    int refcount;
+    size_t length;
+    uint8_t data[];
+};
+
+int websocket_frame_header(uint8_t *header, size_t count, uint8_t opcode);
+struct websocket_frame_buf *websocket_frame_alloc(const void *buf, size_t count, uint8_t opcode);
+void websocket_frame_release(struct websocket_frame_buf *frame);
+
+// Out queue of a connection, only allocated while frames are waiting
+struct websocket_out_queue {
+    uint8_t head;
+    uint8_t count;
+    // Frames at the tail that wait for the fragmented message being sent to end
+    uint8_t held;
+    // Bytes of the head frame already sent
+    size_t offset;
+    size_t bytes;
+    struct websocket_frame_buf *frames[WEBSOCKET_OUT_QUEUE_LEN];
+};
+
+void websocket_queue_init(struct websocket_connection *conn);
+int websocket_queue_frame(struct websocket_connection *conn, struct websocket_frame_buf *frame);
+int websocket_queue_has_room(struct websocket_connection *conn, uint8_t opcode, size_t length);
+int websocket_queue_flush(struct websocket_connection *conn);
+#define websocket_queue_count(conn) ((conn)->out ? (conn)->out->count : 0)
+// Frames that can go out now, the ones before the held ones
+#define websocket_queue_pending(conn) ((conn)->out ? (conn)->out->count - (conn)->out->held : 0)
+// Takes the first header byte of a frame. A fragment is a data frame that does not carry a whole message.
+#define websocket_frame_is_fragment(b) (!((b) & 0x08) && (((b) & WEBSOCKET_FRAME_OPCODE) == WEBSOCKET_FRAME_OPCODE_CONT || !((b) & WEBSOCKET_FRAME_FIN)))
+// Whole data messages wait for the fragmented message being sent to end
+#define websocket_frame_is_held(conn, b) ((conn)->send_fragmented && !((b) & 0x08) && !websocket_frame_is_fragment(b))
+#define websocket_wants_write(conn) ((conn)->out_overflow || websocket_queue_pending(conn) || \
+                                     ((conn)->send_fragmented && (conn)->handler && (conn)->handler->cb_write))
+void websocket_queue_drop(struct websocket_connection *conn);
+
+// Connections whose out queue, write interest or state changed since the server loop last looked at them
+void websocket_mark_dirty(struct websocket_connection *conn);
+struct websocket_connection *websocket_take_dirty(void);
+
+uint32_t websocket_timer_clock(void);
+void websocket_timer_set(struct websocket_timer *timer, uint32_t expires);
+void websocket_timer_cancel(struct websocket_timer *timer);
+int websocket_timer_next(uint32_t now);
+
+void websocket_keepalive_start(struct websocket_connection *conn);
+void websocket_keepalive_frame(struct websocket_connection *conn);
+void websocket_keepalive_run(uint32_t now);
+void websocket_queue_clear(struct websocket_connection *conn);
+
+#if WEBSOCKET_DEFLATE
+struct websocket_zstream;
+
+struct websocket_deflate {
+    uint8_t server_window_bits;
+    uint8_t client_window_bits;
+    uint8_t server_no_context_takeover;
+    uint8_t client_no_context_takeover;
+
+    // Whether the message being sent or received is compressed
+    uint8_t send_compressed;
+    uint8_t recv_compressed;
+
+    struct websocket_zstream *deflater;
+    struct websocket_zstream *inflater;
+
+    // Inflated payload of the current frame
+    uint8_t *inflated;
+};
+
+#define WEBSOCKET_EXTENSIONS_LEN 128
+
+int websocket_deflate_negotiate(const char *extensions, struct websocket_deflate *params, char *response, int response_len);
+int websocket_deflate_compress(struct websocket_deflate *d, const void *buf, size_t count, int fin, uint8_t **out, size_t *out_len);
+int websocket_deflate_decompress(struct websocket_deflate *d, const void *buf, size_t count, int fin, uint8_t **out, size_t *out_len);
+void websocket_deflate_free(struct websocket_deflate *d);
+int websocket_inflate_frame(struct websocket_connection *conn);
+
+#define websocket_has_inflated(conn) ((conn)->deflate && (conn)->deflate->inflated)
+#else
+#define websocket_has_inflated(conn) 0
+#endif
+
+int websocket_channel_init(void);
+int websocket_channel_wake_fd(void);
+void websocket_channel_wake(void);
+void websocket_channel_dispatch(struct http_server *server);
+void websocket_channel_leave(struct websocket_connection *conn);
 
 #endif
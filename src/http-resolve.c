@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __XTENSA__
+#include "lwip/lwip/sockets.h"
+#include "lwip/lwip/netdb.h"
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#endif
+
+#include "http-sm/http.h"
+#include "http-private.h"
+#include "log.h"
+
+#if HTTP_DNS_THREAD
+#include <pthread.h>
+#endif
+
+struct http_dns_entry {
+    char *host;
+    uint16_t port;
+    // Zero for a lookup that failed
+    uint8_t count;
+    uint32_t expires;
+    struct http_address addrs[HTTP_DNS_MAX_ADDRESSES];
+};
+
+static struct http_dns_entry http_dns_cache[HTTP_DNS_CACHE_SIZE];
+
+static int http_resolve_getaddrinfo(const char *host, int port, struct http_address *addrs, int max)
+{
+    const struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *res;
+
+    char port_str[6];
+    sprintf(port_str, "%d", port);
+
+    int err = getaddrinfo(host, port_str, &hints, &res);
+
+    if (err != 0 || res == NULL)
+    {
+        ERROR("getaddrinfo failed");
+        if(res) {
+            freeaddrinfo(res);
+        }
+
+        return -1;
+    }
+
+    // The address families take turns, starting with the first one given, so that when one of them
+    // does not work the connection attempts to the other one are not held up for long (RFC 8305)
+    int family = res->ai_family;
+    struct addrinfo *next[2] = { res, res };
+    int n = 0;
+
+    for(int turn = 0; n < max; turn ^= 1) {
+        for(int i = 0; i < 2; i++) {
+            while(next[i] && ((next[i]->ai_family == family) != (i == 0))) {
+                next[i] = next[i]->ai_next;
+            }
+        }
+
+        if(!next[turn]) {
+            turn ^= 1;
+        }
+
+        struct addrinfo *ai = next[turn];
+        if(!ai) {
+            break;
+        }
+        next[turn] = ai->ai_next;
+
+        if(ai->ai_addrlen > sizeof(addrs[n].addr)) {
+            continue;
+        }
+
+        if (ai->ai_addr->sa_family == AF_INET)
+        {
+            INFO("DNS lookup for %s succeeded. IP=%s", host, inet_ntoa(((struct sockaddr_in *)ai->ai_addr)->sin_addr));
+        }
+
+        memcpy(&addrs[n].addr, ai->ai_addr, ai->ai_addrlen);
+        addrs[n].length = ai->ai_addrlen;
+        n++;
+    }
+
+    freeaddrinfo(res);
+
+    return n;
+}
+
+static http_resolver http_resolver_func = http_resolve_getaddrinfo;
+
+// Use resolver instead of getaddrinfo, or go back to it with NULL. Forgets all earlier lookups.
+void http_set_resolver(http_resolver resolver)
+{
+    http_resolver_func = resolver ? resolver : http_resolve_getaddrinfo;
+    http_resolve_clear();
+}
+
+static struct http_dns_entry *http_resolve_find(const char *host, int port)
+{
+    for(int i = 0; i < HTTP_DNS_CACHE_SIZE; i++) {
+        struct http_dns_entry *entry = &http_dns_cache[i];
+
+        if(entry->host && (entry->port == port) && (strcmp(entry->host, host) == 0)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// The entry for a new lookup: a free one, else the one closest to expiring
+static struct http_dns_entry *http_resolve_slot(uint32_t now)
+{
+    struct http_dns_entry *slot = NULL;
+
+    for(int i = 0; i < HTTP_DNS_CACHE_SIZE; i++) {
+        struct http_dns_entry *entry = &http_dns_cache[i];
+
+        if(!entry->host) {
+            return entry;
+        }
+
+        if(!slot || ((int32_t)(entry->expires - slot->expires) < 0)) {
+            slot = entry;
+        }
+    }
+
+    free(slot->host);
+    slot->host = NULL;
+
+    return slot;
+}
+
+// The entry for host:port if its lookup is still fresh
+static struct http_dns_entry *http_resolve_cached(const char *host, int port, uint32_t now)
+{
+    struct http_dns_entry *entry = http_resolve_find(host, port);
+
+    if(entry && ((int32_t)(entry->expires - now) <= 0)) {
+        free(entry->host);
+        entry->host = NULL;
+        entry = NULL;
+    }
+
+    return entry;
+}
+
+static int http_resolve_copy(struct http_dns_entry *entry, struct http_address *addrs, int max)
+{
+    if(!entry->count) {
+        LOG("DNS lookup for %s failed recently", entry->host);
+        return -1;
+    }
+
+    int n = (entry->count > max) ? max : entry->count;
+    memcpy(addrs, entry->addrs, n * sizeof(*addrs));
+
+    return n;
+}
+
+// Remember the n addresses found for host:port, or the failed lookup if n is not positive, and return them
+// the way http_resolve does
+static int http_resolve_store(const char *host, int port, const struct http_address *found, int n,
+                              struct http_address *addrs, int max, uint32_t now)
+{
+    struct http_dns_entry *entry = http_resolve_slot(now);
+    entry->host = malloc(strlen(host) + 1);
+
+    if(!entry->host) {
+        // Not remembered, but the addresses are still good for this request
+        n = (n > max) ? max : n;
+        if(n > 0) {
+            memcpy(addrs, found, n * sizeof(*addrs));
+        }
+        return (n > 0) ? n : -1;
+    }
+
+    strcpy(entry->host, host);
+    entry->port = port;
+    entry->count = (n > 0) ? n : 0;
+    entry->expires = now + ((n > 0) ? HTTP_DNS_CACHE_TTL : HTTP_DNS_NEGATIVE_TTL);
+    memcpy(entry->addrs, found, entry->count * sizeof(*addrs));
+
+    return http_resolve_copy(entry, addrs, max);
+}
+
+// Look up host:port, from the cache while the last lookup is fresh. Returns the number of addresses in addrs, or -1.
+int http_resolve(const char *host, int port, struct http_address *addrs, int max, uint32_t now)
+{
+    if(!host) {
+        return -1;
+    }
+
+    struct http_dns_entry *entry = http_resolve_cached(host, port, now);
+
+    if(!entry) {
+        struct http_address found[HTTP_DNS_MAX_ADDRESSES];
+        int n = http_resolver_func(host, port, found, HTTP_DNS_MAX_ADDRESSES);
+
+        return http_resolve_store(host, port, found, n, addrs, max, now);
+    }
+
+    return http_resolve_copy(entry, addrs, max);
+}
+
+#if HTTP_DNS_THREAD
+// A lookup for the server loop, running on a thread of its own. Only done is touched by both.
+struct http_dns_lookup {
+    char *host;
+    uint16_t port;
+    uint8_t done;
+    int count;
+    http_resolver resolver;
+    struct http_address addrs[HTTP_DNS_MAX_ADDRESSES];
+};
+
+static struct http_dns_lookup http_dns_lookups[HTTP_DNS_CACHE_SIZE];
+
+static void *http_resolve_run(void *arg)
+{
+    struct http_dns_lookup *lookup = arg;
+
+    lookup->count = lookup->resolver(lookup->host, lookup->port, lookup->addrs, HTTP_DNS_MAX_ADDRESSES);
+    __atomic_store_n(&lookup->done, 1, __ATOMIC_RELEASE);
+
+    // The loop calls http_resolve_nowait again when it wakes up
+    websocket_channel_wake();
+
+    return NULL;
+}
+
+// Start looking up host:port on a thread. Returns -1 if it could not be started.
+static int http_resolve_start(struct http_dns_lookup *lookup, const char *host, int port)
+{
+    pthread_t thread;
+
+    lookup->host = malloc(strlen(host) + 1);
+    if(!lookup->host) {
+        return -1;
+    }
+
+    strcpy(lookup->host, host);
+    lookup->port = port;
+    lookup->done = 0;
+    lookup->resolver = http_resolver_func;
+
+    if(pthread_create(&thread, NULL, http_resolve_run, lookup) != 0) {
+        ERROR("pthread_create");
+        free(lookup->host);
+        lookup->host = NULL;
+        return -1;
+    }
+
+    pthread_detach(thread);
+
+    return 0;
+}
+#endif
+
+// http_resolve for the server loop, which must not block. A name that is not cached is looked up on a helper
+// thread, and 0 is returned until the lookup is done. The loop is woken up then, to call this again.
+int http_resolve_nowait(const char *host, int port, struct http_address *addrs, int max, uint32_t now)
+{
+#if HTTP_DNS_THREAD
+    if(!host) {
+        return -1;
+    }
+
+    struct http_dns_entry *entry = http_resolve_cached(host, port, now);
+    if(entry) {
+        return http_resolve_copy(entry, addrs, max);
+    }
+
+    struct http_dns_lookup *lookup = NULL;
+
+    for(int i = 0; i < HTTP_DNS_CACHE_SIZE; i++) {
+        struct http_dns_lookup *l = &http_dns_lookups[i];
+
+        if(l->host && (l->port == port) && (strcmp(l->host, host) == 0)) {
+            if(!__atomic_load_n(&l->done, __ATOMIC_ACQUIRE)) {
+                return 0;
+            }
+
+            int n = http_resolve_store(host, port, l->addrs, l->count, addrs, max, now);
+            free(l->host);
+            l->host = NULL;
+
+            return n;
+        } else if(!l->host && !lookup) {
+            lookup = l;
+        }
+    }
+
+    if(lookup && (http_resolve_start(lookup, host, port) == 0)) {
+        return 0;
+    }
+
+    LOG("DNS lookup for %s blocks the server loop", host);
+#endif
+    return http_resolve(host, port, addrs, max, now);
+}
+
+// Try addr first next time, since it was the one that could be connected to
+void http_resolve_prefer(const char *host, int port, const struct http_address *addr)
+{
+    struct http_dns_entry *entry = http_resolve_find(host, port);
+
+    if(!entry) {
+        return;
+    }
+
+    for(int i = 1; i < entry->count; i++) {
+        if((entry->addrs[i].length == addr->length) && (memcmp(&entry->addrs[i].addr, &addr->addr, addr->length) == 0)) {
+            struct http_address preferred = entry->addrs[i];
+            memmove(&entry->addrs[1], &entry->addrs[0], i * sizeof(entry->addrs[0]));
+            entry->addrs[0] = preferred;
+            return;
+        }
+    }
+}
+
+void http_resolve_clear(void)
+{
+    for(int i = 0; i < HTTP_DNS_CACHE_SIZE; i++) {
+        free(http_dns_cache[i].host);
+        http_dns_cache[i].host = NULL;
+    }
+}
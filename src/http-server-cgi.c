@@ -4,8 +4,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include "http-sm/http.h"
+#include "http-private.h"
 #include "log.h"
 
 static const char *WWW_DIR = HTTP_WWW_DIR;
@@ -14,12 +16,51 @@ static const char *HASH_EXT = ".hs";
 
 #define HASH_LEN 40
 
+#ifndef HTTP_FS_CACHE_SIZE
+#define HTTP_FS_CACHE_SIZE 8
+#endif
+
+#ifndef HTTP_FS_CACHE_TTL_SECS
+#define HTTP_FS_CACHE_TTL_SECS 10
+#endif
+
+#define NOT_MODIFIED_LEN 224
+#define CACHE_CONTROL_LEN 64
+
 struct http_fs_response
 {
     int fd;
     char buf[128];
 };
 
+// The validator cache remembers the ETag and modification time of recently
+// served files together with a complete 304 response, so that a matching
+// conditional request can be answered without opening the file. Requests
+// that take gzip and ones that do not have their own entries, as they may be
+// served different files. Entries are used for HTTP_FS_CACHE_TTL_SECS seconds
+// after the file was last opened, as long as its modification time is the same.
+struct http_fs_validator
+{
+    char *filename;
+    const struct http_cache_policy *policy;
+    uint8_t accept_gzip;
+    // Whether the .gz file was served
+    uint8_t gzip;
+    time_t checked;
+    time_t last_modified;
+    char etag[HASH_LEN + 3];
+    char not_modified[NOT_MODIFIED_LEN];
+    int not_modified_len;
+};
+
+static struct http_fs_validator validator_cache[HTTP_FS_CACHE_SIZE];
+
+// Applications that do not define their own policy table get "no-cache" for
+// every file
+struct http_cache_policy http_cache_policy_tab[] __attribute__((weak)) = {
+    {NULL, -1, 0},
+};
+
 struct http_mime_map
 {
     const char *ext;
@@ -56,6 +97,216 @@ static const char *get_mime_type(const char *path)
     return p->type;
 }
 
+static const struct http_cache_policy *get_cache_policy(const char *path)
+{
+    for(const struct http_cache_policy *p = http_cache_policy_tab; p->url; p++) {
+        if(http_server_match_glob(p->url, path)) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static void format_cache_control(char *dest, const struct http_cache_policy *policy)
+{
+    if(policy && (policy->flags & HTTP_CACHE_NO_STORE)) {
+        strcpy(dest, "no-store");
+    } else if(!policy || policy->max_age < 0) {
+        strcpy(dest, "no-cache");
+    } else {
+        const char *scope = "";
+
+        if(policy->flags & HTTP_CACHE_PUBLIC) {
+            scope = "public, ";
+        } else if(policy->flags & HTTP_CACHE_PRIVATE) {
+            scope = "private, ";
+        }
+
+        snprintf(dest, CACHE_CONTROL_LEN, "%smax-age=%ld%s", scope, policy->max_age,
+                 (policy->flags & HTTP_CACHE_IMMUTABLE) ? ", immutable" : "");
+    }
+}
+
+static unsigned validator_hash(const char *prefix, const char *base, int accept_gzip)
+{
+    unsigned h = 2166136261u;
+
+    while(*prefix) {
+        h = (h ^ (uint8_t)*prefix++) * 16777619u;
+    }
+
+    while(*base) {
+        h = (h ^ (uint8_t)*base++) * 16777619u;
+    }
+
+    h = (h ^ (accept_gzip ? 1 : 0)) * 16777619u;
+
+    return h % HTTP_FS_CACHE_SIZE;
+}
+
+static struct http_fs_validator *validator_lookup(const char *prefix, const char *base, const struct http_cache_policy *policy,
+                                                  int accept_gzip)
+{
+    struct http_fs_validator *v = &validator_cache[validator_hash(prefix, base, accept_gzip)];
+
+    if(!v->filename || v->policy != policy || v->accept_gzip != accept_gzip) {
+        return NULL;
+    }
+
+    int prefix_len = strlen(prefix);
+
+    if(strncmp(v->filename, prefix, prefix_len) || strcmp(v->filename + prefix_len, base)) {
+        return NULL;
+    }
+
+    if(time(0) - v->checked >= HTTP_FS_CACHE_TTL_SECS) {
+        return NULL;
+    }
+
+    // The file may have changed within the TTL, look at the one that was served
+    int filename_len = strlen(v->filename);
+    struct stat s;
+
+    if(v->gzip) {
+        strcat(v->filename, GZIP_EXT);
+    }
+
+    int ret = stat(v->filename, &s);
+
+    v->filename[filename_len] = 0;
+
+    if((ret < 0) || (s.st_mtime != v->last_modified)) {
+        return NULL;
+    }
+
+    return v;
+}
+
+static struct http_fs_validator *validator_store(const char *prefix, const char *base, const struct http_cache_policy *policy,
+                                                 int accept_gzip, int gzip, const char *etag, time_t last_modified)
+{
+    struct http_fs_validator *v = &validator_cache[validator_hash(prefix, base, accept_gzip)];
+
+    int prefix_len = strlen(prefix);
+
+    if(!v->filename || strncmp(v->filename, prefix, prefix_len) || strcmp(v->filename + prefix_len, base)) {
+        free(v->filename);
+
+        // With room for GZIP_EXT, see validator_lookup
+        v->filename = malloc(prefix_len + strlen(base) + strlen(GZIP_EXT) + 1);
+
+        if(!v->filename) {
+            return NULL;
+        }
+
+        strcpy(v->filename, prefix);
+        strcat(v->filename, base);
+    }
+
+    v->policy = policy;
+    v->accept_gzip = accept_gzip;
+    v->gzip = gzip;
+    v->checked = time(0);
+    v->last_modified = last_modified;
+
+    if(etag) {
+        strcpy(v->etag, etag);
+    } else {
+        v->etag[0] = 0;
+    }
+
+    // Without a date to answer with there is nothing to validate against
+    char date[HTTP_DATE_LEN + 1];
+    if(!http_format_date(date, last_modified)) {
+        free(v->filename);
+        v->filename = NULL;
+        return NULL;
+    }
+
+    char cache_control[CACHE_CONTROL_LEN];
+    format_cache_control(cache_control, policy);
+
+    int n = snprintf(v->not_modified, NOT_MODIFIED_LEN,
+                     "HTTP/1.1 304 %s\r\n"
+                     "Connection: close\r\n"
+                     "Cache-Control: %s\r\n"
+                     "Last-Modified: %s\r\n"
+                     "%s%s%s"
+                     "\r\n",
+                     http_status_string(HTTP_STATUS_NOT_MODIFIED), cache_control, date,
+                     etag ? "ETag: " : "", etag ? etag : "", etag ? "\r\n" : "");
+
+    if(n >= NOT_MODIFIED_LEN) {
+        free(v->filename);
+        v->filename = NULL;
+        return NULL;
+    }
+
+    v->not_modified_len = n;
+
+    return v;
+}
+
+static int validator_not_modified(const struct http_fs_validator *v, const struct http_request *request)
+{
+    if(request->etag) {
+        return v->etag[0] && (strncmp(v->etag + 1, request->etag, HASH_LEN) == 0);
+    } else if(request->if_modified_since) {
+        return v->last_modified <= request->if_modified_since;
+    }
+    return 0;
+}
+
+static enum http_cgi_state send_not_modified(struct http_request *request, const struct http_fs_validator *v)
+{
+    char buf[64];
+
+    while((request->state == HTTP_STATE_SERVER_READ_BODY) && (http_read(request, buf, sizeof(buf)) > 0)) {
+    }
+
+    request->state = HTTP_STATE_SERVER_WRITE_BODY;
+    request->write_content_length = 0;
+
+    http_write_bytes(request, v->not_modified, v->not_modified_len);
+
+    return HTTP_CGI_DONE;
+}
+
+static char *read_hash_file(const char *filename, long *total_size)
+{
+    char buf[HASH_LEN + 24];
+
+    int fd = open(filename, O_RDONLY);
+
+    if(fd < 0) {
+        return NULL;
+    }
+
+    int n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if(n < HASH_LEN) {
+        return NULL;
+    }
+
+    buf[n] = 0;
+
+    char *etag = malloc(HASH_LEN + 3);
+
+    if(etag) {
+        etag[0] = '"';
+        memcpy(etag + 1, buf, HASH_LEN);
+        etag[HASH_LEN + 1] = '"';
+        etag[HASH_LEN + 2] = 0;
+
+        if(n > HASH_LEN + 1 && '0' <= buf[HASH_LEN + 1] && buf[HASH_LEN + 1] <= '9') {
+            *total_size = strtol(buf + HASH_LEN + 1, NULL, 10);
+        }
+    }
+
+    return etag;
+}
+
 enum http_cgi_state cgi_fs(struct http_request* request)
 {
     if(request->method != HTTP_METHOD_GET) {
@@ -74,6 +325,20 @@ enum http_cgi_state cgi_fs(struct http_request* request)
             www_prefix = WWW_DIR;
         }
 
+        const struct http_cache_policy *policy = get_cache_policy(request->path);
+
+        int conditional = request->etag || request->if_modified_since;
+
+        if(conditional) {
+            struct http_fs_validator *v = validator_lookup(www_prefix, base_filename, policy,
+                                                           request->flags & HTTP_FLAG_ACCEPT_GZIP);
+
+            if(v && validator_not_modified(v, request)) {
+                LOG("Cache matches %s", v->filename);
+                return send_not_modified(request, v);
+            }
+        }
+
         char *filename;
 
         filename = malloc(strlen(www_prefix) + strlen(base_filename) + strlen(GZIP_EXT) + 1);
@@ -90,61 +355,11 @@ enum http_cgi_state cgi_fs(struct http_request* request)
         uint8_t file_flag = 0;
         int fd = -1;
 
-        char *etag = NULL;
         long total_size = -1;
 
         strcat(filename, HASH_EXT);
 
-        fd = open(filename, O_RDONLY);
-
-        if(fd >= 0) {
-            etag = malloc(HASH_LEN + 3);
-            if(etag) {
-                int n;
-
-                n = read(fd, etag + 1, HASH_LEN);
-                if(n == HASH_LEN) {
-                    etag[0] = '"';
-                    etag[n+1] = '"';
-                    etag[n+2] = 0;
-                } else {
-                    free(etag);
-                    etag = NULL;
-                }
-                char c;
-
-                if(read(fd, &c, 1) > 0) {
-                    while((read(fd, &c, 1) > 0) && ('0' <= c) && (c <= '9')) {
-                        if(total_size < 0) {
-                            total_size = 0;
-                        }
-                        total_size = 10 * total_size + (c - '0');
-                    }
-                }
-            }
-
-            close(fd);
-        }
-
-        if(etag && request->etag && (strncmp(etag+1, request->etag, HASH_LEN) == 0)) {
-            LOG("Cache matches %s", filename);
-
-            http_begin_response(request, 304, NULL);
-            http_write_header(request, "Cache-Control", "no-cache");
-            http_set_content_length(request, 0);
-
-            if(etag) {
-                http_write_header(request, "ETag", etag);
-            }
-
-            http_end_header(request);
-            http_end_body(request);
-
-            free(filename);
-            free(etag);
-
-            return HTTP_CGI_DONE;
-        }
+        char *etag = read_hash_file(filename, &total_size);
 
         filename[filename_len] = 0;
 
@@ -184,6 +399,19 @@ enum http_cgi_state cgi_fs(struct http_request* request)
         fstat(fd, &s);
         INFO("File size: %d", s.st_size);
 
+        struct http_fs_validator *v = validator_store(www_prefix, base_filename, policy, request->flags & HTTP_FLAG_ACCEPT_GZIP,
+                                                      file_flag & HTTP_FLAG_ACCEPT_GZIP, etag, s.st_mtime);
+
+        if(conditional && v && validator_not_modified(v, request)) {
+            LOG("Cache matches %s", filename);
+
+            close(fd);
+            free(filename);
+            free(etag);
+
+            return send_not_modified(request, v);
+        }
+
         const char *mime_type = get_mime_type(filename);
 
         free(filename);
@@ -192,6 +420,7 @@ enum http_cgi_state cgi_fs(struct http_request* request)
         request->cgi_data = malloc(sizeof(struct http_fs_response));
 
         if(!request->cgi_data) {
+            close(fd);
             free(etag);
             return HTTP_CGI_NOT_FOUND;
         }
@@ -200,8 +429,11 @@ enum http_cgi_state cgi_fs(struct http_request* request)
 
         resp->fd = fd;
 
+        char cache_control[CACHE_CONTROL_LEN];
+        format_cache_control(cache_control, policy);
+
         http_begin_response(request, 200, mime_type);
-        http_write_header(request, "Cache-Control", "no-cache");
+        http_write_header(request, "Cache-Control", cache_control);
         http_set_content_length(request, s.st_size);
 
         if(file_flag & HTTP_FLAG_ACCEPT_GZIP) {
@@ -217,6 +449,11 @@ enum http_cgi_state cgi_fs(struct http_request* request)
             http_write_header(request, "ETag", etag);
         }
 
+        char date[HTTP_DATE_LEN + 1];
+        if(http_format_date(date, s.st_mtime)) {
+            http_write_header(request, "Last-Modified", date);
+        }
+
         http_end_header(request);
 
         free(etag);
@@ -22,6 +22,11 @@
 
 #include "http-sm/http.h"
 #include "http-private.h"
+
+#if HTTP_SERVER_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #include "log.h"
 
 static void http_write_error_response(struct http_request *request)
@@ -131,6 +136,16 @@ int http_begin_response(struct http_request *request, int status, const char *co
 
 enum http_cgi_state cgi_not_found(struct http_request* request);
 
+// Start over on the same connection with the next request of the client
+static void http_server_next_request(struct http_request *request)
+{
+    int fd = request->fd;
+
+    http_free(request);
+    http_response_init(request);
+    request->fd = fd;
+}
+
 static int http_server_call_handler(struct http_request *request)
 {
     int i = 0;
@@ -143,8 +158,21 @@ static int http_server_call_handler(struct http_request *request)
             if(state == HTTP_CGI_DONE) {
                 request->state = HTTP_STATE_SERVER_READ_DONE;
                 break;
+            } else if(state == HTTP_CGI_KEEP_ALIVE) {
+                http_server_next_request(request);
+                break;
             } else if(state == HTTP_CGI_MORE) {
                 break;
+            } else if(state == HTTP_CGI_WAIT) {
+                int pending = http_async_pending(request);
+#if HTTP_SERVER_PROXY
+                pending += http_proxy_pending(request);
+#endif
+                // Nothing to wait for if the client requests could not be started
+                if(pending) {
+                    request->flags |= HTTP_FLAG_WAIT;
+                }
+                break;
             }
         }
 
@@ -169,18 +197,45 @@ static void websocket_handle_message(struct websocket_connection *conn)
     }
 }
 
+static void websocket_free_payload(struct websocket_connection *conn)
+{
+    free(conn->payload);
+    conn->payload = NULL;
+
+#if WEBSOCKET_DEFLATE
+    if(websocket_has_inflated(conn)) {
+        free(conn->deflate->inflated);
+        conn->deflate->inflated = NULL;
+    }
+#endif
+}
+
 void websocket_close(struct websocket_connection *conn, uint8_t *buf, int len)
 {
     websocket_send(conn, buf, len, WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_CLOSE);
 
     conn->state = WEBSOCKET_STATE_CLOSED;
 
+    websocket_timer_cancel(&conn->timer);
+    websocket_queue_clear(conn);
+    websocket_free_payload(conn);
+    websocket_message_free(conn);
+    websocket_channel_leave(conn);
+
+#if WEBSOCKET_DEFLATE
+    websocket_deflate_free(conn->deflate);
+    conn->deflate = NULL;
+#endif
+
     if(conn->handler->cb_close) {
         conn->handler->cb_close(conn);
     }
 
     close(conn->fd);
     conn->fd = -1;
+
+    // The server loop frees the connection once nothing refers to it any more
+    websocket_mark_dirty(conn);
 }
 
 static void websocket_handle_close(struct websocket_connection *conn)
@@ -209,62 +264,142 @@ static void websocket_handle_ping(struct websocket_connection *conn)
     }
 }
 
+static void websocket_handle_pong(struct websocket_connection *conn)
+{
+    // Pongs only matter for keepalive, so the payload is dropped
+    char buf[32];
+    while(conn->frame_index < conn->frame_length) {
+        if(websocket_read(conn, buf, sizeof(buf)) <= 0) {
+            break;
+        }
+    }
+}
+
+static int websocket_fill_buffer(struct websocket_connection *conn)
+{
+    if(conn->buf_index == conn->buf_length) {
+        conn->buf_index = 0;
+        conn->buf_length = 0;
+    } else if(conn->buf_index > 0) {
+        memmove(conn->buf, conn->buf + conn->buf_index, conn->buf_length - conn->buf_index);
+        conn->buf_length -= conn->buf_index;
+        conn->buf_index = 0;
+    }
+
+    return read(conn->fd, conn->buf + conn->buf_length, sizeof(conn->buf) - conn->buf_length);
+}
+
+static void websocket_handle_frame(struct websocket_connection *conn)
+{
+    websocket_keepalive_frame(conn);
+
+    switch(conn->frame_opcode & WEBSOCKET_FRAME_OPCODE) {
+    case WEBSOCKET_FRAME_OPCODE_CONT:
+    case WEBSOCKET_FRAME_OPCODE_BIN:
+    case WEBSOCKET_FRAME_OPCODE_TEXT:
+    {
+        if(conn->handler->cb_message_full) {
+            websocket_message_frame(conn);
+        } else {
+            websocket_handle_message(conn);
+        }
+        break;
+    }
+    case WEBSOCKET_FRAME_OPCODE_PONG:
+    {
+        websocket_handle_pong(conn);
+        break;
+    }
+    case WEBSOCKET_FRAME_OPCODE_CLOSE:
+    {
+        websocket_handle_close(conn);
+        break;
+    }
+    case WEBSOCKET_FRAME_OPCODE_PING:
+    {
+        websocket_handle_ping(conn);
+        break;
+    }
+    }
+
+    if(conn->state == WEBSOCKET_STATE_CLOSED) {
+        return;
+    }
+
+    if(conn->frame_index < conn->frame_length) {
+        int len = conn->frame_length - conn->frame_index;
+        int ret;
+
+        LOG("Handler did not consume the whole message. %d bytes remaining.", len);
+
+        do {
+            char buf[32];
+            int to_read = (sizeof(buf) < len) ? sizeof(buf) : len;
+            ret = websocket_read(conn, buf, to_read);
+        } while(ret > 0);
+    }
+    if(conn->frame_index == conn->frame_length) {
+        conn->state = WEBSOCKET_STATE_DONE;
+    }
+
+    if(conn->state == WEBSOCKET_STATE_DONE) {
+        conn->state = WEBSOCKET_STATE_OPCODE;
+    }
+}
+
 static void websocket_handle_connection(struct websocket_connection *conn)
 {
-    if(conn->state != WEBSOCKET_STATE_BODY) {
-        char c;
-        int ret = read(conn->fd, &c, 1);
+    // One read per wakeup. A frame that has not fully arrived is picked up again on the next one.
+    int ret = conn->payload ? websocket_read_payload(conn) : websocket_fill_buffer(conn);
 
-        if(ret < 0) {
+    if(ret < 0) {
+        if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
             ERROR("Reading websocket");
             conn->state = WEBSOCKET_STATE_ERROR;
-        } else if(ret == 0) {
-            LOG("Unexpected EOF in state %02x", conn->state);
-            conn->state = WEBSOCKET_STATE_ERROR;
-        } else {
-            websocket_parse_frame_header(conn, c);
         }
+    } else if(ret == 0) {
+        LOG("Unexpected EOF in state %02x", conn->state);
+        conn->state = WEBSOCKET_STATE_ERROR;
+    } else if(!conn->payload) {
+        conn->buf_length += ret;
     }
-    if((conn->state == WEBSOCKET_STATE_BODY) && (conn->frame_length == 0 || websocket_is_readable(conn))) {
-        switch(conn->frame_opcode & WEBSOCKET_FRAME_OPCODE) {
-        case WEBSOCKET_FRAME_OPCODE_CONT:
-        case WEBSOCKET_FRAME_OPCODE_BIN:
-        case WEBSOCKET_FRAME_OPCODE_TEXT:
-        case WEBSOCKET_FRAME_OPCODE_PONG:
-        {
-            websocket_handle_message(conn);
-            break;
-        }
-        case WEBSOCKET_FRAME_OPCODE_CLOSE:
-        {
-            websocket_handle_close(conn);
-            break;
-        }
-        case WEBSOCKET_FRAME_OPCODE_PING:
-        {
-            websocket_handle_ping(conn);
-            break;
-        }
-        }
 
-        if(conn->frame_index < conn->frame_length) {
-            int len = conn->frame_length - conn->frame_index;
-            int ret;
+    // Handle every frame that is already buffered before going back to select
+    while(conn->state != WEBSOCKET_STATE_ERROR) {
+        if(conn->state != WEBSOCKET_STATE_BODY) {
+            conn->buf_index += websocket_parse_frame_header_buf(conn, conn->buf + conn->buf_index, conn->buf_length - conn->buf_index);
+
+            if(conn->state != WEBSOCKET_STATE_BODY) {
+                break;
+            }
 
-            LOG("Handler did not consume the whole message. %d bytes remaining.", len);
+            // Small frames are collected in buf, larger ones get their own allocation
+            if((conn->frame_length > sizeof(conn->buf)) && !websocket_frame_ready(conn)) {
+                if(websocket_start_payload(conn) < 0) {
+                    conn->state = WEBSOCKET_STATE_ERROR;
+                    break;
+                }
+            }
+        }
 
-            do {
-                char buf[32];
-                int to_read = (sizeof(buf) < len) ? sizeof(buf) : len;
-                ret = websocket_read(conn, buf, to_read);
-            } while(ret > 0);
+        if(!websocket_frame_ready(conn)) {
+            break;
         }
-        if(conn->frame_index == conn->frame_length) {
-            conn->state = WEBSOCKET_STATE_DONE;
+
+#if WEBSOCKET_DEFLATE
+        if(conn->deflate) {
+            if(websocket_inflate_frame(conn) < 0) {
+                conn->state = WEBSOCKET_STATE_ERROR;
+                break;
+            }
         }
+#endif
+
+        websocket_handle_frame(conn);
+        websocket_free_payload(conn);
 
-        if(conn->state == WEBSOCKET_STATE_DONE) {
-            conn->state = WEBSOCKET_STATE_OPCODE;
+        if((conn->state != WEBSOCKET_STATE_OPCODE) || (conn->buf_index == conn->buf_length)) {
+            break;
         }
     }
 
@@ -290,23 +425,210 @@ static void http_handle_request_read(struct http_request *request, struct http_s
     }
 }
 
+static void http_handle_request(struct http_server *server, struct http_request *request, int readable, int writable)
+{
+    if(readable) {
+        http_handle_request_read(request, server);
+    } else if(writable) {
+        http_server_call_handler(request);
+    }
+    if(http_is_error(request)) {
+        free(request->line);
+        request->line = 0;
+        request->line_length = 0;
+
+        if(request->error > 0) {
+            http_write_error_response(request);
+        }
+
+        http_close(request);
+    }
+}
+
+static void websocket_handle_events(struct websocket_connection *conn, int readable, int writable)
+{
+    if((conn->fd >= 0) && readable) {
+        websocket_handle_connection(conn);
+    }
+    if((conn->fd >= 0) && writable) {
+        // A streaming handler gets to write more once what it sent before has gone out
+        if(conn->send_fragmented && !websocket_queue_pending(conn) && conn->handler->cb_write) {
+            conn->handler->cb_write(conn);
+        } else {
+            // The out queue is flushed with the other dirty connections
+            websocket_mark_dirty(conn);
+        }
+    }
+}
+
+static void websocket_free_connection(struct http_server *server, struct websocket_connection *conn)
+{
+    *conn->pprev = conn->next;
+    if(conn->next) {
+        conn->next->pprev = conn->pprev;
+    }
+    server->websocket_count--;
+
+    websocket_channel_leave(conn);
+    free(conn);
+}
+
+// Flush the out queues that changed, close connections that overflowed and free the ones that were closed
+static void websocket_handle_dirty(struct http_server *server)
+{
+    struct websocket_connection *conn;
+
+    while((conn = websocket_take_dirty())) {
+        if((conn->fd >= 0) && conn->out_overflow) {
+            // Whatever is queued would only delay the close frame
+            uint8_t error_code[] = { 0x03, 0xF0 };
+            websocket_queue_drop(conn);
+            conn->out_overflow = 0;
+            websocket_close(conn, error_code, sizeof(error_code));
+        }
+
+        if((conn->fd >= 0) && websocket_queue_pending(conn)) {
+            if(websocket_queue_flush(conn) < 0) {
+                ERROR("Writing websocket");
+                websocket_close(conn, NULL, 0);
+            }
+        }
+
+        if(conn->fd < 0) {
+            // Closing it above put it back on the list, so it is freed when it comes around again.
+            // A worker that still has messages from it puts it back when it is done.
+            if(!conn->dirty && !conn->jobs) {
+                websocket_free_connection(server, conn);
+            }
+            continue;
+        }
+
+#if HTTP_SERVER_EPOLL
+        websocket_poll_update(server, conn);
+#endif
+    }
+}
+
+#if HTTP_SERVER_EPOLL
+static void http_handle_poll_events(struct http_server *server, struct epoll_event *events, int n)
+{
+    int accept = 0;
+
+    for(int i = 0; i < n; i++) {
+        void *ptr = events[i].data.ptr;
+        int readable = events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR);
+        int writable = events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR);
+
+        if(ptr == &server->fd) {
+            // Accepting now could hand a request slot to a new connection before its old events are handled
+            accept = 1;
+        } else if(ptr == &server->epoll_fd) {
+            // The channel wake fd, drained by websocket_channel_dispatch
+        } else if((ptr >= (void *)server->request) && (ptr < (void *)(server->request + HTTP_SERVER_MAX_CONNECTIONS))) {
+            struct http_request *request = ptr;
+            int j = request - server->request;
+
+            if(request->fd >= 0) {
+                http_handle_request(server, request, readable && (server->request_events[j] & EPOLLIN), writable && (server->request_events[j] & EPOLLOUT));
+            }
+        } else if(http_async_owns(ptr)) {
+            http_async_handle_events(ptr, readable, writable);
+#if HTTP_SERVER_PROXY
+        } else if(http_proxy_owns(ptr)) {
+            http_proxy_handle_events(ptr, readable, writable);
+#endif
+        } else {
+            struct websocket_connection *conn = ptr;
+            websocket_handle_events(conn, readable, writable && (conn->poll_events & EPOLLOUT));
+        }
+    }
+
+    if(accept) {
+        http_accept_new_connection(server);
+    }
+}
+#endif
+
 static int http_server_main_loop(struct http_server *server)
 {
+    uint32_t now = websocket_timer_clock();
+    websocket_keepalive_run(now);
+    websocket_handle_dirty(server);
+    http_async_expire(http_clock());
+    http_async_dispatch(server);
+#if HTTP_SERVER_PROXY
+    http_proxy_expire(http_clock());
+    http_proxy_dispatch(server);
+#endif
+
+#if HTTP_SERVER_EPOLL
+    int num_open = http_poll_update_requests(server);
+    http_async_poll_update(server);
+#if HTTP_SERVER_PROXY
+    http_proxy_poll_update(server);
+#endif
+#else
     fd_set set_read, set_write;
     int maxfd;
 
     int num_open = http_create_select_sets(server, &set_read, &set_write, &maxfd);
+    http_async_create_select_sets(&set_read, &set_write, &maxfd);
+#if HTTP_SERVER_PROXY
+    http_proxy_create_select_sets(&set_read, &set_write, &maxfd);
+#endif
+#endif
+
+    struct timeval t;
+    struct timeval *timeout = 0;
+    int http_timeout = 0;
 
-    int n;
     if(num_open != 0) {
-        struct timeval t;
         t.tv_sec = HTTP_SERVER_TIMEOUT_SECS;
         t.tv_usec = HTTP_SERVER_TIMEOUT_USECS;
+        timeout = &t;
+        http_timeout = 1;
+    }
 
-        n = select(maxfd+1, &set_read, &set_write, 0, &t);
-    } else {
-        n = select(maxfd+1, &set_read, &set_write, 0, 0);
+    // Wake up in time for the next keepalive timer, or client request timeout
+    int next = websocket_timer_next(now);
+    int next_async = http_async_timer_next(http_clock());
+    if((next_async >= 0) && ((next < 0) || (next_async < next))) {
+        next = next_async;
+    }
+#if HTTP_SERVER_PROXY
+    int next_proxy = http_proxy_timer_next(http_clock());
+    if((next_proxy >= 0) && ((next < 0) || (next_proxy < next))) {
+        next = next_proxy;
     }
+#endif
+    if((next >= 0) && (!timeout || (next < t.tv_sec) || ((next == t.tv_sec) && (t.tv_usec > 0)))) {
+        t.tv_sec = next;
+        t.tv_usec = 0;
+        timeout = &t;
+        http_timeout = 0;
+    }
+
+    // Connection attempts are started and given up on by the millisecond
+    int next_ms = http_async_connect_next(http_clock_ms());
+#if HTTP_SERVER_PROXY
+    int next_proxy_ms = http_proxy_connect_next(http_clock_ms());
+    if((next_proxy_ms >= 0) && ((next_ms < 0) || (next_proxy_ms < next_ms))) {
+        next_ms = next_proxy_ms;
+    }
+#endif
+    if((next_ms >= 0) && (!timeout || (next_ms < t.tv_sec * 1000 + t.tv_usec / 1000))) {
+        t.tv_sec = next_ms / 1000;
+        t.tv_usec = (next_ms % 1000) * 1000;
+        timeout = &t;
+        http_timeout = 0;
+    }
+
+#if HTTP_SERVER_EPOLL
+    struct epoll_event events[HTTP_SERVER_EPOLL_EVENTS];
+    int n = epoll_wait(server->epoll_fd, events, HTTP_SERVER_EPOLL_EVENTS, timeout ? (t.tv_sec * 1000 + t.tv_usec / 1000) : -1);
+#else
+    int n = select(maxfd+1, &set_read, &set_write, 0, timeout);
+#endif
 
     // select seems to return -1 on timeout on esp8266 RTOS SDK
     // and does not set errno...
@@ -318,46 +640,47 @@ static int http_server_main_loop(struct http_server *server)
 #endif
 
     if(n <= 0) {
-        for(int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++) {
-            if(server->request[i].fd >= 0) {
-                INFO("Socket %d timed out. Closing.", server->request[i].fd);
-                http_close(&server->request[i]);
+        // Waking up for a keepalive timer does not mean the requests timed out
+        if(http_timeout) {
+            for(int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++) {
+                // Requests waiting for client requests time out with them instead
+                if((server->request[i].fd >= 0) && !(server->request[i].flags & HTTP_FLAG_WAIT)) {
+                    INFO("Socket %d timed out. Closing.", server->request[i].fd);
+                    http_close(&server->request[i]);
+                }
             }
         }
     } else {
+#if HTTP_SERVER_EPOLL
+        websocket_channel_dispatch(server);
+        websocket_worker_dispatch(server);
+        http_handle_poll_events(server, events, n);
+#else
         if(FD_ISSET(server->fd, &set_read)) {
             http_accept_new_connection(server);
         }
 
-        for(int i = 0; i < WEBSOCKET_SERVER_MAX_CONNECTIONS; i++) {
-            if(server->websocket_connection[i].fd >= 0) {
-                if(FD_ISSET(server->websocket_connection[i].fd, &set_read)) {
-                    websocket_handle_connection(&server->websocket_connection[i]);
-                }
+        websocket_channel_dispatch(server);
+        websocket_worker_dispatch(server);
+
+        for(struct websocket_connection *conn = server->websocket_connections; conn; conn = conn->next) {
+            if(conn->fd >= 0) {
+                websocket_handle_events(conn, FD_ISSET(conn->fd, &set_read), FD_ISSET(conn->fd, &set_write));
             }
         }
 
         for(int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++) {
             struct http_request *request = &server->request[i];
             if(request->fd >= 0) {
-                if(FD_ISSET(request->fd, &set_read)) {
-                    http_handle_request_read(&server->request[i], server);
-                } else if(FD_ISSET(server->request[i].fd, &set_write)) {
-                    http_server_call_handler(&server->request[i]);
-                }
-                if(http_is_error(request)) {
-                    free(request->line);
-                    request->line = 0;
-                    request->line_length = 0;
-
-                    if(request->error > 0) {
-                        http_write_error_response(request);
-                    }
-
-                    http_close(request);
-                }
+                http_handle_request(server, request, FD_ISSET(request->fd, &set_read), FD_ISSET(request->fd, &set_write));
             }
         }
+
+        http_async_handle_select(&set_read, &set_write);
+#if HTTP_SERVER_PROXY
+        http_proxy_handle_select(&set_read, &set_write);
+#endif
+#endif
     }
 
     return 0;
@@ -365,37 +688,78 @@ static int http_server_main_loop(struct http_server *server)
 
 int websocket_init(struct http_server *server, struct http_request *request)
 {
-    struct websocket_connection *connection = 0;
-    for(int i = 0; i < WEBSOCKET_SERVER_MAX_CONNECTIONS; i++) {
-        if(server->websocket_connection[i].fd == -1) {
-            connection = &server->websocket_connection[i];
-            break;
-        }
-    }
-    if(connection) {
-        for(struct websocket_url_handler *handler = &websocket_url_tab[0]; handler->url != NULL; handler++) {
-            if(http_server_match_url(handler->url, request->path)) {
-                LOG("WS: %s matches", handler->url);
-                if(handler->cb_open(connection, request)) {
-                    websocket_send_response(request);
-                    connection->fd = request->fd;
-                    connection->handler = handler;
-                    connection->state = WEBSOCKET_STATE_OPCODE;
-                    return request->fd;
-                } else {
-                    break;
-                }
-            }
-        }
-        request->state = HTTP_STATE_ERROR;
-        request->error = HTTP_STATUS_NOT_FOUND;
-        return -1;
-    } else {
+    if(server->websocket_count >= WEBSOCKET_SERVER_MAX_CONNECTIONS) {
         request->state = HTTP_STATE_ERROR;
         request->error = HTTP_STATUS_SERVICE_UNAVAILABLE;
         LOG("WS: no room for new connection %d", request->fd);
         return -1;
     }
+
+    for(struct websocket_url_handler *handler = &websocket_url_tab[0]; handler->url != NULL; handler++) {
+        if(http_server_match_url(handler->url, request->path)) {
+            LOG("WS: %s matches", handler->url);
+
+            struct websocket_connection *connection = malloc(sizeof(*connection));
+            if(!connection) {
+                request->state = HTTP_STATE_ERROR;
+                request->error = HTTP_STATUS_SERVICE_UNAVAILABLE;
+                return -1;
+            }
+
+            connection->fd = -1;
+            connection->handler = handler;
+            websocket_queue_init(connection);
+
+            if(!handler->cb_open(connection, request)) {
+                free(connection);
+                break;
+            }
+
+            const char *extensions = NULL;
+#if WEBSOCKET_DEFLATE
+            struct websocket_deflate params;
+            char response[WEBSOCKET_EXTENSIONS_LEN];
+
+            if(websocket_deflate_negotiate(request->websocket_extensions, &params, response, sizeof(response)) == 0) {
+                connection->deflate = malloc(sizeof(params));
+                if(connection->deflate) {
+                    memcpy(connection->deflate, &params, sizeof(params));
+                    extensions = response;
+                }
+            }
+#endif
+            websocket_send_response(request, extensions);
+            connection->fd = request->fd;
+            connection->state = WEBSOCKET_STATE_OPCODE;
+            connection->buf_index = 0;
+            connection->buf_length = 0;
+
+            connection->next = server->websocket_connections;
+            if(connection->next) {
+                connection->next->pprev = &connection->next;
+            }
+            connection->pprev = &server->websocket_connections;
+            server->websocket_connections = connection;
+            server->websocket_count++;
+
+#if HTTP_SERVER_EPOLL
+            // The socket is already registered for the request it came in on
+            int i = request - server->request;
+            http_poll_set(server, EPOLL_CTL_MOD, connection->fd, EPOLLIN, connection);
+            connection->poll_events = EPOLLIN;
+            server->request_poll_fd[i] = -1;
+#endif
+
+            websocket_set_nodelay(connection);
+            websocket_set_nonblock(connection);
+            websocket_keepalive_start(connection);
+            return request->fd;
+        }
+    }
+
+    request->state = HTTP_STATE_ERROR;
+    request->error = HTTP_STATUS_NOT_FOUND;
+    return -1;
 }
 
 
@@ -414,9 +778,29 @@ static int http_server_start(struct http_server *server, int port)
         server->request[i].state = HTTP_STATE_IDLE;
     }
 
-    for(int i = 0; i < WEBSOCKET_SERVER_MAX_CONNECTIONS; i++) {
-        server->websocket_connection[i].fd = -1;
+    server->websocket_connections = NULL;
+    server->websocket_count = 0;
+
+    websocket_channel_init();
+
+#if HTTP_SERVER_EPOLL
+    if(http_poll_init(server) < 0) {
+        close(listen_fd);
+        return -1;
+    }
+
+    for(int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++) {
+        server->request_poll_fd[i] = -1;
+        server->request_events[i] = 0;
+    }
+
+    http_poll_set(server, EPOLL_CTL_ADD, listen_fd, EPOLLIN, &server->fd);
+    server->listen_events = EPOLLIN;
+
+    if(websocket_channel_wake_fd() >= 0) {
+        http_poll_set(server, EPOLL_CTL_ADD, websocket_channel_wake_fd(), EPOLLIN, &server->epoll_fd);
     }
+#endif
 
     return 0;
 }
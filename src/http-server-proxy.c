@@ -0,0 +1,1014 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "http-sm/http.h"
+#include "http-private.h"
+#include "log.h"
+
+#if HTTP_SERVER_PROXY
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#if HTTP_SERVER_EPOLL
+#include <sys/epoll.h>
+#endif
+
+// Bytes moved through the pipe at a time, what a pipe holds by default
+#define HTTP_PROXY_PIPE_LEN 65536
+
+enum http_proxy_stage {
+    HTTP_PROXY_FREE,
+    // Waiting for the lookup of the upstream server on the helper thread
+    HTTP_PROXY_RESOLVE,
+    HTTP_PROXY_CONNECT,
+    HTTP_PROXY_WRITE_HEAD,
+    HTTP_PROXY_WRITE_BODY,
+    HTTP_PROXY_READ_HEAD,
+    // The response head has been sent to the client, so errors can only close the connection
+    HTTP_PROXY_READ_BODY,
+    // Finished, waiting for the server loop to release the slot
+    HTTP_PROXY_DONE,
+};
+
+static struct http_proxy http_proxy_slots[HTTP_SERVER_PROXY_MAX];
+
+static int http_proxy_again(void)
+{
+    return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+}
+
+static void http_proxy_close_fd(struct http_proxy *p)
+{
+    http_connector_close(&p->connector);
+
+    if(p->upstream.fd >= 0) {
+        close(p->upstream.fd);
+        p->upstream.fd = -1;
+    }
+    p->poll_fd = -1;
+}
+
+// Wait for the upstream socket, 1 to read and 2 to write. While connecting, 2 waits for the attempts.
+static void http_proxy_wait(struct http_proxy *p, int events)
+{
+    p->wait = events;
+    p->deadline = http_clock() + HTTP_SERVER_PROXY_TIMEOUT_SECS;
+}
+
+// Let the handler run again once nothing else keeps its request waiting
+static void http_proxy_wake(struct http_proxy *p)
+{
+    p->wait = 0;
+
+    if(p->owner && !http_async_pending(p->owner) && !http_proxy_pending(p->owner)) {
+        p->owner->flags &= ~HTTP_FLAG_WAIT;
+    }
+}
+
+// Look the upstream server up and move the connection attempts on. Returns 1 once connected, 0 while
+// waiting and -1 when none of the addresses could be connected to.
+static int http_proxy_connecting(struct http_proxy *p)
+{
+    struct http_connector *c = &p->connector;
+    int fd;
+
+    if(p->stage == HTTP_PROXY_RESOLVE) {
+        struct http_address addrs[HTTP_DNS_MAX_ADDRESSES];
+
+        int count = http_resolve_nowait(p->upstream.host, p->upstream.port, addrs, HTTP_DNS_MAX_ADDRESSES, http_clock());
+        if(count == 0) {
+            return 0;
+        }
+
+        http_connector_init(c, addrs, count);
+        p->stage = HTTP_PROXY_CONNECT;
+    }
+
+    int ret = http_connector_poll(c, &fd);
+
+    if(ret < 0) {
+        LOG("Could not connect to %s:%d", p->upstream.host, p->upstream.port);
+    } else if(ret > 0) {
+        if(c->index > 0) {
+            http_resolve_prefer(p->upstream.host, p->upstream.port, &c->addrs[c->index]);
+        }
+
+#if HTTP_SERVER_EPOLL
+        // The attempt is in the loop's epoll set already
+        if(c->polled & (1 << c->index)) {
+            p->poll_fd = fd;
+            p->poll_events = EPOLLOUT;
+        }
+#endif
+        p->upstream.fd = fd;
+        p->stage = HTTP_PROXY_WRITE_HEAD;
+    }
+
+    return ret;
+}
+
+// Start connecting to the upstream server. Returns -1 if it failed already.
+static int http_proxy_connect(struct http_proxy *p)
+{
+    http_connector_init(&p->connector, NULL, 0);
+    p->stage = HTTP_PROXY_RESOLVE;
+
+    int ret = http_proxy_connecting(p);
+    if(ret == 0) {
+        http_proxy_wait(p, 2);
+    }
+
+    return (ret < 0) ? -1 : 0;
+}
+
+// Start over on a new connection, after a pooled one turned out to be closed
+static int http_proxy_retry(struct http_proxy *p)
+{
+    char *host = p->upstream.host;
+    uint16_t port = p->upstream.port;
+
+    LOG("Request to %s:%d on a pooled connection failed", host, port);
+
+    http_proxy_close_fd(p);
+    free(p->upstream.recv_buf);
+    http_free(&p->upstream);
+    memset(&p->upstream, 0, sizeof(p->upstream));
+    http_request_init(&p->upstream);
+
+    p->upstream.host = host;
+    p->upstream.port = port;
+    p->upstream.fd = -1;
+    p->pooled = 0;
+    p->out_index = 0;
+
+    return http_proxy_connect(p);
+}
+
+static const char *http_proxy_method(int method)
+{
+    switch(method) {
+    case HTTP_METHOD_GET:
+        return "GET";
+    case HTTP_METHOD_POST:
+        return "POST";
+    case HTTP_METHOD_DELETE:
+        return "DELETE";
+    default:
+        return NULL;
+    }
+}
+
+// Headers that describe the connection to the client rather than the request (RFC 7230 6.1), and the
+// ones http_proxy_format writes itself
+static const char *http_proxy_hop_headers[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate", "Proxy-Authorization",
+    "TE", "Trailer", "Transfer-Encoding", "Upgrade", "Host", "Content-Length", NULL
+};
+
+// Whether the comma separated list has the name in it
+static int http_proxy_list_has(const char *list, const char *name, int len)
+{
+    while(*list) {
+        list += strspn(list, ", \t");
+
+        int n = strcspn(list, ", \t\r");
+        if((n == len) && (strncasecmp(list, name, len) == 0)) {
+            return 1;
+        }
+
+        list += n;
+        if(*list == '\r') {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// Whether a request header stays with the connection to the client. Besides the hop-by-hop headers, these
+// are the ones a Connection header names.
+static int http_proxy_hop_header(const char *headers, const char *name, int len)
+{
+    for(int i = 0; http_proxy_hop_headers[i]; i++) {
+        if((strlen(http_proxy_hop_headers[i]) == len) && (strncasecmp(http_proxy_hop_headers[i], name, len) == 0)) {
+            return 1;
+        }
+    }
+
+    for(const char *line = headers; line && *line; line = strchr(line, '\n') + 1) {
+        if(strncasecmp(line, "Connection:", 11) == 0) {
+            if(http_proxy_list_has(line + 11, name, len)) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Write the request head for the upstream server, with the request headers of the client less the
+// hop-by-hop ones
+static int http_proxy_format(struct http_proxy *p, struct http_request *request)
+{
+    const struct http_proxy_target *target = p->target;
+    const char *method = http_proxy_method(request->method);
+    const char *path = request->path ? request->path : "/";
+    const char *query = request->query;
+
+    if(!method) {
+        return -1;
+    }
+
+    if(target->strip && (strncmp(path, target->strip, strlen(target->strip)) == 0)) {
+        path += strlen(target->strip);
+    }
+
+    // The query is split in place once its arguments are read, so only a whole one is passed on
+    if(request->query_list) {
+        query = NULL;
+    }
+
+    int size = strlen(path) + (query ? strlen(query) : 0) + strlen(target->host) + request->headers_length + 128;
+
+    p->out = malloc(size);
+    if(!p->out) {
+        return -1;
+    }
+
+    int n = snprintf(p->out, size, "%s %s%s%s%s HTTP/1.1\r\n", method, (*path == '/') ? "" : "/", path,
+                     query ? "?" : "", query ? query : "");
+
+    if(target->port == 80) {
+        n += snprintf(p->out + n, size - n, "Host: %s\r\n", target->host);
+    } else {
+        n += snprintf(p->out + n, size - n, "Host: %s:%d\r\n", target->host, target->port);
+    }
+
+    if(p->body_left > 0) {
+        n += snprintf(p->out + n, size - n, "Content-Length: %d\r\n", p->body_left);
+    }
+
+    for(const char *line = request->headers; line && *line; ) {
+        const char *end = strchr(line, '\n') + 1;
+        int len = strcspn(line, ":");
+
+        if(!http_proxy_hop_header(request->headers, line, len)) {
+            memcpy(p->out + n, line, end - line);
+            n += end - line;
+        }
+
+        line = end;
+    }
+
+    n += snprintf(p->out + n, size - n, "Connection: keep-alive\r\n\r\n");
+
+    p->out_length = n;
+    p->out_index = 0;
+
+    return 0;
+}
+
+static void http_proxy_release(struct http_proxy *p, struct http_server *server)
+{
+    int fd = p->upstream.fd;
+
+    http_connector_close(&p->connector);
+
+    if(fd >= 0) {
+#if HTTP_SERVER_EPOLL
+        // A pooled connection stays open, so it has to leave the loop's epoll set by hand
+        if(server && (p->poll_fd == fd)) {
+            http_poll_set(server, EPOLL_CTL_DEL, fd, 0, NULL);
+        }
+#endif
+        if((p->stage == HTTP_PROXY_DONE) && p->reusable && !p->pipe_bytes) {
+            http_set_nonblock(fd, 0);
+            if(http_client_pool_put(p->upstream.host, p->upstream.port, fd) == 0) {
+                p->upstream.fd = -1;
+            }
+        }
+        http_proxy_close_fd(p);
+    }
+
+    // A pipe with bytes left in it would pass them on to the next request
+    if(p->has_pipe && p->pipe_bytes) {
+        close(p->pipe[0]);
+        close(p->pipe[1]);
+        p->has_pipe = 0;
+    }
+
+    free(p->out);
+    free(p->upstream.recv_buf);
+    http_free(&p->upstream);
+
+    int pipe_fds[2] = { p->pipe[0], p->pipe[1] };
+    uint8_t has_pipe = p->has_pipe;
+
+    memset(p, 0, sizeof(*p));
+    p->upstream.fd = -1;
+    p->poll_fd = -1;
+    p->pipe[0] = pipe_fds[0];
+    p->pipe[1] = pipe_fds[1];
+    p->has_pipe = has_pipe;
+    p->stage = HTTP_PROXY_FREE;
+}
+
+static void http_proxy_error_response(struct http_request *request, int status)
+{
+    const char *message = http_status_string(status);
+
+    http_begin_response(request, status, "text/plain");
+    http_set_content_length(request, strlen(message));
+    http_end_header(request);
+    http_write_string(request, message);
+    http_end_body(request);
+}
+
+// End the request after an error. Until the response head has been sent the client gets status,
+// after that, or with status 0, the connection is closed.
+static enum http_cgi_state http_proxy_fail(struct http_proxy *p, int status)
+{
+    struct http_request *request = p->owner;
+    int head_sent = (p->stage == HTTP_PROXY_READ_BODY);
+
+    p->stage = HTTP_PROXY_DONE;
+    p->reusable = 0;
+    request->cgi_data = NULL;
+
+    if(head_sent || !status) {
+        request->state = HTTP_STATE_ERROR;
+        request->error = 0;
+        return HTTP_CGI_MORE;
+    }
+
+    http_proxy_error_response(request, status);
+    return HTTP_CGI_DONE;
+}
+
+// The steps below return 1 to go on with the next one, 0 to wait, -1 on errors and -2 if the client is gone.
+// They wait for the upstream socket if they set p->wait, and for the client otherwise.
+
+static int http_proxy_connected(struct http_proxy *p)
+{
+    int ret = http_proxy_connecting(p);
+
+    if(ret == 0) {
+        http_proxy_wait(p, 2);
+    }
+
+    return ret;
+}
+
+static int http_proxy_write_head(struct http_proxy *p)
+{
+    int n = send(p->upstream.fd, p->out + p->out_index, p->out_length - p->out_index, MSG_NOSIGNAL);
+
+    if(n < 0) {
+        if(http_proxy_again()) {
+            http_proxy_wait(p, 2);
+            return 0;
+        } else if(p->pooled) {
+            // Nothing of the body has been read yet, so the request can go out again as it is
+            return (http_proxy_retry(p) < 0) ? -1 : 0;
+        }
+        LOG("Writing to %s:%d failed: %s", p->upstream.host, p->upstream.port, strerror(errno));
+        return -1;
+    }
+
+    p->out_index += n;
+
+    if(p->out_index == p->out_length) {
+        p->stage = p->body_left ? HTTP_PROXY_WRITE_BODY : HTTP_PROXY_READ_HEAD;
+    }
+
+    return 1;
+}
+
+// Pass on one pipe of the request body, as much of it as the client has sent
+static int http_proxy_write_body(struct http_proxy *p)
+{
+    struct http_request *request = p->owner;
+
+    if(!p->pipe_bytes && p->body_left) {
+        int avail = 0;
+
+        if((ioctl(request->fd, FIONREAD, &avail) < 0) || (avail <= 0)) {
+            char c;
+            int n = recv(request->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+            if((n < 0) && http_proxy_again()) {
+                return 0;
+            } else if(n <= 0) {
+                LOG("Client closed before sending the body");
+                return -2;
+            }
+            avail = n;
+        }
+
+        // The client socket blocks, so it is only asked for what it already has
+        int len = (avail < p->body_left) ? avail : p->body_left;
+        if(len > HTTP_PROXY_PIPE_LEN) {
+            len = HTTP_PROXY_PIPE_LEN;
+        }
+
+        int n = splice(request->fd, NULL, p->pipe[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n <= 0) {
+            if((n < 0) && http_proxy_again()) {
+                return 0;
+            }
+            LOG("Reading the request body failed");
+            return -2;
+        }
+
+        p->pipe_bytes += n;
+        p->body_left -= n;
+        request->read_content_length -= n;
+    }
+
+    if(p->pipe_bytes) {
+        int n = splice(p->pipe[0], NULL, p->upstream.fd, NULL, p->pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if(n < 0) {
+            if(http_proxy_again()) {
+                http_proxy_wait(p, 2);
+                return 0;
+            }
+            LOG("Writing to %s:%d failed: %s", p->upstream.host, p->upstream.port, strerror(errno));
+            return -1;
+        }
+
+        p->pipe_bytes -= n;
+        if(p->pipe_bytes) {
+            return 1;
+        }
+    }
+
+    if(!p->body_left) {
+        // The handler is called for a writable client from now on
+        request->state = HTTP_STATE_SERVER_WRITE_BEGIN;
+        p->stage = HTTP_PROXY_READ_HEAD;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Send the client the response head, and the part of the body that was read with it
+static int http_proxy_begin_response(struct http_proxy *p)
+{
+    struct http_request *request = p->owner;
+    struct http_request *upstream = &p->upstream;
+    struct http_recv_buffer *b = upstream->recv_buf;
+    char head[HTTP_CLIENT_HEAD_LEN + 64];
+
+    int status = upstream->status;
+    int chunked = 0;
+
+    p->reusable = !(upstream->flags & HTTP_FLAG_CONNECTION_CLOSE);
+
+    if((status < 200) || (status == HTTP_STATUS_NO_CONTENT) || (status == HTTP_STATUS_NOT_MODIFIED)) {
+        p->response_left = 0;
+    } else if(upstream->flags & HTTP_FLAG_READ_CHUNKED) {
+        chunked = 1;
+        http_chunk_init(&p->chunk);
+    } else {
+        p->response_left = upstream->read_content_length;
+        if(p->response_left < 0) {
+            p->reusable = 0;
+        }
+    }
+
+    // The client can tell where a response with a length or chunks ends, so it may send its next request
+    p->keep_alive = !(request->flags & HTTP_FLAG_CONNECTION_CLOSE) && (chunked || (p->response_left >= 0));
+
+    int n = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nConnection: %s\r\n", status, http_status_string(status),
+                     p->keep_alive ? "keep-alive" : "close");
+
+    for(int i = 0; i < b->header_count; i++) {
+        const struct http_header *h = &b->headers[i];
+
+        // These describe the upstream connection, not the one to the client
+        if((strcasecmp(h->name, "Connection") == 0) || (strcasecmp(h->name, "Keep-Alive") == 0)) {
+            continue;
+        }
+
+        n += snprintf(head + n, sizeof(head) - n, "%s: %s\r\n", h->name, h->value);
+        if(n >= (int)sizeof(head)) {
+            LOG("Response head from %s:%d is too long", upstream->host, upstream->port);
+            return -1;
+        }
+    }
+
+    n += snprintf(head + n, sizeof(head) - n, "\r\n");
+    if(n >= (int)sizeof(head)) {
+        return -1;
+    }
+
+    char *data = b->data + b->index;
+    int left = b->length - b->index;
+    int len;
+
+    if(chunked) {
+        len = http_chunk_skip(&p->chunk, data, left);
+        if(len < 0) {
+            LOG("Bad chunk in response from %s:%d", upstream->host, upstream->port);
+            return -1;
+        }
+    } else if(p->response_left >= 0) {
+        len = (left < p->response_left) ? left : p->response_left;
+        p->response_left -= len;
+    } else {
+        len = left;
+    }
+
+    // Anything after the response would be taken for the start of the next one
+    if(len < left) {
+        p->reusable = 0;
+    }
+    b->index += len;
+
+    struct iovec iov[2] = {
+        { .iov_base = head, .iov_len = n },
+        { .iov_base = data, .iov_len = len },
+    };
+
+    p->stage = HTTP_PROXY_READ_BODY;
+    request->state = HTTP_STATE_SERVER_WRITE_BODY;
+
+    if(http_writev_all(request->fd, iov, len ? 2 : 1) < 0) {
+        ERROR("Writing response head failed");
+        return -1;
+    }
+
+    return 1;
+}
+
+static int http_proxy_read_head(struct http_proxy *p)
+{
+    int ret = http_recv_response_header(&p->upstream);
+
+    if(ret == 0) {
+        http_proxy_wait(p, 1);
+        return 0;
+    } else if(ret < 0) {
+        struct http_recv_buffer *b = p->upstream.recv_buf;
+
+        // Nothing came back, so the server may have closed the pooled connection before it saw the request
+        if(p->pooled && !p->has_body && b && !b->length) {
+            return (http_proxy_retry(p) < 0) ? -1 : 0;
+        }
+
+        LOG("Reading response from %s:%d failed", p->upstream.host, p->upstream.port);
+        return -1;
+    }
+
+    return http_proxy_begin_response(p);
+}
+
+static int http_proxy_body_done(struct http_proxy *p)
+{
+    if(p->upstream.flags & HTTP_FLAG_READ_CHUNKED) {
+        return http_chunk_done(&p->chunk);
+    }
+
+    return p->response_left == 0;
+}
+
+// Pass on what the pipe holds to the client, as much as its socket takes. Returns 1 once the pipe is empty,
+// 0 if the client has to take some of it first and -2 if writing failed.
+static int http_proxy_flush_pipe(struct http_proxy *p)
+{
+    struct http_request *request = p->owner;
+    int ret = 1;
+
+    // The rest of the server writes to the client socket blocking, so it only stops blocking for the splice
+    http_set_nonblock(request->fd, 1);
+
+    while(p->pipe_bytes) {
+        int n = splice(p->pipe[0], NULL, request->fd, NULL, p->pipe_bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if((n < 0) && (errno == EINTR)) {
+            continue;
+        } else if((n < 0) && http_proxy_again()) {
+            ret = 0;
+            break;
+        } else if(n <= 0) {
+            LOG("Writing response to client failed");
+            ret = -2;
+            break;
+        }
+
+        p->pipe_bytes -= n;
+    }
+
+    http_set_nonblock(request->fd, 0);
+
+    return ret;
+}
+
+// Pass on one pipe of the response body, or the framing of the next chunk
+static int http_proxy_read_body(struct http_proxy *p)
+{
+    int fd = p->upstream.fd;
+    int chunked = p->upstream.flags & HTTP_FLAG_READ_CHUNKED;
+
+    if(p->pipe_bytes) {
+        // The handler is called again once the client socket has room for the rest
+        int ret = http_proxy_flush_pipe(p);
+        if(ret <= 0) {
+            return ret;
+        }
+
+        if(!http_proxy_body_done(p)) {
+            return 0;
+        }
+    }
+
+    if(http_proxy_body_done(p)) {
+        p->stage = HTTP_PROXY_DONE;
+        return 1;
+    }
+
+    if(chunked && (p->chunk.state != HTTP_CHUNK_DATA)) {
+        char buf[32];
+        int n = recv(fd, buf, sizeof(buf), MSG_PEEK);
+
+        if(n < 0) {
+            if(http_proxy_again()) {
+                http_proxy_wait(p, 1);
+                return 0;
+            }
+            return -1;
+        } else if(n == 0) {
+            LOG("Connection to %s:%d closed in a chunked body", p->upstream.host, p->upstream.port);
+            return -1;
+        }
+
+        int len = http_chunk_frame(&p->chunk, buf, n);
+        if((len < 0) || (recv(fd, buf, len, 0) != len)) {
+            LOG("Bad chunk in response from %s:%d", p->upstream.host, p->upstream.port);
+            return -1;
+        }
+
+        // The framing goes through the empty pipe like the data, so writing it does not block either
+        if(write(p->pipe[1], buf, len) != len) {
+            ERROR("Writing to the pipe failed");
+            return -1;
+        }
+        p->pipe_bytes += len;
+
+        return 1;
+    }
+
+    int want = chunked ? p->chunk.length : p->response_left;
+    if((want < 0) || (want > HTTP_PROXY_PIPE_LEN)) {
+        want = HTTP_PROXY_PIPE_LEN;
+    }
+
+    int n = splice(fd, NULL, p->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if(n < 0) {
+        if(http_proxy_again()) {
+            http_proxy_wait(p, 1);
+            return 0;
+        }
+        LOG("Reading from %s:%d failed: %s", p->upstream.host, p->upstream.port, strerror(errno));
+        return -1;
+    } else if(n == 0) {
+        // Without a length or chunks, the body is whatever comes before the server closes the connection
+        if(!chunked && (p->response_left < 0)) {
+            p->stage = HTTP_PROXY_DONE;
+            return 1;
+        }
+        LOG("Connection to %s:%d closed before the response was complete", p->upstream.host, p->upstream.port);
+        return -1;
+    }
+
+    p->pipe_bytes += n;
+
+    if(chunked) {
+        http_chunk_data(&p->chunk, n);
+    } else if(p->response_left > 0) {
+        p->response_left -= n;
+    }
+
+    return 1;
+}
+
+static struct http_proxy *http_proxy_start(struct http_request *request)
+{
+    const struct http_proxy_target *target = request->cgi_arg;
+    struct http_proxy *p = NULL;
+
+    if(!target || !target->host) {
+        LOG("No upstream server for %s", request->path);
+        http_proxy_error_response(request, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        return NULL;
+    }
+
+    // A chunked body would have to be passed on chunk by chunk
+    if(request->flags & HTTP_FLAG_READ_CHUNKED) {
+        LOG("Chunked request bodies are not passed on");
+        http_proxy_error_response(request, HTTP_STATUS_BAD_REQUEST);
+        return NULL;
+    }
+
+    for(int i = 0; i < HTTP_SERVER_PROXY_MAX; i++) {
+        if(http_proxy_slots[i].stage == HTTP_PROXY_FREE) {
+            p = &http_proxy_slots[i];
+            break;
+        }
+    }
+
+    if(!p) {
+        LOG("No room for a request to %s:%d", target->host, target->port);
+        http_proxy_error_response(request, HTTP_STATUS_SERVICE_UNAVAILABLE);
+        return NULL;
+    }
+
+    if(!p->has_pipe) {
+        if(pipe2(p->pipe, O_CLOEXEC) < 0) {
+            ERROR("pipe failed");
+            http_proxy_error_response(request, HTTP_STATUS_SERVICE_UNAVAILABLE);
+            return NULL;
+        }
+        p->has_pipe = 1;
+    }
+
+    http_request_init(&p->upstream);
+    p->upstream.fd = -1;
+    p->upstream.host = (char *)target->host;
+    p->upstream.port = (target->port > 0) ? target->port : 80;
+    p->target = target;
+    p->owner = request;
+    p->poll_fd = -1;
+    p->body_left = (request->read_content_length > 0) ? request->read_content_length : 0;
+    p->has_body = (p->body_left > 0);
+    p->stage = HTTP_PROXY_CONNECT;
+
+    if(http_proxy_format(p, request) < 0) {
+        LOG("Could not pass on %s", request->path);
+        http_proxy_release(p, NULL);
+        http_proxy_error_response(request, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        return NULL;
+    }
+
+    int fd = http_client_pool_take(p->upstream.host, p->upstream.port);
+    if(fd >= 0) {
+        http_set_nonblock(fd, 1);
+        p->upstream.fd = fd;
+        p->pooled = 1;
+        p->stage = HTTP_PROXY_WRITE_HEAD;
+    } else if(http_proxy_connect(p) < 0) {
+        p->stage = HTTP_PROXY_DONE;
+        http_proxy_error_response(request, HTTP_STATUS_BAD_GATEWAY);
+        return NULL;
+    }
+
+    request->cgi_data = p;
+
+    return p;
+}
+
+// Pass the request on to the server in the http_proxy_target given as cgi_arg, and its response back.
+// Bodies move between the sockets through a pipe with splice, without being copied to the process, and
+// the connections to the upstream server are kept in the client pool for the next request. The connection
+// to the client is kept as well unless it asked to close it or the response ends when upstream closes.
+enum http_cgi_state cgi_proxy(struct http_request* request)
+{
+    struct http_proxy *p = request->cgi_data;
+
+    if(!p) {
+        p = http_proxy_start(request);
+        if(!p) {
+            return HTTP_CGI_DONE;
+        }
+    } else if(p->timed_out) {
+        LOG("Request to %s:%d timed out", p->upstream.host, p->upstream.port);
+        return http_proxy_fail(p, HTTP_STATUS_GATEWAY_TIMEOUT);
+    }
+
+    for(;;) {
+        int ret = -1;
+
+        // Called before the upstream socket is ready
+        if(p->wait) {
+            return HTTP_CGI_WAIT;
+        }
+
+        switch(p->stage) {
+        case HTTP_PROXY_RESOLVE:
+        case HTTP_PROXY_CONNECT:
+            ret = http_proxy_connected(p);
+            break;
+        case HTTP_PROXY_WRITE_HEAD:
+            ret = http_proxy_write_head(p);
+            break;
+        case HTTP_PROXY_WRITE_BODY:
+            ret = http_proxy_write_body(p);
+            break;
+        case HTTP_PROXY_READ_HEAD:
+            ret = http_proxy_read_head(p);
+            break;
+        case HTTP_PROXY_READ_BODY:
+            ret = http_proxy_read_body(p);
+            break;
+        }
+
+        if(ret < 0) {
+            return http_proxy_fail(p, (ret == -1) ? HTTP_STATUS_BAD_GATEWAY : 0);
+        } else if(p->stage == HTTP_PROXY_DONE) {
+            request->cgi_data = NULL;
+            return p->keep_alive ? HTTP_CGI_KEEP_ALIVE : HTTP_CGI_DONE;
+        } else if(ret == 0) {
+            return p->wait ? HTTP_CGI_WAIT : HTTP_CGI_MORE;
+        }
+    }
+}
+
+int http_proxy_pending(struct http_request *owner)
+{
+    int count = 0;
+
+    for(int i = 0; i < HTTP_SERVER_PROXY_MAX; i++) {
+        if((http_proxy_slots[i].owner == owner) && http_proxy_slots[i].wait) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// Wake the handlers whose lookup or connection attempts got anywhere, and the ones that waited too long
+void http_proxy_expire(uint32_t now)
+{
+    for(int i = 0; i < HTTP_SERVER_PROXY_MAX; i++) {
+        struct http_proxy *p = &http_proxy_slots[i];
+
+        if(!p->wait) {
+            continue;
+        }
+
+        if((int32_t)(now - p->deadline) >= 0) {
+            p->timed_out = 1;
+            http_proxy_wake(p);
+        } else if(((p->stage == HTTP_PROXY_RESOLVE) || (p->stage == HTTP_PROXY_CONNECT)) && http_proxy_connecting(p)) {
+            http_proxy_wake(p);
+        }
+    }
+}
+
+// Seconds until the loop has to wake up for a timeout, or -1 if the requests only wait for their sockets
+int http_proxy_timer_next(uint32_t now)
+{
+    int next = -1;
+
+    for(int i = 0; i < HTTP_SERVER_PROXY_MAX; i++) {
+        struct http_proxy *p = &http_proxy_slots[i];
+
+        if(p->wait) {
+            int left = (int32_t)(p->deadline - now);
+            if(left < 0) {
+                left = 0;
+            }
+            if((next < 0) || (left < next)) {
+                next = left;
+            }
+        }
+    }
+
+    return next;
+}
+
+// Milliseconds until a connection attempt is due or times out, or -1 if there is none
+int http_proxy_connect_next(uint32_t now)
+{
+    int next = -1;
+
+    for(int i = 0; i < HTTP_SERVER_PROXY_MAX; i++) {
+        struct http_proxy *p = &http_proxy_slots[i];
+
+        if(p->wait && (p->stage == HTTP_PROXY_CONNECT)) {
+            int left = http_connector_timer_next(&p->connector, now);
+            if((left >= 0) && ((next < 0) || (left < next))) {
+                next = left;
+            }
+        }
+    }
+
+    return next;
+}
+
+// Release the slots of finished requests, and of the ones whose client connection was closed
+void http_proxy_dispatch(struct http_server *server)
+{
+    for(int i = 0; i < HTTP_SERVER_PROXY_MAX; i++) {
+        struct http_proxy *p = &http_proxy_slots[i];
+
+        if(p->stage == HTTP_PROXY_FREE) {
+            continue;
+        }
+
+        if((p->stage == HTTP_PROXY_DONE) || (p->owner->fd < 0) || (p->owner->cgi_data != p)) {
+            http_proxy_release(p, server);
+        }
+    }
+}
+
+void http_proxy_handle_events(struct http_proxy *p, int readable, int writable)
+{
+    // While connecting, the handler is only woken once an attempt got anywhere
+    if(p->wait && (p->stage == HTTP_PROXY_CONNECT)) {
+        if(writable && http_proxy_connecting(p)) {
+            http_proxy_wake(p);
+        }
+    } else if(((p->wait == 1) && readable) || ((p->wait == 2) && writable)) {
+        http_proxy_wake(p);
+    }
+}
+
+int http_proxy_create_select_sets(fd_set *set_read, fd_set *set_write, int *maxfd)
+{
+    int num = 0;
+
+    for(int i = 0; i < HTTP_SERVER_PROXY_MAX; i++) {
+        struct http_proxy *p = &http_proxy_slots[i];
+
+        if(p->wait && (p->stage == HTTP_PROXY_CONNECT)) {
+            num += http_connector_create_select_sets(&p->connector, set_write, maxfd);
+            continue;
+        } else if(!p->wait || (p->upstream.fd < 0)) {
+            continue;
+        }
+
+        FD_SET(p->upstream.fd, (p->wait == 1) ? set_read : set_write);
+        if(p->upstream.fd > *maxfd) {
+            *maxfd = p->upstream.fd;
+        }
+        num++;
+    }
+
+    return num;
+}
+
+void http_proxy_handle_select(fd_set *set_read, fd_set *set_write)
+{
+    for(int i = 0; i < HTTP_SERVER_PROXY_MAX; i++) {
+        struct http_proxy *p = &http_proxy_slots[i];
+        int fd = p->upstream.fd;
+
+        if(p->wait && (p->stage == HTTP_PROXY_CONNECT)) {
+            if(http_connector_isset(&p->connector, set_write)) {
+                http_proxy_handle_events(p, 0, 1);
+            }
+        } else if(p->wait && (fd >= 0)) {
+            http_proxy_handle_events(p, FD_ISSET(fd, set_read), FD_ISSET(fd, set_write));
+        }
+    }
+}
+
+int http_proxy_owns(void *ptr)
+{
+    return (ptr >= (void *)http_proxy_slots) && (ptr < (void *)(http_proxy_slots + HTTP_SERVER_PROXY_MAX));
+}
+
+#if HTTP_SERVER_EPOLL
+void http_proxy_poll_update(struct http_server *server)
+{
+    for(int i = 0; i < HTTP_SERVER_PROXY_MAX; i++) {
+        struct http_proxy *p = &http_proxy_slots[i];
+
+        if(p->stage == HTTP_PROXY_CONNECT) {
+            http_poll_connector(server, &p->connector, p);
+            continue;
+        } else if(p->upstream.fd < 0) {
+            continue;
+        }
+
+        uint8_t poll_events = (p->wait == 1) ? EPOLLIN : (p->wait == 2) ? EPOLLOUT : 0;
+
+        // A connection taken from the pool, or opened after another failed, is not in the set yet
+        if(p->poll_fd != p->upstream.fd) {
+            if(poll_events && (http_poll_set(server, EPOLL_CTL_ADD, p->upstream.fd, poll_events, p) == 0)) {
+                p->poll_fd = p->upstream.fd;
+                p->poll_events = poll_events;
+            }
+        } else if(p->poll_events != poll_events) {
+            http_poll_set(server, EPOLL_CTL_MOD, p->upstream.fd, poll_events, p);
+            p->poll_events = poll_events;
+        }
+    }
+}
+#endif
+
+#endif
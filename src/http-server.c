@@ -13,6 +13,33 @@ int http_server_match_url(const char *server_url, const char *request_url)
     }
 }
 
+int http_server_match_glob(const char *pattern, const char *str)
+{
+    const char *star = NULL;
+    const char *resume = NULL;
+
+    while(*str) {
+        if(*pattern == '*') {
+            star = pattern++;
+            resume = str;
+        } else if(*pattern == *str) {
+            pattern++;
+            str++;
+        } else if(star) {
+            pattern = star + 1;
+            str = ++resume;
+        } else {
+            return 0;
+        }
+    }
+
+    while(*pattern == '*') {
+        pattern++;
+    }
+
+    return *pattern == 0;
+}
+
 const char *http_status_string(enum http_status status)
 {
     switch(status) {
@@ -37,12 +64,21 @@ const char *http_status_string(enum http_status status)
     case HTTP_STATUS_URI_TOO_LONG:
         return "URI Too Long";
 
+    case HTTP_STATUS_HEADERS_TOO_LARGE:
+        return "Request Header Fields Too Large";
+
     case HTTP_STATUS_INTERNAL_SERVER_ERROR:
         return "Internal Server Error";
 
+    case HTTP_STATUS_BAD_GATEWAY:
+        return "Bad Gateway";
+
     case HTTP_STATUS_SERVICE_UNAVAILABLE:
         return "Service Unavailable";
 
+    case HTTP_STATUS_GATEWAY_TIMEOUT:
+        return "Gateway Timeout";
+
     case HTTP_STATUS_VERSION_NOT_SUPPORTED:
         return "HTTP Version Not Supported";
 
@@ -19,6 +19,10 @@
 #include "http-private.h"
 #include "log.h"
 
+#if HTTP_SERVER_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifndef IP2STR
 #define IP2STR(ip) (((ip) >> 24) & 0xFF), (((ip) >> 16) & 0xFF), (((ip) >> 8) & 0xFF), ((ip) & 0xFF)
 #endif
@@ -26,55 +30,31 @@
 
 int http_open_request_socket(struct http_request *request)
 {
-    const struct addrinfo hints = {
-        .ai_family = AF_UNSPEC,
-        .ai_socktype = SOCK_STREAM,
-    };
-    struct addrinfo *res;
-
-    char port_str[6];
+    struct http_address addrs[HTTP_DNS_MAX_ADDRESSES];
 
     if(request->port <= 0) {
         request->port = 80;
     }
 
-    sprintf(port_str, "%d", request->port);
-
-    int err = getaddrinfo(request->host, port_str, &hints, &res);
-
-    if (err != 0 || res == NULL)
-    {
-        ERROR("getaddrinfo failed");
-        if(res) {
-            freeaddrinfo(res);
-        }
+    int count = http_resolve(request->host, request->port, addrs, HTTP_DNS_MAX_ADDRESSES, http_clock());
 
+    if(count <= 0) {
         return -1;
     }
 
-    struct sockaddr *sa = res->ai_addr;
-    if (sa->sa_family == AF_INET)
-    {
-        INFO("DNS lookup for %s succeeded. IP=%s", request->host, inet_ntoa(((struct sockaddr_in *)sa)->sin_addr));
-    }
-
-    int s = socket(res->ai_family, res->ai_socktype, 0);
+    // A host with several addresses may not be reachable on all of them, so they race each other
+    int index;
+    int s = http_connect(addrs, count, request->timeout_ms, &index);
 
     if(s < 0) {
-        ERROR("socket failed");
-        freeaddrinfo(res);
+        LOG("Could not connect to %s:%d", request->host, request->port);
         return -1;
     }
 
-    if(connect(s, res->ai_addr, res->ai_addrlen) != 0) {
-        ERROR("connect failed");
-        close(s);
-        freeaddrinfo(res);
-        return -1;
+    if(index > 0) {
+        http_resolve_prefer(request->host, request->port, &addrs[index]);
     }
 
-    freeaddrinfo(res);
-
     request->fd = s;
     return s;
 }
@@ -87,20 +67,58 @@ void http_free(struct http_request *request)
         free(request->query);
         free(request->query_list);
         free(request->websocket_key);
+        free(request->websocket_extensions);
         free(request->etag);
+        free(request->headers);
     } else {
         free(request->content_type);
+        free(request->websocket_key);
+#if HTTP_CLIENT_GZIP
+        http_gzip_free(request);
+#endif
     }
 }
 
+// A client connection can take another request once a response without Connection: close has been read to the end
+static int http_client_reusable(struct http_request *request)
+{
+    if(!request->status || http_is_error(request) || (request->flags & HTTP_FLAG_CONNECTION_CLOSE)) {
+        return 0;
+    }
+
+    // Bytes read past the response belong to nothing the next request could make sense of
+    if(request->recv_buf && (request->recv_buf->index < request->recv_buf->length)) {
+        return 0;
+    }
+
+    // A chunked body ends with its last chunk, and http_read leaves the request idle after it
+    if(request->flags & HTTP_FLAG_READ_CHUNKED) {
+        return request->state == HTTP_STATE_CLIENT_IDLE;
+    }
+
+    return request->read_content_length == 0;
+}
+
 int http_close(struct http_request *request)
 {
     if(request->fd < 0) {
         return -1;
     }
 
+    int reusable = http_is_client(request) && http_client_reusable(request);
+
     http_free(request);
 
+    if(http_is_client(request)) {
+        free(request->recv_buf);
+        request->recv_buf = 0;
+    }
+
+    if(reusable && (http_client_pool_put(request->host, request->port, request->fd) == 0)) {
+        request->fd = -1;
+        return 0;
+    }
+
     close(request->fd);
     request->fd = -1;
     return 0;
@@ -154,7 +172,9 @@ int http_create_select_sets(struct http_server *server, fd_set *set_read,
         int fd = server->request[i].fd;
         if(fd >= 0) {
             num++;
-            if(server->request[i].state & (HTTP_STATE_READ | HTTP_STATE_READ_NL))
+            if(server->request[i].flags & HTTP_FLAG_WAIT) {
+                // The handler waits for its client requests, not for the socket
+            } else if(server->request[i].state & (HTTP_STATE_READ | HTTP_STATE_READ_NL))
             {
                 FD_SET(fd, set_read);
 
@@ -181,16 +201,27 @@ int http_create_select_sets(struct http_server *server, fd_set *set_read,
         }
     };
 
-    for(int i = 0; i < WEBSOCKET_SERVER_MAX_CONNECTIONS; i++) {
-        int fd = server->websocket_connection[i].fd;
+    for(struct websocket_connection *conn = server->websocket_connections; conn; conn = conn->next) {
+        int fd = conn->fd;
         if(fd >= 0) {
             FD_SET(fd, set_read);
+            if(websocket_wants_write(conn)) {
+                FD_SET(fd, set_write);
+            }
             if(fd > *maxfd) {
                 *maxfd = fd;
             }
         }
     }
 
+    int wake_fd = websocket_channel_wake_fd();
+    if(wake_fd >= 0) {
+        FD_SET(wake_fd, set_read);
+        if(wake_fd > *maxfd) {
+            *maxfd = wake_fd;
+        }
+    }
+
 #ifdef LOG_VERBOSE
     char buf[64];
     char *s = buf;
@@ -214,6 +245,105 @@ int http_create_select_sets(struct http_server *server, fd_set *set_read,
     return num;
 }
 
+#if HTTP_SERVER_EPOLL
+int http_poll_init(struct http_server *server)
+{
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if(server->epoll_fd < 0) {
+        ERROR("epoll_create1 failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+int http_poll_set(struct http_server *server, int op, int fd, uint32_t events, void *ptr)
+{
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = ptr,
+    };
+
+    if(epoll_ctl(server->epoll_fd, op, fd, &ev) < 0) {
+        ERROR("epoll_ctl failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Add the connection attempts that are not in the set yet, to wait for them to become writable
+void http_poll_connector(struct http_server *server, struct http_connector *c, void *ptr)
+{
+    for(int i = 0; i < c->started; i++) {
+        if((c->attempts[i].fd >= 0) && !(c->polled & (1 << i))) {
+            if(http_poll_set(server, EPOLL_CTL_ADD, c->attempts[i].fd, EPOLLOUT, ptr) == 0) {
+                c->polled |= 1 << i;
+            }
+        }
+    }
+}
+
+// Register the requests for the events their state calls for, like http_create_select_sets does.
+// Returns the number of open requests.
+int http_poll_update_requests(struct http_server *server)
+{
+    int num = 0;
+
+    for(int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++) {
+        struct http_request *request = &server->request[i];
+
+        if(request->fd < 0) {
+            continue;
+        }
+
+        num++;
+
+        uint8_t events = 0;
+        if(request->flags & HTTP_FLAG_WAIT) {
+            // No events until the client requests of the handler are done
+        } else if(request->state & (HTTP_STATE_READ | HTTP_STATE_READ_NL)) {
+            events = EPOLLIN;
+        } else if(request->state & HTTP_STATE_WRITE) {
+            events = EPOLLOUT;
+        } else {
+            WARNING("Request %d (fd %d) is neither reading nor writing", i, request->fd);
+        }
+
+        // A closed fd leaves the epoll set by itself, so a new fd in the slot has to be added
+        if(server->request_poll_fd[i] != request->fd) {
+            if(http_poll_set(server, EPOLL_CTL_ADD, request->fd, events, request) == 0) {
+                server->request_poll_fd[i] = request->fd;
+                server->request_events[i] = events;
+            }
+        } else if(server->request_events[i] != events) {
+            http_poll_set(server, EPOLL_CTL_MOD, request->fd, events, request);
+            server->request_events[i] = events;
+        }
+    }
+
+    // Stop listening while every request slot is taken
+    uint8_t listen_events = (num < HTTP_SERVER_MAX_CONNECTIONS) ? EPOLLIN : 0;
+    if(server->listen_events != listen_events) {
+        http_poll_set(server, EPOLL_CTL_MOD, server->fd, listen_events, &server->fd);
+        server->listen_events = listen_events;
+    }
+
+    return num;
+}
+
+void websocket_poll_update(struct http_server *server, struct websocket_connection *conn)
+{
+    uint8_t events = EPOLLIN | (websocket_wants_write(conn) ? EPOLLOUT : 0);
+
+    if(conn->poll_events != events) {
+        http_poll_set(server, EPOLL_CTL_MOD, conn->fd, events, conn);
+        conn->poll_events = events;
+    }
+}
+#endif
+
 int http_accept_new_connection(struct http_server *server)
 {
     int i;
@@ -245,6 +375,11 @@ int http_accept_new_connection(struct http_server *server)
     http_response_init(request);
     request->fd = fd;
 
+#if HTTP_SERVER_EPOLL
+    // The slot may get the number of the fd it had before, which left the epoll set when it was closed
+    server->request_poll_fd[i] = -1;
+#endif
+
     return i;
 }
 
@@ -264,6 +399,8 @@ static void http_request_init_common(struct http_request *request)
     request->poke = -1;
     request->status = 0;
     request->error = 0;
+    request->gzip = 0;
+    request->recv_buf = 0;
 }
 
 void http_response_init(struct http_request *request)
@@ -275,38 +412,31 @@ void http_response_init(struct http_request *request)
     request->cgi_arg = 0;
     request->cgi_data = 0;
     request->websocket_key = 0;
+    request->websocket_extensions = 0;
     request->etag = 0;
+    request->if_modified_since = 0;
+    request->headers = 0;
+    request->headers_length = 0;
 }
 
 void http_request_init(struct http_request *request)
 {
     http_request_init_common(request);
     request->state = HTTP_STATE_CLIENT_IDLE;
+    request->timeout_ms = HTTP_CLIENT_TIMEOUT_MS;
+    request->content_type = 0;
+    request->websocket_key = 0;
 }
 
-void websocket_flush(struct websocket_connection *conn)
+// WebSocket frames are written whole, so Nagle only adds latency
+void websocket_set_nodelay(struct websocket_connection *conn)
 {
     int flag = 1;
     setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
-    flag = 0;
-    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
 }
 
-int websocket_is_readable(struct websocket_connection *conn)
+// WebSocket reads and writes never wait for the peer, the server loop waits for all of them in select
+void websocket_set_nonblock(struct websocket_connection *conn)
 {
-    fd_set set;
-    FD_ZERO(&set);
-    FD_SET(conn->fd, &set);
-
-    struct timeval t;
-    t.tv_sec = 0;
-    t.tv_usec = 0;
-
-    int ret = select(conn->fd + 1, &set, 0, 0, &t);
-
-    if(FD_ISSET(conn->fd, &set)) {
-        return ret > 0;
-    } else {
-        return 0;
-    }
+    http_set_nonblock(conn->fd, 1);
 }
@@ -1,5 +1,19 @@
+#include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#ifdef __XTENSA__
+#include "lwip/lwip/sockets.h"
+#else
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#endif
+
 #include "http-private.h"
+#include "log.h"
 
 int http_hex_to_int(char c)
 {
@@ -13,6 +27,175 @@ int http_hex_to_int(char c)
     return 0;
 }
 
+// Seconds from a clock that does not jump when the time of day is set
+uint32_t http_clock(void)
+{
+#ifdef __XTENSA__
+    return time(0);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+#endif
+}
+
+// Milliseconds from the same clock, for timeouts shorter than a second
+uint32_t http_clock_ms(void)
+{
+#ifdef __XTENSA__
+    return time(0) * 1000;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+void http_set_nonblock(int fd, int nonblock)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, nonblock ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+}
+
+// Let a blocking read on the socket of request, and a write too if write is set, wait no longer than what
+// is left until request->deadline, or for as long as it takes without HTTP_FLAG_DEADLINE. Returns -1 if
+// there is nothing left.
+int http_arm_deadline(struct http_request *request, int write)
+{
+    int left = 0;
+
+    if(request->flags & HTTP_FLAG_DEADLINE) {
+        left = (int32_t)(request->deadline - http_clock_ms());
+        if(left <= 0) {
+            LOG("Request to %s:%d timed out", request->host, request->port);
+            return -1;
+        }
+    }
+
+#ifdef __XTENSA__
+    int t = left;
+#else
+    struct timeval t = {
+        .tv_sec = left / 1000,
+        .tv_usec = (left % 1000) * 1000,
+    };
+#endif
+
+    setsockopt(request->fd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
+    if(write) {
+        setsockopt(request->fd, SOL_SOCKET, SO_SNDTIMEO, &t, sizeof(t));
+    }
+
+    return 0;
+}
+
+static int http_is_hex(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+void http_chunk_init(struct http_chunk_decoder *d)
+{
+    d->length = 0;
+    d->state = HTTP_CHUNK_SIZE_START;
+}
+
+// Go through the chunk sizes, extensions and trailer of a chunked body, up to where the data of a chunk starts
+// or the body ends. Returns the number of bytes gone through, or -1 if the framing is bad. In HTTP_CHUNK_DATA,
+// d->length bytes of data come next, and http_chunk_data is told how many of them were taken.
+int http_chunk_frame(struct http_chunk_decoder *d, const char *data, int len)
+{
+    int i;
+
+    for(i = 0; (i < len) && (d->state != HTTP_CHUNK_DATA) && (d->state != HTTP_CHUNK_END); i++) {
+        char c = data[i];
+
+        switch(d->state) {
+        case HTTP_CHUNK_SIZE_START:
+            if(!http_is_hex(c)) {
+                return -1;
+            }
+            d->length = http_hex_to_int(c);
+            d->state = HTTP_CHUNK_SIZE;
+            break;
+
+        case HTTP_CHUNK_SIZE:
+            if(http_is_hex(c)) {
+                if(d->length > (INT_MAX >> 4)) {
+                    return -1;
+                }
+                d->length = 16 * d->length + http_hex_to_int(c);
+            } else if(c == '\n') {
+                d->state = d->length ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+            } else if((c == ';') || (c == ' ') || (c == '\t')) {
+                d->state = HTTP_CHUNK_EXTENSION;
+            } else if(c != '\r') {
+                return -1;
+            }
+            break;
+
+        case HTTP_CHUNK_EXTENSION:
+            if(c == '\n') {
+                d->state = d->length ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+            }
+            break;
+
+        case HTTP_CHUNK_DATA_END:
+            if(c == '\n') {
+                d->state = HTTP_CHUNK_SIZE_START;
+            } else if(c != '\r') {
+                return -1;
+            }
+            break;
+
+        case HTTP_CHUNK_TRAILER:
+            if(c == '\n') {
+                d->state = HTTP_CHUNK_END;
+            } else if(c != '\r') {
+                d->state = HTTP_CHUNK_TRAILER_LINE;
+            }
+            break;
+
+        case HTTP_CHUNK_TRAILER_LINE:
+            if(c == '\n') {
+                d->state = HTTP_CHUNK_TRAILER;
+            }
+            break;
+        }
+    }
+
+    return i;
+}
+
+void http_chunk_data(struct http_chunk_decoder *d, int n)
+{
+    d->length -= n;
+
+    if(!d->length) {
+        d->state = HTTP_CHUNK_DATA_END;
+    }
+}
+
+// Go through framing and data alike, up to the end of the body. Returns the number of bytes gone through, or -1.
+int http_chunk_skip(struct http_chunk_decoder *d, const char *data, int len)
+{
+    int i = 0;
+
+    while((i < len) && !http_chunk_done(d)) {
+        int n;
+
+        if(d->state == HTTP_CHUNK_DATA) {
+            n = (len - i < d->length) ? len - i : d->length;
+            http_chunk_data(d, n);
+        } else if((n = http_chunk_frame(d, data + i, len - i)) < 0) {
+            return -1;
+        }
+
+        i += n;
+    }
+
+    return i;
+}
 
 unsigned http_base64_encode_length(unsigned len)
 {
@@ -154,3 +337,96 @@ unsigned http_base64_decode(char *dest, const char *src, unsigned len)
 
     return n;
 }
+
+static const char *const day_names[7] = { "Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed" };
+static const char *const month_names[12] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+// Days since 1970-01-01 in the proleptic Gregorian calendar
+static long days_from_civil(long y, unsigned m, unsigned d)
+{
+    y -= m <= 2;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = y - era * 400;
+    unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (long)doe - 719468;
+}
+
+static void civil_from_days(long z, long *y, unsigned *m, unsigned *d)
+{
+    z += 719468;
+    long era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = z - era * 146097;
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+
+    *d = doy - (153 * mp + 2) / 5 + 1;
+    *m = mp < 10 ? mp + 3 : mp - 9;
+    *y = (long)yoe + era * 400 + (*m <= 2);
+}
+
+// Writes an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT", followed by a
+// terminating zero. dest must have room for HTTP_DATE_LEN + 1 characters.
+int http_format_date(char *dest, time_t t)
+{
+    if(!dest || t < 0) {
+        return 0;
+    }
+
+    long days = t / 86400;
+    long secs = t % 86400;
+
+    long y;
+    unsigned m, d;
+    civil_from_days(days, &y, &m, &d);
+
+    return snprintf(dest, HTTP_DATE_LEN + 1, "%s, %02u %s %04ld %02ld:%02ld:%02ld GMT",
+                    day_names[days % 7], d, month_names[m - 1], y,
+                    secs / 3600, (secs / 60) % 60, secs % 60);
+}
+
+static int parse_digits(const char *s, int n)
+{
+    int val = 0;
+    for(int i = 0; i < n; i++) {
+        if(s[i] < '0' || s[i] > '9') {
+            return -1;
+        }
+        val = 10 * val + (s[i] - '0');
+    }
+    return val;
+}
+
+// Parses an IMF-fixdate. The obsolete RFC 850 and asctime formats are not
+// supported. Returns zero if the date could not be parsed.
+time_t http_parse_date(const char *str)
+{
+    if(!str || strlen(str) < HTTP_DATE_LEN) {
+        return 0;
+    }
+
+    if(str[3] != ',' || str[4] != ' ' || str[7] != ' ' || str[11] != ' ' || str[16] != ' '
+       || str[19] != ':' || str[22] != ':' || strncmp(str + 25, " GMT", 4) != 0) {
+        return 0;
+    }
+
+    unsigned m;
+    for(m = 0; m < 12; m++) {
+        if(strncmp(str + 8, month_names[m], 3) == 0) {
+            break;
+        }
+    }
+
+    int d = parse_digits(str + 5, 2);
+    int y = parse_digits(str + 12, 4);
+    int hh = parse_digits(str + 17, 2);
+    int mm = parse_digits(str + 20, 2);
+    int ss = parse_digits(str + 23, 2);
+
+    if(m == 12 || d < 1 || d > 31 || y < 1970 || hh < 0 || hh > 23 || mm < 0 || mm > 59 || ss < 0 || ss > 60) {
+        return 0;
+    }
+
+    return (time_t)days_from_civil(y, m + 1, d) * 86400 + hh * 3600 + mm * 60 + ss;
+}
@@ -0,0 +1,324 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef __XTENSA__
+#include <fcntl.h>
+#endif
+
+#include "http-sm/http.h"
+#include "http-sm/websocket.h"
+#include "http-private.h"
+#include "log.h"
+
+// A published frame waiting for the server loop to fan it out
+struct websocket_publication {
+    struct websocket_publication *next;
+    struct websocket_frame_buf *frame;
+    char channel[];
+};
+
+// A channel with at least one subscriber. Only touched from the server loop.
+struct websocket_channel {
+    char *name;
+    // In no particular order, and the channel is on the list of each of them
+    struct websocket_connection **subscribers;
+    int count;
+    int size;
+};
+
+// The channels a connection is subscribed to, kept out of line to keep idle connections small.
+// Freed when the last one is left, so a connection on no channel has none.
+struct websocket_channel_list {
+    uint16_t count;
+    uint16_t size;
+    struct websocket_channel *channel[];
+};
+
+// The channels that have subscribers, in no particular order. Grows as channels are made.
+static struct websocket_channel **websocket_channel_tab;
+static int websocket_channel_count;
+static int websocket_channel_size;
+
+// Pushed to from any thread, drained by the server loop
+static struct websocket_publication *websocket_pending;
+
+static int websocket_wake_fds[2] = { -1, -1 };
+
+int websocket_channel_init(void)
+{
+#ifndef __XTENSA__
+    if(websocket_wake_fds[0] < 0) {
+        if(pipe(websocket_wake_fds) < 0) {
+            ERROR("pipe");
+            return -1;
+        }
+
+        fcntl(websocket_wake_fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(websocket_wake_fds[1], F_SETFL, O_NONBLOCK);
+    }
+#endif
+    return 0;
+}
+
+int websocket_channel_wake_fd(void)
+{
+    return websocket_wake_fds[0];
+}
+
+// Make the server loop look at what other threads handed it
+void websocket_channel_wake(void)
+{
+    if(websocket_wake_fds[1] >= 0) {
+        char c = 0;
+        if(write(websocket_wake_fds[1], &c, 1) < 0 && errno != EAGAIN) {
+            ERROR("Waking server loop");
+        }
+    }
+}
+
+// The size an array that is full at size grows to, doubling up to max, or -1 if it is at max already
+static int websocket_channel_grow_size(int size, int max)
+{
+    if(size >= max) {
+        return -1;
+    }
+
+    return (size == 0) ? 4 : (2 * size < max) ? 2 * size : max;
+}
+
+static struct websocket_channel *websocket_channel_find(const char *channel, int create)
+{
+    for(int i = 0; i < websocket_channel_count; i++) {
+        if(strcmp(websocket_channel_tab[i]->name, channel) == 0) {
+            return websocket_channel_tab[i];
+        }
+    }
+
+    if(!create) {
+        return NULL;
+    }
+
+    if(websocket_channel_count == websocket_channel_size) {
+        int size = websocket_channel_grow_size(websocket_channel_size, WEBSOCKET_MAX_CHANNELS);
+        struct websocket_channel **tab = (size > 0) ? realloc(websocket_channel_tab, size * sizeof(*tab)) : NULL;
+
+        if(!tab) {
+            return NULL;
+        }
+
+        websocket_channel_tab = tab;
+        websocket_channel_size = size;
+    }
+
+    struct websocket_channel *ch = calloc(1, sizeof(*ch));
+    if(!ch) {
+        return NULL;
+    }
+
+    ch->name = strdup(channel);
+    if(!ch->name) {
+        free(ch);
+        return NULL;
+    }
+
+    websocket_channel_tab[websocket_channel_count++] = ch;
+
+    return ch;
+}
+
+// Whether the connection is on the channel
+static int websocket_channel_has(struct websocket_connection *conn, struct websocket_channel *ch)
+{
+    struct websocket_channel_list *list = conn->channels;
+
+    for(int i = 0; list && i < list->count; i++) {
+        if(list->channel[i] == ch) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Drop the channel once nobody is left on it
+static void websocket_channel_drop_empty(struct websocket_channel *ch)
+{
+    if(ch->count > 0) {
+        return;
+    }
+
+    for(int i = 0; i < websocket_channel_count; i++) {
+        if(websocket_channel_tab[i] == ch) {
+            websocket_channel_tab[i] = websocket_channel_tab[--websocket_channel_count];
+            break;
+        }
+    }
+
+    free(ch->name);
+    free(ch->subscribers);
+    free(ch);
+}
+
+// Take the connection off the channel, and the channel off the list of the connection
+static void websocket_channel_remove(struct websocket_channel *ch, struct websocket_connection *conn)
+{
+    for(int i = 0; i < ch->count; i++) {
+        if(ch->subscribers[i] == conn) {
+            ch->subscribers[i] = ch->subscribers[--ch->count];
+            break;
+        }
+    }
+
+    struct websocket_channel_list *list = conn->channels;
+
+    for(int i = 0; i < list->count; i++) {
+        if(list->channel[i] == ch) {
+            list->channel[i] = list->channel[--list->count];
+            break;
+        }
+    }
+
+    if(list->count == 0) {
+        free(list);
+        conn->channels = NULL;
+    }
+
+    websocket_channel_drop_empty(ch);
+}
+
+int websocket_subscribe(struct websocket_connection *conn, const char *channel)
+{
+    struct websocket_channel *ch = websocket_channel_find(channel, 1);
+
+    if(!ch) {
+        LOG("WS: no room for channel %s", channel);
+        return -1;
+    }
+
+    if(websocket_channel_has(conn, ch)) {
+        return 0;
+    }
+
+    struct websocket_channel_list *list = conn->channels;
+
+    if(!list || list->count == list->size) {
+        int size = websocket_channel_grow_size(list ? list->size : 0, WEBSOCKET_MAX_CHANNELS);
+        list = (size > 0) ? realloc(conn->channels, sizeof(*list) + size * sizeof(list->channel[0])) : NULL;
+
+        if(!list) {
+            // Drop the channel again if it was made for this connection
+            websocket_channel_drop_empty(ch);
+            return -1;
+        }
+
+        if(!conn->channels) {
+            list->count = 0;
+        }
+        list->size = size;
+        conn->channels = list;
+    }
+
+    if(ch->count == ch->size) {
+        int size = websocket_channel_grow_size(ch->size, INT_MAX);
+        struct websocket_connection **subscribers = (size > 0) ? realloc(ch->subscribers, size * sizeof(*subscribers)) : NULL;
+
+        if(!subscribers) {
+            websocket_channel_drop_empty(ch);
+            return -1;
+        }
+
+        ch->subscribers = subscribers;
+        ch->size = size;
+    }
+
+    ch->subscribers[ch->count++] = conn;
+    list->channel[list->count++] = ch;
+
+    return 0;
+}
+
+void websocket_unsubscribe(struct websocket_connection *conn, const char *channel)
+{
+    struct websocket_channel *ch = websocket_channel_find(channel, 0);
+
+    if(ch && websocket_channel_has(conn, ch)) {
+        websocket_channel_remove(ch, conn);
+    }
+}
+
+// Unsubscribe from everything, before the connection goes away
+void websocket_channel_leave(struct websocket_connection *conn)
+{
+    while(conn->channels) {
+        websocket_channel_remove(conn->channels->channel[conn->channels->count - 1], conn);
+    }
+}
+
+// Frame the message once and hand it to the server loop. Safe to call from other threads, but not from a signal handler.
+int websocket_publish(const char *channel, const void *buf, size_t count, enum websocket_frame_opcode opcode)
+{
+    size_t channel_len = strlen(channel);
+    struct websocket_publication *pub = malloc(sizeof(*pub) + channel_len + 1);
+
+    if(!pub) {
+        return -1;
+    }
+
+    pub->frame = websocket_frame_alloc(buf, count, opcode | WEBSOCKET_FRAME_FIN);
+    if(!pub->frame) {
+        free(pub);
+        return -1;
+    }
+    memcpy(pub->channel, channel, channel_len + 1);
+
+    pub->next = __atomic_load_n(&websocket_pending, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&websocket_pending, &pub->next, pub, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+
+    websocket_channel_wake();
+
+    return 0;
+}
+
+void websocket_channel_dispatch(struct http_server *server)
+{
+    if(websocket_wake_fds[0] >= 0) {
+        char buf[16];
+        while(read(websocket_wake_fds[0], buf, sizeof(buf)) > 0) {
+        }
+    }
+
+    struct websocket_publication *pub = __atomic_exchange_n(&websocket_pending, NULL, __ATOMIC_ACQUIRE);
+
+    // The pending list is LIFO, so reverse it to keep publish order
+    struct websocket_publication *list = NULL;
+    while(pub) {
+        struct websocket_publication *next = pub->next;
+        pub->next = list;
+        list = pub;
+        pub = next;
+    }
+
+    while(list) {
+        struct websocket_publication *next = list->next;
+        struct websocket_channel *ch = websocket_channel_find(list->channel, 0);
+
+        // Hold a reference so the frame survives subscribers flushing it
+        list->frame->refcount++;
+
+        if(ch) {
+            for(int j = 0; j < ch->count; j++) {
+                if(ch->subscribers[j]->fd >= 0) {
+                    websocket_queue_frame(ch->subscribers[j], list->frame);
+                }
+            }
+        }
+
+        websocket_frame_release(list->frame);
+        free(list);
+        list = next;
+    }
+}
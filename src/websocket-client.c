@@ -0,0 +1,176 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "http-sm/http.h"
+#include "http-sm/websocket.h"
+#include "http-private.h"
+#include "log.h"
+
+static int websocket_client_handshake(struct http_request *request)
+{
+    uint8_t nonce[16];
+    char key[25];
+    char expected[WEBSOCKET_ACCEPT_LEN];
+
+    websocket_random(nonce, sizeof(nonce));
+    http_base64_encode(key, (const char *)nonce, sizeof(nonce));
+    key[sizeof(key) - 1] = 0;
+
+    if(http_begin_request(request) <= 0) {
+        return -1;
+    }
+
+    http_write_header(request, "Upgrade", "websocket");
+    http_write_header(request, "Connection", "Upgrade");
+    http_write_header(request, "Sec-WebSocket-Key", key);
+    http_write_header(request, "Sec-WebSocket-Version", "13");
+    http_end_header(request);
+
+    if(http_read_response_header(request) < 0) {
+        return -1;
+    }
+
+    // The server may send its first frames right behind the upgrade response
+    struct http_recv_buffer *b = request->recv_buf;
+    if(b->length - b->index > WEBSOCKET_BUFFER_LEN) {
+        LOG("WS: %d bytes after upgrade response of %s do not fit", b->length - b->index, request->path);
+        return -1;
+    }
+
+    if(request->status != 101) {
+        LOG("WS: upgrade of %s refused with status %d", request->path, request->status);
+        return -1;
+    }
+
+    websocket_accept_key(key, expected);
+
+    if(!(request->flags & HTTP_FLAG_WEBSOCKET) || !request->websocket_key || (strcmp(request->websocket_key, expected) != 0)) {
+        LOG("WS: bad upgrade response for %s", request->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+struct websocket_connection *websocket_connect(const char *host, int port, const char *path)
+{
+    struct http_request request;
+
+    http_request_init(&request);
+    request.host = (char *)host;
+    request.port = port;
+    request.path = (char *)path;
+
+    if(http_open_request_socket(&request) < 0) {
+        ERROR("http_open_request_socket failed");
+        return NULL;
+    }
+
+    if(websocket_client_handshake(&request) < 0) {
+        http_close(&request);
+        return NULL;
+    }
+
+    struct websocket_connection *conn = malloc(sizeof(*conn));
+    if(!conn) {
+        http_close(&request);
+        return NULL;
+    }
+
+    memset(conn, 0, sizeof(*conn));
+    websocket_queue_init(conn);
+    conn->fd = request.fd;
+    conn->state = WEBSOCKET_STATE_OPCODE;
+    conn->client = 1;
+
+    struct http_recv_buffer *b = request.recv_buf;
+    conn->buf_length = b->length - b->index;
+    memcpy(conn->buf, b->data + b->index, conn->buf_length);
+    free(request.recv_buf);
+    request.recv_buf = 0;
+
+    http_free(&request);
+    websocket_set_nodelay(conn);
+
+    return conn;
+}
+
+int websocket_next_frame(struct websocket_connection *conn)
+{
+    for(;;) {
+        // Whatever is left of the previous frame is skipped
+        while(conn->state == WEBSOCKET_STATE_BODY) {
+            uint8_t buf[64];
+            if(websocket_read(conn, buf, sizeof(buf)) <= 0) {
+                break;
+            }
+        }
+
+        if((conn->state == WEBSOCKET_STATE_ERROR) || (conn->state == WEBSOCKET_STATE_CLOSED)) {
+            return -1;
+        }
+
+        if(conn->state == WEBSOCKET_STATE_DONE) {
+            conn->state = WEBSOCKET_STATE_OPCODE;
+        }
+
+        while(conn->state != WEBSOCKET_STATE_BODY) {
+            if(conn->buf_index == conn->buf_length) {
+                int ret = read(conn->fd, conn->buf, sizeof(conn->buf));
+                if(ret <= 0) {
+                    if((ret < 0) && (errno == EINTR)) {
+                        continue;
+                    }
+                    conn->state = WEBSOCKET_STATE_ERROR;
+                    return -1;
+                }
+                conn->buf_index = 0;
+                conn->buf_length = ret;
+            }
+
+            conn->buf_index += websocket_parse_frame_header_buf(conn, conn->buf + conn->buf_index, conn->buf_length - conn->buf_index);
+
+            if(conn->state == WEBSOCKET_STATE_ERROR) {
+                return -1;
+            }
+        }
+
+        if((conn->frame_opcode & WEBSOCKET_FRAME_OPCODE) != WEBSOCKET_FRAME_OPCODE_PING) {
+            return conn->frame_opcode;
+        }
+
+        // Control frames carry at most 125 bytes
+        uint8_t ping[125];
+        int len = 0;
+        while((conn->state == WEBSOCKET_STATE_BODY) && (len < sizeof(ping))) {
+            int ret = websocket_read(conn, ping + len, sizeof(ping) - len);
+            if(ret <= 0) {
+                break;
+            }
+            len += ret;
+        }
+
+        if(websocket_send(conn, ping, len, WEBSOCKET_FRAME_OPCODE_PONG) < 0) {
+            conn->state = WEBSOCKET_STATE_ERROR;
+            return -1;
+        }
+    }
+}
+
+void websocket_disconnect(struct websocket_connection *conn)
+{
+    if(!conn) {
+        return;
+    }
+
+    if((conn->state != WEBSOCKET_STATE_ERROR) && (conn->state != WEBSOCKET_STATE_CLOSED)) {
+        const uint8_t status[] = { 0x03, 0xE8 };
+        websocket_send(conn, status, sizeof(status), WEBSOCKET_FRAME_OPCODE_CLOSE);
+    }
+
+    websocket_channel_leave(conn);
+    close(conn->fd);
+    free(conn);
+}
@@ -0,0 +1,361 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "http-sm/http.h"
+#include "http-sm/websocket.h"
+#include "http-private.h"
+#include "log.h"
+
+#if WEBSOCKET_DEFLATE
+
+#include <zlib.h>
+
+// A zlib stream that can be reused by any connection with the same window size
+struct websocket_zstream {
+    z_stream z;
+    uint8_t inflate;
+    uint8_t window_bits;
+    struct websocket_zstream *next;
+};
+
+static struct websocket_zstream *websocket_zstream_pool;
+static int websocket_zstream_pool_count;
+
+static const uint8_t websocket_deflate_tail[] = { 0x00, 0x00, 0xFF, 0xFF };
+
+static struct websocket_zstream *websocket_zstream_acquire(int inflate, int window_bits)
+{
+    for(struct websocket_zstream **p = &websocket_zstream_pool; *p; p = &(*p)->next) {
+        struct websocket_zstream *s = *p;
+        if((s->inflate == inflate) && (s->window_bits == window_bits)) {
+            *p = s->next;
+            websocket_zstream_pool_count--;
+            return s;
+        }
+    }
+
+    struct websocket_zstream *s = calloc(1, sizeof(*s));
+    if(!s) {
+        return NULL;
+    }
+
+    s->inflate = inflate;
+    s->window_bits = window_bits;
+
+    // Negative window bits select a raw deflate stream
+    int ret;
+    if(inflate) {
+        ret = inflateInit2(&s->z, -window_bits);
+    } else {
+        ret = deflateInit2(&s->z, WEBSOCKET_DEFLATE_LEVEL, Z_DEFLATED, -window_bits, WEBSOCKET_DEFLATE_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    }
+
+    if(ret != Z_OK) {
+        LOG("WS: could not init zlib stream: %d", ret);
+        free(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+static void websocket_zstream_release(struct websocket_zstream *s)
+{
+    if(!s) {
+        return;
+    }
+
+    if(websocket_zstream_pool_count < WEBSOCKET_DEFLATE_POOL_SIZE) {
+        if(s->inflate) {
+            inflateReset(&s->z);
+        } else {
+            deflateReset(&s->z);
+        }
+        s->next = websocket_zstream_pool;
+        websocket_zstream_pool = s;
+        websocket_zstream_pool_count++;
+    } else {
+        if(s->inflate) {
+            inflateEnd(&s->z);
+        } else {
+            deflateEnd(&s->z);
+        }
+        free(s);
+    }
+}
+
+static char *websocket_deflate_trim(char *s)
+{
+    while(*s == ' ' || *s == '\t') {
+        s++;
+    }
+
+    char *end = s + strlen(s);
+    while((end > s) && (end[-1] == ' ' || end[-1] == '\t')) {
+        *--end = 0;
+    }
+
+    return s;
+}
+
+// Parse a window bits value. An absent value is returned as 0.
+static int websocket_deflate_parse_bits(char *val, int allow_empty)
+{
+    if(!val) {
+        return allow_empty ? 0 : -1;
+    }
+
+    val = websocket_deflate_trim(val);
+
+    int len = strlen(val);
+    if((len >= 2) && (val[0] == '"') && (val[len - 1] == '"')) {
+        val[len - 1] = 0;
+        val++;
+    }
+
+    if((strlen(val) == 1) && (val[0] >= '8') && (val[0] <= '9')) {
+        return val[0] - '0';
+    } else if((strlen(val) == 2) && (val[0] == '1') && (val[1] >= '0') && (val[1] <= '5')) {
+        return 10 + val[1] - '0';
+    }
+
+    return -1;
+}
+
+// Try to accept a single permessage-deflate offer. Returns 0 and fills in params and response on success.
+static int websocket_deflate_accept_offer(char *offer, struct websocket_deflate *params, char *response, int response_len)
+{
+    char *save;
+    char *name = strtok_r(offer, ";", &save);
+
+    if(!name || strcmp(websocket_deflate_trim(name), "permessage-deflate") != 0) {
+        return -1;
+    }
+
+    int server_no_context_takeover = 0;
+    int client_no_context_takeover = 0;
+    int server_max_window_bits = -1;
+    int client_max_window_bits = -1;
+
+    for(char *param = strtok_r(NULL, ";", &save); param; param = strtok_r(NULL, ";", &save)) {
+        char *val = strchr(param, '=');
+        if(val) {
+            *val++ = 0;
+        }
+        param = websocket_deflate_trim(param);
+
+        if(strcmp(param, "server_no_context_takeover") == 0) {
+            if(server_no_context_takeover || val) {
+                return -1;
+            }
+            server_no_context_takeover = 1;
+        } else if(strcmp(param, "client_no_context_takeover") == 0) {
+            if(client_no_context_takeover || val) {
+                return -1;
+            }
+            client_no_context_takeover = 1;
+        } else if(strcmp(param, "server_max_window_bits") == 0) {
+            if(server_max_window_bits >= 0) {
+                return -1;
+            }
+            server_max_window_bits = websocket_deflate_parse_bits(val, 0);
+            // zlib can not produce raw streams with an 8 bit window
+            if(server_max_window_bits < 9) {
+                return -1;
+            }
+        } else if(strcmp(param, "client_max_window_bits") == 0) {
+            if(client_max_window_bits >= 0) {
+                return -1;
+            }
+            client_max_window_bits = websocket_deflate_parse_bits(val, 1);
+            if(client_max_window_bits < 0) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
+    }
+
+    memset(params, 0, sizeof(*params));
+
+    params->server_window_bits = WEBSOCKET_DEFLATE_WINDOW_BITS;
+    if((server_max_window_bits > 0) && (server_max_window_bits < params->server_window_bits)) {
+        params->server_window_bits = server_max_window_bits;
+    }
+
+    // The client window can only be limited if the client said it supports that
+    params->client_window_bits = 15;
+    if(client_max_window_bits >= 0) {
+        params->client_window_bits = WEBSOCKET_DEFLATE_WINDOW_BITS;
+        if((client_max_window_bits > 0) && (client_max_window_bits < params->client_window_bits)) {
+            params->client_window_bits = client_max_window_bits;
+        }
+    }
+
+    params->server_no_context_takeover = server_no_context_takeover || WEBSOCKET_DEFLATE_NO_CONTEXT_TAKEOVER;
+    params->client_no_context_takeover = client_no_context_takeover || WEBSOCKET_DEFLATE_NO_CONTEXT_TAKEOVER;
+
+    int n = snprintf(response, response_len, "permessage-deflate");
+
+    if(params->server_no_context_takeover) {
+        n += snprintf(response + n, response_len - n, "; server_no_context_takeover");
+    }
+    if(params->client_no_context_takeover) {
+        n += snprintf(response + n, response_len - n, "; client_no_context_takeover");
+    }
+    // A window size may only be sent back if the client offered it
+    if(server_max_window_bits > 0) {
+        n += snprintf(response + n, response_len - n, "; server_max_window_bits=%d", params->server_window_bits);
+    }
+    if((client_max_window_bits >= 0) && (params->client_window_bits < 15)) {
+        n += snprintf(response + n, response_len - n, "; client_max_window_bits=%d", params->client_window_bits);
+    }
+
+    return 0;
+}
+
+int websocket_deflate_negotiate(const char *extensions, struct websocket_deflate *params, char *response, int response_len)
+{
+    if(!extensions) {
+        return -1;
+    }
+
+    char *copy = strdup(extensions);
+    if(!copy) {
+        return -1;
+    }
+
+    int ret = -1;
+    char *save;
+
+    for(char *offer = strtok_r(copy, ",", &save); offer; offer = strtok_r(NULL, ",", &save)) {
+        if(websocket_deflate_accept_offer(offer, params, response, response_len) == 0) {
+            ret = 0;
+            break;
+        }
+    }
+
+    free(copy);
+
+    return ret;
+}
+
+// Run data through a zlib stream with Z_SYNC_FLUSH, appending the output to a growing buffer
+static int websocket_zstream_run(struct websocket_zstream *s, const uint8_t *in, size_t in_len, uint8_t **out, size_t *out_len, size_t *out_size, size_t max_len)
+{
+    s->z.next_in = (uint8_t *)in;
+    s->z.avail_in = in_len;
+
+    do {
+        if(*out_len == *out_size) {
+            size_t size = *out_size ? 2 * *out_size : in_len + 64;
+            if(size > max_len + 1) {
+                size = max_len + 1;
+            }
+            if(size <= *out_size) {
+                LOG("WS: inflated frame is longer than %d bytes", (int)max_len);
+                return -1;
+            }
+
+            uint8_t *p = realloc(*out, size);
+            if(!p) {
+                return -1;
+            }
+            *out = p;
+            *out_size = size;
+        }
+
+        s->z.next_out = *out + *out_len;
+        s->z.avail_out = *out_size - *out_len;
+
+        int ret = s->inflate ? inflate(&s->z, Z_SYNC_FLUSH) : deflate(&s->z, Z_SYNC_FLUSH);
+
+        *out_len = *out_size - s->z.avail_out;
+
+        if((ret != Z_OK) && (ret != Z_BUF_ERROR)) {
+            LOG("WS: zlib error %d", ret);
+            return -1;
+        }
+    } while((s->z.avail_in > 0) || (s->z.avail_out == 0));
+
+    return 0;
+}
+
+int websocket_deflate_compress(struct websocket_deflate *d, const void *buf, size_t count, int fin, uint8_t **out, size_t *out_len)
+{
+    if(!d->deflater) {
+        d->deflater = websocket_zstream_acquire(0, d->server_window_bits);
+        if(!d->deflater) {
+            return -1;
+        }
+    }
+
+    size_t size = 0;
+    *out = NULL;
+    *out_len = 0;
+
+    if(websocket_zstream_run(d->deflater, buf, count, out, out_len, &size, (size_t)-2) < 0) {
+        free(*out);
+        *out = NULL;
+        return -1;
+    }
+
+    if(fin) {
+        // Every message ends with a sync flush, whose tail is implied
+        if((*out_len >= 4) && (memcmp(*out + *out_len - 4, websocket_deflate_tail, 4) == 0)) {
+            *out_len -= 4;
+        }
+
+        if(d->server_no_context_takeover) {
+            websocket_zstream_release(d->deflater);
+            d->deflater = NULL;
+        }
+    }
+
+    return 0;
+}
+
+int websocket_deflate_decompress(struct websocket_deflate *d, const void *buf, size_t count, int fin, uint8_t **out, size_t *out_len)
+{
+    if(!d->inflater) {
+        d->inflater = websocket_zstream_acquire(1, d->client_window_bits < 9 ? 9 : d->client_window_bits);
+        if(!d->inflater) {
+            return -1;
+        }
+    }
+
+    size_t size = 0;
+    *out = NULL;
+    *out_len = 0;
+
+    int ret = websocket_zstream_run(d->inflater, buf, count, out, out_len, &size, WEBSOCKET_DEFLATE_MAX_INFLATED_LEN);
+
+    if((ret == 0) && fin) {
+        ret = websocket_zstream_run(d->inflater, websocket_deflate_tail, sizeof(websocket_deflate_tail), out, out_len, &size, WEBSOCKET_DEFLATE_MAX_INFLATED_LEN);
+
+        if(d->client_no_context_takeover) {
+            websocket_zstream_release(d->inflater);
+            d->inflater = NULL;
+        }
+    }
+
+    if(ret < 0) {
+        free(*out);
+        *out = NULL;
+    }
+
+    return ret;
+}
+
+void websocket_deflate_free(struct websocket_deflate *d)
+{
+    if(d) {
+        websocket_zstream_release(d->deflater);
+        websocket_zstream_release(d->inflater);
+        free(d->inflated);
+        free(d);
+    }
+}
+
+#endif
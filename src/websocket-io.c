@@ -1,28 +1,42 @@
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __XTENSA__
+#include "lwip/lwip/sockets.h"
+#else
+#include <sys/socket.h>
+#endif
+
 #include "http-sm/http.h"
 #include "http-sm/sha1.h"
 #include "http-private.h"
 #include "log.h"
 
-void websocket_send_response(struct http_request *request)
+// Compute the Sec-WebSocket-Accept value for a Sec-WebSocket-Key
+void websocket_accept_key(const char *key, char *accept)
+{
+    const char *guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+    struct http_sha1_ctx ctx;
+    uint8_t hash[21];
+    http_sha1_init(&ctx);
+    http_sha1_update(&ctx, (const uint8_t*)key, strlen(key));
+    http_sha1_update(&ctx, (const uint8_t*)guid, strlen(guid));
+    http_sha1_final(hash, &ctx);
+    http_base64_encode(accept, (char *)hash, 20);
+    accept[WEBSOCKET_ACCEPT_LEN - 1] = 0;
+}
+
+void websocket_send_response(struct http_request *request, const char *extensions)
 {
     const char *response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n";
     http_write_all(request->fd, response, strlen(response));
 
     if(request->websocket_key) {
-        const char *guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-
-        struct http_sha1_ctx ctx;
-        uint8_t hash[21];
-        http_sha1_init(&ctx);
-        http_sha1_update(&ctx, (const uint8_t*)request->websocket_key, strlen(request->websocket_key));
-        http_sha1_update(&ctx, (const uint8_t*)guid, strlen(guid));
-        http_sha1_final(hash, &ctx);
-        char hash_base64[29];
-        http_base64_encode(hash_base64, (char *)hash, 20);
-        hash_base64[28] = 0;
+        char hash_base64[WEBSOCKET_ACCEPT_LEN];
+        websocket_accept_key(request->websocket_key, hash_base64);
 
         const char *header = "Sec-WebSocket-Accept: ";
         http_write_all(request->fd, header, strlen(header));
@@ -30,6 +44,13 @@ void websocket_send_response(struct http_request *request)
         http_write_all(request->fd, "\r\n", 2);
     }
 
+    if(extensions) {
+        const char *header = "Sec-WebSocket-Extensions: ";
+        http_write_all(request->fd, header, strlen(header));
+        http_write_all(request->fd, extensions, strlen(extensions));
+        http_write_all(request->fd, "\r\n", 2);
+    }
+
     http_write_all(request->fd, "\r\n", 2);
 }
 
@@ -39,8 +60,16 @@ void websocket_parse_frame_header(struct websocket_connection *conn, uint8_t c)
 {
     switch(conn->state & ~WEBSOCKET_STATE_MASK) {
     case WEBSOCKET_STATE_OPCODE:
+    {
+        uint8_t allowed = WEBSOCKET_FRAME_OPCODE | WEBSOCKET_FRAME_FIN;
+
+        // RSV1 marks the first frame of a compressed data message
+        if(conn->deflate && (((c & WEBSOCKET_FRAME_OPCODE) == WEBSOCKET_FRAME_OPCODE_TEXT) || ((c & WEBSOCKET_FRAME_OPCODE) == WEBSOCKET_FRAME_OPCODE_BIN))) {
+            allowed |= WEBSOCKET_FRAME_RSV1;
+        }
+
         conn->frame_index = 0;
-        if((c & ~(WEBSOCKET_FRAME_OPCODE | WEBSOCKET_FRAME_MASK)) || ((c & 0x07) > 2)) {
+        if((c & ~allowed) || ((c & 0x07) > 2)) {
             LOG("Unkown websocket opcode: %02X", c);
             conn->state = WEBSOCKET_STATE_ERROR;
         } else {
@@ -48,6 +77,7 @@ void websocket_parse_frame_header(struct websocket_connection *conn, uint8_t c)
             conn->state = WEBSOCKET_STATE_LEN8;
         }
         break;
+    }
 
     case WEBSOCKET_STATE_LEN8:
     {
@@ -132,6 +162,66 @@ void websocket_parse_frame_header(struct websocket_connection *conn, uint8_t c)
     }
 }
 
+#define websocket_is_header_state(conn) (((conn)->state & ~WEBSOCKET_STATE_MASK) < WEBSOCKET_STATE_BODY)
+
+int websocket_parse_frame_header_buf(struct websocket_connection *conn, const uint8_t *buf, int len)
+{
+    if((conn->state == WEBSOCKET_STATE_OPCODE) && (len >= 2)) {
+        uint8_t c = buf[1];
+        int header_len = 2;
+
+        if((c & WEBSOCKET_FRAME_LEN) == WEBSOCKET_FRAME_LEN_16BIT) {
+            header_len += 2;
+        } else if((c & WEBSOCKET_FRAME_LEN) == WEBSOCKET_FRAME_LEN_64BIT) {
+            header_len += 8;
+        }
+
+        if(c & WEBSOCKET_FRAME_MASK) {
+            header_len += 4;
+        }
+
+        if(len >= header_len) {
+            websocket_parse_frame_header(conn, buf[0]);
+
+            if(conn->state == WEBSOCKET_STATE_ERROR) {
+                return 1;
+            }
+
+            const uint8_t *p = buf + 2;
+
+            if((c & WEBSOCKET_FRAME_LEN) == WEBSOCKET_FRAME_LEN_16BIT) {
+                conn->frame_length = ((uint64_t)p[0] << 8) | p[1];
+                p += 2;
+            } else if((c & WEBSOCKET_FRAME_LEN) == WEBSOCKET_FRAME_LEN_64BIT) {
+                conn->frame_length = 0;
+                for(int i = 0; i < 8; i++) {
+                    conn->frame_length = (conn->frame_length << 8) | p[i];
+                }
+                p += 8;
+            } else {
+                conn->frame_length = c & WEBSOCKET_FRAME_LEN;
+            }
+
+            if(c & WEBSOCKET_FRAME_MASK) {
+                memcpy(conn->frame_mask, p, 4);
+            } else {
+                memset(conn->frame_mask, 0, 4);
+            }
+
+            conn->state = WEBSOCKET_STATE_BODY;
+
+            return header_len;
+        }
+    }
+
+    // The header is incomplete, so keep track of it byte by byte
+    int i = 0;
+    while((i < len) && websocket_is_header_state(conn)) {
+        websocket_parse_frame_header(conn, buf[i++]);
+    }
+    return i;
+}
+
 int websocket_read(struct websocket_connection *conn, void *buf_, size_t count)
 {
     if(conn->state != WEBSOCKET_STATE_BODY) {
@@ -144,45 +234,771 @@ int websocket_read(struct websocket_connection *conn, void *buf_, size_t count)
         count = conn->frame_length - conn->frame_index;
     }
 
-    if(websocket_is_readable(conn)) {
-        int n = http_read_all(conn->fd, buf, count);
+#if WEBSOCKET_DEFLATE
+    if(websocket_has_inflated(conn)) {
+        memcpy(buf, conn->deflate->inflated + conn->frame_index, count);
+        conn->frame_index += count;
 
-        for(int i = 0; i < n; i++) {
-            buf[i] ^= conn->frame_mask[(conn->frame_index++) % 4];
+        if(conn->frame_length == conn->frame_index) {
+            conn->state = WEBSOCKET_STATE_DONE;
         }
+        return count;
+    }
+#endif
 
-        if(n < 0) {
-            conn->state = WEBSOCKET_STATE_ERROR;
+    if(conn->payload) {
+        memcpy(buf, conn->payload + conn->frame_index, count);
+        conn->frame_index += count;
+
+        if(conn->frame_length == conn->frame_index) {
+            conn->state = WEBSOCKET_STATE_DONE;
+        }
+        return count;
+    }
+
+    int n = 0;
+
+    if(conn->buf_index < conn->buf_length) {
+        n = conn->buf_length - conn->buf_index;
+        if(n > count) {
+            n = count;
         }
 
-        if(conn->frame_length == conn->frame_index || n == 0) {
+        memcpy(buf, conn->buf + conn->buf_index, n);
+        conn->buf_index += n;
+    }
+
+    // The server loop only hands over frames that are already buffered, so this is for direct callers.
+    // A single read, which may come back short.
+    if(n < count) {
+        int ret = read(conn->fd, buf + n, count - n);
+
+        if(ret < 0) {
+            if((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+                conn->state = WEBSOCKET_STATE_ERROR;
+                return ret;
+            }
+        } else if(ret == 0) {
             conn->state = WEBSOCKET_STATE_DONE;
+        } else {
+            n += ret;
+        }
+    }
+
+    websocket_mask((uint8_t *)buf, n, conn->frame_mask, conn->frame_index);
+    conn->frame_index += n;
+
+    if(conn->frame_length == conn->frame_index) {
+        conn->state = WEBSOCKET_STATE_DONE;
+    }
+
+    return n;
+}
+
+// True when the rest of the current frame is in memory, so handlers can read it without waiting
+int websocket_frame_ready(struct websocket_connection *conn)
+{
+    if(conn->payload) {
+        return conn->payload_length == conn->frame_length;
+    }
+
+    return conn->frame_length - conn->frame_index <= conn->buf_length - conn->buf_index;
+}
+
+// Hand out the rest of the current frame without copying it, if it is all in memory.
+// Returns its length, or -1 if it has not all arrived. data is valid until the next read from the socket.
+int websocket_frame_data(struct websocket_connection *conn, const uint8_t **data)
+{
+    if(conn->state != WEBSOCKET_STATE_BODY) {
+        return -1;
+    }
+
+    size_t n = conn->frame_length - conn->frame_index;
+
+#if WEBSOCKET_DEFLATE
+    if(websocket_has_inflated(conn)) {
+        *data = conn->deflate->inflated + conn->frame_index;
+    } else
+#endif
+    if(conn->payload) {
+        if(conn->payload_length < conn->frame_length) {
+            return -1;
+        }
+        *data = conn->payload + conn->frame_index;
+    } else {
+        if(n > conn->buf_length - conn->buf_index) {
+            return -1;
         }
 
-        return n;
+        // Unmasked in place
+        uint8_t *p = conn->buf + conn->buf_index;
+        websocket_mask(p, n, conn->frame_mask, conn->frame_index);
+        conn->buf_index += n;
+        *data = p;
     }
+
+    conn->frame_index = conn->frame_length;
+    conn->state = WEBSOCKET_STATE_DONE;
+
+    return n;
+}
+
+// Move the buffered part of a frame that is too large for buf into a payload allocation
+int websocket_start_payload(struct websocket_connection *conn)
+{
+    if(conn->frame_length > WEBSOCKET_MAX_FRAME_LEN) {
+        LOG("WS: frame of %llu bytes is too long", (unsigned long long)conn->frame_length);
+        return -1;
+    }
+
+    conn->payload = malloc(conn->frame_length);
+    if(!conn->payload) {
+        return -1;
+    }
+
+    size_t n = conn->buf_length - conn->buf_index;
+    memcpy(conn->payload, conn->buf + conn->buf_index, n);
+    websocket_mask(conn->payload, n, conn->frame_mask, 0);
+
+    conn->buf_index = conn->buf_length;
+    conn->payload_length = n;
+
     return 0;
 }
 
-int websocket_send(struct websocket_connection *conn, const void *buf, size_t count, enum websocket_frame_opcode opcode)
+// Read more of a large frame. Returns like read.
+int websocket_read_payload(struct websocket_connection *conn)
+{
+    int ret = read(conn->fd, conn->payload + conn->payload_length, conn->frame_length - conn->payload_length);
+
+    if(ret > 0) {
+        websocket_mask(conn->payload + conn->payload_length, ret, conn->frame_mask, conn->payload_length);
+        conn->payload_length += ret;
+    }
+
+    return ret;
+}
+
+// Write an unmasked frame header for a payload of count bytes. The header is at most 10 bytes.
+int websocket_frame_header(uint8_t *header, size_t count, uint8_t opcode)
 {
-    uint8_t op = opcode | WEBSOCKET_FRAME_FIN;
-    write(conn->fd, &op, 1);
+    header[0] = opcode;
 
     if(count < 0x7e) {
-        uint8_t c = count;
-        write(conn->fd, &c, sizeof(c));
+        header[1] = count;
+        return 2;
     } else if(count < 0x10000) {
-        uint8_t c[] = { 0x7e, (count >> 8) & 0xFF, count & 0xFF };
-        write(conn->fd, &c, sizeof(c));
+        header[1] = 0x7e;
+        header[2] = (count >> 8) & 0xFF;
+        header[3] = count & 0xFF;
+        return 4;
     } else {
-        uint8_t c[] = { 0x7f, (count >> 56) & 0xFF, (count >> 48) & 0xFF, (count >> 40) & 0xFF, (count >> 32) & 0xFF, (count >> 24) & 0xFF, (count >> 16) & 0xFF, (count >> 8) & 0xFF, count & 0xFF };
-        write(conn->fd, &c, sizeof(c));
+        header[1] = 0x7f;
+        for(int i = 0; i < 8; i++) {
+            header[2 + i] = ((uint64_t)count >> (56 - 8 * i)) & 0xFF;
+        }
+        return 10;
     }
+}
 
-    int ret = http_write_all(conn->fd, buf, count);
+// Frames from a client are masked, so the payload is copied. Client connections are blocking and never queue.
+static int websocket_send_masked(struct websocket_connection *conn, const void *buf, size_t count, uint8_t opcode)
+{
+    uint8_t header[14];
+    int header_len = websocket_frame_header(header, count, opcode);
+
+    uint8_t mask[4];
+    websocket_random(mask, sizeof(mask));
+    header[1] |= WEBSOCKET_FRAME_MASK;
+    memcpy(header + header_len, mask, sizeof(mask));
+    header_len += sizeof(mask);
+
+    uint8_t small[WEBSOCKET_BUFFER_LEN];
+    uint8_t *frame = (header_len + count <= sizeof(small)) ? small : malloc(header_len + count);
+    if(!frame) {
+        return -1;
+    }
 
-    websocket_flush(conn);
+    memcpy(frame, header, header_len);
+    memcpy(frame + header_len, buf, count);
+    websocket_mask(frame + header_len, count, mask, 0);
 
-    return ret;
+    int ret = http_write_all(conn->fd, (const char *)frame, header_len + count);
+
+    if(frame != small) {
+        free(frame);
+    }
+
+    return (ret < 0) ? -1 : count;
+}
+
+// Write to the socket without blocking. Returns the number of bytes written, which is 0 if the socket is full.
+static ssize_t websocket_sendv(int fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = iovcnt,
+    };
+
+    for(;;) {
+        ssize_t n = sendmsg(fd, &msg, MSG_DONTWAIT);
+
+#ifndef __XTENSA__
+        // Pipes and files can only be written blocking
+        if((n < 0) && (errno == ENOTSOCK)) {
+            n = writev(fd, iov, iovcnt);
+        }
+#endif
+
+        if(n >= 0) {
+            return n;
+        } else if((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            return 0;
+        } else if(errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// Send a whole frame without blocking, queueing whatever the socket does not take right away
+static int websocket_send_queued(struct websocket_connection *conn, const void *buf, size_t count, uint8_t opcode)
+{
+    ssize_t n = 0;
+
+    if(conn->client) {
+        return websocket_send_masked(conn, buf, count, opcode);
+    }
+
+    if(conn->out_overflow) {
+        return -1;
+    }
+
+    if(websocket_queue_pending(conn) > 0) {
+        if(websocket_queue_flush(conn) < 0) {
+            return -1;
+        }
+    }
+
+    uint8_t header[10];
+    int header_len = websocket_frame_header(header, count, opcode);
+
+    // Nothing has to go out first, so try to write straight from the caller's buffer. A partly written frame
+    // has to be queued, so this is only done when the queue has room for it. Data messages sent in the middle
+    // of a fragmented message are held in the queue until it has ended.
+    if(!websocket_queue_pending(conn) && !websocket_frame_is_held(conn, opcode) &&
+       websocket_queue_has_room(conn, opcode, header_len + count)) {
+        struct iovec iov[] = {
+            { .iov_base = header, .iov_len = header_len },
+            { .iov_base = (void *)buf, .iov_len = count },
+        };
+
+        n = websocket_sendv(conn->fd, iov, (count > 0) ? 2 : 1);
+        if(n < 0) {
+            return -1;
+        } else if((size_t)n == header_len + count) {
+            return count;
+        }
+    }
+
+    struct websocket_frame_buf *frame = websocket_frame_alloc(buf, count, opcode);
+    if(!frame) {
+        return -1;
+    }
+
+    frame->refcount++;
+    int ret = websocket_queue_frame(conn, frame);
+    if((ret == 0) && (n > 0)) {
+        // Nothing was pending, so this frame is at the head of the queue
+        conn->out->offset = n;
+    }
+    websocket_frame_release(frame);
+
+    // A dropped fragment would break the message, so the caller is told to try again later
+    if(conn->out_overflow || ((ret < 0) && websocket_frame_is_fragment(opcode))) {
+        return -1;
+    }
+
+    return count;
+}
+
+// Send one frame of a data message, compressing the payload if the message is compressed
+static int websocket_send_data_frame(struct websocket_connection *conn, const void *buf, size_t count, uint8_t opcode, int fin)
+{
+#if WEBSOCKET_DEFLATE
+    if(conn->deflate && conn->deflate->send_compressed) {
+        uint8_t *out;
+        size_t out_len;
+
+        if(websocket_deflate_compress(conn->deflate, buf, count, fin, &out, &out_len) < 0) {
+            return -1;
+        }
+
+        // The queue looks at send_compressed to tell compressed fragments apart
+        int ret = websocket_send_queued(conn, out, out_len, opcode);
+        free(out);
+
+        if(fin) {
+            conn->deflate->send_compressed = 0;
+        }
+
+        return (ret < 0) ? -1 : count;
+    }
+#endif
+    return websocket_send_queued(conn, buf, count, opcode);
+}
+
+// Decide if a new data message should be compressed, and return the RSV1 bit for its first frame
+static uint8_t websocket_start_message(struct websocket_connection *conn, size_t count, uint8_t opcode)
+{
+#if WEBSOCKET_DEFLATE
+    opcode &= WEBSOCKET_FRAME_OPCODE;
+    if(conn->deflate && ((opcode == WEBSOCKET_FRAME_OPCODE_TEXT) || (opcode == WEBSOCKET_FRAME_OPCODE_BIN)) && (count >= WEBSOCKET_DEFLATE_MIN_LEN)) {
+        conn->deflate->send_compressed = 1;
+        return WEBSOCKET_FRAME_RSV1;
+    }
+#endif
+    return 0;
+}
+
+// Never blocks. Frames the socket can not take right away wait in the out queue, subject to the overflow policy.
+int websocket_send(struct websocket_connection *conn, const void *buf, size_t count, enum websocket_frame_opcode opcode)
+{
+    if(opcode & 0x08) {
+        return websocket_send_queued(conn, buf, count, opcode | WEBSOCKET_FRAME_FIN);
+    }
+
+    // In the middle of a fragmented message the frame is held in the queue, and it is not compressed as
+    // the compressor is busy with the fragments
+    if(conn->send_fragmented) {
+        return websocket_send_queued(conn, buf, count, (opcode & ~WEBSOCKET_FRAME_RSV1) | WEBSOCKET_FRAME_FIN);
+    }
+
+    uint8_t rsv = websocket_start_message(conn, count, opcode);
+
+    return websocket_send_data_frame(conn, buf, count, (opcode & ~WEBSOCKET_FRAME_RSV1) | rsv | WEBSOCKET_FRAME_FIN, 1);
+}
+
+// Start a fragmented message. Control frames still go out between its fragments, other messages are held
+// back until websocket_send_end. None of these block: a fragment the socket can not take is queued, and -1
+// means that it was not sent, so the same data can be sent again from cb_write.
+int websocket_send_begin(struct websocket_connection *conn, const void *buf, size_t count, enum websocket_frame_opcode opcode)
+{
+    if(conn->send_fragmented) {
+        LOG("WS: fragmented message already in progress on %d", conn->fd);
+        return -1;
+    }
+
+    conn->send_fragmented = 1;
+
+    // The total size is not known, so always compress when possible
+    uint8_t rsv = websocket_start_message(conn, WEBSOCKET_DEFLATE_MIN_LEN, opcode);
+
+    if(websocket_send_data_frame(conn, buf, count, (opcode & WEBSOCKET_FRAME_OPCODE) | rsv, 0) < 0) {
+        conn->send_fragmented = 0;
+#if WEBSOCKET_DEFLATE
+        if(conn->deflate) {
+            conn->deflate->send_compressed = 0;
+        }
+#endif
+        return -1;
+    }
+
+    // The server loop calls cb_write once the socket is writable
+    websocket_mark_dirty(conn);
+
+    return count;
+}
+
+int websocket_send_continue(struct websocket_connection *conn, const void *buf, size_t count)
+{
+    if(!conn->send_fragmented) {
+        return -1;
+    }
+
+    return websocket_send_data_frame(conn, buf, count, WEBSOCKET_FRAME_OPCODE_CONT, 0);
+}
+
+int websocket_send_end(struct websocket_connection *conn, const void *buf, size_t count)
+{
+    if(!conn->send_fragmented) {
+        return -1;
+    }
+
+    if(websocket_send_data_frame(conn, buf, count, WEBSOCKET_FRAME_OPCODE_CONT | WEBSOCKET_FRAME_FIN, 1) < 0) {
+        return -1;
+    }
+
+    // The messages held back may go out now
+    conn->send_fragmented = 0;
+    if(conn->out) {
+        conn->out->held = 0;
+    }
+    websocket_mark_dirty(conn);
+
+    return count;
+}
+
+#if WEBSOCKET_DEFLATE
+// Read the payload of a compressed frame and replace it with the inflated data
+int websocket_inflate_frame(struct websocket_connection *conn)
+{
+    struct websocket_deflate *d = conn->deflate;
+    uint8_t opcode = conn->frame_opcode & WEBSOCKET_FRAME_OPCODE;
+
+    if((opcode == WEBSOCKET_FRAME_OPCODE_TEXT) || (opcode == WEBSOCKET_FRAME_OPCODE_BIN)) {
+        d->recv_compressed = (conn->frame_opcode & WEBSOCKET_FRAME_RSV1) != 0;
+    } else if(opcode != WEBSOCKET_FRAME_OPCODE_CONT) {
+        return 0;
+    }
+
+    if(!d->recv_compressed) {
+        return 0;
+    }
+
+    if(conn->frame_length > WEBSOCKET_DEFLATE_MAX_INFLATED_LEN) {
+        LOG("WS: compressed frame of %d bytes is too long", (int)conn->frame_length);
+        return -1;
+    }
+
+    size_t len = conn->frame_length;
+    uint8_t *buf = malloc(len + 1);
+    if(!buf) {
+        return -1;
+    }
+
+    if(websocket_read(conn, buf, len) != len) {
+        free(buf);
+        return -1;
+    }
+
+    int fin = (conn->frame_opcode & WEBSOCKET_FRAME_FIN) != 0;
+    size_t out_len;
+    int ret = websocket_deflate_decompress(d, buf, len, fin, &d->inflated, &out_len);
+    free(buf);
+
+    if(ret < 0) {
+        return -1;
+    }
+
+    if(fin) {
+        d->recv_compressed = 0;
+    }
+
+    // Handlers see an ordinary uncompressed frame
+    conn->frame_opcode &= ~WEBSOCKET_FRAME_RSV1;
+    conn->frame_length = out_len;
+    conn->frame_index = 0;
+    conn->state = WEBSOCKET_STATE_BODY;
+
+    return 0;
+}
+#endif
+
+struct websocket_frame_buf *websocket_frame_alloc(const void *buf, size_t count, uint8_t opcode)
+{
+    uint8_t header[10];
+    int header_len = websocket_frame_header(header, count, opcode);
+
+    struct websocket_frame_buf *frame = malloc(sizeof(*frame) + header_len + count);
+    if(!frame) {
+        return NULL;
+    }
+
+    frame->refcount = 0;
+    frame->length = header_len + count;
+    memcpy(frame->data, header, header_len);
+    memcpy(frame->data + header_len, buf, count);
+
+    return frame;
+}
+
+void websocket_frame_release(struct websocket_frame_buf *frame)
+{
+    if(--frame->refcount <= 0) {
+        free(frame);
+    }
+}
+
+void websocket_queue_init(struct websocket_connection *conn)
+{
+    conn->out = 0;
+    conn->client = 0;
+    conn->jobs = 0;
+    conn->overflow_policy = WEBSOCKET_OVERFLOW_POLICY;
+    conn->out_overflow = 0;
+    conn->channels = 0;
+    conn->send_fragmented = 0;
+    conn->deflate = 0;
+    conn->payload = 0;
+    conn->message = 0;
+    conn->timer.next = 0;
+    conn->timer.pprev = 0;
+    conn->ping_outstanding = 0;
+    conn->dirty = 0;
+    conn->poll_events = 0;
+    conn->cb_data = 0;
+}
+
+static struct websocket_connection *websocket_dirty;
+
+void websocket_mark_dirty(struct websocket_connection *conn)
+{
+    // Client connections are not watched by the server loop
+    if(!conn->dirty && !conn->client) {
+        conn->dirty = 1;
+        conn->dirty_next = websocket_dirty;
+        websocket_dirty = conn;
+    }
+}
+
+struct websocket_connection *websocket_take_dirty(void)
+{
+    struct websocket_connection *conn = websocket_dirty;
+
+    if(conn) {
+        websocket_dirty = conn->dirty_next;
+        conn->dirty_next = NULL;
+        conn->dirty = 0;
+    }
+
+    return conn;
+}
+
+#define websocket_queue_at(q, i) ((q)->frames[((q)->head + (i)) % WEBSOCKET_OUT_QUEUE_LEN])
+
+// The queue is given back as soon as it is empty, so idle connections do not hold on to it
+static void websocket_queue_release(struct websocket_connection *conn)
+{
+    if(conn->out && (conn->out->count == 0)) {
+        free(conn->out);
+        conn->out = NULL;
+    }
+}
+
+// Drop the i:th queued frame
+static void websocket_queue_remove(struct websocket_connection *conn, int i)
+{
+    struct websocket_out_queue *q = conn->out;
+    struct websocket_frame_buf *frame = websocket_queue_at(q, i);
+
+    q->bytes -= frame->length;
+    websocket_frame_release(frame);
+
+    if(i >= q->count - q->held) {
+        q->held--;
+    }
+
+    for(; i < q->count - 1; i++) {
+        websocket_queue_at(q, i) = websocket_queue_at(q, i + 1);
+    }
+    q->count--;
+}
+
+static int websocket_queue_is_full(struct websocket_connection *conn, size_t length)
+{
+    struct websocket_out_queue *q = conn->out;
+
+    // A frame larger than the whole budget still goes into an empty queue
+    return q && ((q->count == WEBSOCKET_OUT_QUEUE_LEN) || ((q->count > 0) && (q->bytes + length > WEBSOCKET_OUT_QUEUE_BYTES)));
+}
+
+int websocket_queue_has_room(struct websocket_connection *conn, uint8_t opcode, size_t length)
+{
+    // Control frames are small and must not be lost, so only the slot limit applies to them
+    return (opcode & 0x08) ? (websocket_queue_count(conn) < WEBSOCKET_OUT_QUEUE_LEN) : !websocket_queue_is_full(conn, length);
+}
+
+// Drop every frame that has not started to go out. A partly sent frame has to be finished, so it stays.
+void websocket_queue_drop(struct websocket_connection *conn)
+{
+    if(!conn->out) {
+        return;
+    }
+
+    int first = (conn->out->offset > 0) ? 1 : 0;
+
+    while(conn->out->count > first) {
+        websocket_queue_remove(conn, first);
+    }
+
+    websocket_queue_release(conn);
+}
+
+// A frame that the peer needs to make sense of what follows it: a fragment of a message, or with context
+// takeover a compressed frame, as the peer inflates each message with the window left by the ones before it.
+static int websocket_queue_must_keep(struct websocket_connection *conn, struct websocket_frame_buf *frame)
+{
+    if(websocket_frame_is_fragment(frame->data[0])) {
+        return 1;
+    }
+
+#if WEBSOCKET_DEFLATE
+    if(conn->deflate && !conn->deflate->server_no_context_takeover && (frame->data[0] & WEBSOCKET_FRAME_RSV1)) {
+        return 1;
+    }
+#endif
+
+    return 0;
+}
+
+// Dropping a frame that must be kept would break the stream, so the connection is closed instead. The frame to
+// queue is dropped by DROP_NEWEST, which is fine unless it is compressed: the compressor has moved on, so it can
+// not be sent again. An uncompressed fragment is sent again by the caller. The other policies drop queued frames
+// from first on.
+static int websocket_queue_must_close(struct websocket_connection *conn, struct websocket_frame_buf *frame, int first)
+{
+#if WEBSOCKET_DEFLATE
+    if(conn->deflate && websocket_queue_must_keep(conn, frame) &&
+       ((frame->data[0] & WEBSOCKET_FRAME_RSV1) || conn->deflate->send_compressed)) {
+        return 1;
+    }
+#endif
+
+    if(conn->overflow_policy != WEBSOCKET_OVERFLOW_DROP_NEWEST) {
+        for(int i = first; i < conn->out->count; i++) {
+            if(websocket_queue_must_keep(conn, websocket_queue_at(conn->out, i))) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int websocket_queue_frame(struct websocket_connection *conn, struct websocket_frame_buf *frame)
+{
+    if(conn->out_overflow) {
+        return -1;
+    }
+
+    // Control frames are small and must not be lost, so only the slot limit applies to them
+    int control = frame->data[0] & 0x08;
+
+    if(!control && websocket_queue_is_full(conn, frame->length)) {
+        int first = (conn->out->offset > 0) ? 1 : 0;
+        int policy = conn->overflow_policy;
+
+        if(websocket_queue_must_close(conn, frame, first)) {
+            policy = WEBSOCKET_OVERFLOW_CLOSE;
+        }
+
+        switch(policy) {
+        case WEBSOCKET_OVERFLOW_DROP_OLDEST:
+            while((conn->out->count > first) && websocket_queue_is_full(conn, frame->length)) {
+                websocket_queue_remove(conn, first);
+            }
+            break;
+
+        case WEBSOCKET_OVERFLOW_COALESCE:
+            websocket_queue_drop(conn);
+            break;
+
+        case WEBSOCKET_OVERFLOW_CLOSE:
+            LOG("WS: out queue of %d is full, closing", conn->fd);
+            conn->out_overflow = 1;
+            websocket_mark_dirty(conn);
+            return -1;
+
+        default:
+            break;
+        }
+
+        if(websocket_queue_is_full(conn, frame->length)) {
+            LOG("WS: out queue of %d is full, dropping frame", conn->fd);
+            return -1;
+        }
+    } else if(websocket_queue_count(conn) == WEBSOCKET_OUT_QUEUE_LEN) {
+        LOG("WS: out queue of %d is full, dropping frame", conn->fd);
+        return -1;
+    }
+
+    if(!conn->out) {
+        conn->out = malloc(sizeof(*conn->out));
+        if(!conn->out) {
+            return -1;
+        }
+        conn->out->head = 0;
+        conn->out->count = 0;
+        conn->out->held = 0;
+        conn->out->offset = 0;
+        conn->out->bytes = 0;
+    }
+
+    struct websocket_out_queue *q = conn->out;
+
+    int i = q->count;
+
+    if(websocket_frame_is_held(conn, frame->data[0])) {
+        q->held++;
+    } else {
+        // Fragments and control frames go ahead of the held messages
+        for(; i > q->count - q->held; i--) {
+            websocket_queue_at(q, i) = websocket_queue_at(q, i - 1);
+        }
+    }
+
+    websocket_queue_at(q, i) = frame;
+    q->count++;
+    q->bytes += frame->length;
+    frame->refcount++;
+
+    websocket_mark_dirty(conn);
+
+    return 0;
+}
+
+// Send as much of the out queue as possible, stopping as soon as the socket is full. Held frames stay.
+int websocket_queue_flush(struct websocket_connection *conn)
+{
+    struct websocket_out_queue *q = conn->out;
+
+    while(websocket_queue_pending(conn) > 0) {
+        struct iovec iov[8];
+        int iovcnt = 0;
+
+        for(int i = 0; (i < q->count - q->held) && (iovcnt < sizeof(iov) / sizeof(iov[0])); i++) {
+            struct websocket_frame_buf *frame = websocket_queue_at(q, i);
+            size_t offset = (i == 0) ? q->offset : 0;
+
+            iov[iovcnt].iov_base = frame->data + offset;
+            iov[iovcnt].iov_len = frame->length - offset;
+            iovcnt++;
+        }
+
+        ssize_t n = websocket_sendv(conn->fd, iov, iovcnt);
+
+        if(n < 0) {
+            return -1;
+        } else if(n == 0) {
+            return 0;
+        }
+
+        q->offset += n;
+
+        while((q->count > q->held) && (q->offset >= q->frames[q->head]->length)) {
+            q->offset -= q->frames[q->head]->length;
+            q->bytes -= q->frames[q->head]->length;
+            websocket_frame_release(q->frames[q->head]);
+            q->head = (q->head + 1) % WEBSOCKET_OUT_QUEUE_LEN;
+            q->count--;
+        }
+    }
+
+    websocket_queue_release(conn);
+
+    return 0;
+}
+
+void websocket_queue_clear(struct websocket_connection *conn)
+{
+    struct websocket_out_queue *q = conn->out;
+
+    if(q) {
+        while(q->count > 0) {
+            websocket_frame_release(q->frames[q->head]);
+            q->head = (q->head + 1) % WEBSOCKET_OUT_QUEUE_LEN;
+            q->count--;
+        }
+        websocket_queue_release(conn);
+    }
 }
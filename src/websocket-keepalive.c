@@ -0,0 +1,219 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "http-sm/http.h"
+#include "http-sm/websocket.h"
+#include "http-private.h"
+#include "log.h"
+
+// Timers hash into slots by expiry second. A slot can hold timers for later laps of the wheel,
+// so arming and cancelling are O(1) and each second only one slot has to be looked at.
+static struct websocket_timer *websocket_timer_wheel[WEBSOCKET_TIMER_SLOTS];
+
+// The second the wheel has been run up to. Also the clock used for keepalive bookkeeping,
+// so that receiving a frame does not need a system call.
+static uint32_t websocket_timer_now;
+
+#define websocket_time_before(a, b) ((int32_t)((a) - (b)) < 0)
+
+uint32_t websocket_timer_clock(void)
+{
+#ifdef __XTENSA__
+    return time(0);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+#endif
+}
+
+void websocket_timer_cancel(struct websocket_timer *timer)
+{
+    if(timer->pprev) {
+        *timer->pprev = timer->next;
+        if(timer->next) {
+            timer->next->pprev = timer->pprev;
+        }
+        timer->next = NULL;
+        timer->pprev = NULL;
+    }
+}
+
+void websocket_timer_set(struct websocket_timer *timer, uint32_t expires)
+{
+    websocket_timer_cancel(timer);
+
+    // A slot that has already been passed would not be looked at again until the next lap
+    if(!websocket_time_before(websocket_timer_now, expires)) {
+        expires = websocket_timer_now + 1;
+    }
+
+    struct websocket_timer **slot = &websocket_timer_wheel[expires % WEBSOCKET_TIMER_SLOTS];
+
+    timer->expires = expires;
+    timer->next = *slot;
+    if(*slot) {
+        (*slot)->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+// Seconds until the next slot with a timer in it, or -1 if no timer is armed
+int websocket_timer_next(uint32_t now)
+{
+    for(int i = 1; i <= WEBSOCKET_TIMER_SLOTS; i++) {
+        if(websocket_timer_wheel[(now + i) % WEBSOCKET_TIMER_SLOTS]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int websocket_keepalive_setting(int value, int def)
+{
+    if(value == 0) {
+        value = def;
+    }
+    return (value > 0) ? value : 0;
+}
+
+#define websocket_ping_interval(conn) websocket_keepalive_setting((conn)->handler->ping_interval, WEBSOCKET_PING_INTERVAL)
+#define websocket_pong_timeout(conn) websocket_keepalive_setting((conn)->handler->pong_timeout, WEBSOCKET_PONG_TIMEOUT)
+#define websocket_idle_timeout(conn) websocket_keepalive_setting((conn)->handler->idle_timeout, WEBSOCKET_IDLE_TIMEOUT)
+
+// Arm the timer for the earliest thing that may need to happen
+static void websocket_keepalive_schedule(struct websocket_connection *conn)
+{
+    int ping_interval = websocket_ping_interval(conn);
+    int pong_timeout = websocket_pong_timeout(conn);
+    int idle_timeout = websocket_idle_timeout(conn);
+
+    int armed = 0;
+    uint32_t expires = 0;
+
+    if(conn->ping_outstanding && pong_timeout) {
+        expires = conn->ping_sent + pong_timeout;
+        armed = 1;
+    } else if(conn->ping_outstanding && ping_interval) {
+        expires = conn->ping_sent + ping_interval;
+        armed = 1;
+    } else if(ping_interval) {
+        expires = conn->last_rx + ping_interval;
+        armed = 1;
+    }
+
+    if(idle_timeout) {
+        uint32_t idle = conn->last_data + idle_timeout;
+        if(!armed || websocket_time_before(idle, expires)) {
+            expires = idle;
+        }
+        armed = 1;
+    }
+
+    if(armed) {
+        websocket_timer_set(&conn->timer, expires);
+    } else {
+        websocket_timer_cancel(&conn->timer);
+    }
+}
+
+void websocket_keepalive_start(struct websocket_connection *conn)
+{
+    conn->last_rx = websocket_timer_now;
+    conn->last_data = websocket_timer_now;
+    conn->ping_outstanding = 0;
+
+    websocket_keepalive_schedule(conn);
+}
+
+// Called for every received frame. The timer is left alone and catches up when it expires.
+void websocket_keepalive_frame(struct websocket_connection *conn)
+{
+    conn->last_rx = websocket_timer_now;
+    conn->ping_outstanding = 0;
+
+    if(!(conn->frame_opcode & 0x08)) {
+        conn->last_data = websocket_timer_now;
+    }
+}
+
+static void websocket_keepalive_expired(struct websocket_connection *conn, uint32_t now)
+{
+    int ping_interval = websocket_ping_interval(conn);
+    int pong_timeout = websocket_pong_timeout(conn);
+    int idle_timeout = websocket_idle_timeout(conn);
+
+    if(idle_timeout && !websocket_time_before(now, conn->last_data + idle_timeout)) {
+        uint8_t status[] = { 0x03, 0xE9 };
+        LOG("WS: %d has been idle for %d seconds, closing", conn->fd, idle_timeout);
+        websocket_close(conn, status, sizeof(status));
+        return;
+    }
+
+    if(conn->ping_outstanding && pong_timeout && !websocket_time_before(now, conn->ping_sent + pong_timeout)) {
+        uint8_t status[] = { 0x03, 0xE9 };
+        LOG("WS: no reply to ping from %d, closing", conn->fd);
+        websocket_close(conn, status, sizeof(status));
+        return;
+    }
+
+    if(ping_interval) {
+        uint32_t since = conn->ping_outstanding ? conn->ping_sent : conn->last_rx;
+
+        if(!websocket_time_before(now, since + ping_interval)) {
+            if(websocket_send(conn, "", 0, WEBSOCKET_FRAME_OPCODE_PING) < 0) {
+                websocket_close(conn, NULL, 0);
+                return;
+            }
+            conn->ping_outstanding = 1;
+            conn->ping_sent = now;
+        }
+    }
+
+    websocket_keepalive_schedule(conn);
+}
+
+void websocket_keepalive_run(uint32_t now)
+{
+    if(!websocket_time_before(websocket_timer_now, now)) {
+        return;
+    }
+
+    // After a long stall every slot is looked at once
+    uint32_t ticks = now - websocket_timer_now;
+    if(ticks > WEBSOCKET_TIMER_SLOTS) {
+        ticks = WEBSOCKET_TIMER_SLOTS;
+    }
+
+    // Collect first, since handling a timer may arm it again
+    struct websocket_timer *expired = NULL;
+
+    for(uint32_t i = 1; i <= ticks; i++) {
+        struct websocket_timer **p = &websocket_timer_wheel[(websocket_timer_now + i) % WEBSOCKET_TIMER_SLOTS];
+
+        while(*p) {
+            struct websocket_timer *timer = *p;
+
+            if(websocket_time_before(now, timer->expires)) {
+                p = &timer->next;
+            } else {
+                websocket_timer_cancel(timer);
+                timer->next = expired;
+                expired = timer;
+            }
+        }
+    }
+
+    websocket_timer_now = now;
+
+    while(expired) {
+        struct websocket_timer *timer = expired;
+        expired = timer->next;
+        timer->next = NULL;
+
+        struct websocket_connection *conn = (struct websocket_connection *)((char *)timer - offsetof(struct websocket_connection, timer));
+        websocket_keepalive_expired(conn, now);
+    }
+}
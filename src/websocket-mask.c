@@ -0,0 +1,142 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef __XTENSA__
+#include "esp_common.h"
+#else
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#include "http-private.h"
+
+#ifdef __XTENSA__
+typedef uint32_t websocket_mask_word;
+#else
+typedef uint64_t websocket_mask_word;
+#endif
+
+// XOR buf with the frame mask, starting at byte offset of the payload
+void websocket_mask(uint8_t *buf, size_t len, const uint8_t *mask, uint64_t offset)
+{
+    uint8_t m[4];
+
+    for(int i = 0; i < 4; i++) {
+        m[i] = mask[(offset + i) % 4];
+    }
+
+    size_t i = 0;
+
+    // Unaligned head, one byte at a time
+    while((i < len) && ((uintptr_t)(buf + i) % sizeof(websocket_mask_word))) {
+        buf[i] ^= m[i % 4];
+        i++;
+    }
+
+    // From here on i only advances in multiples of four, so the rotation is fixed
+    uint8_t r[4] = { m[i % 4], m[(i + 1) % 4], m[(i + 2) % 4], m[(i + 3) % 4] };
+    uint32_t m32;
+    memcpy(&m32, r, sizeof(m32));
+
+#if defined(__AVX2__)
+    const __m256i m256 = _mm256_set1_epi32(m32);
+    for(; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        _mm256_storeu_si256((__m256i *)(buf + i), _mm256_xor_si256(v, m256));
+    }
+#endif
+
+#if defined(__SSE2__)
+    const __m128i m128 = _mm_set1_epi32(m32);
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        _mm_storeu_si128((__m128i *)(buf + i), _mm_xor_si128(v, m128));
+    }
+#endif
+
+    websocket_mask_word mw;
+    for(int k = 0; k < sizeof(mw); k += 4) {
+        memcpy((uint8_t *)&mw + k, r, 4);
+    }
+
+    for(; i + sizeof(mw) <= len; i += sizeof(mw)) {
+        websocket_mask_word w;
+        memcpy(&w, buf + i, sizeof(w));
+        w ^= mw;
+        memcpy(buf + i, &w, sizeof(w));
+    }
+
+    // Tail
+    for(; i < len; i++) {
+        buf[i] ^= m[i % 4];
+    }
+}
+
+#ifdef __XTENSA__
+void websocket_random(uint8_t *buf, size_t len)
+{
+    while(len > 0) {
+        uint32_t r = os_random();
+        size_t n = (len < sizeof(r)) ? len : sizeof(r);
+        memcpy(buf, &r, n);
+        buf += n;
+        len -= n;
+    }
+}
+#else
+// Random bytes for handshake keys and frame masks. They are read from /dev/urandom in batches,
+// so masking a frame does not usually need a system call.
+static uint8_t websocket_random_pool[256];
+static size_t websocket_random_index = sizeof(websocket_random_pool);
+
+static void websocket_random_refill(void)
+{
+    static int fd = -1;
+    size_t n = 0;
+
+    if(fd < 0) {
+        fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    }
+
+    while((fd >= 0) && (n < sizeof(websocket_random_pool))) {
+        ssize_t ret = read(fd, websocket_random_pool + n, sizeof(websocket_random_pool) - n);
+        if(ret <= 0) {
+            break;
+        }
+        n += ret;
+    }
+
+    // Without /dev/urandom masks only need to be hard to guess for a proxy, not secret
+    for(; n < sizeof(websocket_random_pool); n++) {
+        websocket_random_pool[n] = rand();
+    }
+
+    websocket_random_index = 0;
+}
+
+void websocket_random(uint8_t *buf, size_t len)
+{
+    while(len > 0) {
+        if(websocket_random_index == sizeof(websocket_random_pool)) {
+            websocket_random_refill();
+        }
+
+        size_t n = sizeof(websocket_random_pool) - websocket_random_index;
+        if(n > len) {
+            n = len;
+        }
+
+        memcpy(buf, websocket_random_pool + websocket_random_index, n);
+        websocket_random_index += n;
+        buf += n;
+        len -= n;
+    }
+}
+#endif
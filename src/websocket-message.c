@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "http-sm/http.h"
+#include "http-sm/websocket.h"
+#include "http-private.h"
+#include "log.h"
+
+// Buffers of finished messages are kept for the next fragmented message, as long as they are not too large
+static struct websocket_message *websocket_message_pool;
+static int websocket_message_pool_count;
+
+static struct websocket_message *websocket_message_acquire(void)
+{
+    struct websocket_message *m = websocket_message_pool;
+
+    if(m) {
+        websocket_message_pool = m->next;
+        websocket_message_pool_count--;
+    } else {
+        m = calloc(1, sizeof(*m));
+        if(!m) {
+            return NULL;
+        }
+    }
+
+    m->length = 0;
+    m->next = NULL;
+
+    return m;
+}
+
+static void websocket_message_release(struct websocket_message *m)
+{
+    if(!m) {
+        return;
+    }
+
+    if((websocket_message_pool_count < WEBSOCKET_MESSAGE_POOL_SIZE) && (m->size <= WEBSOCKET_MESSAGE_POOL_MAX_LEN)) {
+        m->next = websocket_message_pool;
+        websocket_message_pool = m;
+        websocket_message_pool_count++;
+    } else {
+        free(m->data);
+        free(m);
+    }
+}
+
+static int websocket_message_append(struct websocket_message *m, const uint8_t *data, size_t len, size_t max_len)
+{
+    if(len > max_len - m->length) {
+        return -1;
+    }
+
+    if(m->length + len > m->size) {
+        size_t size = m->size ? 2 * m->size : 256;
+        if(size < m->length + len) {
+            size = m->length + len;
+        }
+        if(size > max_len) {
+            size = max_len;
+        }
+
+        uint8_t *p = realloc(m->data, size);
+        if(!p) {
+            return -2;
+        }
+        m->data = p;
+        m->size = size;
+    }
+
+    memcpy(m->data + m->length, data, len);
+    m->length += len;
+
+    return 0;
+}
+
+static void websocket_message_fail(struct websocket_connection *conn, uint16_t code)
+{
+    uint8_t status[] = { code >> 8, code & 0xFF };
+    websocket_close(conn, status, sizeof(status));
+}
+
+static void websocket_message_deliver(struct websocket_connection *conn, const uint8_t *data, size_t len, uint8_t opcode)
+{
+    if((opcode == WEBSOCKET_FRAME_OPCODE_TEXT) && !websocket_utf8_valid(data, len)) {
+        LOG("WS: text message from %d is not valid UTF-8", conn->fd);
+        websocket_message_fail(conn, 1007);
+        return;
+    }
+
+    if(conn->handler->threaded) {
+        // A connection that sends faster than its messages are handled is told to try again later
+        int ret = websocket_worker_submit(conn, data, len, opcode);
+        if(ret < 0) {
+            websocket_message_fail(conn, (ret == -2) ? 1013 : 1011);
+        }
+    } else {
+        conn->handler->cb_message_full(conn, data, len, opcode);
+    }
+}
+
+// Handle a data frame for a cb_message_full handler. The whole frame has to be in memory.
+void websocket_message_frame(struct websocket_connection *conn)
+{
+    uint8_t opcode = conn->frame_opcode & WEBSOCKET_FRAME_OPCODE;
+    int fin = (conn->frame_opcode & WEBSOCKET_FRAME_FIN) != 0;
+
+    // A continuation needs a message to continue, and a new message can not start inside another one
+    if((opcode == WEBSOCKET_FRAME_OPCODE_CONT) != (conn->message != NULL)) {
+        LOG("WS: unexpected %s frame from %d", (opcode == WEBSOCKET_FRAME_OPCODE_CONT) ? "continuation" : "data", conn->fd);
+        websocket_message_fail(conn, 1002);
+        return;
+    }
+
+    const uint8_t *data;
+    int len = websocket_frame_data(conn, &data);
+    if(len < 0) {
+        websocket_message_fail(conn, 1011);
+        return;
+    }
+
+    size_t max_len = conn->handler->max_message_len ? conn->handler->max_message_len : WEBSOCKET_MAX_MESSAGE_LEN;
+
+    // Unfragmented messages are handed over straight from the frame
+    if(!conn->message && fin) {
+        if(len > max_len) {
+            websocket_message_fail(conn, 1009);
+        } else {
+            websocket_message_deliver(conn, data, len, opcode);
+        }
+        return;
+    }
+
+    if(!conn->message) {
+        conn->message = websocket_message_acquire();
+        if(!conn->message) {
+            websocket_message_fail(conn, 1011);
+            return;
+        }
+        conn->message->opcode = opcode;
+    }
+
+    int ret = websocket_message_append(conn->message, data, len, max_len);
+    if(ret < 0) {
+        if(ret == -1) {
+            LOG("WS: message from %d is longer than %d bytes", conn->fd, (int)max_len);
+        }
+        websocket_message_fail(conn, (ret == -1) ? 1009 : 1011);
+        return;
+    }
+
+    if(fin) {
+        // Detached first, so the handler may close the connection
+        struct websocket_message *m = conn->message;
+        conn->message = NULL;
+
+        websocket_message_deliver(conn, m->data, m->length, m->opcode);
+        websocket_message_release(m);
+    }
+}
+
+void websocket_message_free(struct websocket_connection *conn)
+{
+    websocket_message_release(conn->message);
+    conn->message = NULL;
+}
@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "http-private.h"
+
+#ifdef __XTENSA__
+typedef uint32_t websocket_utf8_word;
+#define WEBSOCKET_UTF8_HIGH_BITS 0x80808080UL
+#else
+typedef uint64_t websocket_utf8_word;
+#define WEBSOCKET_UTF8_HIGH_BITS 0x8080808080808080ULL
+#endif
+
+// Length of the run of ASCII bytes at the start of buf
+static size_t websocket_utf8_ascii_prefix(const uint8_t *buf, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for(; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        if(_mm256_movemask_epi8(v)) {
+            break;
+        }
+    }
+#endif
+
+#if defined(__SSE2__)
+    for(; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        if(_mm_movemask_epi8(v)) {
+            break;
+        }
+    }
+#endif
+
+    for(; i + sizeof(websocket_utf8_word) <= len; i += sizeof(websocket_utf8_word)) {
+        websocket_utf8_word w;
+        memcpy(&w, buf + i, sizeof(w));
+        if(w & WEBSOCKET_UTF8_HIGH_BITS) {
+            break;
+        }
+    }
+
+    while((i < len) && (buf[i] < 0x80)) {
+        i++;
+    }
+
+    return i;
+}
+
+// Check that buf is well formed UTF-8 as in RFC 3629: no overlong forms, surrogates or
+// code points above U+10FFFF. Returns 1 if it is.
+int websocket_utf8_valid(const uint8_t *buf, size_t len)
+{
+    size_t i = 0;
+
+    while(i < len) {
+        i += websocket_utf8_ascii_prefix(buf + i, len - i);
+        if(i == len) {
+            break;
+        }
+
+        uint8_t c = buf[i];
+        int n;
+        uint8_t lo = 0x80;
+        uint8_t hi = 0xBF;
+
+        if((c >= 0xC2) && (c <= 0xDF)) {
+            n = 1;
+        } else if((c >= 0xE0) && (c <= 0xEF)) {
+            n = 2;
+            if(c == 0xE0) {
+                lo = 0xA0;
+            } else if(c == 0xED) {
+                hi = 0x9F;
+            }
+        } else if((c >= 0xF0) && (c <= 0xF4)) {
+            n = 3;
+            if(c == 0xF0) {
+                lo = 0x90;
+            } else if(c == 0xF4) {
+                hi = 0x8F;
+            }
+        } else {
+            return 0;
+        }
+
+        if(len - i <= n) {
+            return 0;
+        }
+
+        // Only the first continuation byte has a narrower range
+        if((buf[i + 1] < lo) || (buf[i + 1] > hi)) {
+            return 0;
+        }
+        for(int k = 2; k <= n; k++) {
+            if((buf[i + k] & 0xC0) != 0x80) {
+                return 0;
+            }
+        }
+
+        i += n + 1;
+    }
+
+    return 1;
+}
@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "http-sm/http.h"
+#include "http-sm/websocket.h"
+#include "http-private.h"
+#include "log.h"
+
+#if WEBSOCKET_WORKER_THREADS > 0
+
+#include <pthread.h>
+
+// A message from a threaded handler, or the note that a job is finished
+struct websocket_reply {
+    struct websocket_reply *next;
+    struct websocket_connection *conn;
+    const uint8_t *data;
+    size_t length;
+    uint8_t opcode;
+    uint8_t done;
+};
+
+struct websocket_job {
+    // Handed back to the server loop when the handler returns, so finishing a job can not fail
+    struct websocket_reply done;
+    struct websocket_job *next;
+    size_t length;
+    uint8_t opcode;
+    uint8_t data[];
+};
+
+struct websocket_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct websocket_job *head;
+    struct websocket_job **tail;
+};
+
+static struct websocket_worker websocket_workers[WEBSOCKET_WORKER_THREADS];
+static int websocket_workers_started;
+
+// Pushed to from the workers, drained by the server loop
+static struct websocket_reply *websocket_replies;
+
+static void websocket_reply_push(struct websocket_reply *reply)
+{
+    reply->next = __atomic_load_n(&websocket_replies, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&websocket_replies, &reply->next, reply, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+
+    websocket_channel_wake();
+}
+
+static void *websocket_worker_run(void *arg)
+{
+    struct websocket_worker *worker = arg;
+
+    for(;;) {
+        pthread_mutex_lock(&worker->lock);
+        while(!worker->head) {
+            pthread_cond_wait(&worker->cond, &worker->lock);
+        }
+
+        struct websocket_job *job = worker->head;
+        worker->head = job->next;
+        if(!worker->head) {
+            worker->tail = &worker->head;
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        struct websocket_connection *conn = job->done.conn;
+        conn->handler->cb_message_full(conn, job->data, job->length, job->opcode);
+
+        job->done.done = 1;
+        websocket_reply_push(&job->done);
+    }
+
+    return NULL;
+}
+
+static int websocket_worker_start(void)
+{
+    for(int i = 0; i < WEBSOCKET_WORKER_THREADS; i++) {
+        struct websocket_worker *worker = &websocket_workers[i];
+
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+        worker->head = NULL;
+        worker->tail = &worker->head;
+
+        if(pthread_create(&worker->thread, NULL, websocket_worker_run, worker) != 0) {
+            ERROR("pthread_create");
+            return -1;
+        }
+        pthread_detach(worker->thread);
+        websocket_workers_started++;
+    }
+
+    return 0;
+}
+
+// Hand a message to the worker that owns the connection. Returns -2 if the connection has too many waiting.
+int websocket_worker_submit(struct websocket_connection *conn, const uint8_t *data, size_t len, uint8_t opcode)
+{
+    // Started on first use, and a pool that only partly started is used as it is
+    if(!websocket_workers_started) {
+        websocket_worker_start();
+        if(!websocket_workers_started) {
+            return -1;
+        }
+    }
+
+    if(conn->jobs >= WEBSOCKET_WORKER_MAX_JOBS) {
+        LOG("WS: %d has %d messages waiting for a worker", conn->fd, conn->jobs);
+        return -2;
+    }
+
+    struct websocket_job *job = malloc(sizeof(*job) + len);
+    if(!job) {
+        return -1;
+    }
+
+    job->done.conn = conn;
+    job->done.data = NULL;
+    job->done.length = 0;
+    job->done.opcode = 0;
+    job->done.done = 0;
+    job->next = NULL;
+    job->length = len;
+    job->opcode = opcode;
+    memcpy(job->data, data, len);
+
+    // Always the same worker for a connection, which keeps its messages in order
+    struct websocket_worker *worker = &websocket_workers[((uintptr_t)conn / sizeof(*conn)) % websocket_workers_started];
+
+    pthread_mutex_lock(&worker->lock);
+    *worker->tail = job;
+    worker->tail = &job->next;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+
+    conn->jobs++;
+
+    return 0;
+}
+
+int websocket_reply(struct websocket_connection *conn, const void *buf, size_t count, enum websocket_frame_opcode opcode)
+{
+    struct websocket_reply *reply = malloc(sizeof(*reply) + count);
+    if(!reply) {
+        return -1;
+    }
+
+    reply->conn = conn;
+    reply->data = (const uint8_t *)(reply + 1);
+    reply->length = count;
+    reply->opcode = opcode;
+    reply->done = 0;
+    memcpy(reply + 1, buf, count);
+
+    websocket_reply_push(reply);
+
+    return count;
+}
+
+// Send the replies from the workers. Connections that were closed while a worker had them are freed once it is done.
+void websocket_worker_dispatch(struct http_server *server)
+{
+    struct websocket_reply *reply = __atomic_exchange_n(&websocket_replies, NULL, __ATOMIC_ACQUIRE);
+
+    // The list is LIFO, so reverse it to keep the order of each worker's replies
+    struct websocket_reply *list = NULL;
+    while(reply) {
+        struct websocket_reply *next = reply->next;
+        reply->next = list;
+        list = reply;
+        reply = next;
+    }
+
+    while(list) {
+        struct websocket_reply *next = list->next;
+        struct websocket_connection *conn = list->conn;
+
+        if(list->done) {
+            conn->jobs--;
+            if((conn->fd < 0) && !conn->jobs) {
+                websocket_mark_dirty(conn);
+            }
+        } else if(conn->fd >= 0) {
+            websocket_send(conn, list->data, list->length, list->opcode);
+        }
+
+        free(list);
+        list = next;
+    }
+}
+
+#else
+
+// Without threads the handler runs right away, and replies are sent as they are made
+int websocket_worker_submit(struct websocket_connection *conn, const uint8_t *data, size_t len, uint8_t opcode)
+{
+    conn->handler->cb_message_full(conn, data, len, opcode);
+    return 0;
+}
+
+int websocket_reply(struct websocket_connection *conn, const void *buf, size_t count, enum websocket_frame_opcode opcode)
+{
+    return websocket_send(conn, buf, count, opcode);
+}
+
+void websocket_worker_dispatch(struct http_server *server)
+{
+}
+
+#endif
@@ -456,6 +456,60 @@ describe('HTTP server', () => {
             expect(headers).to.include('ETag: "76cfb6cad8170c70f014da2b201652911a4cff4d"');
         });
 
+        it('sends a Last-Modified header', async () => {
+            await socket.write(''
+                + 'GET /no-etag.txt HTTP/1.1\r\n'
+                + `Host: ${host}:${port}\r\n`
+                + '\r\n');
+
+            const statusLine = await readLine(socket);
+            const headers = await readHeaders(socket);
+
+            expect(server.isRunning).to.be.true;
+            expect(statusLine).to.equal('HTTP/1.1 200 OK');
+            expect(headers.join(' ')).to.match(/Last-Modified: \w{3}, \d{2} \w{3} \d{4} \d{2}:\d{2}:\d{2} GMT/);
+        });
+
+        it('it returns 304 when If-Modified-Since is not older than the file', async () => {
+            await socket.write(''
+                + 'GET /no-etag.txt HTTP/1.1\r\n'
+                + `Host: ${host}:${port}\r\n`
+                + 'If-Modified-Since: Fri, 01 Jan 2100 00:00:00 GMT\r\n'
+                + '\r\n');
+
+            const statusLine = await readLine(socket);
+
+            expect(server.isRunning).to.be.true;
+            expect(statusLine).to.equal('HTTP/1.1 304 Not Modified');
+        });
+
+        it('it transfers the file when If-Modified-Since is older than the file', async () => {
+            await socket.write(''
+                + 'GET /no-etag.txt HTTP/1.1\r\n'
+                + `Host: ${host}:${port}\r\n`
+                + 'If-Modified-Since: Thu, 01 Jan 1970 00:00:01 GMT\r\n'
+                + '\r\n');
+
+            const statusLine = await readLine(socket);
+
+            expect(server.isRunning).to.be.true;
+            expect(statusLine).to.equal('HTTP/1.1 200 OK');
+        });
+
+        it('it ignores If-Modified-Since when If-None-Match does not match', async () => {
+            await socket.write(''
+                + 'GET /simple.txt HTTP/1.1\r\n'
+                + `Host: ${host}:${port}\r\n`
+                + 'If-None-Match: "XYZ"\r\n'
+                + 'If-Modified-Since: Fri, 01 Jan 2100 00:00:00 GMT\r\n'
+                + '\r\n');
+
+            const statusLine = await readLine(socket);
+
+            expect(server.isRunning).to.be.true;
+            expect(statusLine).to.equal('HTTP/1.1 200 OK');
+        });
+
         it('it returns no ETag if there is no hash', async () => {
             await socket.write(''
                 + 'GET /no-etag.txt HTTP/1.1\r\n'
@@ -471,6 +525,63 @@ describe('HTTP server', () => {
             expect(headers.join(' ')).to.not.include('ETag');
         });
 
+        it('sends Cache-Control: no-cache by default', async () => {
+            await socket.write(''
+                + 'GET /simple.txt HTTP/1.1\r\n'
+                + `Host: ${host}:${port}\r\n`
+                + '\r\n');
+
+            const statusLine = await readLine(socket);
+            const headers = await readHeaders(socket);
+
+            expect(server.isRunning).to.be.true;
+            expect(statusLine).to.equal('HTTP/1.1 200 OK');
+            expect(headers).to.include('Cache-Control: no-cache');
+        });
+
+        it('sends the Cache-Control header from the cache policy table', async () => {
+            await socket.write(''
+                + 'GET /app.min.js HTTP/1.1\r\n'
+                + `Host: ${host}:${port}\r\n`
+                + '\r\n');
+
+            const statusLine = await readLine(socket);
+            const headers = await readHeaders(socket);
+
+            expect(server.isRunning).to.be.true;
+            expect(statusLine).to.equal('HTTP/1.1 200 OK');
+            expect(headers).to.include('Cache-Control: public, max-age=31536000, immutable');
+        });
+
+        it('sends a private Cache-Control header from the cache policy table', async () => {
+            await socket.write(''
+                + 'GET /private/private.txt HTTP/1.1\r\n'
+                + `Host: ${host}:${port}\r\n`
+                + '\r\n');
+
+            const statusLine = await readLine(socket);
+            const headers = await readHeaders(socket);
+
+            expect(server.isRunning).to.be.true;
+            expect(statusLine).to.equal('HTTP/1.1 200 OK');
+            expect(headers).to.include('Cache-Control: private, max-age=60');
+        });
+
+        it('sends the Cache-Control header from the cache policy table with 304', async () => {
+            await socket.write(''
+                + 'GET /app.min.js HTTP/1.1\r\n'
+                + `Host: ${host}:${port}\r\n`
+                + 'If-Modified-Since: Fri, 01 Jan 2100 00:00:00 GMT\r\n'
+                + '\r\n');
+
+            const statusLine = await readLine(socket);
+            const headers = await readHeaders(socket);
+
+            expect(server.isRunning).to.be.true;
+            expect(statusLine).to.equal('HTTP/1.1 304 Not Modified');
+            expect(headers).to.include('Cache-Control: public, max-age=31536000, immutable');
+        });
+
         it('performs websocket handshake without key', async () => {
             await socket.write(''
                 + 'GET /ws-echo HTTP/1.1\r\n'
@@ -595,6 +706,43 @@ describe('HTTP server', () => {
             expect(server.isRunning).to.be.true;
             expect(array).to.deep.equal(message);
         });
+
+        it('can publish one message to several websockets', async () => {
+            const outSocket1 = createSocket();
+            const outSocket2 = createSocket();
+            await outSocket1.connect({ host, port });
+            await outSocket2.connect({ host, port });
+
+            await connectWebsocket(socket, '/ws-in');
+            await connectWebsocket(outSocket1, '/ws-out');
+            await connectWebsocket(outSocket2, '/ws-out');
+
+            const message = [0x81, 0x02, 0x68, 0x69];
+
+            await socket.write(Buffer.from(message));
+
+            const array1 = Array.from(await outSocket1.read(message.length));
+            const array2 = Array.from(await outSocket2.read(message.length));
+
+            expect(server.isRunning).to.be.true;
+            expect(array1).to.deep.equal(message);
+            expect(array2).to.deep.equal(message);
+        });
+
+        it('can stream a fragmented message', async () => {
+            await connectWebsocket(socket, '/ws-stream');
+
+            await socket.write(Buffer.from([0x81, 0x02, 0x33, 0x30]));
+
+            // An empty first frame, one continuation frame and a final frame
+            const response = await socket.read(2 + 2 + 118 + 2 + 112);
+
+            expect(server.isRunning).to.be.true;
+            expect(Array.from(response.slice(0, 2))).to.deep.equal([0x01, 0x00]);
+            expect(Array.from(response.slice(2, 4))).to.deep.equal([0x00, 118]);
+            expect(Array.from(response.slice(122, 124))).to.deep.equal([0x80, 112]);
+            expect(response.slice(124).toString()).to.match(/line 29\n$/);
+        });
     });
 
 
@@ -0,0 +1 @@
+console.log("This is a minified file");
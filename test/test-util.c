@@ -9,6 +9,7 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <signal.h>
 
 #include "test-util.h"
@@ -327,12 +328,16 @@ void *__real_malloc(size_t size);
 void __real_free(void *ptr);
 ssize_t __real_read(int fd, void *buf, size_t count);
 ssize_t __real_write(int fd, const void *buf, size_t count);
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t __real_sendmsg(int fd, const struct msghdr *msg, int flags);
 
 
 void *__wrap_malloc(size_t size) __attribute__((weak));
 void __wrap_free(void *ptr) __attribute__((weak));
 ssize_t __wrap_read(int fd, void *buf, size_t count) __attribute__((weak));
 ssize_t __wrap_write(int fd, const void *buf, size_t count) __attribute__((weak));
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt) __attribute__((weak));
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags) __attribute__((weak));
 
 void *__wrap_malloc(size_t size)
 {
@@ -353,3 +358,22 @@ ssize_t __wrap_write(int fd, const void *buf, size_t count)
 {
     return __real_write(fd, buf, count);
 }
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    return __real_writev(fd, iov, iovcnt);
+}
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+    return __real_sendmsg(fd, msg, flags);
+}
+
+// Default stubs of the server loop ////////////////////////////////////////////
+
+void websocket_channel_wake(void) __attribute__((weak));
+
+// Tests without the server loop have nothing to wake up, they look at their requests again by themselves
+void websocket_channel_wake(void)
+{
+}
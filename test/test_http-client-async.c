@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <cmocka.h>
+
+#include "http-sm/http.h"
+#include "http-private.h"
+
+#include "test-util.h"
+
+// Mocks ///////////////////////////////////////////////////////////////////////
+
+static int resolve(const char *host, int port, struct http_address *addrs, int max)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)&addrs[0].addr;
+
+    memset(&addrs[0], 0, sizeof(addrs[0]));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addrs[0].length = sizeof(*sin);
+
+    return 1;
+}
+
+// An address whose accept queue is full, so connecting to it waits for an answer that does not come,
+// before the one of the test server
+static struct sockaddr_in silent_addr;
+
+static int resolve_silent_first(const char *host, int port, struct http_address *addrs, int max)
+{
+    memset(&addrs[0], 0, sizeof(addrs[0]));
+    memcpy(&addrs[0].addr, &silent_addr, sizeof(silent_addr));
+    addrs[0].length = sizeof(silent_addr);
+
+    return 1 + resolve(host, port, addrs + 1, max - 1);
+}
+
+int websocket_channel_wake_fd(void)
+{
+    return -1;
+}
+
+// Helpers /////////////////////////////////////////////////////////////////////
+
+// A server on 127.0.0.1, answering every request on a connection with response
+static int listen_fd;
+static int listen_port;
+static int peer_fd[4];
+static const char *response;
+
+static int done_count;
+static int done_status[4];
+static char done_body[4][64];
+
+static void cb_done(struct http_async *async)
+{
+    int i = done_count++;
+
+    if(i < 4) {
+        done_status[i] = async->request.status;
+        snprintf(done_body[i], sizeof(done_body[i]), "%s", async->body ? async->body : "");
+    }
+}
+
+static void serve(void)
+{
+    fd_set set;
+    struct timeval t = { 0, 0 };
+
+    FD_ZERO(&set);
+    FD_SET(listen_fd, &set);
+
+    if(select(listen_fd + 1, &set, NULL, NULL, &t) > 0) {
+        for(int i = 0; i < 4; i++) {
+            if(peer_fd[i] <= 0) {
+                peer_fd[i] = accept(listen_fd, NULL, NULL);
+                break;
+            }
+        }
+    }
+
+    for(int i = 0; i < 4; i++) {
+        char buf[512];
+
+        if(peer_fd[i] <= 0) {
+            continue;
+        }
+
+        FD_ZERO(&set);
+        FD_SET(peer_fd[i], &set);
+
+        if((select(peer_fd[i] + 1, &set, NULL, NULL, &t) > 0) && (recv(peer_fd[i], buf, sizeof(buf), 0) > 0) && response) {
+            assert_int_equal(send(peer_fd[i], response, strlen(response), 0), strlen(response));
+        }
+    }
+}
+
+// Run the requests the way the server loop does, until the callbacks have been called count times
+static void run_until_done(int count)
+{
+    for(int n = 0; (n < 1000) && (done_count < count); n++) {
+        fd_set set_read, set_write;
+        int maxfd = 0;
+        struct timeval t = { 0, 1000 };
+
+        http_async_expire(http_clock());
+
+        FD_ZERO(&set_read);
+        FD_ZERO(&set_write);
+
+        http_async_create_select_sets(&set_read, &set_write, &maxfd);
+
+        if(select(maxfd + 1, &set_read, &set_write, NULL, &t) > 0) {
+            http_async_handle_select(&set_read, &set_write);
+        }
+
+        serve();
+        http_async_dispatch(NULL);
+    }
+
+    assert_true(done_count >= count);
+}
+
+static int setup(void **state)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert_true(listen_fd >= 0);
+    assert_int_equal(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    assert_int_equal(listen(listen_fd, 4), 0);
+    assert_int_equal(getsockname(listen_fd, (struct sockaddr *)&addr, &len), 0);
+    listen_port = ntohs(addr.sin_port);
+
+    http_set_resolver(resolve);
+    done_count = 0;
+    response = NULL;
+
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    http_client_pool_clear();
+    http_set_resolver(NULL);
+
+    for(int i = 0; i < 4; i++) {
+        if(peer_fd[i] > 0) {
+            close(peer_fd[i]);
+            peer_fd[i] = 0;
+        }
+    }
+
+    if(listen_fd > 0) {
+        close(listen_fd);
+        listen_fd = 0;
+    }
+
+    return 0;
+}
+
+// Tests ///////////////////////////////////////////////////////////////////////
+
+static void test__http_async_get__reads_response_with_content_length(void **states)
+{
+    response = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nHello";
+
+    assert_non_null(http_async_get(NULL, "localhost", listen_port, "/", cb_done, NULL));
+
+    run_until_done(1);
+    assert_int_equal(done_status[0], 200);
+    assert_string_equal(done_body[0], "Hello");
+}
+
+static void test__http_async_get__reads_chunked_response(void **states)
+{
+    response = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nHello\r\n7;ext=1\r\n, World\r\n0\r\nX-Trailer: 1\r\n\r\n";
+
+    assert_non_null(http_async_get(NULL, "localhost", listen_port, "/", cb_done, NULL));
+
+    run_until_done(1);
+    assert_int_equal(done_status[0], 200);
+    assert_string_equal(done_body[0], "Hello, World");
+}
+
+static void test__http_async_get__keeps_connection_for_the_next_request(void **states)
+{
+    response = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nOK";
+
+    assert_non_null(http_async_get(NULL, "localhost", listen_port, "/", cb_done, NULL));
+    run_until_done(1);
+
+    int fd = http_client_pool_take("localhost", listen_port);
+    assert_true(fd >= 0);
+    assert_int_equal(http_client_pool_put("localhost", listen_port, fd), 0);
+
+    assert_non_null(http_async_get(NULL, "localhost", listen_port, "/", cb_done, NULL));
+    run_until_done(2);
+    assert_int_equal(done_status[1], 200);
+
+    // The second request went over the first connection
+    assert_true(peer_fd[1] <= 0);
+}
+
+static void test__http_async_get__fails_if_the_connection_is_refused(void **states)
+{
+    close(listen_fd);
+    listen_fd = 0;
+
+    assert_non_null(http_async_get(NULL, "localhost", listen_port, "/", cb_done, NULL));
+
+    run_until_done(1);
+    assert_int_equal(done_status[0], 0);
+}
+
+static void test__http_async_get__starts_next_address_while_first_does_not_answer(void **states)
+{
+    socklen_t len = sizeof(silent_addr);
+
+    int silent_fd = socket(AF_INET, SOCK_STREAM, 0);
+    silent_addr = (struct sockaddr_in){ .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    assert_int_equal(bind(silent_fd, (struct sockaddr *)&silent_addr, sizeof(silent_addr)), 0);
+    assert_int_equal(listen(silent_fd, 0), 0);
+    assert_int_equal(getsockname(silent_fd, (struct sockaddr *)&silent_addr, &len), 0);
+
+    int queued_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert_int_equal(connect(queued_fd, (struct sockaddr *)&silent_addr, sizeof(silent_addr)), 0);
+
+    http_set_resolver(resolve_silent_first);
+    response = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nOK";
+
+    uint32_t start = http_clock_ms();
+    assert_non_null(http_async_get(NULL, "localhost", listen_port, "/", cb_done, NULL));
+
+    run_until_done(1);
+    assert_int_equal(done_status[0], 200);
+    assert_true((int)(http_clock_ms() - start) < HTTP_CLIENT_CONNECT_TIMEOUT_MS);
+
+    close(queued_fd);
+    close(silent_fd);
+}
+
+static void test__http_async_expire__fails_requests_that_take_too_long(void **states)
+{
+    assert_non_null(http_async_get(NULL, "localhost", listen_port, "/", cb_done, NULL));
+
+    http_async_expire(http_clock() + HTTP_CLIENT_ASYNC_TIMEOUT_SECS - 1);
+    http_async_dispatch(NULL);
+    assert_int_equal(done_count, 0);
+
+    http_async_expire(http_clock() + HTTP_CLIENT_ASYNC_TIMEOUT_SECS);
+    assert_int_equal(http_async_timer_next(http_clock()), 0);
+    http_async_dispatch(NULL);
+    assert_int_equal(done_count, 1);
+    assert_int_equal(done_status[0], 0);
+}
+
+static void test__http_async_dispatch__wakes_owner_when_all_its_requests_are_done(void **states)
+{
+    struct http_request owner = { .flags = HTTP_FLAG_WAIT };
+
+    response = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nOK";
+
+    assert_non_null(http_async_get(&owner, "localhost", listen_port, "/a", cb_done, NULL));
+    assert_non_null(http_async_get(&owner, "localhost", listen_port, "/b", cb_done, NULL));
+    assert_int_equal(http_async_pending(&owner), 2);
+
+    run_until_done(1);
+    if(http_async_pending(&owner)) {
+        assert_true(owner.flags & HTTP_FLAG_WAIT);
+    }
+
+    run_until_done(2);
+    assert_int_equal(http_async_pending(&owner), 0);
+    assert_false(owner.flags & HTTP_FLAG_WAIT);
+}
+
+static void test__http_async_get__returns_null_when_all_slots_are_taken(void **states)
+{
+    for(int i = 0; i < HTTP_CLIENT_ASYNC_MAX; i++) {
+        assert_non_null(http_async_get(NULL, "localhost", listen_port, "/", cb_done, NULL));
+    }
+
+    assert_null(http_async_get(NULL, "localhost", listen_port, "/", cb_done, NULL));
+
+    http_async_expire(http_clock() + HTTP_CLIENT_ASYNC_TIMEOUT_SECS);
+    http_async_dispatch(NULL);
+    assert_int_equal(done_count, HTTP_CLIENT_ASYNC_MAX);
+}
+
+// Main ////////////////////////////////////////////////////////////////////////
+
+const struct CMUnitTest tests_for_http_client_async[] = {
+    cmocka_unit_test_setup_teardown(test__http_async_get__reads_response_with_content_length, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_async_get__reads_chunked_response, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_async_get__keeps_connection_for_the_next_request, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_async_get__fails_if_the_connection_is_refused, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_async_get__starts_next_address_while_first_does_not_answer, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_async_expire__fails_requests_that_take_too_long, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_async_dispatch__wakes_owner_when_all_its_requests_are_done, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_async_get__returns_null_when_all_slots_are_taken, setup, teardown),
+};
+
+int main(void)
+{
+    int fails = 0;
+    fails += cmocka_run_group_tests(tests_for_http_client_async, NULL, NULL);
+
+    return fails;
+}
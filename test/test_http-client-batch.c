@@ -0,0 +1,402 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <cmocka.h>
+
+#include "http-sm/http.h"
+#include "http-private.h"
+
+#include "test-util.h"
+
+// Mocks ///////////////////////////////////////////////////////////////////////
+
+static int resolve(const char *host, int port, struct http_address *addrs, int max)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)&addrs[0].addr;
+
+    memset(&addrs[0], 0, sizeof(addrs[0]));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addrs[0].length = sizeof(*sin);
+
+    return 1;
+}
+
+int websocket_channel_wake_fd(void)
+{
+    return -1;
+}
+
+// Helpers /////////////////////////////////////////////////////////////////////
+
+// A server on 127.0.0.1 answering the n:th request it gets with responses[n]
+static int listen_fd;
+static int listen_port;
+static pthread_t server_thread;
+
+static const char **responses;
+// Close each connection after this many responses, unless it is 0
+static int close_after;
+// Wait for this many requests before answering the first one on a connection
+static int wait_for;
+
+static int connections;
+static int max_in_flight;
+static char received[2048];
+static int received_length;
+
+static int count_requests(const char *buf, int len)
+{
+    int n = 0;
+    for(int i = 3; i < len; i++) {
+        if(memcmp(buf + i - 3, "\r\n\r\n", 4) == 0) {
+            n++;
+        }
+    }
+    return n;
+}
+
+static void *serve(void *arg)
+{
+    static int served;
+    served = 0;
+
+    for(;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0) {
+            break;
+        }
+
+        connections++;
+
+        int start = received_length;
+        int answered = 0;
+
+        for(;;) {
+            int requests = count_requests(received + start, received_length - start);
+            int in_flight = requests - answered;
+
+            if(in_flight > max_in_flight) {
+                max_in_flight = in_flight;
+            }
+
+            if((in_flight > 0) && ((answered > 0) || (requests >= wait_for))) {
+                const char *response = responses[served++];
+                if(write(fd, response, strlen(response)) < 0) {
+                    break;
+                }
+                answered++;
+
+                if(close_after && (answered == close_after)) {
+                    break;
+                }
+                continue;
+            }
+
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+            if(poll(&pfd, 1, 1000) == 0) {
+                // Stop waiting for requests that do not come
+                wait_for = 0;
+                continue;
+            }
+
+            int n = read(fd, received + received_length, sizeof(received) - received_length - 1);
+            if(n <= 0) {
+                break;
+            }
+            received_length += n;
+        }
+
+        // Read what the client still sends, so closing does not reset the responses it has not read
+        char buf[256];
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        shutdown(fd, SHUT_WR);
+        while((poll(&pfd, 1, 1000) > 0) && (read(fd, buf, sizeof(buf)) > 0)) {
+        }
+
+        close(fd);
+    }
+
+    return NULL;
+}
+
+struct batch_result {
+    int status[8];
+    char body[8][64];
+};
+
+static void cb_status(int index, struct http_request *response, void *arg)
+{
+    struct batch_result *result = arg;
+    result->status[index] = response->status;
+}
+
+static void cb_body(int index, const char *data, int len, void *arg)
+{
+    struct batch_result *result = arg;
+    strncat(result->body[index], data, len);
+}
+
+static int setup(void **state)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert_true(listen_fd >= 0);
+    assert_int_equal(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    assert_int_equal(listen(listen_fd, 4), 0);
+    assert_int_equal(getsockname(listen_fd, (struct sockaddr *)&addr, &len), 0);
+    listen_port = ntohs(addr.sin_port);
+
+    http_set_resolver(resolve);
+
+    close_after = 0;
+    wait_for = 0;
+    connections = 0;
+    max_in_flight = 0;
+    received_length = 0;
+    memset(received, 0, sizeof(received));
+
+    return 0;
+}
+
+static void start_server(const char **r)
+{
+    responses = r;
+    assert_int_equal(pthread_create(&server_thread, NULL, serve, NULL), 0);
+}
+
+static int teardown(void **state)
+{
+    http_client_pool_clear();
+    http_set_resolver(NULL);
+
+    if(listen_fd > 0) {
+        // Wakes the server thread up from accept
+        shutdown(listen_fd, SHUT_RDWR);
+        if(responses) {
+            pthread_join(server_thread, NULL);
+        }
+        close(listen_fd);
+        listen_fd = 0;
+    }
+    responses = NULL;
+
+    return 0;
+}
+
+// Tests ///////////////////////////////////////////////////////////////////////
+
+static void test__http_batch__reports_responses_in_order(void **states)
+{
+    const char *r[] = {
+        "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\none",
+        "HTTP/1.1 404 Not Found\r\nTransfer-Encoding: chunked\r\n\r\n3\r\ntwo\r\n0\r\n\r\n",
+        "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nthree",
+    };
+    const struct http_batch_request requests[] = {
+        { .path = "/a" },
+        { .path = "/b", .query = "x=1" },
+        { .path = "/c" },
+    };
+    struct batch_result result = { };
+
+    start_server(r);
+
+    assert_int_equal(http_batch("localhost", listen_port, requests, 3, cb_status, cb_body, &result), 3);
+
+    assert_int_equal(result.status[0], 200);
+    assert_int_equal(result.status[1], 404);
+    assert_int_equal(result.status[2], 200);
+    assert_string_equal(result.body[0], "one");
+    assert_string_equal(result.body[1], "two");
+    assert_string_equal(result.body[2], "three");
+
+    assert_int_equal(connections, 1);
+    assert_string_prefix_equal("GET /a HTTP/1.1\r\n", received);
+    assert_string_contains_substring("GET /b?x=1 HTTP/1.1\r\n", received);
+    assert_string_contains_substring("GET /c HTTP/1.1\r\n", received);
+}
+
+static void test__http_batch__sends_requests_before_reading_responses(void **states)
+{
+    const char *r[] = {
+        "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n1",
+        "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n2",
+        "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n3",
+    };
+    const struct http_batch_request requests[] = {
+        { .path = "/" }, { .path = "/" }, { .path = "/" },
+    };
+    struct batch_result result = { };
+
+    wait_for = 3;
+    start_server(r);
+
+    assert_int_equal(http_batch("localhost", listen_port, requests, 3, cb_status, cb_body, &result), 3);
+    assert_int_equal(max_in_flight, HTTP_CLIENT_PIPELINE_DEPTH < 3 ? HTTP_CLIENT_PIPELINE_DEPTH : 3);
+}
+
+static void test__http_batch__sends_unanswered_requests_again_when_server_closes(void **states)
+{
+    const char *r[] = {
+        "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n1",
+        "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n2",
+        "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n3",
+        "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n4",
+    };
+    const struct http_batch_request requests[] = {
+        { .path = "/" }, { .path = "/" }, { .path = "/" }, { .path = "/" },
+    };
+    struct batch_result result = { };
+
+    close_after = 2;
+    start_server(r);
+
+    assert_int_equal(http_batch("localhost", listen_port, requests, 4, cb_status, cb_body, &result), 4);
+
+    for(int i = 0; i < 4; i++) {
+        char expected[2] = { '1' + i, 0 };
+        assert_int_equal(result.status[i], 200);
+        assert_string_equal(result.body[i], expected);
+    }
+    assert_int_equal(connections, 2);
+}
+
+static void test__http_batch__sends_post_body(void **states)
+{
+    const char *r[] = {
+        "HTTP/1.1 204 No Content\r\nContent-Length: 0\r\n\r\n",
+    };
+    const struct http_batch_request requests[] = {
+        { .path = "/post", .method = HTTP_METHOD_POST, .body = "hello", .body_length = 5 },
+    };
+    struct batch_result result = { };
+
+    start_server(r);
+
+    assert_int_equal(http_batch("localhost", listen_port, requests, 1, cb_status, cb_body, &result), 1);
+    assert_int_equal(result.status[0], 204);
+    assert_string_prefix_equal("POST /post HTTP/1.1\r\n", received);
+    assert_string_contains_substring("Content-Length: 5\r\n", received);
+    assert_string_contains_substring("\r\n\r\nhello", received);
+}
+
+static void test__http_batch__reads_the_response_to_a_post_before_sending_more(void **states)
+{
+    const char *r[] = {
+        "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n1",
+        "HTTP/1.1 204 No Content\r\nContent-Length: 0\r\n\r\n",
+        "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n3",
+    };
+    const struct http_batch_request requests[] = {
+        { .path = "/" },
+        { .path = "/post", .method = HTTP_METHOD_POST, .body = "x", .body_length = 1 },
+        { .path = "/" },
+    };
+    struct batch_result result = { };
+
+    wait_for = 3;
+    start_server(r);
+
+    assert_int_equal(http_batch("localhost", listen_port, requests, 3, cb_status, cb_body, &result), 3);
+    assert_int_equal(result.status[1], 204);
+    assert_int_equal(result.status[2], 200);
+    assert_int_equal(max_in_flight, 2);
+}
+
+static void test__http_batch__reports_an_unanswered_post_instead_of_sending_it_again(void **states)
+{
+    const char *r[] = {
+        "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n1",
+        "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n2",
+        "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n3",
+    };
+    const struct http_batch_request requests[] = {
+        { .path = "/" },
+        { .path = "/post", .method = HTTP_METHOD_POST, .body = "x", .body_length = 1 },
+        { .path = "/" },
+    };
+    struct batch_result result = { .status = { -1, -1, -1 } };
+
+    close_after = 1;
+    wait_for = 2;
+    start_server(r);
+
+    assert_int_equal(http_batch("localhost", listen_port, requests, 3, cb_status, cb_body, &result), 2);
+
+    assert_int_equal(result.status[0], 200);
+    assert_int_equal(result.status[1], 0);
+    assert_int_equal(result.status[2], 200);
+    assert_string_equal(result.body[2], "2");
+
+    const char *post = strstr(received, "POST /post");
+    assert_non_null(post);
+    assert_null(strstr(post + 1, "POST /post"));
+}
+
+static void test__http_batch__keeps_connection_for_the_next_batch(void **states)
+{
+    const char *r[] = {
+        "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\n1",
+    };
+    const struct http_batch_request requests[] = {
+        { .path = "/" },
+    };
+    struct batch_result result = { };
+
+    start_server(r);
+
+    assert_int_equal(http_batch("localhost", listen_port, requests, 1, cb_status, cb_body, &result), 1);
+
+    int fd = http_client_pool_take("localhost", listen_port);
+    assert_true(fd >= 0);
+    close(fd);
+}
+
+static void test__http_batch__reports_status_zero_if_it_can_not_connect(void **states)
+{
+    const struct http_batch_request requests[] = {
+        { .path = "/" }, { .path = "/" },
+    };
+    struct batch_result result = { .status = { -1, -1 } };
+
+    close(listen_fd);
+    listen_fd = 0;
+
+    assert_int_equal(http_batch("localhost", listen_port, requests, 2, cb_status, cb_body, &result), 0);
+    assert_int_equal(result.status[0], 0);
+    assert_int_equal(result.status[1], 0);
+}
+
+// Main ////////////////////////////////////////////////////////////////////////
+
+const struct CMUnitTest tests_for_http_client_batch[] = {
+    cmocka_unit_test_setup_teardown(test__http_batch__reports_responses_in_order, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_batch__sends_requests_before_reading_responses, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_batch__sends_unanswered_requests_again_when_server_closes, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_batch__sends_post_body, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_batch__reads_the_response_to_a_post_before_sending_more, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_batch__reports_an_unanswered_post_instead_of_sending_it_again, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_batch__keeps_connection_for_the_next_batch, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_batch__reports_status_zero_if_it_can_not_connect, setup, teardown),
+};
+
+int main(void)
+{
+    int fails = 0;
+    fails += cmocka_run_group_tests(tests_for_http_client_batch, NULL, NULL);
+
+    return fails;
+}
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include <cmocka.h>
+
+#include "http-sm/http.h"
+#include "http-private.h"
+
+#include "test-util.h"
+
+// Helpers /////////////////////////////////////////////////////////////////////
+
+static int peer_fd[HTTP_CLIENT_POOL_SIZE + 1];
+
+// A connected socket, whose other end stays open like an idle server would
+static int open_conn(int i)
+{
+    int fds[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    peer_fd[i] = fds[1];
+    return fds[0];
+}
+
+static int is_open(int fd)
+{
+    return fcntl(fd, F_GETFD) >= 0;
+}
+
+static int teardown(void **state)
+{
+    http_client_pool_clear();
+
+    for(int i = 0; i < sizeof(peer_fd) / sizeof(peer_fd[0]); i++) {
+        if(peer_fd[i] > 0) {
+            close(peer_fd[i]);
+            peer_fd[i] = 0;
+        }
+    }
+
+    return 0;
+}
+
+// Tests ///////////////////////////////////////////////////////////////////////
+
+static void test__http_client_pool__returns_connection_to_the_same_host_and_port(void **states)
+{
+    int fd = open_conn(0);
+
+    assert_int_equal(http_client_pool_put("www.example.com", 80, fd), 0);
+
+    assert_int_equal(http_client_pool_take("www.example.com", 8080), -1);
+    assert_int_equal(http_client_pool_take("example.com", 80), -1);
+    assert_int_equal(http_client_pool_take("www.example.com", 80), fd);
+    assert_int_equal(http_client_pool_take("www.example.com", 80), -1);
+
+    close(fd);
+}
+
+static void test__http_client_pool__keeps_at_most_per_host_limit(void **states)
+{
+    int fds[HTTP_CLIENT_POOL_PER_HOST + 1];
+
+    for(int i = 0; i < HTTP_CLIENT_POOL_PER_HOST; i++) {
+        fds[i] = open_conn(i);
+        assert_int_equal(http_client_pool_put("www.example.com", 80, fds[i]), 0);
+    }
+
+    fds[HTTP_CLIENT_POOL_PER_HOST] = open_conn(HTTP_CLIENT_POOL_PER_HOST);
+    assert_int_equal(http_client_pool_put("www.example.com", 80, fds[HTTP_CLIENT_POOL_PER_HOST]), -1);
+    close(fds[HTTP_CLIENT_POOL_PER_HOST]);
+
+    // Other hosts are not affected
+    int other = open_conn(HTTP_CLIENT_POOL_PER_HOST + 1);
+    assert_int_equal(http_client_pool_put("www.example.org", 80, other), 0);
+}
+
+static void test__http_client_pool__closes_the_oldest_connection_when_full(void **states)
+{
+    int fds[HTTP_CLIENT_POOL_SIZE + 1];
+    char host[32];
+
+    for(int i = 0; i < HTTP_CLIENT_POOL_SIZE + 1; i++) {
+        snprintf(host, sizeof(host), "host%d", i);
+        fds[i] = open_conn(i);
+        assert_int_equal(http_client_pool_put(host, 80, fds[i]), 0);
+    }
+
+    assert_false(is_open(fds[0]));
+    assert_int_equal(http_client_pool_take("host0", 80), -1);
+    assert_int_equal(http_client_pool_take("host1", 80), fds[1]);
+
+    close(fds[1]);
+}
+
+static void test__http_client_pool__closes_idle_connections(void **states)
+{
+    int fd = open_conn(0);
+
+    assert_int_equal(http_client_pool_put("www.example.com", 80, fd), 0);
+
+    http_client_pool_evict(http_clock() + HTTP_CLIENT_POOL_IDLE_SECS - 1);
+    assert_true(is_open(fd));
+
+    http_client_pool_evict(http_clock() + HTTP_CLIENT_POOL_IDLE_SECS);
+    assert_false(is_open(fd));
+    assert_int_equal(http_client_pool_take("www.example.com", 80), -1);
+}
+
+static void test__http_client_pool__drops_connection_closed_by_server(void **states)
+{
+    int fd = open_conn(0);
+
+    assert_int_equal(http_client_pool_put("www.example.com", 80, fd), 0);
+
+    close(peer_fd[0]);
+    peer_fd[0] = 0;
+
+    assert_int_equal(http_client_pool_take("www.example.com", 80), -1);
+    assert_false(is_open(fd));
+}
+
+static void test__http_client_pool__drops_connection_with_unexpected_data(void **states)
+{
+    int fd = open_conn(0);
+
+    assert_int_equal(http_client_pool_put("www.example.com", 80, fd), 0);
+    assert_int_equal(write(peer_fd[0], "x", 1), 1);
+
+    assert_int_equal(http_client_pool_take("www.example.com", 80), -1);
+    assert_false(is_open(fd));
+}
+
+// Main ////////////////////////////////////////////////////////////////////////
+
+const struct CMUnitTest tests_for_http_client_pool[] = {
+    cmocka_unit_test_setup_teardown(test__http_client_pool__returns_connection_to_the_same_host_and_port, NULL, teardown),
+    cmocka_unit_test_setup_teardown(test__http_client_pool__keeps_at_most_per_host_limit, NULL, teardown),
+    cmocka_unit_test_setup_teardown(test__http_client_pool__closes_the_oldest_connection_when_full, NULL, teardown),
+    cmocka_unit_test_setup_teardown(test__http_client_pool__closes_idle_connections, NULL, teardown),
+    cmocka_unit_test_setup_teardown(test__http_client_pool__drops_connection_closed_by_server, NULL, teardown),
+    cmocka_unit_test_setup_teardown(test__http_client_pool__drops_connection_with_unexpected_data, NULL, teardown),
+};
+
+int main(void)
+{
+    int fails = 0;
+    fails += cmocka_run_group_tests(tests_for_http_client_pool, NULL, NULL);
+
+    return fails;
+}
@@ -6,10 +6,12 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 
 #include <cmocka.h>
 
 #include "http-sm/http.h"
+#include "http-private.h"
 
 #include "test-util.h"
 
@@ -17,18 +19,37 @@
 
 static int enable_malloc_mock = 0;
 
+// The fd a successful http_open_request_socket hands out, if any
+static int request_socket_fd = -1;
+
 int http_open_request_socket(struct http_request *request)
 {
     check_expected(request);
+    if(request_socket_fd >= 0) {
+        request->fd = request_socket_fd;
+    }
     return mock();
 }
 
+// What the server answers once the request is sent, for tests that talk to a socket
+static int reply_fd = -1;
+static const char *reply_data;
+
 int http_begin_request(struct http_request *request)
 {
     check_expected(request);
+    if(reply_fd >= 0) {
+        assert_int_equal(write(reply_fd, reply_data, strlen(reply_data)), strlen(reply_data));
+    }
     return mock();
 }
 
+void http_write_header(struct http_request *request, const char *name, const char *value)
+{
+    check_expected(name);
+    check_expected(value);
+}
+
 void http_end_header(struct http_request *request)
 {
     check_expected(request);
@@ -37,9 +58,29 @@ void http_end_header(struct http_request *request)
 int http_close(struct http_request *request)
 {
     check_expected(request);
+    free(request->recv_buf);
+    request->recv_buf = 0;
     return mock();
 }
 
+int http_write_all(int fd, const char *str, int len)
+{
+    return write(fd, str, len);
+}
+
+int http_write_bytes(struct http_request *request, const char *data, int len)
+{
+    return write(request->fd, data, len);
+}
+
+int http_end_body(struct http_request *request)
+{
+    check_expected(request);
+    free(request->line);
+    request->line = 0;
+    return 0;
+}
+
 void *__real_malloc(size_t size);
 
 void *__wrap_malloc(size_t size)
@@ -78,6 +119,9 @@ static void test__http_get_request__parses_http_headers(void **states)
     expect_any(http_begin_request, request);
     will_return(http_begin_request, 1);
 
+    expect_string(http_write_header, name, "Connection");
+    expect_string(http_write_header, value, "keep-alive");
+
     expect_any(http_end_header, request);
 
     int ret = http_get_request(&request);
@@ -95,6 +139,138 @@ static void test__http_get_request__parses_http_headers(void **states)
     assert_int_equal(0, n);
 
     free(request.content_type);
+    free(request.recv_buf);
+
+    close(fd);
+}
+
+static void test__http_get_request__keeps_all_response_headers(void **states)
+{
+    const char *reply =
+        "HTTP/1.1 301 Moved Permanently\r\n"
+        "Location: http://www.example.org/\r\n"
+        "ETag:  \"33a64df5\" \r\n"
+        "cache-control: max-age=3600\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n";
+
+    int fd = write_tmp_file(reply);
+
+    struct http_request request = {
+        .host = "www.example.com",
+        .path = "/",
+
+        .fd = fd,
+    };
+
+    expect_any(http_open_request_socket, request);
+    will_return(http_open_request_socket, 1);
+
+    expect_any(http_begin_request, request);
+    will_return(http_begin_request, 1);
+
+    expect_string(http_write_header, name, "Connection");
+    expect_string(http_write_header, value, "keep-alive");
+
+    expect_any(http_end_header, request);
+
+    int ret = http_get_request(&request);
+    assert_true(ret > 0);
+    assert_int_equal(301, request.status);
+
+    assert_string_equal("http://www.example.org/", http_get_header(&request, "Location"));
+    assert_string_equal("\"33a64df5\"", http_get_header(&request, "etag"));
+    assert_string_equal("max-age=3600", http_get_header(&request, "Cache-Control"));
+    assert_null(http_get_header(&request, "Content-Type"));
+
+    const struct http_header *headers;
+    assert_int_equal(4, http_get_headers(&request, &headers));
+    assert_string_equal("Location", headers[0].name);
+    assert_string_equal("Content-Length", headers[3].name);
+    assert_string_equal("0", headers[3].value);
+
+    free(request.recv_buf);
+
+    close(fd);
+}
+
+static void test__http_get_request__returns_minus_one_if_header_is_too_long(void **states)
+{
+    static char reply[HTTP_CLIENT_HEAD_LEN + 64];
+
+    strcpy(reply, "HTTP/1.1 200 OK\r\nX-Padding: ");
+    memset(reply + strlen(reply), 'x', HTTP_CLIENT_HEAD_LEN);
+    strcat(reply, "\r\n\r\n");
+
+    int fd = write_tmp_file(reply);
+
+    struct http_request request = {
+        .host = "www.example.com",
+        .path = "/",
+
+        .fd = fd,
+    };
+
+    expect_any(http_open_request_socket, request);
+    will_return(http_open_request_socket, 1);
+
+    expect_any(http_begin_request, request);
+    will_return(http_begin_request, 1);
+
+    expect_string(http_write_header, name, "Connection");
+    expect_string(http_write_header, value, "keep-alive");
+
+    expect_any(http_end_header, request);
+
+    expect_any(http_close, request);
+    will_return(http_close, 0);
+
+    int ret = http_get_request(&request);
+
+    assert_int_equal(-1, ret);
+    assert_int_equal(HTTP_STATE_CLIENT_ERROR, request.state);
+    assert_null(request.recv_buf);
+
+    close(fd);
+}
+
+static void test__http_read_response_header__leaves_the_next_response_in_the_buffer(void **states)
+{
+    const char *reply =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Length: 5\r\n"
+        "\r\n"
+        "hello"
+        "HTTP/1.1 404 Not Found\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n";
+
+    int fd = write_tmp_file(reply);
+
+    struct http_request request = {
+        .fd = fd,
+        .state = HTTP_STATE_CLIENT_IDLE,
+    };
+
+    assert_int_equal(0, http_read_response_header(&request));
+    assert_int_equal(200, request.status);
+    assert_int_equal(HTTP_STATE_CLIENT_IDLE, request.state);
+
+    // The whole reply came in one read, the body and the next response wait in the buffer
+    struct http_recv_buffer *b = request.recv_buf;
+    assert_int_equal(strlen(reply), b->length);
+    assert_memory_equal("hello", b->data + b->index, 5);
+
+    b->index += 5;
+    request.read_content_length = -1;
+
+    assert_int_equal(0, http_read_response_header(&request));
+    assert_int_equal(404, request.status);
+    assert_int_equal(0, request.read_content_length);
+    assert_string_equal("0", http_get_header(&request, "Content-Length"));
+    assert_int_equal(b->index, b->length);
+
+    free(request.recv_buf);
 
     close(fd);
 }
@@ -189,6 +365,9 @@ static void test__http_get_request__returns_minus_one_if_header_is_incomplete(vo
     expect_any(http_begin_request, request);
     will_return(http_begin_request, 1);
 
+    expect_string(http_write_header, name, "Connection");
+    expect_string(http_write_header, value, "keep-alive");
+
     expect_any(http_end_header, request);
 
     expect_any(http_close, request);
@@ -227,6 +406,9 @@ static void test__http_get_request__returns_minus_one_if_header_does_not_parse_c
     expect_any(http_begin_request, request);
     will_return(http_begin_request, 1);
 
+    expect_string(http_write_header, name, "Connection");
+    expect_string(http_write_header, value, "keep-alive");
+
     expect_any(http_end_header, request);
 
     expect_any(http_close, request);
@@ -265,6 +447,9 @@ static void test__http_get_request__returns_minus_one_if_malloc_fails(void **sta
     expect_any(http_begin_request, request);
     will_return(http_begin_request, 1);
 
+    expect_string(http_write_header, name, "Connection");
+    expect_string(http_write_header, value, "keep-alive");
+
     expect_any(http_end_header, request);
 
     expect_any(__wrap_malloc, size);
@@ -284,6 +469,395 @@ static void test__http_get_request__returns_minus_one_if_malloc_fails(void **sta
     close(fd);
 }
 
+static void test__http_get_request__uses_a_pooled_connection(void **states)
+{
+    const char *reply =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n";
+
+    int fds[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    assert_int_equal(http_client_pool_put("www.example.com", 80, fds[0]), 0);
+
+    struct http_request request = {
+        .host = "www.example.com",
+        .port = 80,
+        .path = "/",
+
+        .fd = -1,
+    };
+
+    expect_any(http_begin_request, request);
+    will_return(http_begin_request, 1);
+
+    expect_string(http_write_header, name, "Connection");
+    expect_string(http_write_header, value, "keep-alive");
+
+    expect_any(http_end_header, request);
+
+    reply_fd = fds[1];
+    reply_data = reply;
+
+    int ret = http_get_request(&request);
+    reply_fd = -1;
+
+    assert_true(ret > 0);
+    assert_int_equal(fds[0], request.fd);
+    assert_int_equal(HTTP_STATE_CLIENT_READ_BODY, request.state);
+    assert_int_equal(200, request.status);
+    assert_int_equal(-1, http_client_pool_take("www.example.com", 80));
+
+    free(request.recv_buf);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test__http_get_request__retries_on_a_new_connection_if_the_pooled_one_fails(void **states)
+{
+    const char *reply =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Length: 606\r\n"
+        "\r\n";
+
+    int fd = write_tmp_file(reply);
+
+    int fds[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    assert_int_equal(http_client_pool_put("www.example.com", 80, fds[0]), 0);
+
+    struct http_request request = {
+        .host = "www.example.com",
+        .port = 80,
+        .path = "/",
+
+        .fd = -1,
+    };
+
+    expect_any(http_begin_request, request);
+    will_return(http_begin_request, -1);
+
+    expect_any(http_close, request);
+    will_return(http_close, 0);
+
+    request_socket_fd = fd;
+    expect_any(http_open_request_socket, request);
+    will_return(http_open_request_socket, 1);
+
+    expect_any(http_begin_request, request);
+    will_return(http_begin_request, 1);
+
+    expect_string(http_write_header, name, "Connection");
+    expect_string(http_write_header, value, "keep-alive");
+
+    expect_any(http_end_header, request);
+
+    int ret = http_get_request(&request);
+    request_socket_fd = -1;
+
+    assert_true(ret > 0);
+    assert_int_equal(fd, request.fd);
+    assert_int_equal(HTTP_STATE_CLIENT_READ_BODY, request.state);
+    assert_int_equal(200, request.status);
+    assert_int_equal(606, request.read_content_length);
+
+    free(request.recv_buf);
+
+    close(fd);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test__http_post_request__sends_body_with_content_length(void **states)
+{
+    int fds[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+    struct http_request request = {
+        .host = "www.example.com",
+        .port = 80,
+        .path = "/",
+
+        .fd = -1,
+    };
+
+    request_socket_fd = fds[0];
+    expect_any(http_open_request_socket, request);
+    will_return(http_open_request_socket, 1);
+
+    reply_fd = fds[1];
+    reply_data = "HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n";
+    expect_any(http_begin_request, request);
+    will_return(http_begin_request, 1);
+
+    expect_string(http_write_header, name, "Content-Length");
+    expect_string(http_write_header, value, "5");
+    expect_string(http_write_header, name, "Connection");
+    expect_string(http_write_header, value, "keep-alive");
+
+    expect_any(http_end_header, request);
+
+    int ret = http_post_request(&request, "hello", 5);
+    request_socket_fd = -1;
+    reply_fd = -1;
+
+    char buf[8] = { 0 };
+    assert_int_equal(read(fds[1], buf, sizeof(buf)), 5);
+
+    assert_true(ret > 0);
+    assert_string_equal("hello", buf);
+    assert_int_equal(HTTP_METHOD_POST, request.method);
+    assert_int_equal(HTTP_STATE_CLIENT_READ_BODY, request.state);
+    assert_int_equal(201, request.status);
+
+    free(request.recv_buf);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test__http_post_request__is_not_sent_again_if_the_pooled_connection_fails_after_it(void **states)
+{
+    int pooled[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, pooled), 0);
+    assert_int_equal(http_client_pool_put("www.example.com", 80, pooled[0]), 0);
+
+    struct http_request request = {
+        .host = "www.example.com",
+        .port = 80,
+        .path = "/",
+
+        .fd = -1,
+    };
+
+    // The server takes the request, but what comes back is not a response
+    reply_fd = pooled[1];
+    reply_data = "garbage\r\n\r\n";
+    expect_any(http_begin_request, request);
+    will_return(http_begin_request, 1);
+
+    expect_string(http_write_header, name, "Content-Length");
+    expect_string(http_write_header, value, "5");
+    expect_string(http_write_header, name, "Connection");
+    expect_string(http_write_header, value, "keep-alive");
+
+    expect_any(http_end_header, request);
+
+    expect_any(http_close, request);
+    will_return(http_close, 0);
+
+    // No new connection is opened for it
+    int ret = http_post_request(&request, "hello", 5);
+    reply_fd = -1;
+
+    char buf[8] = { 0 };
+    assert_int_equal(read(pooled[1], buf, sizeof(buf)), 5);
+
+    assert_int_equal(-1, ret);
+    assert_string_equal("hello", buf);
+    assert_int_equal(HTTP_STATE_CLIENT_ERROR, request.state);
+
+    close(pooled[0]);
+    close(pooled[1]);
+}
+
+static void test__http_post_request__keeps_put_method(void **states)
+{
+    const char *reply =
+        "HTTP/1.1 204 No Content\r\n"
+        "\r\n";
+
+    int fd = write_tmp_file(reply);
+
+    struct http_request request = {
+        .host = "www.example.com",
+        .path = "/",
+        .method = HTTP_METHOD_PUT,
+
+        .fd = fd,
+    };
+
+    expect_any(http_open_request_socket, request);
+    will_return(http_open_request_socket, 1);
+
+    expect_any(http_begin_request, request);
+    will_return(http_begin_request, 1);
+
+    expect_string(http_write_header, name, "Content-Length");
+    expect_string(http_write_header, value, "0");
+    expect_string(http_write_header, name, "Connection");
+    expect_string(http_write_header, value, "keep-alive");
+
+    expect_any(http_end_header, request);
+
+    int ret = http_post_request(&request, NULL, 0);
+
+    assert_true(ret > 0);
+    assert_int_equal(HTTP_METHOD_PUT, request.method);
+    assert_int_equal(204, request.status);
+
+    free(request.recv_buf);
+
+    close(fd);
+}
+
+static int write_body_in_parts(struct http_request *request, void *arg)
+{
+    assert_true(request->flags & HTTP_FLAG_WRITE_CHUNKED);
+
+    http_write_bytes(request, "log ", 4);
+    http_write_bytes(request, arg, strlen(arg));
+
+    return 0;
+}
+
+static void test__http_post_request_stream__sends_chunked_body_on_a_new_connection(void **states)
+{
+    int fds[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+    int pooled[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, pooled), 0);
+    assert_int_equal(http_client_pool_put("www.example.com", 80, pooled[0]), 0);
+
+    struct http_request request = {
+        .host = "www.example.com",
+        .port = 80,
+        .path = "/",
+
+        .fd = -1,
+    };
+
+    request_socket_fd = fds[0];
+    expect_any(http_open_request_socket, request);
+    will_return(http_open_request_socket, 1);
+
+    reply_fd = fds[1];
+    reply_data = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+    expect_any(http_begin_request, request);
+    will_return(http_begin_request, 1);
+
+    expect_string(http_write_header, name, "Transfer-Encoding");
+    expect_string(http_write_header, value, "chunked");
+    expect_string(http_write_header, name, "Connection");
+    expect_string(http_write_header, value, "keep-alive");
+
+    expect_any(http_end_header, request);
+    expect_any(http_end_body, request);
+
+    int ret = http_post_request_stream(&request, -1, write_body_in_parts, "line");
+    request_socket_fd = -1;
+    reply_fd = -1;
+
+    char buf[16] = { 0 };
+    assert_int_equal(read(fds[1], buf, sizeof(buf)), 8);
+
+    assert_true(ret > 0);
+    assert_string_equal("log line", buf);
+    assert_int_equal(200, request.status);
+    assert_int_equal(pooled[0], http_client_pool_take("www.example.com", 80));
+
+    free(request.recv_buf);
+
+    close(fds[0]);
+    close(fds[1]);
+    close(pooled[0]);
+    close(pooled[1]);
+}
+
+static void test__http_post_request_file__sends_part_of_file(void **states)
+{
+    int fds[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+    int file = write_tmp_file("0123456789");
+
+    struct http_request request = {
+        .host = "www.example.com",
+        .port = 80,
+        .path = "/",
+
+        .fd = -1,
+    };
+
+    request_socket_fd = fds[0];
+    expect_any(http_open_request_socket, request);
+    will_return(http_open_request_socket, 1);
+
+    reply_fd = fds[1];
+    reply_data = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+    expect_any(http_begin_request, request);
+    will_return(http_begin_request, 1);
+
+    expect_string(http_write_header, name, "Content-Length");
+    expect_string(http_write_header, value, "6");
+    expect_string(http_write_header, name, "Connection");
+    expect_string(http_write_header, value, "keep-alive");
+
+    expect_any(http_end_header, request);
+
+    int ret = http_post_request_file(&request, file, 2, 6);
+    request_socket_fd = -1;
+    reply_fd = -1;
+
+    char buf[16] = { 0 };
+    assert_int_equal(read(fds[1], buf, sizeof(buf)), 6);
+
+    assert_true(ret > 0);
+    assert_string_equal("234567", buf);
+    assert_int_equal(200, request.status);
+
+    free(request.recv_buf);
+
+    close(file);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test__http_post_request_file__fails_if_file_is_too_short(void **states)
+{
+    int fds[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+    int file = write_tmp_file("0123");
+
+    struct http_request request = {
+        .host = "www.example.com",
+        .port = 80,
+        .path = "/",
+
+        .fd = -1,
+    };
+
+    request_socket_fd = fds[0];
+    expect_any(http_open_request_socket, request);
+    will_return(http_open_request_socket, 1);
+
+    expect_any(http_begin_request, request);
+    will_return(http_begin_request, 1);
+
+    expect_string(http_write_header, name, "Content-Length");
+    expect_string(http_write_header, value, "10");
+    expect_string(http_write_header, name, "Connection");
+    expect_string(http_write_header, value, "keep-alive");
+
+    expect_any(http_end_header, request);
+
+    expect_any(http_close, request);
+    will_return(http_close, 0);
+
+    int ret = http_post_request_file(&request, file, 0, 10);
+    request_socket_fd = -1;
+
+    assert_int_equal(-1, ret);
+    assert_int_equal(HTTP_STATE_CLIENT_ERROR, request.state);
+
+    close(file);
+    close(fds[0]);
+    close(fds[1]);
+}
+
 
 // Setup & Teardown ////////////////////////////////////////////////////////////
 
@@ -304,10 +878,21 @@ static int gr_teardown_malloc_mock(void **state)
 
 const struct CMUnitTest tests_for_http_get_request[] = {
     cmocka_unit_test(test__http_get_request__parses_http_headers),
+    cmocka_unit_test(test__http_get_request__keeps_all_response_headers),
+    cmocka_unit_test(test__http_get_request__returns_minus_one_if_header_is_too_long),
+    cmocka_unit_test(test__http_read_response_header__leaves_the_next_response_in_the_buffer),
     cmocka_unit_test(test__http_get_request__returns_minus_one_if_http_open_request_socket_fails),
     cmocka_unit_test(test__http_get_request__returns_minus_one_if_http_begin_request_fails),
     cmocka_unit_test(test__http_get_request__returns_minus_one_if_header_is_incomplete),
     cmocka_unit_test(test__http_get_request__returns_minus_one_if_header_does_not_parse_correctly),
+    cmocka_unit_test(test__http_get_request__uses_a_pooled_connection),
+    cmocka_unit_test(test__http_get_request__retries_on_a_new_connection_if_the_pooled_one_fails),
+    cmocka_unit_test(test__http_post_request__sends_body_with_content_length),
+    cmocka_unit_test(test__http_post_request__is_not_sent_again_if_the_pooled_connection_fails_after_it),
+    cmocka_unit_test(test__http_post_request__keeps_put_method),
+    cmocka_unit_test(test__http_post_request_stream__sends_chunked_body_on_a_new_connection),
+    cmocka_unit_test(test__http_post_request_file__sends_part_of_file),
+    cmocka_unit_test(test__http_post_request_file__fails_if_file_is_too_short),
 };
 
 const struct CMUnitTest tests_for_http_get_request_malloc_mock[] = {
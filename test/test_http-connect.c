@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <cmocka.h>
+
+#include "http-sm/http.h"
+#include "http-private.h"
+
+#include "test-util.h"
+
+// Helpers /////////////////////////////////////////////////////////////////////
+
+static int listen_fds[2];
+static int client_fd;
+
+static void make_address(struct http_address *address, int port)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)&address->addr;
+
+    memset(address, 0, sizeof(*address));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address->length = sizeof(*sin);
+}
+
+// Listen on a free port of 127.0.0.1 and fill in its address
+static int start_listening(struct http_address *address, int backlog)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert_true(fd >= 0);
+    assert_int_equal(bind(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    assert_int_equal(listen(fd, backlog), 0);
+    assert_int_equal(getsockname(fd, (struct sockaddr *)&addr, &len), 0);
+
+    make_address(address, ntohs(addr.sin_port));
+
+    return fd;
+}
+
+// A port nobody listens on, so connecting to it is refused
+static void refused_address(struct http_address *address)
+{
+    int fd = start_listening(address, 1);
+    close(fd);
+}
+
+// An address whose accept queue is full, so connecting to it waits for an answer that does not come
+static int silent_address(struct http_address *address)
+{
+    int fd = start_listening(address, 0);
+
+    client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert_int_equal(connect(client_fd, (struct sockaddr *)&address->addr, address->length), 0);
+
+    return fd;
+}
+
+static int teardown(void **state)
+{
+    for(int i = 0; i < 2; i++) {
+        if(listen_fds[i] > 0) {
+            close(listen_fds[i]);
+            listen_fds[i] = 0;
+        }
+    }
+
+    if(client_fd > 0) {
+        close(client_fd);
+        client_fd = 0;
+    }
+
+    return 0;
+}
+
+// Tests ///////////////////////////////////////////////////////////////////////
+
+static void test__http_connect__connects_in_blocking_mode(void **states)
+{
+    struct http_address addrs[1];
+    int index = -1;
+
+    listen_fds[0] = start_listening(&addrs[0], 1);
+
+    int fd = http_connect(addrs, 1, 1000, &index);
+
+    assert_true(fd >= 0);
+    assert_int_equal(index, 0);
+    assert_false(fcntl(fd, F_GETFL, 0) & O_NONBLOCK);
+
+    close(fd);
+}
+
+static void test__http_connect__tries_next_address_if_connect_is_refused(void **states)
+{
+    struct http_address addrs[2];
+    int index = -1;
+
+    refused_address(&addrs[0]);
+    listen_fds[1] = start_listening(&addrs[1], 1);
+
+    int fd = http_connect(addrs, 2, 1000, &index);
+
+    assert_true(fd >= 0);
+    assert_int_equal(index, 1);
+
+    close(fd);
+}
+
+static void test__http_connect__starts_next_address_while_first_does_not_answer(void **states)
+{
+    struct http_address addrs[2];
+    int index = -1;
+
+    listen_fds[0] = silent_address(&addrs[0]);
+    listen_fds[1] = start_listening(&addrs[1], 1);
+
+    uint32_t start = http_clock_ms();
+    int fd = http_connect(addrs, 2, 0, &index);
+    int elapsed = http_clock_ms() - start;
+
+    assert_true(fd >= 0);
+    assert_int_equal(index, 1);
+    assert_true(elapsed >= HTTP_CLIENT_CONNECT_DELAY_MS - 10);
+    assert_true(elapsed < HTTP_CLIENT_CONNECT_TIMEOUT_MS);
+
+    close(fd);
+}
+
+static void test__http_connect__gives_up_when_timeout_has_passed(void **states)
+{
+    struct http_address addrs[1];
+    int index = -1;
+
+    listen_fds[0] = silent_address(&addrs[0]);
+
+    uint32_t start = http_clock_ms();
+    int fd = http_connect(addrs, 1, 100, &index);
+    int elapsed = http_clock_ms() - start;
+
+    assert_int_equal(fd, -1);
+    assert_true(elapsed >= 90);
+    assert_true(elapsed < 1000);
+}
+
+static void test__http_connect__fails_if_no_address_answers(void **states)
+{
+    struct http_address addrs[2];
+    int index = -1;
+
+    refused_address(&addrs[0]);
+    refused_address(&addrs[1]);
+
+    assert_int_equal(http_connect(addrs, 2, 1000, &index), -1);
+    assert_int_equal(index, -1);
+}
+
+// Poll the attempts the way the server loop does, until one of them connects or all have failed
+static int run_connector(struct http_connector *c, int *fd)
+{
+    int ret = 0;
+
+    for(int i = 0; (i < 10000) && (ret == 0); i++) {
+        ret = http_connector_poll(c, fd);
+        usleep(1000);
+    }
+
+    return ret;
+}
+
+static void test__http_connector_poll__starts_next_address_while_first_does_not_answer(void **states)
+{
+    struct http_address addrs[2];
+    struct http_connector c;
+    int fd = -1;
+
+    listen_fds[0] = silent_address(&addrs[0]);
+    listen_fds[1] = start_listening(&addrs[1], 1);
+
+    uint32_t start = http_clock_ms();
+    http_connector_init(&c, addrs, 2);
+
+    // The first attempt gets a moment of its own
+    assert_int_equal(http_connector_poll(&c, &fd), 0);
+    assert_int_equal(c.started, 1);
+    assert_true(http_connector_timer_next(&c, http_clock_ms()) <= HTTP_CLIENT_CONNECT_DELAY_MS);
+
+    assert_int_equal(run_connector(&c, &fd), 1);
+    int elapsed = http_clock_ms() - start;
+
+    assert_true(fd >= 0);
+    assert_int_equal(c.index, 1);
+    assert_true(fcntl(fd, F_GETFL, 0) & O_NONBLOCK);
+    assert_true(elapsed >= HTTP_CLIENT_CONNECT_DELAY_MS - 10);
+    assert_true(elapsed < HTTP_CLIENT_CONNECT_TIMEOUT_MS);
+
+    close(fd);
+}
+
+static void test__http_connector_poll__fails_if_no_address_answers(void **states)
+{
+    struct http_address addrs[2];
+    struct http_connector c;
+    int fd = -1;
+
+    refused_address(&addrs[0]);
+    refused_address(&addrs[1]);
+
+    http_connector_init(&c, addrs, 2);
+
+    assert_int_equal(run_connector(&c, &fd), -1);
+    assert_int_equal(http_connector_timer_next(&c, http_clock_ms()), -1);
+}
+
+// Main ////////////////////////////////////////////////////////////////////////
+
+const struct CMUnitTest tests_for_http_connect[] = {
+    cmocka_unit_test_setup_teardown(test__http_connect__connects_in_blocking_mode, NULL, teardown),
+    cmocka_unit_test_setup_teardown(test__http_connect__tries_next_address_if_connect_is_refused, NULL, teardown),
+    cmocka_unit_test_setup_teardown(test__http_connect__starts_next_address_while_first_does_not_answer, NULL, teardown),
+    cmocka_unit_test_setup_teardown(test__http_connect__gives_up_when_timeout_has_passed, NULL, teardown),
+    cmocka_unit_test_setup_teardown(test__http_connect__fails_if_no_address_answers, NULL, teardown),
+    cmocka_unit_test_setup_teardown(test__http_connector_poll__starts_next_address_while_first_does_not_answer, NULL, teardown),
+    cmocka_unit_test_setup_teardown(test__http_connector_poll__fails_if_no_address_answers, NULL, teardown),
+};
+
+int main(void)
+{
+    int fails = 0;
+    fails += cmocka_run_group_tests(tests_for_http_connect, NULL, NULL);
+
+    return fails;
+}
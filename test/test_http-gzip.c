@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <cmocka.h>
+
+#include "http-sm/http.h"
+#include "http-private.h"
+
+#include "test-util.h"
+
+// Helpers /////////////////////////////////////////////////////////////////////
+
+// Compress s the way a server does for Content-Encoding: gzip, returns the compressed length
+static int gzip(const char *s, int len, char *out, int out_len)
+{
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+
+    assert_int_equal(deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY), Z_OK);
+
+    z.next_in = (uint8_t *)s;
+    z.avail_in = len;
+    z.next_out = (uint8_t *)out;
+    z.avail_out = out_len;
+
+    assert_int_equal(deflate(&z, Z_FINISH), Z_STREAM_END);
+    deflateEnd(&z);
+
+    return out_len - z.avail_out;
+}
+
+// Write data as a chunked body, size bytes in each chunk
+static int write_chunked(const char *data, int len, int size)
+{
+    char buf[4096];
+    int n = 0;
+
+    for(int i = 0; i < len; i += size) {
+        int chunk = (len - i < size) ? len - i : size;
+        n += sprintf(buf + n, "%x\r\n", chunk);
+        memcpy(buf + n, data + i, chunk);
+        n += chunk;
+        n += sprintf(buf + n, "\r\n");
+    }
+    n += sprintf(buf + n, "0\r\n\r\n");
+
+    return write_tmp_file_bin(buf, n);
+}
+
+static void init_gzip_request(struct http_request *request, int fd)
+{
+    memset(request, 0, sizeof(*request));
+    request->fd = fd;
+    request->flags = HTTP_FLAG_ACCEPT_GZIP | HTTP_FLAG_READ_GZIP;
+    request->poke = -1;
+    request->state = HTTP_STATE_CLIENT_READ_BODY;
+}
+
+static void read_all(struct http_request *request, char *buf, int len, int step)
+{
+    int n = 0;
+
+    while(request->state == HTTP_STATE_CLIENT_READ_BODY) {
+        int ret = http_read(request, buf + n, (len - n < step) ? len - n : step);
+        assert_true(ret >= 0);
+        n += ret;
+    }
+
+    buf[n] = 0;
+}
+
+static void assert_at_end_of_file(int fd)
+{
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    off_t end = lseek(fd, 0, SEEK_END);
+
+    assert_int_equal(end, pos);
+}
+
+// Tests ///////////////////////////////////////////////////////////////////////
+
+static void test__http_read__inflates_body_with_content_length(void **states)
+{
+    const char *s = "Hello, Hello, Hello, World";
+    char compressed[256];
+    char buf[64];
+    int len = gzip(s, strlen(s), compressed, sizeof(compressed));
+
+    int fd = write_tmp_file_bin(compressed, len);
+    assert_true(0 <= fd);
+
+    struct http_request request;
+    init_gzip_request(&request, fd);
+    request.read_content_length = len;
+
+    read_all(&request, buf, sizeof(buf) - 1, sizeof(buf) - 1);
+
+    assert_string_equal(s, buf);
+    assert_int_equal(request.state, HTTP_STATE_CLIENT_IDLE);
+    assert_int_equal(request.read_content_length, 0);
+    assert_null(request.gzip);
+
+    close(fd);
+}
+
+static void test__http_read__inflates_chunked_body_and_reads_the_last_chunk(void **states)
+{
+    const char *s = "The quick brown fox jumps over the lazy dog. The quick brown fox jumps over the lazy dog.";
+    char compressed[256];
+    char buf[128];
+    int len = gzip(s, strlen(s), compressed, sizeof(compressed));
+
+    int fd = write_chunked(compressed, len, 7);
+    assert_true(0 <= fd);
+
+    struct http_request request;
+    init_gzip_request(&request, fd);
+    request.flags |= HTTP_FLAG_READ_CHUNKED;
+
+    read_all(&request, buf, sizeof(buf) - 1, 10);
+
+    assert_string_equal(s, buf);
+    assert_int_equal(request.state, HTTP_STATE_CLIENT_IDLE);
+    assert_at_end_of_file(fd);
+
+    close(fd);
+}
+
+static void test__http_read__returns_inflated_data_longer_than_the_body(void **states)
+{
+    static char s[3000];
+    static char buf[3001];
+    char compressed[512];
+
+    for(int i = 0; i < sizeof(s); i++) {
+        s[i] = 'a' + (i % 7);
+    }
+
+    int len = gzip(s, sizeof(s), compressed, sizeof(compressed));
+    assert_true(len < 100);
+
+    int fd = write_tmp_file_bin(compressed, len);
+    assert_true(0 <= fd);
+
+    struct http_request request;
+    init_gzip_request(&request, fd);
+    request.read_content_length = len;
+
+    read_all(&request, buf, sizeof(buf) - 1, 100);
+
+    assert_int_equal(strlen(buf), sizeof(s));
+    assert_memory_equal(s, buf, sizeof(s));
+
+    close(fd);
+}
+
+static void test__http_getc__returns_inflated_bytes(void **states)
+{
+    const char *s = "abc";
+    char compressed[64];
+    int len = gzip(s, strlen(s), compressed, sizeof(compressed));
+
+    int fd = write_tmp_file_bin(compressed, len);
+    assert_true(0 <= fd);
+
+    struct http_request request;
+    init_gzip_request(&request, fd);
+    request.read_content_length = len;
+
+    assert_int_equal(http_getc(&request), 'a');
+    assert_int_equal(http_getc(&request), 'b');
+    assert_int_equal(http_getc(&request), 'c');
+    assert_int_equal(http_getc(&request), 0);
+    assert_int_equal(request.state, HTTP_STATE_CLIENT_IDLE);
+
+    close(fd);
+}
+
+static void test__http_read__fails_on_data_that_is_not_gzip(void **states)
+{
+    const char *s = "This is not compressed";
+    char buf[64];
+
+    int fd = write_tmp_file(s);
+    assert_true(0 <= fd);
+
+    struct http_request request;
+    init_gzip_request(&request, fd);
+    request.read_content_length = strlen(s);
+
+    assert_int_equal(http_read(&request, buf, sizeof(buf)), -1);
+    assert_true(http_is_error(&request));
+    assert_null(request.gzip);
+
+    close(fd);
+}
+
+static void test__http_read__fails_if_body_ends_before_gzip_stream(void **states)
+{
+    const char *s = "Hello, World";
+    char compressed[64];
+    char buf[64];
+    int len = gzip(s, strlen(s), compressed, sizeof(compressed));
+
+    int fd = write_tmp_file_bin(compressed, len - 4);
+    assert_true(0 <= fd);
+
+    struct http_request request;
+    init_gzip_request(&request, fd);
+    request.read_content_length = len - 4;
+
+    assert_int_equal(http_read(&request, buf, sizeof(buf)), -1);
+    assert_true(http_is_error(&request));
+
+    close(fd);
+}
+
+static void test__http_read__does_not_inflate_without_read_gzip(void **states)
+{
+    const char *s = "plain";
+    char buf[6] = "XXXXX";
+
+    int fd = write_tmp_file(s);
+    assert_true(0 <= fd);
+
+    struct http_request request;
+    init_gzip_request(&request, fd);
+    request.flags = HTTP_FLAG_ACCEPT_GZIP;
+    request.read_content_length = strlen(s);
+
+    assert_int_equal(http_read(&request, buf, 5), 5);
+    assert_string_equal(s, buf);
+
+    close(fd);
+}
+
+// Main ////////////////////////////////////////////////////////////////////////
+
+const struct CMUnitTest tests_for_http_gzip[] = {
+    cmocka_unit_test(test__http_read__inflates_body_with_content_length),
+    cmocka_unit_test(test__http_read__inflates_chunked_body_and_reads_the_last_chunk),
+    cmocka_unit_test(test__http_read__returns_inflated_data_longer_than_the_body),
+    cmocka_unit_test(test__http_getc__returns_inflated_bytes),
+    cmocka_unit_test(test__http_read__fails_on_data_that_is_not_gzip),
+    cmocka_unit_test(test__http_read__fails_if_body_ends_before_gzip_stream),
+    cmocka_unit_test(test__http_read__does_not_inflate_without_read_gzip),
+};
+
+int main(void)
+{
+    int fails = 0;
+    fails += cmocka_run_group_tests(tests_for_http_gzip, NULL, NULL);
+
+    return fails;
+}
@@ -9,6 +9,9 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <signal.h>
 
 #include <cmocka.h>
@@ -22,17 +25,6 @@ static void init_server_request(struct http_request *request, int fd);
 static void init_server_request_write_chunked(struct http_request *request, int fd);
 static void init_client_request(struct http_request *request, int fd);
 
-// Mocks ///////////////////////////////////////////////////////////////////////
-
-void websocket_flush(struct websocket_connection *conn)
-{
-}
-
-int websocket_is_readable(struct websocket_connection *conn)
-{
-    return 1;
-}
-
 // Helpers /////////////////////////////////////////////////////////////////////
 
 static void parse_header_helper(struct websocket_connection *conn, const uint8_t *s, int n)
@@ -757,6 +749,105 @@ static void test__http_read__doesnt_read_more_than_content_length_te_identity(vo
     close(fd);
 }
 
+static void test__http_read__returns_bytes_left_in_receive_buffer_first(void **states)
+{
+    int fd = write_tmp_file("lo");
+    assert_true(0 <= fd);
+
+    struct http_recv_buffer *b = calloc(1, sizeof(*b));
+    memcpy(b->data, "HTTP/1.1 200 OK\r\n\r\nhel", 22);
+    b->head = 19;
+    b->index = 19;
+    b->length = 22;
+
+    struct http_request request;
+    init_client_request(&request, fd);
+    request.recv_buf = b;
+    request.read_content_length = 5;
+
+    char buf[6] = "XXXXX";
+
+    assert_int_equal(http_read(&request, buf, 5), 5);
+
+    assert_string_equal("hello", buf);
+    assert_int_equal(request.read_content_length, 0);
+    assert_memory_equal("HTTP/1.1 200 OK", b->data, 15);
+
+    free(b);
+    close(fd);
+}
+
+static void test__http_read__reads_chunked_body_through_receive_buffer(void **states)
+{
+    const char *s[] = {
+        "4\r\n",
+        "0123",
+        "\r\n",
+        "2\r\n",
+        "45",
+        "\r\n",
+        "0\r\n",
+        "\r\n",
+        "HTTP/1.1",
+        0
+    };
+
+    int fd = write_tmp_file_n(s);
+    assert_true(0 <= fd);
+
+    struct http_recv_buffer *b = calloc(1, sizeof(*b));
+
+    struct http_request request;
+    init_client_request(&request, fd);
+    request.recv_buf = b;
+    request.flags |= HTTP_FLAG_READ_CHUNKED;
+
+    char buf[8] = "XXXXXXX";
+    int n = 0;
+
+    while(request.state == HTTP_STATE_CLIENT_READ_BODY) {
+        int ret = http_read(&request, buf + n, sizeof(buf) - 1 - n);
+        assert_true(ret >= 0);
+        n += ret;
+    }
+    buf[n] = 0;
+
+    assert_string_equal("012345", buf);
+    assert_int_equal(request.state, HTTP_STATE_CLIENT_IDLE);
+    // What follows the body stays in the buffer for the next response
+    assert_int_equal(b->length - b->index, 8);
+    assert_memory_equal("HTTP/1.1", b->data + b->index, 8);
+
+    free(b);
+    close(fd);
+}
+
+static void test__http_read__fails_once_the_deadline_has_passed(void **states)
+{
+    int sv[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    assert_int_equal(write(sv[1], "hello", 5), 5);
+
+    struct http_request request;
+    init_client_request(&request, sv[0]);
+    request.read_content_length = 5;
+    request.flags |= HTTP_FLAG_DEADLINE;
+    request.deadline = http_clock_ms() - 1;
+
+    char buf[6] = "XXXXX";
+
+    // The data is there, but the time of the request is up
+    assert_int_equal(http_read(&request, buf, 5), -1);
+
+    request.deadline = http_clock_ms() + 1000;
+
+    assert_int_equal(http_read(&request, buf, 5), 5);
+    assert_string_equal("hello", buf);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
 
 static void test__http_write_header__writes_the_header(void **states)
 {
@@ -1236,7 +1327,7 @@ static void test__websocket_send_response__writes_response_without_sec_websocket
     request.flags = HTTP_FLAG_WEBSOCKET;
     request.websocket_key = 0;
 
-    websocket_send_response(&request);
+    websocket_send_response(&request, NULL);
 
     assert_string_equal(expected, get_file_content(fd));
 
@@ -1260,7 +1351,41 @@ static void test__websocket_send_response__writes_response_with_sec_websocket_ke
     request.flags = HTTP_FLAG_WEBSOCKET;
     request.websocket_key = "dGhlIHNhbXBsZSBub25jZQ==";
 
-    websocket_send_response(&request);
+    websocket_send_response(&request, NULL);
+
+    assert_string_equal(expected, get_file_content(fd));
+
+    close(fd);
+}
+
+static void test__websocket_accept_key__matches_rfc_example(void **states)
+{
+    char accept[WEBSOCKET_ACCEPT_LEN];
+
+    websocket_accept_key("dGhlIHNhbXBsZSBub25jZQ==", accept);
+
+    assert_string_equal("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", accept);
+}
+
+static void test__websocket_send_response__writes_sec_websocket_extensions(void **states)
+{
+    const char *expected = ""
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"
+        "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+        "\r\n";
+
+    int fd = open_tmp_file();
+    assert_true(0 <= fd);
+
+    struct http_request request;
+    init_server_request(&request, fd);
+    request.flags = HTTP_FLAG_WEBSOCKET;
+    request.websocket_key = "dGhlIHNhbXBsZSBub25jZQ==";
+
+    websocket_send_response(&request, "permessage-deflate");
 
     assert_string_equal(expected, get_file_content(fd));
 
@@ -1482,6 +1607,42 @@ static void test__websocket_send__sends_a_16bit_message(void **states)
     close(fd);
 }
 
+static void test__websocket_send__masks_frames_from_a_client(void **states)
+{
+    int fd = open_tmp_file();
+    assert_true(fd >= 0);
+
+    struct websocket_connection conn = {
+        .fd = fd,
+        .client = 1,
+    };
+
+    char str[200];
+    for(int i = 0; i < sizeof(str); i++) {
+        str[i] = 'a' + i % 26;
+    }
+
+    int n = websocket_send(&conn, str, sizeof(str), WEBSOCKET_FRAME_OPCODE_BIN);
+    assert_int_equal(n, sizeof(str));
+
+    uint8_t raw[4 + 4 + sizeof(str)];
+    lseek(conn.fd, 0, SEEK_SET);
+    assert_int_equal(read(conn.fd, raw, sizeof(raw)), sizeof(raw));
+    assert_int_equal(raw[1], WEBSOCKET_FRAME_MASK | WEBSOCKET_FRAME_LEN_16BIT);
+
+    lseek(conn.fd, 0, SEEK_SET);
+    parse_header_fd_helper(&conn);
+
+    assert_int_equal(conn.frame_opcode, WEBSOCKET_FRAME_OPCODE_BIN | WEBSOCKET_FRAME_FIN);
+    assert_int_equal(conn.frame_length, sizeof(str));
+
+    char buf[sizeof(str)];
+    assert_int_equal(websocket_read(&conn, buf, sizeof(buf)), sizeof(buf));
+    assert_memory_equal(buf, str, sizeof(str));
+
+    close(fd);
+}
+
 static void test__websocket_send__sends_a_64bit_message(void **states)
 {
     int fd = open_tmp_file();
@@ -1524,6 +1685,169 @@ static void test__websocket_send__sends_a_64bit_message(void **states)
     close(fd);
 }
 
+static void test__websocket_send_begin__sends_fragments_with_fin_on_the_last(void **states)
+{
+    int fd = open_tmp_file();
+    assert_true(fd >= 0);
+
+    struct websocket_connection conn = {
+        .fd = fd,
+    };
+
+    assert_int_equal(websocket_send_begin(&conn, "ab", 2, WEBSOCKET_FRAME_OPCODE_TEXT), 2);
+    assert_int_equal(websocket_send_continue(&conn, "cd", 2), 2);
+    assert_int_equal(websocket_send_end(&conn, "e", 1), 1);
+
+    char expected[] = { 0x01, 0x02, 'a', 'b', 0x00, 0x02, 'c', 'd', 0x80, 0x01, 'e', 0 };
+
+    assert_memory_equal(expected, get_file_content(fd), sizeof(expected));
+    assert_false(conn.send_fragmented);
+
+    close(fd);
+}
+
+static void test__websocket_send_begin__allows_control_frames_between_fragments(void **states)
+{
+    int fd = open_tmp_file();
+    assert_true(fd >= 0);
+
+    struct websocket_connection conn = {
+        .fd = fd,
+    };
+
+    websocket_send_begin(&conn, "ab", 2, WEBSOCKET_FRAME_OPCODE_TEXT);
+    websocket_send(&conn, "p", 1, WEBSOCKET_FRAME_OPCODE_PONG);
+    websocket_send_end(&conn, "c", 1);
+
+    char expected[] = { 0x01, 0x02, 'a', 'b', 0x8a, 0x01, 'p', 0x80, 0x01, 'c', 0 };
+
+    assert_memory_equal(expected, get_file_content(fd), sizeof(expected));
+
+    close(fd);
+}
+
+static void test__websocket_send_begin__fails_if_a_message_is_in_progress(void **states)
+{
+    int fd = open_tmp_file();
+    assert_true(fd >= 0);
+
+    struct websocket_connection conn = {
+        .fd = fd,
+    };
+
+    assert_int_equal(websocket_send_begin(&conn, "ab", 2, WEBSOCKET_FRAME_OPCODE_TEXT), 2);
+    assert_int_equal(websocket_send_begin(&conn, "cd", 2, WEBSOCKET_FRAME_OPCODE_TEXT), -1);
+
+    close(fd);
+}
+
+static void test__websocket_send_continue__fails_without_begin(void **states)
+{
+    int fd = open_tmp_file();
+    assert_true(fd >= 0);
+
+    struct websocket_connection conn = {
+        .fd = fd,
+    };
+
+    assert_int_equal(websocket_send_continue(&conn, "ab", 2), -1);
+    assert_int_equal(websocket_send_end(&conn, "ab", 2), -1);
+    assert_string_equal("", get_file_content(fd));
+
+    close(fd);
+}
+
+static void test__websocket_send__compresses_long_messages_when_deflate_is_negotiated(void **states)
+{
+    int fd = open_tmp_file();
+    assert_true(fd >= 0);
+
+    struct websocket_deflate *deflate = calloc(1, sizeof(*deflate));
+    assert_non_null(deflate);
+    deflate->server_window_bits = 15;
+    deflate->client_window_bits = 15;
+
+    struct websocket_connection conn = {
+        .fd = fd,
+        .deflate = deflate,
+    };
+
+    char message[WEBSOCKET_DEFLATE_MIN_LEN];
+    memset(message, 'a', sizeof(message));
+
+    assert_int_equal(websocket_send(&conn, message, sizeof(message), WEBSOCKET_FRAME_OPCODE_TEXT), sizeof(message));
+    assert_int_equal(websocket_send(&conn, "short", 5, WEBSOCKET_FRAME_OPCODE_TEXT), 5);
+
+    const uint8_t *content = (const uint8_t *)get_file_content(fd);
+
+    assert_int_equal(0xc1, content[0]);
+    assert_true(content[1] < sizeof(message));
+    assert_int_equal(0x81, content[2 + content[1]]);
+    assert_int_equal(5, content[3 + content[1]]);
+
+    websocket_deflate_free(deflate);
+    close(fd);
+}
+
+static void test__websocket_inflate_frame__replaces_payload_with_inflated_data(void **states)
+{
+    const uint8_t frame[] = { 0xc1, 0x07, 0xf2, 0x48, 0xcd, 0xc9, 0xc9, 0x07, 0x00 };
+
+    int fd = write_tmp_file_bin((const char *)frame, sizeof(frame));
+
+    struct websocket_deflate *deflate = calloc(1, sizeof(*deflate));
+    assert_non_null(deflate);
+    deflate->server_window_bits = 15;
+    deflate->client_window_bits = 15;
+
+    struct websocket_connection conn = {
+        .fd = fd,
+        .deflate = deflate,
+    };
+
+    parse_header_fd_helper(&conn);
+
+    assert_int_equal(0, websocket_inflate_frame(&conn));
+    assert_int_equal(WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_TEXT, conn.frame_opcode);
+    assert_int_equal(5, conn.frame_length);
+
+    char buf[6];
+    assert_int_equal(5, websocket_read(&conn, buf, 5));
+    buf[5] = 0;
+
+    assert_string_equal("Hello", buf);
+    assert_int_equal(WEBSOCKET_STATE_DONE, conn.state);
+
+    websocket_deflate_free(deflate);
+    close(fd);
+}
+
+static void test__websocket_parse_frame_header__accepts_rsv1_only_with_deflate(void **states)
+{
+    struct websocket_deflate deflate;
+    struct websocket_connection conn = {
+        .deflate = NULL,
+    };
+
+    conn.state = WEBSOCKET_STATE_OPCODE;
+    websocket_parse_frame_header(&conn, 0xc1);
+    assert_int_equal(WEBSOCKET_STATE_ERROR, conn.state);
+
+    conn.deflate = &deflate;
+
+    conn.state = WEBSOCKET_STATE_OPCODE;
+    websocket_parse_frame_header(&conn, 0xc1);
+    assert_int_equal(WEBSOCKET_STATE_LEN8, conn.state);
+
+    conn.state = WEBSOCKET_STATE_OPCODE;
+    websocket_parse_frame_header(&conn, 0xc9);
+    assert_int_equal(WEBSOCKET_STATE_ERROR, conn.state);
+
+    conn.state = WEBSOCKET_STATE_OPCODE;
+    websocket_parse_frame_header(&conn, 0xc0);
+    assert_int_equal(WEBSOCKET_STATE_ERROR, conn.state);
+}
+
 static void test__websocket_parse_frame_header__can_read_opcode(void **states)
 {
     struct websocket_connection conn = {
@@ -1653,7 +1977,9 @@ static void test__websocket_parse_frame_header__can_read_len64_mask(void **state
 
 static void test__websocket_parse_frame_header__sets_error_for_unknown_opcode(void **states)
 {
-    struct websocket_connection conn;
+    struct websocket_connection conn = {
+        .deflate = NULL,
+    };
 
     const uint8_t opcode[] = {
         0x03, 0x04, 0x05, 0x06, 0x07, 0x0b, 0x0c, 0x0d,
@@ -1669,6 +1995,246 @@ static void test__websocket_parse_frame_header__sets_error_for_unknown_opcode(vo
     }
 }
 
+static void test__websocket_parse_frame_header_buf__can_read_whole_header(void **states)
+{
+    struct websocket_connection conn = {
+        .state = WEBSOCKET_STATE_OPCODE,
+    };
+
+    const uint8_t input[] = {0x82, 0xFF, 0x12, 0x34, 0x56, 0x78, 0xAB, 0xCD, 0xEF, 0x01, 0x01, 0x02, 0x03, 0x04, 'X'};
+    int n = websocket_parse_frame_header_buf(&conn, input, sizeof(input));
+
+    assert_int_equal(n, 14);
+    assert_int_equal(conn.frame_opcode, 0x82);
+    assert_int_equal(conn.frame_length, 0x12345678ABCDEF01);
+    assert_int_equal(conn.frame_index, 0);
+    assert_int_equal(conn.state, WEBSOCKET_STATE_BODY);
+    assert_int_equal(conn.frame_mask[0], 0x01);
+    assert_int_equal(conn.frame_mask[1], 0x02);
+    assert_int_equal(conn.frame_mask[2], 0x03);
+    assert_int_equal(conn.frame_mask[3], 0x04);
+}
+
+static void test__websocket_parse_frame_header_buf__can_read_header_in_several_parts(void **states)
+{
+    struct websocket_connection conn = {
+        .state = WEBSOCKET_STATE_OPCODE,
+    };
+
+    const uint8_t input[] = {0x81, 0xFE, 0x12, 0x34, 0x01, 0x02, 0x03, 0x04};
+    int n;
+
+    n = websocket_parse_frame_header_buf(&conn, input, 3);
+    assert_int_equal(n, 3);
+    assert_int_equal(conn.state & ~WEBSOCKET_STATE_MASK, WEBSOCKET_STATE_LEN16_1);
+
+    n = websocket_parse_frame_header_buf(&conn, input + 3, sizeof(input) - 3);
+    assert_int_equal(n, 5);
+    assert_int_equal(conn.frame_length, 0x1234);
+    assert_int_equal(conn.state, WEBSOCKET_STATE_BODY);
+    assert_int_equal(conn.frame_mask[0], 0x01);
+    assert_int_equal(conn.frame_mask[3], 0x04);
+}
+
+static void test__websocket_parse_frame_header_buf__stops_at_end_of_header(void **states)
+{
+    struct websocket_connection conn = {
+        .state = WEBSOCKET_STATE_OPCODE,
+    };
+
+    const uint8_t input[] = {0x81, 0x02, 'a', 'b', 0x81, 0x01, 'c'};
+    int n = websocket_parse_frame_header_buf(&conn, input, sizeof(input));
+
+    assert_int_equal(n, 2);
+    assert_int_equal(conn.frame_length, 2);
+    assert_int_equal(conn.state, WEBSOCKET_STATE_BODY);
+}
+
+static void test__websocket_parse_frame_header_buf__sets_error_for_unknown_opcode(void **states)
+{
+    struct websocket_connection conn = {
+        .state = WEBSOCKET_STATE_OPCODE,
+    };
+
+    const uint8_t input[] = {0x83, 0x01, 'a'};
+    websocket_parse_frame_header_buf(&conn, input, sizeof(input));
+
+    assert_int_equal(conn.state, WEBSOCKET_STATE_ERROR);
+}
+
+static void test__websocket_read__reads_buffered_data_before_fd(void **states)
+{
+    const char rest[] = { 'c' ^ 'c', 'd' ^ 'd', 'e' ^ 'a' };
+
+    int fd = write_tmp_file_bin(rest, sizeof(rest));
+
+    struct websocket_connection conn = {
+        .fd = fd,
+        .state = WEBSOCKET_STATE_OPCODE,
+    };
+
+    const uint8_t input[] = { 0x81, 0x85, 'a', 'b', 'c', 'd', 'a' ^ 'a', 'b' ^ 'b' };
+    memcpy(conn.buf, input, sizeof(input));
+    conn.buf_length = sizeof(input);
+    conn.buf_index = websocket_parse_frame_header_buf(&conn, conn.buf, conn.buf_length);
+
+    char buf[6];
+    int n = websocket_read(&conn, buf, 5);
+    buf[5] = 0;
+
+    assert_int_equal(n, 5);
+    assert_string_equal(buf, "abcde");
+    assert_int_equal(conn.buf_index, conn.buf_length);
+    assert_int_equal(conn.state, WEBSOCKET_STATE_DONE);
+
+    close(fd);
+}
+
+static void test__websocket_connection__fits_in_its_memory_budget(void **states)
+{
+    assert_true(sizeof(struct websocket_connection) <= WEBSOCKET_CONNECTION_BUDGET);
+}
+
+static void test__websocket_frame_ready__is_true_when_the_whole_frame_is_buffered(void **states)
+{
+    struct websocket_connection conn = {
+        .state = WEBSOCKET_STATE_OPCODE,
+    };
+
+    const uint8_t input[] = { 0x81, 0x03, 'a', 'b', 'c' };
+    memcpy(conn.buf, input, sizeof(input));
+    conn.buf_length = 4;
+    conn.buf_index = websocket_parse_frame_header_buf(&conn, conn.buf, conn.buf_length);
+
+    assert_int_equal(conn.state, WEBSOCKET_STATE_BODY);
+    assert_false(websocket_frame_ready(&conn));
+
+    conn.buf_length = 5;
+    assert_true(websocket_frame_ready(&conn));
+}
+
+static void test__websocket_read_payload__collects_a_large_frame_across_reads(void **states)
+{
+    const uint8_t mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    uint8_t payload[300];
+    uint8_t masked[300];
+
+    for(int i = 0; i < sizeof(payload); i++) {
+        payload[i] = i;
+        masked[i] = payload[i] ^ mask[i % 4];
+    }
+
+    int fd = write_tmp_file_bin((const char *)masked + 50, sizeof(masked) - 50);
+
+    struct websocket_connection conn = {
+        .fd = fd,
+        .state = WEBSOCKET_STATE_OPCODE,
+    };
+
+    const uint8_t header[] = { 0x82, 0x80 | 126, 0x01, 0x2c, 0x12, 0x34, 0x56, 0x78 };
+    memcpy(conn.buf, header, sizeof(header));
+    memcpy(conn.buf + sizeof(header), masked, 50);
+    conn.buf_length = sizeof(header) + 50;
+    conn.buf_index = websocket_parse_frame_header_buf(&conn, conn.buf, conn.buf_length);
+
+    assert_int_equal(conn.frame_length, 300);
+    assert_false(websocket_frame_ready(&conn));
+
+    assert_int_equal(websocket_start_payload(&conn), 0);
+    assert_int_equal(conn.payload_length, 50);
+    assert_int_equal(conn.buf_index, conn.buf_length);
+
+    assert_int_equal(websocket_read_payload(&conn), 250);
+    assert_true(websocket_frame_ready(&conn));
+
+    uint8_t buf[300];
+    assert_int_equal(websocket_read(&conn, buf, sizeof(buf)), 300);
+    assert_memory_equal(buf, payload, sizeof(payload));
+    assert_int_equal(conn.state, WEBSOCKET_STATE_DONE);
+
+    free(conn.payload);
+    close(fd);
+}
+
+static void test__websocket_start_payload__rejects_frames_over_max_frame_len(void **states)
+{
+    struct websocket_connection conn = {
+        .frame_length = WEBSOCKET_MAX_FRAME_LEN + 1,
+        .state = WEBSOCKET_STATE_BODY,
+    };
+
+    assert_int_equal(websocket_start_payload(&conn), -1);
+    assert_null(conn.payload);
+}
+
+static void test__websocket_frame_data__unmasks_buffered_frame_in_place(void **states)
+{
+    struct websocket_connection conn = {
+        .state = WEBSOCKET_STATE_OPCODE,
+    };
+
+    const uint8_t input[] = { 0x81, 0x83, 0x01, 0x02, 0x03, 0x04, 'a' ^ 0x01, 'b' ^ 0x02, 'c' ^ 0x03, 0x81 };
+    memcpy(conn.buf, input, sizeof(input));
+    conn.buf_length = sizeof(input) - 1;
+    conn.buf_index = websocket_parse_frame_header_buf(&conn, conn.buf, conn.buf_length);
+
+    const uint8_t *data;
+
+    conn.buf_length--;
+    assert_int_equal(websocket_frame_data(&conn, &data), -1);
+    conn.buf_length++;
+
+    assert_int_equal(websocket_frame_data(&conn, &data), 3);
+    assert_ptr_equal(data, conn.buf + 6);
+    assert_memory_equal(data, "abc", 3);
+    assert_int_equal(conn.buf_index, 9);
+    assert_int_equal(conn.state, WEBSOCKET_STATE_DONE);
+}
+
+static void test__http_writev_all__waits_on_a_full_socket_above_fd_setsize(void **states)
+{
+    static char buf[1024 * 1024];
+    struct rlimit limit;
+    int sv[2];
+    int fd = FD_SETSIZE + 10;
+
+    assert_int_equal(getrlimit(RLIMIT_NOFILE, &limit), 0);
+    if(limit.rlim_cur <= fd) {
+        if(limit.rlim_max <= fd) {
+            skip();
+        }
+        limit.rlim_cur = fd + 1;
+        assert_int_equal(setrlimit(RLIMIT_NOFILE, &limit), 0);
+    }
+
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    assert_int_equal(dup2(sv[0], fd), fd);
+    close(sv[0]);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    pid_t pid = fork();
+    if(pid == 0) {
+        close(fd);
+
+        // Fall behind, so the writer finds the socket full
+        usleep(50000);
+        while(read(sv[1], buf, sizeof(buf)) > 0) {
+        }
+        _exit(0);
+    }
+    close(sv[1]);
+
+    struct iovec iov[] = {
+        { .iov_base = buf, .iov_len = sizeof(buf) / 2 },
+        { .iov_base = buf + sizeof(buf) / 2, .iov_len = sizeof(buf) / 2 },
+    };
+
+    assert_int_equal(http_writev_all(fd, iov, 2), sizeof(buf));
+
+    close(fd);
+    waitpid(pid, NULL, 0);
+}
+
 
 // Main ////////////////////////////////////////////////////////////////////////
 
@@ -1705,6 +2271,9 @@ const struct CMUnitTest tests_for_http_io[] = {
     cmocka_unit_test(test__http_read__returns_zero_at_end_of_file_with_te_identity),
     cmocka_unit_test(test__http_read__returns_zero_at_end_of_file_with_te_chunked),
     cmocka_unit_test(test__http_read__doesnt_read_more_than_content_length_te_identity),
+    cmocka_unit_test(test__http_read__returns_bytes_left_in_receive_buffer_first),
+    cmocka_unit_test(test__http_read__reads_chunked_body_through_receive_buffer),
+    cmocka_unit_test(test__http_read__fails_once_the_deadline_has_passed),
 
     cmocka_unit_test(test__http_write_header__writes_the_header),
     cmocka_unit_test(test__http_write_header__writes_nothing_when_name_is_null),
@@ -1742,6 +2311,8 @@ const struct CMUnitTest tests_for_http_io[] = {
 
     cmocka_unit_test(test__websocket_send_response__writes_response_without_sec_websocket_key),
     cmocka_unit_test(test__websocket_send_response__writes_response_with_sec_websocket_key),
+    cmocka_unit_test(test__websocket_send_response__writes_sec_websocket_extensions),
+    cmocka_unit_test(test__websocket_accept_key__matches_rfc_example),
 
     cmocka_unit_test(test__websocket_read__can_read_without_mask),
     cmocka_unit_test(test__websocket_read__can_read_with_mask),
@@ -1753,6 +2324,13 @@ const struct CMUnitTest tests_for_http_io[] = {
     cmocka_unit_test(test__websocket_send__sends_a_simple_message),
     cmocka_unit_test(test__websocket_send__sends_a_16bit_message),
     cmocka_unit_test(test__websocket_send__sends_a_64bit_message),
+    cmocka_unit_test(test__websocket_send__masks_frames_from_a_client),
+    cmocka_unit_test(test__websocket_send_begin__sends_fragments_with_fin_on_the_last),
+    cmocka_unit_test(test__websocket_send_begin__allows_control_frames_between_fragments),
+    cmocka_unit_test(test__websocket_send_begin__fails_if_a_message_is_in_progress),
+    cmocka_unit_test(test__websocket_send_continue__fails_without_begin),
+    cmocka_unit_test(test__websocket_send__compresses_long_messages_when_deflate_is_negotiated),
+    cmocka_unit_test(test__websocket_inflate_frame__replaces_payload_with_inflated_data),
 
     cmocka_unit_test(test__websocket_parse_frame_header__can_read_opcode),
     cmocka_unit_test(test__websocket_parse_frame_header__can_read_len8_no_mask),
@@ -1762,6 +2340,19 @@ const struct CMUnitTest tests_for_http_io[] = {
     cmocka_unit_test(test__websocket_parse_frame_header__can_read_len64_no_mask),
     cmocka_unit_test(test__websocket_parse_frame_header__can_read_len64_mask),
     cmocka_unit_test(test__websocket_parse_frame_header__sets_error_for_unknown_opcode),
+    cmocka_unit_test(test__websocket_parse_frame_header__accepts_rsv1_only_with_deflate),
+
+    cmocka_unit_test(test__websocket_parse_frame_header_buf__can_read_whole_header),
+    cmocka_unit_test(test__websocket_parse_frame_header_buf__can_read_header_in_several_parts),
+    cmocka_unit_test(test__websocket_parse_frame_header_buf__stops_at_end_of_header),
+    cmocka_unit_test(test__websocket_parse_frame_header_buf__sets_error_for_unknown_opcode),
+    cmocka_unit_test(test__websocket_read__reads_buffered_data_before_fd),
+    cmocka_unit_test(test__websocket_connection__fits_in_its_memory_budget),
+    cmocka_unit_test(test__websocket_frame_ready__is_true_when_the_whole_frame_is_buffered),
+    cmocka_unit_test(test__websocket_read_payload__collects_a_large_frame_across_reads),
+    cmocka_unit_test(test__websocket_frame_data__unmasks_buffered_frame_in_place),
+    cmocka_unit_test(test__websocket_start_payload__rejects_frames_over_max_frame_len),
+    cmocka_unit_test(test__http_writev_all__waits_on_a_full_socket_above_fd_setsize),
 };
 
 int main(void)
@@ -3,6 +3,8 @@
 #include <setjmp.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
 
 #include <cmocka.h>
 
@@ -16,7 +18,7 @@
 static int enable_malloc_mock = 0;
 static int enable_write_mock = 0;
 static int enable_read_mock = 0;
-static int enable_websocket_flush_mock = 0;
+static int enable_sendmsg_mock = 0;
 
 static char *wrap_read_buf;
 
@@ -70,16 +72,29 @@ ssize_t __wrap_read(int fd, void *buf, size_t count)
     }
 }
 
-void websocket_flush(struct websocket_connection *conn)
-{
-    if(enable_websocket_flush_mock) {
-        check_expected(conn);
-    }
-}
+ssize_t __real_sendmsg(int fd, const struct msghdr *msg, int flags);
 
-int websocket_is_readable(struct websocket_connection *conn)
+// A negative mock value is returned as -1 with errno set to its negation
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags)
 {
-    return 1;
+    if(enable_sendmsg_mock) {
+        size_t len = 0;
+        for(int i = 0; i < msg->msg_iovlen; i++) {
+            len += msg->msg_iov[i].iov_len;
+        }
+
+        check_expected(fd);
+        check_expected(len);
+
+        int n = mock();
+        if(n < 0) {
+            errno = -n;
+            return -1;
+        }
+        return (n > len) ? len : n;
+    } else {
+        return __real_sendmsg(fd, msg, flags);
+    }
 }
 
 
@@ -205,7 +220,7 @@ static void test__http_write_string__returns_minus_one_if_write_fails_with_te_id
     assert_int_equal(-1, ret);
 }
 
-static void test__websocket_read__reads_everything(void **states)
+static void test__websocket_read__returns_short_read_without_waiting(void **states)
 {
     struct websocket_connection conn = {
         .fd = 3,
@@ -223,32 +238,207 @@ static void test__websocket_read__reads_everything(void **states)
     expect_value(__wrap_read, count, 3);
     will_return(__wrap_read, 2);
 
+    int ret = websocket_read(&conn, buf, 3);
+    buf[ret] = 0;
+
+    assert_int_equal(2, ret);
+    assert_string_equal(buf, "ab");
+
     expect_value(__wrap_read, fd, 3);
-    expect_value(__wrap_read, buf, buf+2);
+    expect_value(__wrap_read, buf, buf);
     expect_value(__wrap_read, count, 1);
     will_return(__wrap_read, 1);
 
-    int ret = websocket_read(&conn, buf, 3);
+    ret = websocket_read(&conn, buf, 3);
     buf[ret] = 0;
 
-    assert_int_equal(3, ret);
-    assert_string_equal(buf, "abc");
+    assert_int_equal(1, ret);
+    assert_string_equal(buf, "c");
+    assert_int_equal(conn.state, WEBSOCKET_STATE_DONE);
 }
 
-static void test__websocket_write__flushes_socket(void **states)
+static void init_sendmsg_conn(struct websocket_connection *conn)
 {
-    int fd = open_tmp_file();
-    assert_true(0 <= fd);
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = 3;
+    websocket_queue_init(conn);
+}
 
-    struct websocket_connection conn = {
-        .fd = fd,
-    };
+static void test__websocket_send_begin__writes_header_and_payload_with_one_sendmsg(void **states)
+{
+    struct websocket_connection conn;
+    init_sendmsg_conn(&conn);
+
+    expect_value(__wrap_sendmsg, fd, 3);
+    expect_value(__wrap_sendmsg, len, 2 + 3);
+    will_return(__wrap_sendmsg, 5);
+
+    assert_int_equal(websocket_send_begin(&conn, "abc", 3, WEBSOCKET_FRAME_OPCODE_TEXT), 3);
+    assert_true(conn.send_fragmented);
+    assert_null(conn.out);
+}
+
+static void test__websocket_send_begin__queues_the_rest_after_partial_write(void **states)
+{
+    struct websocket_connection conn;
+    init_sendmsg_conn(&conn);
+
+    char str[300];
+    memset(str, 'x', sizeof(str));
+
+    expect_value(__wrap_sendmsg, fd, 3);
+    expect_value(__wrap_sendmsg, len, 4 + 300);
+    will_return(__wrap_sendmsg, 2);
+
+    assert_int_equal(websocket_send_begin(&conn, str, sizeof(str), WEBSOCKET_FRAME_OPCODE_BIN), 300);
+    assert_int_equal(conn.out->count, 1);
+    assert_int_equal(conn.out->offset, 2);
+
+    websocket_queue_clear(&conn);
+}
+
+static void test__websocket_send_begin__returns_minus_one_if_sendmsg_fails(void **states)
+{
+    struct websocket_connection conn;
+    init_sendmsg_conn(&conn);
+
+    expect_value(__wrap_sendmsg, fd, 3);
+    expect_value(__wrap_sendmsg, len, 2 + 3);
+    will_return(__wrap_sendmsg, -EPIPE);
+
+    assert_int_equal(websocket_send_begin(&conn, "abc", 3, WEBSOCKET_FRAME_OPCODE_TEXT), -1);
+    assert_false(conn.send_fragmented);
+    assert_null(conn.out);
+}
 
-    const char *str = "abc";
+static void test__websocket_send_end__lets_held_messages_go_after_the_last_fragment(void **states)
+{
+    struct websocket_connection conn;
+    init_sendmsg_conn(&conn);
+
+    expect_value(__wrap_sendmsg, fd, 3);
+    expect_value(__wrap_sendmsg, len, 2 + 1);
+    will_return(__wrap_sendmsg, -EAGAIN);
+
+    assert_int_equal(websocket_send_begin(&conn, "a", 1, WEBSOCKET_FRAME_OPCODE_TEXT), 1);
+
+    // A message sent now has to wait for the fragmented one to end, so it is not even tried
+    expect_value(__wrap_sendmsg, fd, 3);
+    expect_value(__wrap_sendmsg, len, 3);
+    will_return(__wrap_sendmsg, -EAGAIN);
+
+    assert_int_equal(websocket_send(&conn, "x", 1, WEBSOCKET_FRAME_OPCODE_TEXT), 1);
+    assert_int_equal(conn.out->count, 2);
+    assert_int_equal(conn.out->held, 1);
+
+    // A ping goes ahead of it
+    expect_value(__wrap_sendmsg, fd, 3);
+    expect_value(__wrap_sendmsg, len, 3);
+    will_return(__wrap_sendmsg, -EAGAIN);
+
+    assert_int_equal(websocket_send(&conn, "p", 1, WEBSOCKET_FRAME_OPCODE_PING), 1);
+
+    expect_value(__wrap_sendmsg, fd, 3);
+    expect_value(__wrap_sendmsg, len, 3 + 3);
+    will_return(__wrap_sendmsg, -EAGAIN);
+
+    assert_int_equal(websocket_send_end(&conn, "b", 1), 1);
+    assert_false(conn.send_fragmented);
+    assert_int_equal(conn.out->held, 0);
+
+    // The frames go out in order: fragment, ping, last fragment, held message
+    uint8_t order[] = { 0x01, 0x89, 0x80, 0x81 };
+    for(int i = 0; i < 4; i++) {
+        assert_int_equal(conn.out->frames[(conn.out->head + i) % WEBSOCKET_OUT_QUEUE_LEN]->data[0], order[i]);
+    }
+
+    expect_value(__wrap_sendmsg, fd, 3);
+    expect_value(__wrap_sendmsg, len, 4 * 3);
+    will_return(__wrap_sendmsg, 4 * 3);
+
+    assert_int_equal(websocket_queue_flush(&conn), 0);
+    assert_null(conn.out);
+}
+
+static void test__websocket_send__writes_header_and_payload_with_one_sendmsg(void **states)
+{
+    struct websocket_connection conn;
+    init_sendmsg_conn(&conn);
+
+    expect_value(__wrap_sendmsg, fd, 3);
+    expect_value(__wrap_sendmsg, len, 2 + 3);
+    will_return(__wrap_sendmsg, 5);
+
+    assert_int_equal(websocket_send(&conn, "abc", 3, WEBSOCKET_FRAME_OPCODE_TEXT), 3);
+    assert_null(conn.out);
+}
+
+static void test__websocket_send__queues_the_rest_after_partial_write(void **states)
+{
+    struct websocket_connection conn;
+    init_sendmsg_conn(&conn);
+
+    char str[300];
+    memset(str, 'x', sizeof(str));
+
+    expect_value(__wrap_sendmsg, fd, 3);
+    expect_value(__wrap_sendmsg, len, 4 + 300);
+    will_return(__wrap_sendmsg, 100);
+
+    assert_int_equal(websocket_send(&conn, str, sizeof(str), WEBSOCKET_FRAME_OPCODE_BIN), 300);
+    assert_int_equal(conn.out->count, 1);
+    assert_int_equal(conn.out->offset, 100);
+
+    // The next send flushes the rest first
+    expect_value(__wrap_sendmsg, fd, 3);
+    expect_value(__wrap_sendmsg, len, 204);
+    will_return(__wrap_sendmsg, 204);
+
+    expect_value(__wrap_sendmsg, fd, 3);
+    expect_value(__wrap_sendmsg, len, 2 + 3);
+    will_return(__wrap_sendmsg, 5);
+
+    assert_int_equal(websocket_send(&conn, "abc", 3, WEBSOCKET_FRAME_OPCODE_TEXT), 3);
+    assert_null(conn.out);
+}
+
+static void test__websocket_send__queues_frame_if_socket_is_full(void **states)
+{
+    struct websocket_connection conn;
+    init_sendmsg_conn(&conn);
+
+    expect_value(__wrap_sendmsg, fd, 3);
+    expect_value(__wrap_sendmsg, len, 2 + 3);
+    will_return(__wrap_sendmsg, -EAGAIN);
+
+    assert_int_equal(websocket_send(&conn, "abc", 3, WEBSOCKET_FRAME_OPCODE_TEXT), 3);
+    assert_int_equal(conn.out->count, 1);
+    assert_int_equal(conn.out->offset, 0);
+    assert_int_equal(conn.out->bytes, 5);
+
+    // Still full, so the next frame is queued behind it without trying to write it directly
+    expect_value(__wrap_sendmsg, fd, 3);
+    expect_value(__wrap_sendmsg, len, 5);
+    will_return(__wrap_sendmsg, -EAGAIN);
+
+    assert_int_equal(websocket_send(&conn, "de", 2, WEBSOCKET_FRAME_OPCODE_TEXT), 2);
+    assert_int_equal(conn.out->count, 2);
+    assert_int_equal(conn.out->bytes, 9);
+
+    websocket_queue_clear(&conn);
+}
+
+static void test__websocket_send__returns_minus_one_if_sendmsg_fails(void **states)
+{
+    struct websocket_connection conn;
+    init_sendmsg_conn(&conn);
 
-    expect_value(websocket_flush, conn, &conn);
+    expect_value(__wrap_sendmsg, fd, 3);
+    expect_value(__wrap_sendmsg, len, 2 + 3);
+    will_return(__wrap_sendmsg, -EPIPE);
 
-    websocket_send(&conn, str, strlen(str), WEBSOCKET_FRAME_OPCODE_TEXT | WEBSOCKET_FRAME_FIN);
+    assert_int_equal(websocket_send(&conn, "abc", 3, WEBSOCKET_FRAME_OPCODE_TEXT), -1);
+    assert_null(conn.out);
 }
 
 // Setup & Teardown ////////////////////////////////////////////////////////////
@@ -289,15 +479,15 @@ static int gr_teardown_write_mock(void **state)
     return 0;
 }
 
-static int gr_setup_websocket_flush_mock(void **state)
+static int gr_setup_sendmsg_mock(void **state)
 {
-    enable_websocket_flush_mock = 1;
+    enable_sendmsg_mock = 1;
     return 0;
 }
 
-static int gr_teardown_websocket_flush_mock(void **state)
+static int gr_teardown_sendmsg_mock(void **state)
 {
-    enable_websocket_flush_mock = 0;
+    enable_sendmsg_mock = 0;
     return 0;
 }
 
@@ -314,15 +504,22 @@ const struct CMUnitTest tests_for_http_io_read_mock[] = {
     cmocka_unit_test(test__http_getc__returns_minus_one_if_read_fails_with_te_chunked),
     cmocka_unit_test(test__http_getc__returns_minus_one_if_read_fails_in_beginning_of_chunk_header),
     cmocka_unit_test(test__http_getc__returns_minus_one_if_read_fails_at_end_of_chunk_header),
-    cmocka_unit_test(test__websocket_read__reads_everything),
+    cmocka_unit_test(test__websocket_read__returns_short_read_without_waiting),
 };
 
 const struct CMUnitTest tests_for_http_io_write_mock[] = {
     cmocka_unit_test(test__http_write_string__returns_minus_one_if_write_fails_with_te_identity),
 };
 
-const struct CMUnitTest tests_for_http_io_websocket_flush_mock[] = {
-    cmocka_unit_test(test__websocket_write__flushes_socket),
+const struct CMUnitTest tests_for_http_io_sendmsg_mock[] = {
+    cmocka_unit_test(test__websocket_send__writes_header_and_payload_with_one_sendmsg),
+    cmocka_unit_test(test__websocket_send__queues_the_rest_after_partial_write),
+    cmocka_unit_test(test__websocket_send__queues_frame_if_socket_is_full),
+    cmocka_unit_test(test__websocket_send__returns_minus_one_if_sendmsg_fails),
+    cmocka_unit_test(test__websocket_send_begin__writes_header_and_payload_with_one_sendmsg),
+    cmocka_unit_test(test__websocket_send_begin__queues_the_rest_after_partial_write),
+    cmocka_unit_test(test__websocket_send_begin__returns_minus_one_if_sendmsg_fails),
+    cmocka_unit_test(test__websocket_send_end__lets_held_messages_go_after_the_last_fragment),
 };
 
 int main(void)
@@ -332,7 +529,7 @@ int main(void)
     fails += cmocka_run_group_tests(tests_for_http_io_malloc_mock, gr_setup_malloc_mock, gr_teardown_malloc_mock);
     fails += cmocka_run_group_tests(tests_for_http_io_read_mock, gr_setup_read_mock, gr_teardown_read_mock);
     fails += cmocka_run_group_tests(tests_for_http_io_write_mock, gr_setup_write_mock, gr_teardown_write_mock);
-    fails += cmocka_run_group_tests(tests_for_http_io_websocket_flush_mock, gr_setup_websocket_flush_mock, gr_teardown_websocket_flush_mock);
+    fails += cmocka_run_group_tests(tests_for_http_io_sendmsg_mock, gr_setup_sendmsg_mock, gr_teardown_sendmsg_mock);
 
     return fails;
 }
@@ -47,7 +47,11 @@ static void init_request(struct http_request *request)
     request->read_content_length = -1;
     request->write_content_length = -1;
     request->websocket_key = 0;
+    request->websocket_extensions = 0;
     request->etag = 0;
+    request->if_modified_since = 0;
+    request->headers = 0;
+    request->headers_length = 0;
 }
 
 static void create_server_request(struct http_request *request)
@@ -70,7 +74,9 @@ static void free_request(struct http_request *request)
     free(request->query);
     free(request->content_type);
     free(request->websocket_key);
+    free(request->websocket_extensions);
     free(request->etag);
+    free(request->headers);
 }
 
 
@@ -303,6 +309,32 @@ static void test__http_parse_header__can_parse_sec_websocket_key(void **state)
     free_request(&request);
 }
 
+static void test__http_parse_header__can_parse_sec_websocket_extensions(void **state)
+{
+    struct http_request request;
+    create_server_request(&request);
+
+    parse_header_helper(&request, "GET / HTTP/1.1\r\nSec-WebSocket-Extensions: permessage-deflate; x\r\n");
+
+    assert_non_null(request.websocket_extensions);
+    assert_string_equal("permessage-deflate; x", request.websocket_extensions);
+
+    free_request(&request);
+}
+
+static void test__http_parse_header__joins_repeated_sec_websocket_extensions(void **state)
+{
+    struct http_request request;
+    create_server_request(&request);
+
+    parse_header_helper(&request, "GET / HTTP/1.1\r\nSec-WebSocket-Extensions: x-foo\r\nSec-WebSocket-Extensions: permessage-deflate\r\n");
+
+    assert_non_null(request.websocket_extensions);
+    assert_string_equal("x-foo, permessage-deflate", request.websocket_extensions);
+
+    free_request(&request);
+}
+
 static void test__http_parse_header__can_parse_if_none_match(void **state)
 {
     struct http_request request;
@@ -316,6 +348,76 @@ static void test__http_parse_header__can_parse_if_none_match(void **state)
     free_request(&request);
 }
 
+static void test__http_parse_header__can_parse_if_modified_since(void **state)
+{
+    struct http_request request;
+    create_server_request(&request);
+
+    parse_header_helper(&request, "GET / HTTP/1.1\r\nIf-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n");
+
+    assert_int_equal(784111777, request.if_modified_since);
+
+    free_request(&request);
+}
+
+static void test__http_parse_header__ignores_unparseable_if_modified_since(void **state)
+{
+    struct http_request request;
+    create_server_request(&request);
+
+    parse_header_helper(&request, "GET / HTTP/1.1\r\nIf-Modified-Since: yesterday\r\n");
+
+    assert_false(http_is_error(&request));
+    assert_int_equal(0, request.if_modified_since);
+
+    free_request(&request);
+}
+
+static void test__http_parse_header__can_parse_connection_close_if_server(void **state)
+{
+    struct http_request request;
+    create_server_request(&request);
+
+    parse_header_helper(&request, "GET / HTTP/1.1\r\nConnection: close\r\n");
+
+    assert_true(request.flags & HTTP_FLAG_CONNECTION_CLOSE);
+
+    free_request(&request);
+}
+
+#if HTTP_SERVER_PROXY
+static void test__http_parse_header__keeps_header_lines_if_server(void **state)
+{
+    struct http_request request;
+    create_server_request(&request);
+
+    parse_header_helper(&request, "GET / HTTP/1.1\r\nHost: test\r\nCookie: a=1\r\nIf-None-Match: \"abc\"\r\n\r\n");
+
+    assert_string_equal("Host: test\r\nCookie: a=1\r\nIf-None-Match: \"abc\"\r\n", request.headers);
+    assert_int_equal(strlen(request.headers), request.headers_length);
+    assert_string_equal("abc", request.etag);
+
+    free_request(&request);
+}
+
+static void test__http_parse_header__too_many_header_lines_give_error(void **state)
+{
+    struct http_request request;
+    create_server_request(&request);
+
+    parse_header_helper(&request, "GET / HTTP/1.1\r\n");
+    for(int i = 0; (i < HTTP_SERVER_PROXY_HEADERS_LEN / 16) && !http_is_error(&request); i++) {
+        parse_header_helper(&request, "X-Header: 1234\r\n");
+    }
+
+    assert_true(http_is_error(&request));
+    assert_int_equal(HTTP_STATUS_HEADERS_TOO_LARGE, request.error);
+    assert_true(request.headers_length <= HTTP_SERVER_PROXY_HEADERS_LEN);
+
+    free_request(&request);
+}
+#endif
+
 static void test__http_parse_header__unparseable_content_length_gives_error(void **state)
 {
     struct http_request request;
@@ -341,6 +443,65 @@ static void test__http_parse_header__can_parse_content_type_if_client(void **sta
     free_request(&request);
 }
 
+static void test__http_parse_header__can_parse_websocket_upgrade_if_client(void **state)
+{
+    struct http_request request;
+    create_client_request(&request);
+
+    parse_header_helper(&request, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n");
+
+    assert_int_equal(101, request.status);
+    assert_true(request.flags & HTTP_FLAG_WEBSOCKET);
+    assert_non_null(request.websocket_key);
+    assert_string_equal("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", request.websocket_key);
+    free_request(&request);
+}
+
+static void test__http_parse_header__can_parse_connection_close_if_client(void **state)
+{
+    struct http_request request;
+    create_client_request(&request);
+
+    parse_header_helper(&request, "HTTP/1.1 200 OK\r\nConnection: close\r\n");
+
+    assert_true(request.flags & HTTP_FLAG_CONNECTION_CLOSE);
+    free_request(&request);
+}
+
+static void test__http_parse_header__does_not_set_connection_close_for_keep_alive(void **state)
+{
+    struct http_request request;
+    create_client_request(&request);
+
+    parse_header_helper(&request, "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\n");
+
+    assert_false(request.flags & HTTP_FLAG_CONNECTION_CLOSE);
+    free_request(&request);
+}
+
+static void test__http_parse_header__sets_read_gzip_if_client_asked_for_it(void **state)
+{
+    struct http_request request;
+    create_client_request(&request);
+    request.flags |= HTTP_FLAG_ACCEPT_GZIP;
+
+    parse_header_helper(&request, "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n");
+
+    assert_true(request.flags & HTTP_FLAG_READ_GZIP);
+    free_request(&request);
+}
+
+static void test__http_parse_header__does_not_set_read_gzip_if_client_did_not_ask_for_it(void **state)
+{
+    struct http_request request;
+    create_client_request(&request);
+
+    parse_header_helper(&request, "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n");
+
+    assert_false(request.flags & HTTP_FLAG_READ_GZIP);
+    free_request(&request);
+}
+
 
 static void test__http_parse_header__missing_newline_in_header_gives_error(void **state)
 {
@@ -551,6 +712,8 @@ static void test__http_parse_header__returns_error_when_malloc_fails_when_alloca
     assert_null(request.host);
     assert_true(http_is_error(&request));
     assert_int_equal(HTTP_STATUS_INTERNAL_SERVER_ERROR, request.error);
+
+    free(request.headers);
 }
 
 static void test__http_parse_header__returns_error_when_malloc_fails_when_allocating_websocket_key(void **state)
@@ -584,6 +747,8 @@ static void test__http_parse_header__returns_error_when_malloc_fails_when_alloca
     assert_null(request.websocket_key);
     assert_true(http_is_error(&request));
     assert_int_equal(HTTP_STATUS_INTERNAL_SERVER_ERROR, request.error);
+
+    free(request.headers);
 }
 
 static void test__http_parse_header__returns_error_when_malloc_fails_when_allocating_content_type(void **state)
@@ -873,10 +1038,24 @@ const struct CMUnitTest tests_for_http_parse_header[] = {
     cmocka_unit_test(test__http_parse_header__does_not_set_accept_encoding_if_client),
     cmocka_unit_test(test__http_parse_header__can_parse_transfer_encoding_chunked),
     cmocka_unit_test(test__http_parse_header__can_parse_content_type_if_client),
+    cmocka_unit_test(test__http_parse_header__can_parse_websocket_upgrade_if_client),
+    cmocka_unit_test(test__http_parse_header__can_parse_connection_close_if_client),
+    cmocka_unit_test(test__http_parse_header__does_not_set_connection_close_for_keep_alive),
+    cmocka_unit_test(test__http_parse_header__sets_read_gzip_if_client_asked_for_it),
+    cmocka_unit_test(test__http_parse_header__does_not_set_read_gzip_if_client_did_not_ask_for_it),
     cmocka_unit_test(test__http_parse_header__can_parse_content_length),
     cmocka_unit_test(test__http_parse_header__can_parse_upgrade_websocket),
     cmocka_unit_test(test__http_parse_header__can_parse_sec_websocket_key),
+    cmocka_unit_test(test__http_parse_header__can_parse_sec_websocket_extensions),
+    cmocka_unit_test(test__http_parse_header__joins_repeated_sec_websocket_extensions),
     cmocka_unit_test(test__http_parse_header__can_parse_if_none_match),
+    cmocka_unit_test(test__http_parse_header__can_parse_if_modified_since),
+    cmocka_unit_test(test__http_parse_header__ignores_unparseable_if_modified_since),
+    cmocka_unit_test(test__http_parse_header__can_parse_connection_close_if_server),
+#if HTTP_SERVER_PROXY
+    cmocka_unit_test(test__http_parse_header__keeps_header_lines_if_server),
+    cmocka_unit_test(test__http_parse_header__too_many_header_lines_give_error),
+#endif
     cmocka_unit_test(test__http_parse_header__unparseable_content_length_gives_error),
     cmocka_unit_test(test__http_parse_header__missing_newline_in_header_gives_error),
     cmocka_unit_test(test__http_parse_header__client_can_read_response),
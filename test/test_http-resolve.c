@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <cmocka.h>
+
+#include "http-sm/http.h"
+#include "http-private.h"
+
+#include "test-util.h"
+
+// Helpers /////////////////////////////////////////////////////////////////////
+
+static void make_address(struct http_address *address, uint32_t ip, int port)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)&address->addr;
+
+    memset(address, 0, sizeof(*address));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    sin->sin_addr.s_addr = htonl(ip);
+    address->length = sizeof(*sin);
+}
+
+static uint32_t address_ip(const struct http_address *address)
+{
+    return ntohl(((const struct sockaddr_in *)&address->addr)->sin_addr.s_addr);
+}
+
+// Stands in for the name server: names starting with unknown do not exist, all others have two addresses
+static int resolve(const char *host, int port, struct http_address *addrs, int max)
+{
+    check_expected(host);
+
+    if(strncmp(host, "unknown", 7) == 0) {
+        return -1;
+    }
+
+    make_address(&addrs[0], 0x0A000001, port);
+    if(max < 2) {
+        return 1;
+    }
+    make_address(&addrs[1], 0x0A000002, port);
+
+    return 2;
+}
+
+// The same for lookups on the helper thread, where cmocka can not check anything
+static int resolve_calls;
+
+static int resolve_on_thread(const char *host, int port, struct http_address *addrs, int max)
+{
+    __atomic_add_fetch(&resolve_calls, 1, __ATOMIC_RELAXED);
+    usleep(10000);
+
+    make_address(&addrs[0], 0x0A000001, port);
+    return 1;
+}
+
+static int setup(void **state)
+{
+    http_set_resolver(resolve);
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    http_set_resolver(NULL);
+    return 0;
+}
+
+// Tests ///////////////////////////////////////////////////////////////////////
+
+static void test__http_resolve__uses_the_resolver(void **states)
+{
+    struct http_address addrs[HTTP_DNS_MAX_ADDRESSES];
+
+    expect_string(resolve, host, "example.com");
+
+    assert_int_equal(http_resolve("example.com", 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000), 2);
+    assert_int_equal(address_ip(&addrs[0]), 0x0A000001);
+    assert_int_equal(address_ip(&addrs[1]), 0x0A000002);
+    assert_int_equal(ntohs(((struct sockaddr_in *)&addrs[0].addr)->sin_port), 80);
+}
+
+static void test__http_resolve__caches_lookup_until_it_expires(void **states)
+{
+    struct http_address addrs[HTTP_DNS_MAX_ADDRESSES];
+
+    expect_string(resolve, host, "example.com");
+    assert_int_equal(http_resolve("example.com", 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000), 2);
+
+    assert_int_equal(http_resolve("example.com", 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000 + HTTP_DNS_CACHE_TTL - 1), 2);
+    assert_int_equal(address_ip(&addrs[0]), 0x0A000001);
+
+    expect_string(resolve, host, "example.com");
+    assert_int_equal(http_resolve("example.com", 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000 + HTTP_DNS_CACHE_TTL), 2);
+}
+
+static void test__http_resolve__caches_each_port(void **states)
+{
+    struct http_address addrs[HTTP_DNS_MAX_ADDRESSES];
+
+    expect_string(resolve, host, "example.com");
+    assert_int_equal(http_resolve("example.com", 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000), 2);
+
+    expect_string(resolve, host, "example.com");
+    assert_int_equal(http_resolve("example.com", 8080, addrs, HTTP_DNS_MAX_ADDRESSES, 1000), 2);
+    assert_int_equal(ntohs(((struct sockaddr_in *)&addrs[0].addr)->sin_port), 8080);
+}
+
+static void test__http_resolve__caches_failed_lookup_for_a_shorter_time(void **states)
+{
+    struct http_address addrs[HTTP_DNS_MAX_ADDRESSES];
+
+    expect_string(resolve, host, "unknown.example");
+    assert_int_equal(http_resolve("unknown.example", 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000), -1);
+
+    assert_int_equal(http_resolve("unknown.example", 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000 + HTTP_DNS_NEGATIVE_TTL - 1), -1);
+
+    expect_string(resolve, host, "unknown.example");
+    assert_int_equal(http_resolve("unknown.example", 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000 + HTTP_DNS_NEGATIVE_TTL), -1);
+}
+
+static void test__http_resolve__returns_at_most_max_addresses(void **states)
+{
+    struct http_address addrs[1];
+
+    expect_string(resolve, host, "example.com");
+    assert_int_equal(http_resolve("example.com", 80, addrs, 1, 1000), 1);
+    assert_int_equal(address_ip(&addrs[0]), 0x0A000001);
+}
+
+static void test__http_resolve__replaces_entry_closest_to_expiring_when_full(void **states)
+{
+    struct http_address addrs[HTTP_DNS_MAX_ADDRESSES];
+    char host[32];
+
+    for(int i = 0; i < HTTP_DNS_CACHE_SIZE + 1; i++) {
+        snprintf(host, sizeof(host), "host%d", i);
+        expect_string(resolve, host, host);
+        http_resolve(host, 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000 + i);
+    }
+
+    // host0 was pushed out, the rest are still cached
+    expect_string(resolve, host, "host0");
+    http_resolve("host0", 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000 + HTTP_DNS_CACHE_SIZE);
+
+    http_resolve("host2", 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000 + HTTP_DNS_CACHE_SIZE);
+}
+
+static void test__http_resolve_prefer__moves_address_to_the_front(void **states)
+{
+    struct http_address addrs[HTTP_DNS_MAX_ADDRESSES];
+
+    expect_string(resolve, host, "example.com");
+    assert_int_equal(http_resolve("example.com", 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000), 2);
+
+    http_resolve_prefer("example.com", 80, &addrs[1]);
+
+    assert_int_equal(http_resolve("example.com", 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000), 2);
+    assert_int_equal(address_ip(&addrs[0]), 0x0A000002);
+    assert_int_equal(address_ip(&addrs[1]), 0x0A000001);
+}
+
+static void test__http_resolve_nowait__looks_up_on_a_thread_and_caches_the_result(void **states)
+{
+    struct http_address addrs[HTTP_DNS_MAX_ADDRESSES];
+    int n = 0;
+
+    http_set_resolver(resolve_on_thread);
+    resolve_calls = 0;
+
+    assert_int_equal(http_resolve_nowait("example.com", 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000), 0);
+
+    for(int i = 0; (i < 1000) && (n == 0); i++) {
+        usleep(1000);
+        n = http_resolve_nowait("example.com", 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000);
+    }
+
+    assert_int_equal(n, 1);
+    assert_int_equal(address_ip(&addrs[0]), 0x0A000001);
+
+    // Answered from the cache, without another lookup
+    assert_int_equal(http_resolve("example.com", 80, addrs, HTTP_DNS_MAX_ADDRESSES, 1000), 1);
+    assert_int_equal(__atomic_load_n(&resolve_calls, __ATOMIC_RELAXED), 1);
+}
+
+// Main ////////////////////////////////////////////////////////////////////////
+
+const struct CMUnitTest tests_for_http_resolve[] = {
+    cmocka_unit_test_setup_teardown(test__http_resolve__uses_the_resolver, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_resolve__caches_lookup_until_it_expires, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_resolve__caches_each_port, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_resolve__caches_failed_lookup_for_a_shorter_time, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_resolve__returns_at_most_max_addresses, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_resolve__replaces_entry_closest_to_expiring_when_full, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_resolve_prefer__moves_address_to_the_front, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_resolve_nowait__looks_up_on_a_thread_and_caches_the_result, setup, teardown),
+};
+
+int main(void)
+{
+    int fails = 0;
+    fails += cmocka_run_group_tests(tests_for_http_resolve, NULL, NULL);
+
+    return fails;
+}
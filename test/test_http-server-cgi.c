@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <utime.h>
+#include <sys/socket.h>
+
+#include <cmocka.h>
+
+#include "http-sm/http.h"
+#include "http-private.h"
+
+#include "test-util.h"
+
+// Mocks ///////////////////////////////////////////////////////////////////////
+
+// The one in http-server-main.c, without the server loop around it
+int http_begin_response(struct http_request *request, int status, const char *content_type)
+{
+    char buf[64];
+
+    request->state = HTTP_STATE_SERVER_WRITE_HEADER;
+
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\n", status, http_status_string(status));
+    http_write_string(request, buf);
+    http_write_header(request, "Connection", "close");
+
+    if(content_type) {
+        http_write_header(request, "Content-Type", content_type);
+    }
+
+    return 0;
+}
+
+// Helpers /////////////////////////////////////////////////////////////////////
+
+static char dir[40];
+static char filename[sizeof(dir) + 16];
+static char gzip_filename[sizeof(dir) + 16];
+static char answer[1024];
+
+static void write_file(const char *name, const char *s, time_t mtime)
+{
+    struct utimbuf t = { mtime, mtime };
+
+    FILE *f = fopen(name, "w");
+    assert_non_null(f);
+    fputs(s, f);
+    fclose(f);
+
+    assert_int_equal(utime(name, &t), 0);
+}
+
+// Run cgi_fs on a conditional GET of filename and return the status line of the response
+static int get(int flags, time_t if_modified_since)
+{
+    struct http_request request;
+    int sv[2];
+
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+
+    memset(&request, 0, sizeof(request));
+    request.fd = sv[0];
+    request.read_content_length = -1;
+    request.write_content_length = -1;
+    request.poke = -1;
+    request.method = HTTP_METHOD_GET;
+    request.path = "/file.txt";
+    request.cgi_arg = filename;
+    request.flags = flags;
+    request.if_modified_since = if_modified_since;
+    request.state = HTTP_STATE_SERVER_WRITE_BEGIN;
+
+    while(cgi_fs(&request) == HTTP_CGI_MORE) {
+    }
+
+    close(sv[0]);
+
+    int n = recv(sv[1], answer, sizeof(answer) - 1, 0);
+    close(sv[1]);
+
+    assert_true(n > 12);
+    answer[n] = 0;
+
+    return strtol(answer + 9, NULL, 10);
+}
+
+static int setup(void **state)
+{
+    strcpy(dir, "/tmp/test_http-server-cgi-XXXXXX");
+    assert_non_null(mkdtemp(dir));
+
+    snprintf(filename, sizeof(filename), "%s/file.txt", dir);
+    snprintf(gzip_filename, sizeof(gzip_filename), "%s/file.txt.gz", dir);
+
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    unlink(filename);
+    unlink(gzip_filename);
+    rmdir(dir);
+
+    return 0;
+}
+
+// Tests ///////////////////////////////////////////////////////////////////////
+
+static void test__cgi_fs__does_not_answer_from_the_cache_if_the_file_has_changed(void **state)
+{
+    write_file(filename, "hello", 1000000);
+
+    assert_int_equal(get(0, 1000000), HTTP_STATUS_NOT_MODIFIED);
+
+    write_file(filename, "hello again", 2000000);
+
+    assert_int_equal(get(0, 1000000), HTTP_STATUS_OK);
+}
+
+static void test__cgi_fs__keeps_the_validators_of_the_gzip_file_apart(void **state)
+{
+    write_file(filename, "hello", 1000000);
+    write_file(gzip_filename, "not really gzip", 3000000);
+
+    assert_int_equal(get(0, 2000000), HTTP_STATUS_NOT_MODIFIED);
+    assert_int_equal(get(HTTP_FLAG_ACCEPT_GZIP, 2000000), HTTP_STATUS_OK);
+    assert_int_equal(get(HTTP_FLAG_ACCEPT_GZIP, 3000000), HTTP_STATUS_NOT_MODIFIED);
+    assert_int_equal(get(0, 2000000), HTTP_STATUS_NOT_MODIFIED);
+}
+
+static void test__cgi_fs__leaves_out_the_date_of_a_file_from_before_1970(void **state)
+{
+    write_file(filename, "hello", -1000);
+
+    assert_int_equal(get(0, 1000000), HTTP_STATUS_OK);
+    assert_null(strstr(answer, "Last-Modified"));
+    assert_non_null(strstr(answer, "\r\n\r\nhello"));
+
+    assert_int_equal(get(0, 1000000), HTTP_STATUS_OK);
+}
+
+// Main ////////////////////////////////////////////////////////////////////////
+
+const struct CMUnitTest tests_for_http_server_cgi[] = {
+    cmocka_unit_test_setup_teardown(test__cgi_fs__does_not_answer_from_the_cache_if_the_file_has_changed, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__cgi_fs__keeps_the_validators_of_the_gzip_file_apart, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__cgi_fs__leaves_out_the_date_of_a_file_from_before_1970, setup, teardown),
+};
+
+int main(void)
+{
+    int fails = 0;
+    fails += cmocka_run_group_tests(tests_for_http_server_cgi, NULL, NULL);
+
+    return fails;
+}
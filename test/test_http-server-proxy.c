@@ -0,0 +1,505 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <cmocka.h>
+
+#include "http-sm/http.h"
+#include "http-private.h"
+
+#include "test-util.h"
+
+// Mocks ///////////////////////////////////////////////////////////////////////
+
+static int resolve(const char *host, int port, struct http_address *addrs, int max)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)&addrs[0].addr;
+
+    memset(&addrs[0], 0, sizeof(addrs[0]));
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addrs[0].length = sizeof(*sin);
+
+    return 1;
+}
+
+int websocket_channel_wake_fd(void)
+{
+    return -1;
+}
+
+// The one in http-server-main.c, without the server loop around it
+int http_begin_response(struct http_request *request, int status, const char *content_type)
+{
+    char buf[64];
+
+    request->state = HTTP_STATE_SERVER_WRITE_HEADER;
+
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\n", status, http_status_string(status));
+    http_write_string(request, buf);
+    http_write_header(request, "Connection", "close");
+
+    if(content_type) {
+        http_write_header(request, "Content-Type", content_type);
+    }
+
+    return 0;
+}
+
+// Helpers /////////////////////////////////////////////////////////////////////
+
+#define BIG_LEN 200000
+
+// An upstream server on 127.0.0.1, answering each request with response once request_length bytes have come
+static int listen_fd;
+static int listen_port;
+static int peer_fd[2];
+static const char *response;
+static int response_length;
+static int response_index;
+
+static char received[BIG_LEN + 1024];
+static int received_length;
+static int request_length;
+
+// The client of the server request, on the other end of a socket pair
+static int client_fd;
+// The client takes nothing of the response while this is set
+static int client_stalled;
+static const char *body;
+static int body_length;
+static int body_index;
+
+static char answer[BIG_LEN + 1024];
+static int answer_length;
+
+static struct http_proxy_target target = { "localhost", 0, "/api" };
+static struct http_request owner;
+
+static int set_nonblock(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+static int readable(int fd)
+{
+    fd_set set;
+    struct timeval t = { 0, 0 };
+
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+
+    return select(fd + 1, &set, NULL, NULL, &t) > 0;
+}
+
+static void serve(void)
+{
+    if(readable(listen_fd)) {
+        for(int i = 0; i < 2; i++) {
+            if(peer_fd[i] <= 0) {
+                peer_fd[i] = set_nonblock(accept(listen_fd, NULL, NULL));
+                break;
+            }
+        }
+    }
+
+    for(int i = 0; i < 2; i++) {
+        if(peer_fd[i] <= 0) {
+            continue;
+        }
+
+        int n = recv(peer_fd[i], received + received_length, sizeof(received) - received_length - 1, 0);
+        if(n > 0) {
+            received_length += n;
+            received[received_length] = 0;
+
+            // The whole request has come with this read
+            if((received_length - n < request_length) && (received_length >= request_length)) {
+                response_index = 0;
+            }
+        }
+
+        if(response && (received_length >= request_length) && (response_index < response_length)) {
+            n = send(peer_fd[i], response + response_index, response_length - response_index, 0);
+            if(n > 0) {
+                response_index += n;
+            }
+        }
+    }
+}
+
+// Talk to the proxy the way a client does, sending the body and taking the response as they go
+static void talk(void)
+{
+    if(body_index < body_length) {
+        int n = send(client_fd, body + body_index, body_length - body_index, 0);
+        if(n > 0) {
+            body_index += n;
+        }
+    }
+
+    if(client_stalled) {
+        return;
+    }
+
+    int n;
+    while((n = recv(client_fd, answer + answer_length, sizeof(answer) - answer_length - 1, 0)) > 0) {
+        answer_length += n;
+        answer[answer_length] = 0;
+    }
+}
+
+static void init_owner(int method, const char *path, const char *query)
+{
+    int sv[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+
+    memset(&owner, 0, sizeof(owner));
+    http_response_init(&owner);
+    owner.fd = sv[0];
+    owner.method = method;
+    owner.path = (char *)path;
+    owner.query = (char *)query;
+    owner.cgi_arg = &target;
+    owner.state = HTTP_STATE_SERVER_WRITE_BEGIN;
+
+    client_fd = set_nonblock(sv[1]);
+    answer_length = 0;
+    answer[0] = 0;
+    body = NULL;
+    body_length = 0;
+    body_index = 0;
+    client_stalled = 0;
+}
+
+static void set_body(const char *s, int len)
+{
+    body = s;
+    body_length = len;
+    owner.read_content_length = len;
+    owner.state = HTTP_STATE_SERVER_READ_BODY;
+}
+
+static void set_response(const char *s, int len)
+{
+    response = s;
+    response_length = len;
+    response_index = len;
+}
+
+// Run the handler the way the server loop does, until it is done or count times
+static enum http_cgi_state run(int count)
+{
+    enum http_cgi_state state = HTTP_CGI_MORE;
+
+    for(int n = 0; n < count; n++) {
+        http_proxy_expire(http_clock());
+
+        int ready = !(owner.flags & HTTP_FLAG_WAIT) &&
+                    (!(owner.state & HTTP_STATE_READ) || readable(owner.fd));
+
+        if(ready) {
+            state = cgi_proxy(&owner);
+
+            if((state == HTTP_CGI_DONE) || (state == HTTP_CGI_KEEP_ALIVE) || http_is_error(&owner)) {
+                break;
+            } else if((state == HTTP_CGI_WAIT) && http_proxy_pending(&owner)) {
+                owner.flags |= HTTP_FLAG_WAIT;
+            }
+        }
+
+        fd_set set_read, set_write;
+        int maxfd = 0;
+        struct timeval t = { 0, 1000 };
+
+        FD_ZERO(&set_read);
+        FD_ZERO(&set_write);
+
+        http_proxy_create_select_sets(&set_read, &set_write, &maxfd);
+
+        if(select(maxfd + 1, &set_read, &set_write, NULL, &t) > 0) {
+            http_proxy_handle_select(&set_read, &set_write);
+        }
+
+        serve();
+        talk();
+    }
+
+    http_proxy_dispatch(NULL);
+    talk();
+
+    return state;
+}
+
+static enum http_cgi_state run_until_done(void)
+{
+    return run(5000);
+}
+
+static int setup(void **state)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert_true(listen_fd >= 0);
+    assert_int_equal(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    assert_int_equal(listen(listen_fd, 2), 0);
+    assert_int_equal(getsockname(listen_fd, (struct sockaddr *)&addr, &len), 0);
+    listen_port = ntohs(addr.sin_port);
+    target.port = listen_port;
+
+    http_set_resolver(resolve);
+    set_response(NULL, 0);
+    received_length = 0;
+    request_length = 1;
+
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    http_client_pool_clear();
+    http_set_resolver(NULL);
+
+    for(int i = 0; i < 2; i++) {
+        if(peer_fd[i] > 0) {
+            close(peer_fd[i]);
+            peer_fd[i] = 0;
+        }
+    }
+
+    if(listen_fd > 0) {
+        close(listen_fd);
+        listen_fd = 0;
+    }
+
+    if(owner.fd >= 0) {
+        close(owner.fd);
+        owner.fd = -1;
+    }
+
+    close(client_fd);
+
+    return 0;
+}
+
+// Tests ///////////////////////////////////////////////////////////////////////
+
+static void test__cgi_proxy__passes_on_request_and_response_with_content_length(void **states)
+{
+    const char *s = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nContent-Type: text/plain\r\n\r\nHello";
+    set_response(s, strlen(s));
+
+    init_owner(HTTP_METHOD_GET, "/api/hello", "a=1");
+
+    assert_int_equal(run_until_done(), HTTP_CGI_KEEP_ALIVE);
+
+    assert_string_prefix_equal("GET /hello?a=1 HTTP/1.1\r\n", received);
+    assert_string_contains_substring("Connection: keep-alive\r\n", received);
+    assert_string_equal("HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nContent-Length: 5\r\nContent-Type: text/plain\r\n\r\nHello", answer);
+}
+
+static void test__cgi_proxy__passes_on_request_headers_but_not_hop_by_hop_ones(void **states)
+{
+    const char *s = "HTTP/1.1 204 No Content\r\n\r\n";
+    set_response(s, strlen(s));
+
+    init_owner(HTTP_METHOD_GET, "/api/hello", NULL);
+    owner.headers = "Host: example.com\r\nUser-Agent: test\r\nConnection: close, X-Hop\r\nCookie: a=1\r\n"
+                    "Keep-Alive: timeout=5\r\nX-Hop: 1\r\nAuthorization: Basic dGVzdA==\r\nContent-Type: text/plain\r\n";
+    owner.headers_length = strlen(owner.headers);
+    owner.flags |= HTTP_FLAG_CONNECTION_CLOSE;
+
+    assert_int_equal(run_until_done(), HTTP_CGI_DONE);
+    assert_string_equal("HTTP/1.1 204 No Content\r\nConnection: close\r\n\r\n", answer);
+
+    char expected[256];
+    snprintf(expected, sizeof(expected), "GET /hello HTTP/1.1\r\nHost: localhost:%d\r\nUser-Agent: test\r\nCookie: a=1\r\n"
+             "Authorization: Basic dGVzdA==\r\nContent-Type: text/plain\r\nConnection: keep-alive\r\n\r\n", listen_port);
+    assert_string_equal(expected, received);
+}
+
+static void test__cgi_proxy__passes_on_chunked_response_as_it_is(void **states)
+{
+    const char *s = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nHello\r\n7;ext=1\r\n, World\r\n0\r\nX-Trailer: 1\r\n\r\n";
+    set_response(s, strlen(s));
+
+    init_owner(HTTP_METHOD_GET, "/api/", NULL);
+
+    assert_int_equal(run_until_done(), HTTP_CGI_KEEP_ALIVE);
+
+    assert_string_prefix_equal("GET / HTTP/1.1\r\n", received);
+    assert_string_equal("HTTP/1.1 200 OK\r\nConnection: keep-alive\r\nTransfer-Encoding: chunked\r\n\r\n"
+                        "5\r\nHello\r\n7;ext=1\r\n, World\r\n0\r\nX-Trailer: 1\r\n\r\n", answer);
+}
+
+static void test__cgi_proxy__passes_on_bodies_longer_than_the_pipe(void **states)
+{
+    static char big_body[BIG_LEN];
+    static char big_response[BIG_LEN + 64];
+
+    for(int i = 0; i < BIG_LEN; i++) {
+        big_body[i] = 'a' + (i % 23);
+    }
+
+    int head = sprintf(big_response, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", BIG_LEN);
+    memcpy(big_response + head, big_body, BIG_LEN);
+    set_response(big_response, head + BIG_LEN);
+
+    init_owner(HTTP_METHOD_POST, "/api/post", NULL);
+    set_body(big_body, BIG_LEN);
+
+    // The response is sent once the whole request has come
+    request_length = BIG_LEN + 1;
+
+    assert_int_equal(run_until_done(), HTTP_CGI_KEEP_ALIVE);
+
+    char *end = strstr(received, "\r\n\r\n");
+    assert_non_null(end);
+    assert_string_contains_substring("Content-Length: 200000\r\n", received);
+    assert_int_equal(received + received_length - (end + 4), BIG_LEN);
+    assert_memory_equal(end + 4, big_body, BIG_LEN);
+
+    end = strstr(answer, "\r\n\r\n");
+    assert_non_null(end);
+    assert_int_equal(answer + answer_length - (end + 4), BIG_LEN);
+    assert_memory_equal(end + 4, big_body, BIG_LEN);
+}
+
+static void test__cgi_proxy__does_not_block_while_the_client_takes_no_more(void **states)
+{
+    static char big_response[BIG_LEN + 64];
+
+    int head = sprintf(big_response, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n", BIG_LEN);
+    memset(big_response + head, 'x', BIG_LEN);
+    set_response(big_response, head + BIG_LEN);
+
+    init_owner(HTTP_METHOD_GET, "/api/big", NULL);
+
+    // More than the client socket holds
+    int size = 4096;
+    assert_int_equal(setsockopt(owner.fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)), 0);
+    assert_int_equal(setsockopt(client_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)), 0);
+
+    client_stalled = 1;
+    assert_int_equal(run(200), HTTP_CGI_MORE);
+    assert_true(owner.state & HTTP_STATE_WRITE);
+
+    client_stalled = 0;
+    assert_int_equal(run_until_done(), HTTP_CGI_KEEP_ALIVE);
+
+    char *end = strstr(answer, "\r\n\r\n");
+    assert_non_null(end);
+    assert_int_equal(answer + answer_length - (end + 4), BIG_LEN);
+}
+
+static void test__cgi_proxy__keeps_upstream_connection_for_the_next_request(void **states)
+{
+    const char *s = "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nOK";
+    set_response(s, strlen(s));
+
+    init_owner(HTTP_METHOD_GET, "/api/a", NULL);
+    assert_int_equal(run_until_done(), HTTP_CGI_KEEP_ALIVE);
+    close(owner.fd);
+    close(client_fd);
+
+    received_length = 0;
+    set_response(s, strlen(s));
+
+    init_owner(HTTP_METHOD_GET, "/api/b", NULL);
+    assert_int_equal(run_until_done(), HTTP_CGI_KEEP_ALIVE);
+
+    assert_string_prefix_equal("GET /b HTTP/1.1\r\n", received);
+    assert_string_contains_substring("\r\n\r\nOK", answer);
+
+    // The second request went over the first connection
+    assert_true(peer_fd[1] <= 0);
+}
+
+static void test__cgi_proxy__answers_bad_gateway_if_the_connection_is_refused(void **states)
+{
+    close(listen_fd);
+    listen_fd = 0;
+
+    init_owner(HTTP_METHOD_GET, "/api/", NULL);
+
+    assert_int_equal(run_until_done(), HTTP_CGI_DONE);
+    assert_string_prefix_equal("HTTP/1.1 502 Bad Gateway\r\n", answer);
+}
+
+static void test__cgi_proxy__closes_client_connection_if_upstream_closes_in_the_body(void **states)
+{
+    const char *s = "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nHello";
+    set_response(s, strlen(s));
+
+    init_owner(HTTP_METHOD_GET, "/api/", NULL);
+
+    // Run until the head has been passed on, then cut the upstream connection
+    for(int n = 0; (n < 100) && !strstr(answer, "Hello"); n++) {
+        assert_int_not_equal(run(10), HTTP_CGI_DONE);
+    }
+
+    close(peer_fd[0]);
+    peer_fd[0] = 0;
+
+    assert_int_equal(run_until_done(), HTTP_CGI_MORE);
+    assert_true(http_is_error(&owner));
+    assert_string_prefix_equal("HTTP/1.1 200 OK\r\n", answer);
+}
+
+static void test__http_proxy_expire__answers_gateway_timeout(void **states)
+{
+    init_owner(HTTP_METHOD_GET, "/api/", NULL);
+
+    assert_int_equal(cgi_proxy(&owner), HTTP_CGI_WAIT);
+    assert_int_equal(http_proxy_pending(&owner), 1);
+    owner.flags |= HTTP_FLAG_WAIT;
+
+    http_proxy_expire(http_clock() + HTTP_SERVER_PROXY_TIMEOUT_SECS);
+    assert_int_equal(http_proxy_pending(&owner), 0);
+    assert_false(owner.flags & HTTP_FLAG_WAIT);
+
+    assert_int_equal(cgi_proxy(&owner), HTTP_CGI_DONE);
+    http_proxy_dispatch(NULL);
+    talk();
+
+    assert_string_prefix_equal("HTTP/1.1 504 Gateway Timeout\r\n", answer);
+}
+
+// Main ////////////////////////////////////////////////////////////////////////
+
+const struct CMUnitTest tests_for_http_server_proxy[] = {
+    cmocka_unit_test_setup_teardown(test__cgi_proxy__passes_on_request_and_response_with_content_length, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__cgi_proxy__passes_on_request_headers_but_not_hop_by_hop_ones, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__cgi_proxy__passes_on_chunked_response_as_it_is, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__cgi_proxy__passes_on_bodies_longer_than_the_pipe, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__cgi_proxy__does_not_block_while_the_client_takes_no_more, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__cgi_proxy__keeps_upstream_connection_for_the_next_request, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__cgi_proxy__answers_bad_gateway_if_the_connection_is_refused, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__cgi_proxy__closes_client_connection_if_upstream_closes_in_the_body, setup, teardown),
+    cmocka_unit_test_setup_teardown(test__http_proxy_expire__answers_gateway_timeout, setup, teardown),
+};
+
+int main(void)
+{
+    int fails = 0;
+
+    // Writing to a closed connection fails instead of ending the test
+    signal(SIGPIPE, SIG_IGN);
+
+    fails += cmocka_run_group_tests(tests_for_http_server_proxy, NULL, NULL);
+
+    return fails;
+}
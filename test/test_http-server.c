@@ -37,6 +37,40 @@ static void test__http_server_match_url__returns_false_if_wildcard_does_not_matc
     assert_false(http_server_match_url("a*", "bcd"));
 }
 
+static void test__http_server_match_glob__returns_true_if_the_string_exactly_matches(void **states)
+{
+    assert_true(http_server_match_glob("/index.html", "/index.html"));
+    assert_true(http_server_match_glob("", ""));
+}
+
+static void test__http_server_match_glob__returns_false_for_partial_match(void **states)
+{
+    assert_false(http_server_match_glob("/index", "/index.html"));
+    assert_false(http_server_match_glob("/index.html", "/index"));
+}
+
+static void test__http_server_match_glob__can_match_a_prefix(void **states)
+{
+    assert_true(http_server_match_glob("/assets/*", "/assets/app.js"));
+    assert_true(http_server_match_glob("/assets/*", "/assets/"));
+    assert_false(http_server_match_glob("/assets/*", "/index.html"));
+}
+
+static void test__http_server_match_glob__can_match_a_suffix(void **states)
+{
+    assert_true(http_server_match_glob("*.js", "/assets/app.js"));
+    assert_false(http_server_match_glob("*.js", "/assets/app.json"));
+}
+
+static void test__http_server_match_glob__can_match_several_wildcards(void **states)
+{
+    assert_true(http_server_match_glob("/app.*.js", "/app.3f2a9c.js"));
+    assert_true(http_server_match_glob("*/app.*.*", "/a/b/app.3f2a9c.js"));
+    assert_true(http_server_match_glob("*a*a*", "banana"));
+    assert_false(http_server_match_glob("/app.*.js", "/app.js"));
+    assert_false(http_server_match_glob("*a*a*a*a", "banana"));
+}
+
 static void assert_non_empty_string(const char *s)
 {
     assert_non_null(s);
@@ -74,6 +108,11 @@ const struct CMUnitTest tests_for_http_server[] = {
     cmocka_unit_test(test__http_server_match_url__returns_false_if_the_url_does_not_match),
     cmocka_unit_test(test__http_server_match_url__returns_true_if_wildcard_matches),
     cmocka_unit_test(test__http_server_match_url__returns_false_if_wildcard_does_not_matches),
+    cmocka_unit_test(test__http_server_match_glob__returns_true_if_the_string_exactly_matches),
+    cmocka_unit_test(test__http_server_match_glob__returns_false_for_partial_match),
+    cmocka_unit_test(test__http_server_match_glob__can_match_a_prefix),
+    cmocka_unit_test(test__http_server_match_glob__can_match_a_suffix),
+    cmocka_unit_test(test__http_server_match_glob__can_match_several_wildcards),
 };
 
 const struct CMUnitTest tests_for_http_status_string[] = {
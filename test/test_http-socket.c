@@ -3,6 +3,7 @@
 #include <setjmp.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
 
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -10,12 +11,18 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <cmocka.h>
 
 #include "http-sm/http.h"
 #include "http-private.h"
 
+#if HTTP_SERVER_EPOLL
+#include <sys/epoll.h>
+#endif
+
 // Mocks ///////////////////////////////////////////////////////////////////////
 
 struct addrinfo *getaddrinfo_res;
@@ -51,7 +58,12 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
     check_expected(sockfd);
     check_expected(addr);
     check_expected(addrlen);
-    return mock();
+
+    int ret = mock();
+    if(ret < 0) {
+        errno = ECONNREFUSED;
+    }
+    return ret;
 }
 
 int close(int fd)
@@ -101,19 +113,40 @@ int setsockopt(int fd, int level, int optname, const void *optval, socklen_t opt
     return mock();
 }
 
+int websocket_channel_wake_fd(void)
+{
+    return -1;
+}
+
 // Helper Functions ////////////////////////////////////////////////////////////
 
 static void init_server(struct http_server *server)
 {
     for(int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++) {
         server->request[i].fd = -1;
+        server->request[i].flags = 0;
     }
-    for(int i = 0; i < WEBSOCKET_SERVER_MAX_CONNECTIONS; i++) {
-        server->websocket_connection[i].fd = -1;
-    }
+    server->websocket_connections = NULL;
+    server->websocket_count = 0;
     server->fd = 3;
 }
 
+static void add_websocket(struct http_server *server, struct websocket_connection *conn, int fd)
+{
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fd;
+    conn->next = server->websocket_connections;
+    server->websocket_connections = conn;
+    server->websocket_count++;
+}
+
+// Lookups are cached, so every test starts from an empty cache
+static int clear_dns_cache(void **state)
+{
+    http_resolve_clear();
+    return 0;
+}
+
 // Tests ///////////////////////////////////////////////////////////////////////
 
 
@@ -162,7 +195,7 @@ static void test__http_open_request_socket__can_open_a_socket(void **states)
     will_return(socket, 3);
 
     expect_value(connect, sockfd, 3);
-    expect_value(connect, addr, res.ai_addr);
+    expect_memory(connect, addr, &sa, sizeof(sa));
     expect_value(connect, addrlen, res.ai_addrlen);
     will_return(connect, 0);
 
@@ -418,6 +451,111 @@ static void test__http_open_request_socket__returns_minus_one_if_connect_fails(v
     assert_int_equal(-1, fd);
 }
 
+static void test__http_open_request_socket__tries_next_address_if_connect_fails(void **states)
+{
+    struct http_request request = {
+        .host = "www.example.com",
+        .path = "/",
+        .port = 80,
+        .method = HTTP_METHOD_GET,
+    };
+
+    struct sockaddr_in sa[2] = {
+        {
+            .sin_family = AF_INET,
+            .sin_port = htons(80),
+            .sin_addr = { .s_addr = htonl(0xC0A80104) },
+        },
+        {
+            .sin_family = AF_INET,
+            .sin_port = htons(80),
+            .sin_addr = { .s_addr = htonl(0xC0A80105) },
+        },
+    };
+
+    struct addrinfo res[2] = {
+        {
+            .ai_family = AF_INET,
+            .ai_socktype = SOCK_STREAM,
+            .ai_addr = (struct sockaddr *)&sa[0],
+            .ai_addrlen = sizeof(sa[0]),
+            .ai_next = &res[1],
+        },
+        {
+            .ai_family = AF_INET,
+            .ai_socktype = SOCK_STREAM,
+            .ai_addr = (struct sockaddr *)&sa[1],
+            .ai_addrlen = sizeof(sa[1]),
+        },
+    };
+
+    getaddrinfo_res = &res[0];
+
+    expect_any(getaddrinfo, node);
+    expect_any(getaddrinfo, service);
+    expect_any(getaddrinfo, hints);
+    will_return(getaddrinfo, 0);
+
+    expect_value(freeaddrinfo, res, getaddrinfo_res);
+
+    expect_any_count(socket, domain, 2);
+    expect_any_count(socket, type, 2);
+    expect_any_count(socket, protocol, 2);
+    will_return(socket, 3);
+    will_return(socket, 4);
+
+    expect_value(connect, sockfd, 3);
+    expect_memory(connect, addr, &sa[0], sizeof(sa[0]));
+    expect_any(connect, addrlen);
+    will_return(connect, -1);
+
+    expect_value(close, fd, 3);
+    will_return(close, 0);
+
+    expect_value(connect, sockfd, 4);
+    expect_memory(connect, addr, &sa[1], sizeof(sa[1]));
+    expect_any(connect, addrlen);
+    will_return(connect, 0);
+
+    int fd = http_open_request_socket(&request);
+    assert_int_equal(4, fd);
+    assert_int_equal(4, request.fd);
+
+    // The next request to the host uses the cached lookup, starting with the address that worked
+    expect_any(socket, domain);
+    expect_any(socket, type);
+    expect_any(socket, protocol);
+    will_return(socket, 5);
+
+    expect_value(connect, sockfd, 5);
+    expect_memory(connect, addr, &sa[1], sizeof(sa[1]));
+    expect_any(connect, addrlen);
+    will_return(connect, 0);
+
+    fd = http_open_request_socket(&request);
+    assert_int_equal(5, fd);
+}
+
+static void test__http_open_request_socket__remembers_failed_lookup(void **states)
+{
+    struct http_request request = {
+        .host = "www.example.com",
+        .path = "/",
+        .port = 80,
+        .method = HTTP_METHOD_GET,
+    };
+
+    getaddrinfo_res = 0;
+
+    expect_any(getaddrinfo, node);
+    expect_any(getaddrinfo, service);
+    expect_any(getaddrinfo, hints);
+    will_return(getaddrinfo, EAI_NONAME);
+
+    assert_int_equal(-1, http_open_request_socket(&request));
+    assert_int_equal(-1, http_open_request_socket(&request));
+}
+
 static void test__http_close__closes_the_socket(void **states)
 {
     struct http_request request = {
@@ -448,6 +586,65 @@ static void test__http_close__closes_the_socket_when_client(void **states)
     assert_int_equal(-1, request.fd);
 }
 
+static void test__http_close__keeps_a_finished_client_connection_for_reuse(void **states)
+{
+    struct http_request request = {
+        .fd = 3,
+        .state = HTTP_STATE_CLIENT_READ_BODY,
+        .host = "www.example.com",
+        .port = 80,
+        .status = 200,
+        .read_content_length = 0,
+    };
+
+    int ret = http_close(&request);
+    assert_int_equal(0, ret);
+    assert_int_equal(-1, request.fd);
+
+    expect_value(close, fd, 3);
+    will_return(close, 0);
+
+    http_client_pool_clear();
+}
+
+static void test__http_close__closes_a_client_connection_with_unread_body(void **states)
+{
+    struct http_request request = {
+        .fd = 3,
+        .state = HTTP_STATE_CLIENT_READ_BODY,
+        .host = "www.example.com",
+        .port = 80,
+        .status = 200,
+        .read_content_length = 10,
+    };
+
+    expect_value(close, fd, 3);
+    will_return(close, 0);
+
+    int ret = http_close(&request);
+    assert_int_equal(0, ret);
+    assert_int_equal(-1, request.fd);
+}
+
+static void test__http_close__closes_a_client_connection_the_server_closes(void **states)
+{
+    struct http_request request = {
+        .fd = 3,
+        .state = HTTP_STATE_CLIENT_IDLE,
+        .flags = HTTP_FLAG_READ_CHUNKED | HTTP_FLAG_CONNECTION_CLOSE,
+        .host = "www.example.com",
+        .port = 80,
+        .status = 200,
+    };
+
+    expect_value(close, fd, 3);
+    will_return(close, 0);
+
+    int ret = http_close(&request);
+    assert_int_equal(0, ret);
+    assert_int_equal(-1, request.fd);
+}
+
 static void test__http_close__does_not_close_a_closed_socket(void **states)
 {
     struct http_request request = {
@@ -724,9 +921,10 @@ static void test__http_create_select_sets__can_add_websocket_fd_less_than_listen
     int maxfd;
     fd_set set_read, set_write, set_test;
 
-    init_server(&server);
+    struct websocket_connection conn;
 
-    server.websocket_connection[0].fd = 2;
+    init_server(&server);
+    add_websocket(&server, &conn, 2);
 
     int n = http_create_select_sets(&server, &set_read, &set_write, &maxfd);
 
@@ -748,9 +946,10 @@ static void test__http_create_select_sets__can_add_websocket_fd_greater_than_lis
     int maxfd;
     fd_set set_read, set_write, set_test;
 
-    init_server(&server);
+    struct websocket_connection conn;
 
-    server.websocket_connection[0].fd = 5;
+    init_server(&server);
+    add_websocket(&server, &conn, 5);
 
     int n = http_create_select_sets(&server, &set_read, &set_write, &maxfd);
 
@@ -766,6 +965,140 @@ static void test__http_create_select_sets__can_add_websocket_fd_greater_than_lis
     assert_memory_equal(&set_test, &set_write, sizeof(set_test));
 }
 
+static void test__http_create_select_sets__adds_websocket_with_queued_frames_to_write_set(void **states)
+{
+    struct http_server server;
+    int maxfd;
+    fd_set set_read, set_write, set_test;
+
+    struct websocket_connection conn;
+    struct websocket_out_queue queue = {
+        .count = 1,
+    };
+
+    init_server(&server);
+    add_websocket(&server, &conn, 5);
+    conn.out = &queue;
+
+    http_create_select_sets(&server, &set_read, &set_write, &maxfd);
+
+    FD_ZERO(&set_test);
+    FD_SET(5, &set_test);
+    FD_SET(3, &set_test);
+    assert_memory_equal(&set_test, &set_read, sizeof(set_test));
+
+    FD_ZERO(&set_test);
+    FD_SET(5, &set_test);
+    assert_memory_equal(&set_test, &set_write, sizeof(set_test));
+}
+
+#if HTTP_SERVER_EPOLL
+static void init_poll_server(struct http_server *server, int listen_fd)
+{
+    init_server(server);
+
+    server->epoll_fd = epoll_create1(0);
+    assert_true(server->epoll_fd >= 0);
+
+    server->fd = listen_fd;
+    assert_int_equal(http_poll_set(server, EPOLL_CTL_ADD, listen_fd, EPOLLIN, &server->fd), 0);
+    server->listen_events = EPOLLIN;
+
+    for(int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++) {
+        server->request_poll_fd[i] = -1;
+        server->request_events[i] = 0;
+    }
+}
+
+static void test__http_poll_update_requests__registers_request_for_its_state(void **states)
+{
+    struct http_server server;
+    int listen_fds[2];
+    int fds[2];
+
+    assert_int_equal(pipe(listen_fds), 0);
+    assert_int_equal(pipe(fds), 0);
+
+    init_poll_server(&server, listen_fds[0]);
+
+    server.request[0].fd = fds[0];
+    server.request[0].state = HTTP_STATE_SERVER_READ_METHOD;
+
+    assert_int_equal(http_poll_update_requests(&server), 1);
+    assert_int_equal(server.request_poll_fd[0], fds[0]);
+    assert_int_equal(server.request_events[0], EPOLLIN);
+
+    assert_int_equal(write(fds[1], "G", 1), 1);
+
+    struct epoll_event ev;
+    assert_int_equal(epoll_wait(server.epoll_fd, &ev, 1, 0), 1);
+    assert_ptr_equal(ev.data.ptr, &server.request[0]);
+}
+
+static void test__http_poll_update_requests__stops_listening_when_all_slots_are_taken(void **states)
+{
+    struct http_server server;
+    int listen_fds[2];
+
+    assert_int_equal(pipe(listen_fds), 0);
+
+    init_poll_server(&server, listen_fds[0]);
+
+    for(int i = 0; i < HTTP_SERVER_MAX_CONNECTIONS; i++) {
+        int fds[2];
+        assert_int_equal(pipe(fds), 0);
+        server.request[i].fd = fds[1];
+        server.request[i].state = HTTP_STATE_SERVER_WRITE_BODY;
+    }
+
+    assert_int_equal(http_poll_update_requests(&server), HTTP_SERVER_MAX_CONNECTIONS);
+    assert_int_equal(server.listen_events, 0);
+    assert_int_equal(server.request_events[0], EPOLLOUT);
+
+    // A pending connection does not wake the loop while there is no slot for it
+    assert_int_equal(write(listen_fds[1], "x", 1), 1);
+
+    struct epoll_event ev[HTTP_SERVER_MAX_CONNECTIONS + 1];
+    int n = epoll_wait(server.epoll_fd, ev, HTTP_SERVER_MAX_CONNECTIONS + 1, 0);
+    assert_int_equal(n, HTTP_SERVER_MAX_CONNECTIONS);
+    for(int i = 0; i < n; i++) {
+        assert_true(ev[i].data.ptr != &server.fd);
+    }
+}
+
+static void test__websocket_poll_update__waits_for_writable_only_with_queued_frames(void **states)
+{
+    struct http_server server;
+    struct websocket_connection conn;
+    struct websocket_out_queue queue = {
+        .count = 1,
+    };
+    int listen_fds[2];
+    int fds[2];
+
+    assert_int_equal(pipe(listen_fds), 0);
+    assert_int_equal(pipe(fds), 0);
+
+    init_poll_server(&server, listen_fds[0]);
+    add_websocket(&server, &conn, fds[1]);
+
+    assert_int_equal(http_poll_set(&server, EPOLL_CTL_ADD, conn.fd, EPOLLIN, &conn), 0);
+    conn.poll_events = EPOLLIN;
+
+    struct epoll_event ev;
+
+    websocket_poll_update(&server, &conn);
+    assert_int_equal(conn.poll_events, EPOLLIN);
+    assert_int_equal(epoll_wait(server.epoll_fd, &ev, 1, 0), 0);
+
+    conn.out = &queue;
+    websocket_poll_update(&server, &conn);
+    assert_int_equal(conn.poll_events, EPOLLIN | EPOLLOUT);
+    assert_int_equal(epoll_wait(server.epoll_fd, &ev, 1, 0), 1);
+    assert_ptr_equal(ev.data.ptr, &conn);
+    assert_true(ev.events & EPOLLOUT);
+}
+#endif
 
 static void test__http_accept_new_connection__accepts_new_connection_when_not_all_slots_are_empty(void **states)
 {
@@ -906,6 +1239,9 @@ static void test__http_response_init__initialises_the_request(void **states)
     assert_null(request.cgi_arg);
     assert_null(request.websocket_key);
     assert_null(request.etag);
+    assert_int_equal(request.if_modified_since, 0);
+    assert_null(request.headers);
+    assert_int_equal(request.headers_length, 0);
     assert_true(http_is_server(&request));
     assert_false(http_is_client(&request));
     assert_false(http_is_error(&request));
@@ -932,18 +1268,20 @@ static void test__http_request_init__initialises_the_request(void **states)
     assert_int_equal(request.write_content_length, -1);
     assert_int_equal(request.poke, -1);
     assert_int_equal(request.chunk_length, 0);
+    assert_int_equal(request.timeout_ms, HTTP_CLIENT_TIMEOUT_MS);
+    assert_null(request.content_type);
+    assert_null(request.websocket_key);
     assert_false(http_is_server(&request));
     assert_true(http_is_client(&request));
     assert_false(http_is_error(&request));
 }
 
-static void test__websocket_flush__flushes_the_socket(void **states)
+static void test__websocket_set_nodelay__sets_tcp_nodelay(void **states)
 {
     struct websocket_connection conn = {
         .fd = 3,
     };
 
-    int val_zero = 0;
     int val_one = 1;
 
     expect_value(setsockopt, fd, 3);
@@ -951,33 +1289,44 @@ static void test__websocket_flush__flushes_the_socket(void **states)
     expect_value(setsockopt, optname, TCP_NODELAY);
     expect_memory(setsockopt, optval, &val_one, sizeof(val_one));
     expect_value(setsockopt, optlen, sizeof(val_one));
-
     will_return(setsockopt, 0);
 
-    expect_value(setsockopt, fd, 3);
-    expect_value(setsockopt, level, IPPROTO_TCP);
-    expect_value(setsockopt, optname, TCP_NODELAY);
-    expect_memory(setsockopt, optval, &val_zero, sizeof(val_zero));
-    expect_value(setsockopt, optlen, sizeof(val_zero));
-    will_return(setsockopt, 0);
+    websocket_set_nodelay(&conn);
+}
+
+static void test__websocket_set_nonblock__sets_o_nonblock(void **states)
+{
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+
+    struct websocket_connection conn = {
+        .fd = fds[0],
+    };
+
+    websocket_set_nonblock(&conn);
 
-    websocket_flush(&conn);
+    assert_true(fcntl(fds[0], F_GETFL, 0) & O_NONBLOCK);
 }
 
 
 // Main ////////////////////////////////////////////////////////////////////////
 
 const struct CMUnitTest tests_for_http_socket[] = {
-    cmocka_unit_test(test__http_open_request_socket__can_open_a_socket),
-    cmocka_unit_test(test__http_open_request_socket__can_open_a_socket_with_non_default_port),
-    cmocka_unit_test(test__http_open_request_socket__default_port_is_80),
-    cmocka_unit_test(test__http_open_request_socket__returns_minus_one_if_getaddrinfo_returns_error),
-    cmocka_unit_test(test__http_open_request_socket__returns_minus_one_if_getaddrinfo_gives_null_res),
-    cmocka_unit_test(test__http_open_request_socket__returns_minus_one_if_socket_fails),
-    cmocka_unit_test(test__http_open_request_socket__returns_minus_one_if_connect_fails),
+    cmocka_unit_test_setup_teardown(test__http_open_request_socket__can_open_a_socket, NULL, clear_dns_cache),
+    cmocka_unit_test_setup_teardown(test__http_open_request_socket__can_open_a_socket_with_non_default_port, NULL, clear_dns_cache),
+    cmocka_unit_test_setup_teardown(test__http_open_request_socket__default_port_is_80, NULL, clear_dns_cache),
+    cmocka_unit_test_setup_teardown(test__http_open_request_socket__returns_minus_one_if_getaddrinfo_returns_error, NULL, clear_dns_cache),
+    cmocka_unit_test_setup_teardown(test__http_open_request_socket__returns_minus_one_if_getaddrinfo_gives_null_res, NULL, clear_dns_cache),
+    cmocka_unit_test_setup_teardown(test__http_open_request_socket__returns_minus_one_if_socket_fails, NULL, clear_dns_cache),
+    cmocka_unit_test_setup_teardown(test__http_open_request_socket__returns_minus_one_if_connect_fails, NULL, clear_dns_cache),
+    cmocka_unit_test_setup_teardown(test__http_open_request_socket__tries_next_address_if_connect_fails, NULL, clear_dns_cache),
+    cmocka_unit_test_setup_teardown(test__http_open_request_socket__remembers_failed_lookup, NULL, clear_dns_cache),
 
     cmocka_unit_test(test__http_close__closes_the_socket),
     cmocka_unit_test(test__http_close__closes_the_socket_when_client),
+    cmocka_unit_test(test__http_close__keeps_a_finished_client_connection_for_reuse),
+    cmocka_unit_test(test__http_close__closes_a_client_connection_with_unread_body),
+    cmocka_unit_test(test__http_close__closes_a_client_connection_the_server_closes),
     cmocka_unit_test(test__http_close__does_not_close_a_closed_socket),
 
     cmocka_unit_test(test__http_open_listen_socket__opens_and_binds_and_listens),
@@ -995,6 +1344,7 @@ const struct CMUnitTest tests_for_http_socket[] = {
     cmocka_unit_test(test__http_create_select_sets__does_not_add_nonready_socket_to_sets),
     cmocka_unit_test(test__http_create_select_sets__can_add_websocket_fd_less_than_listen_fd_to_read_set),
     cmocka_unit_test(test__http_create_select_sets__can_add_websocket_fd_greater_than_listen_fd_to_read_set),
+    cmocka_unit_test(test__http_create_select_sets__adds_websocket_with_queued_frames_to_write_set),
 
     cmocka_unit_test(test__http_accept_new_connection__fails_if_there_are_no_empty_slot),
     cmocka_unit_test(test__http_accept_new_connection__accepts_new_connection_when_all_slots_are_empty),
@@ -1005,7 +1355,13 @@ const struct CMUnitTest tests_for_http_socket[] = {
     cmocka_unit_test(test__http_response_init__initialises_the_request),
     cmocka_unit_test(test__http_request_init__initialises_the_request),
 
-    cmocka_unit_test(test__websocket_flush__flushes_the_socket),
+    cmocka_unit_test(test__websocket_set_nodelay__sets_tcp_nodelay),
+    cmocka_unit_test(test__websocket_set_nonblock__sets_o_nonblock),
+#if HTTP_SERVER_EPOLL
+    cmocka_unit_test(test__http_poll_update_requests__registers_request_for_its_state),
+    cmocka_unit_test(test__http_poll_update_requests__stops_listening_when_all_slots_are_taken),
+    cmocka_unit_test(test__websocket_poll_update__waits_for_writable_only_with_queued_frames),
+#endif
 };
 
 int main(void)
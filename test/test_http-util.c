@@ -396,6 +396,116 @@ static void test__http_base64_decode__can_decode_all_values(void **state)
     }
 }
 
+static void test__http_format_date__formats_an_imf_fixdate(void **state)
+{
+    char buf[HTTP_DATE_LEN + 1];
+
+    assert_int_equal(HTTP_DATE_LEN, http_format_date(buf, 784111777));
+    assert_string_equal("Sun, 06 Nov 1994 08:49:37 GMT", buf);
+
+    http_format_date(buf, 0);
+    assert_string_equal("Thu, 01 Jan 1970 00:00:00 GMT", buf);
+
+    http_format_date(buf, 951782400);
+    assert_string_equal("Tue, 29 Feb 2000 00:00:00 GMT", buf);
+}
+
+static void test__http_parse_date__parses_an_imf_fixdate(void **state)
+{
+    assert_int_equal(784111777, http_parse_date("Sun, 06 Nov 1994 08:49:37 GMT"));
+    assert_int_equal(0, http_parse_date("Thu, 01 Jan 1970 00:00:00 GMT"));
+    assert_int_equal(951782400, http_parse_date("Tue, 29 Feb 2000 00:00:00 GMT"));
+}
+
+static void test__http_parse_date__returns_zero_for_unsupported_formats(void **state)
+{
+    assert_int_equal(0, http_parse_date(NULL));
+    assert_int_equal(0, http_parse_date(""));
+    assert_int_equal(0, http_parse_date("Sunday, 06-Nov-94 08:49:37 GMT"));
+    assert_int_equal(0, http_parse_date("Sun Nov  6 08:49:37 1994"));
+    assert_int_equal(0, http_parse_date("Sun, 06 Xyz 1994 08:49:37 GMT"));
+    assert_int_equal(0, http_parse_date("Sun, 06 Nov 1994 08:49:37 CET"));
+    assert_int_equal(0, http_parse_date("Sun, 06 Nov 1994 25:49:37 GMT"));
+}
+
+static void test__http_parse_date__is_the_inverse_of_http_format_date(void **state)
+{
+    char buf[HTTP_DATE_LEN + 1];
+
+    for(time_t t = 0; t < 4102444800; t += 86400 * 37 + 3671) {
+        http_format_date(buf, t);
+        assert_int_equal(t, http_parse_date(buf));
+    }
+}
+
+static void test__http_chunk_frame__stops_where_the_chunk_data_starts(void **state)
+{
+    struct http_chunk_decoder d;
+    const char data[] = "1a;name=value\r\nabc";
+
+    http_chunk_init(&d);
+
+    assert_int_equal(sizeof(data) - 4, http_chunk_frame(&d, data, sizeof(data) - 1));
+    assert_int_equal(HTTP_CHUNK_DATA, d.state);
+    assert_int_equal(0x1a, d.length);
+}
+
+static void test__http_chunk_frame__returns_error_for_a_bad_chunk_size(void **state)
+{
+    struct http_chunk_decoder d;
+
+    http_chunk_init(&d);
+    assert_int_equal(-1, http_chunk_frame(&d, "x\r\n", 3));
+
+    http_chunk_init(&d);
+    assert_int_equal(-1, http_chunk_frame(&d, "1x\r\n", 4));
+}
+
+static void test__http_chunk_frame__returns_error_if_the_chunk_size_overflows(void **state)
+{
+    struct http_chunk_decoder d;
+
+    http_chunk_init(&d);
+    assert_int_equal(-1, http_chunk_frame(&d, "123456789\r\n", 11));
+}
+
+static void test__http_chunk_frame__returns_error_if_chunk_data_is_not_followed_by_crlf(void **state)
+{
+    struct http_chunk_decoder d;
+
+    http_chunk_init(&d);
+    assert_int_equal(3, http_chunk_frame(&d, "1\r\n", 3));
+    http_chunk_data(&d, 1);
+
+    assert_int_equal(-1, http_chunk_frame(&d, "x\r\n", 3));
+}
+
+static void test__http_chunk_skip__goes_through_a_whole_body_with_trailers(void **state)
+{
+    struct http_chunk_decoder d;
+    const char body[] = "3\r\nabc\r\n10 ; ext\r\n0123456789abcdef\r\n0\r\nX-Trailer: 1\r\n\r\nnext";
+
+    http_chunk_init(&d);
+
+    assert_int_equal(sizeof(body) - 5, http_chunk_skip(&d, body, sizeof(body) - 1));
+    assert_true(http_chunk_done(&d));
+}
+
+static void test__http_chunk_skip__can_be_fed_one_byte_at_a_time(void **state)
+{
+    struct http_chunk_decoder d;
+    const char body[] = "3\r\nabc\r\n0\r\n\r\n";
+
+    http_chunk_init(&d);
+
+    for(int i = 0; i < sizeof(body) - 1; i++) {
+        assert_false(http_chunk_done(&d));
+        assert_int_equal(1, http_chunk_skip(&d, body + i, 1));
+    }
+
+    assert_true(http_chunk_done(&d));
+}
+
 const struct CMUnitTest tests_for_http_util[] = {
     cmocka_unit_test(test__http_hex_to_int__can_convert_hex_digits),
     cmocka_unit_test(test__http_hex_to_int__returns_zero_if_argument_is_not_a_digit),
@@ -428,6 +538,17 @@ const struct CMUnitTest tests_for_http_util[] = {
     cmocka_unit_test(test__http_base64_decode__returns_zero_if_dest_is_null),
     cmocka_unit_test(test__http_base64_decode__does_not_write_outside_buffer),
     cmocka_unit_test(test__http_base64_decode__can_decode_all_values),
+    cmocka_unit_test(test__http_format_date__formats_an_imf_fixdate),
+    cmocka_unit_test(test__http_parse_date__parses_an_imf_fixdate),
+    cmocka_unit_test(test__http_parse_date__returns_zero_for_unsupported_formats),
+    cmocka_unit_test(test__http_parse_date__is_the_inverse_of_http_format_date),
+
+    cmocka_unit_test(test__http_chunk_frame__stops_where_the_chunk_data_starts),
+    cmocka_unit_test(test__http_chunk_frame__returns_error_for_a_bad_chunk_size),
+    cmocka_unit_test(test__http_chunk_frame__returns_error_if_the_chunk_size_overflows),
+    cmocka_unit_test(test__http_chunk_frame__returns_error_if_chunk_data_is_not_followed_by_crlf),
+    cmocka_unit_test(test__http_chunk_skip__goes_through_a_whole_body_with_trailers),
+    cmocka_unit_test(test__http_chunk_skip__can_be_fed_one_byte_at_a_time),
 };
 
 int main(void)
@@ -0,0 +1,598 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+
+#include <cmocka.h>
+
+#include "http-sm/http.h"
+#include "http-private.h"
+
+#include "test-util.h"
+
+// Helpers /////////////////////////////////////////////////////////////////////
+
+static struct websocket_connection conns[WEBSOCKET_SERVER_MAX_CONNECTIONS];
+static int peer_fd[WEBSOCKET_SERVER_MAX_CONNECTIONS];
+
+static void init_server(struct http_server *server)
+{
+    server->websocket_connections = NULL;
+
+    for(int i = 0; i < WEBSOCKET_SERVER_MAX_CONNECTIONS; i++) {
+        int fds[2];
+        assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+        conns[i].fd = fds[0];
+        websocket_queue_init(&conns[i]);
+        peer_fd[i] = fds[1];
+
+        conns[i].next = server->websocket_connections;
+        server->websocket_connections = &conns[i];
+    }
+}
+
+static void free_server(struct http_server *server)
+{
+    // The connections are reused by the next test
+    while(websocket_take_dirty()) {
+    }
+
+    for(int i = 0; i < WEBSOCKET_SERVER_MAX_CONNECTIONS; i++) {
+        websocket_channel_leave(&conns[i]);
+        websocket_queue_clear(&conns[i]);
+        close(conns[i].fd);
+        close(peer_fd[i]);
+    }
+}
+
+// Tests ///////////////////////////////////////////////////////////////////////
+
+static void test__websocket_publish__queues_the_same_frame_for_all_subscribers(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+
+    websocket_subscribe(&conns[0], "news");
+    websocket_subscribe(&conns[2], "news");
+
+    assert_int_equal(websocket_publish("news", "hello", 5, WEBSOCKET_FRAME_OPCODE_TEXT), 0);
+    websocket_channel_dispatch(&server);
+
+    assert_int_equal(conns[0].out->count, 1);
+    assert_int_equal(websocket_queue_count(&conns[1]), 0);
+    assert_int_equal(conns[2].out->count, 1);
+
+    struct websocket_frame_buf *frame = conns[0].out->frames[0];
+    assert_ptr_equal(frame, conns[2].out->frames[0]);
+    assert_int_equal(frame->refcount, 2);
+
+    const uint8_t expected[] = { 0x81, 0x05, 'h', 'e', 'l', 'l', 'o' };
+    assert_int_equal(frame->length, sizeof(expected));
+    assert_memory_equal(frame->data, expected, sizeof(expected));
+
+    free_server(&server);
+}
+
+static void test__websocket_queue_flush__sends_queued_frames_in_order(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+
+    websocket_subscribe(&conns[1], "news");
+
+    websocket_publish("news", "one", 3, WEBSOCKET_FRAME_OPCODE_TEXT);
+    websocket_publish("news", "two", 3, WEBSOCKET_FRAME_OPCODE_BIN);
+    websocket_channel_dispatch(&server);
+
+    assert_int_equal(conns[1].out->count, 2);
+    assert_int_equal(websocket_queue_flush(&conns[1]), 0);
+    assert_null(conns[1].out);
+
+    const uint8_t expected[] = { 0x81, 0x03, 'o', 'n', 'e', 0x82, 0x03, 't', 'w', 'o' };
+    uint8_t buf[sizeof(expected)];
+    assert_int_equal(read(peer_fd[1], buf, sizeof(buf)), sizeof(expected));
+    assert_memory_equal(buf, expected, sizeof(expected));
+
+    free_server(&server);
+}
+
+static void test__websocket_publish__does_nothing_for_channel_without_subscribers(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+
+    websocket_subscribe(&conns[0], "news");
+
+    websocket_publish("weather", "rain", 4, WEBSOCKET_FRAME_OPCODE_TEXT);
+    websocket_channel_dispatch(&server);
+
+    for(int i = 0; i < WEBSOCKET_SERVER_MAX_CONNECTIONS; i++) {
+        assert_int_equal(websocket_queue_count(&conns[i]), 0);
+    }
+
+    free_server(&server);
+}
+
+static void test__websocket_unsubscribe__stops_delivery(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+
+    websocket_subscribe(&conns[0], "news");
+    websocket_unsubscribe(&conns[0], "news");
+
+    websocket_publish("news", "hello", 5, WEBSOCKET_FRAME_OPCODE_TEXT);
+    websocket_channel_dispatch(&server);
+
+    assert_int_equal(websocket_queue_count(&conns[0]), 0);
+
+    free_server(&server);
+}
+
+static void test__websocket_unsubscribe__frees_the_channel_after_its_last_subscriber(void **states)
+{
+    struct http_server server;
+    char name[16];
+    init_server(&server);
+
+    for(int i = 0; i < 2 * WEBSOCKET_MAX_CHANNELS; i++) {
+        snprintf(name, sizeof(name), "channel-%d", i);
+
+        assert_int_equal(websocket_subscribe(&conns[0], name), 0);
+        assert_int_equal(websocket_subscribe(&conns[1], name), 0);
+        websocket_unsubscribe(&conns[0], name);
+        websocket_unsubscribe(&conns[1], name);
+    }
+
+    assert_null(conns[0].channels);
+    assert_null(conns[1].channels);
+
+    free_server(&server);
+}
+
+static void test__websocket_subscribe__keeps_the_channel_while_it_has_subscribers(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+
+    websocket_subscribe(&conns[0], "news");
+    websocket_subscribe(&conns[1], "news");
+    websocket_subscribe(&conns[1], "news");
+    websocket_unsubscribe(&conns[0], "news");
+
+    websocket_publish("news", "hello", 5, WEBSOCKET_FRAME_OPCODE_TEXT);
+    websocket_channel_dispatch(&server);
+
+    assert_int_equal(websocket_queue_count(&conns[0]), 0);
+    assert_int_equal(websocket_queue_count(&conns[1]), 1);
+
+    free_server(&server);
+}
+
+static void test__websocket_subscribe__grows_the_channel_table_on_demand(void **states)
+{
+    struct http_server server;
+    char name[16];
+    init_server(&server);
+
+    // More than a bit mask in the connection could hold
+    for(int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "channel-%d", i);
+        assert_int_equal(websocket_subscribe(&conns[i % 2], name), 0);
+    }
+
+    websocket_publish("channel-98", "hello", 5, WEBSOCKET_FRAME_OPCODE_TEXT);
+    websocket_publish("channel-99", "hello", 5, WEBSOCKET_FRAME_OPCODE_TEXT);
+    websocket_channel_dispatch(&server);
+
+    assert_int_equal(websocket_queue_count(&conns[0]), 1);
+    assert_int_equal(websocket_queue_count(&conns[1]), 1);
+
+    free_server(&server);
+}
+
+static void test__websocket_channel_leave__frees_the_channels_of_a_connection(void **states)
+{
+    struct http_server server;
+    char name[16];
+    init_server(&server);
+
+    for(int i = 0; i < WEBSOCKET_MAX_CHANNELS; i++) {
+        snprintf(name, sizeof(name), "channel-%d", i);
+        assert_int_equal(websocket_subscribe(&conns[0], name), 0);
+    }
+    assert_int_equal(websocket_subscribe(&conns[1], "news"), -1);
+
+    websocket_channel_leave(&conns[0]);
+
+    assert_null(conns[0].channels);
+    assert_int_equal(websocket_subscribe(&conns[1], "news"), 0);
+
+    free_server(&server);
+}
+
+static void test__websocket_queue_frame__drops_frames_when_queue_is_full(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+
+    websocket_subscribe(&conns[0], "news");
+
+    for(int i = 0; i < WEBSOCKET_OUT_QUEUE_LEN + 2; i++) {
+        websocket_publish("news", "x", 1, WEBSOCKET_FRAME_OPCODE_TEXT);
+    }
+    websocket_channel_dispatch(&server);
+
+    assert_int_equal(conns[0].out->count, WEBSOCKET_OUT_QUEUE_LEN);
+
+    free_server(&server);
+}
+
+static int queue_opcode_helper(struct websocket_connection *conn, char c, size_t len, uint8_t opcode)
+{
+    char *buf = malloc(len);
+    assert_non_null(buf);
+    memset(buf, c, len);
+
+    struct websocket_frame_buf *frame = websocket_frame_alloc(buf, len, WEBSOCKET_FRAME_FIN | opcode);
+    assert_non_null(frame);
+    free(buf);
+
+    frame->refcount++;
+    int ret = websocket_queue_frame(conn, frame);
+    websocket_frame_release(frame);
+
+    return ret;
+}
+
+static int queue_helper(struct websocket_connection *conn, char c, size_t len)
+{
+    return queue_opcode_helper(conn, c, len, WEBSOCKET_FRAME_OPCODE_BIN);
+}
+
+static void test__websocket_queue_frame__marks_the_connection_dirty_once(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+
+    assert_null(websocket_take_dirty());
+
+    assert_int_equal(queue_helper(&conns[0], 'a', 1), 0);
+    assert_int_equal(queue_helper(&conns[0], 'b', 1), 0);
+    assert_int_equal(queue_helper(&conns[1], 'c', 1), 0);
+
+    assert_ptr_equal(websocket_take_dirty(), &conns[1]);
+    assert_ptr_equal(websocket_take_dirty(), &conns[0]);
+    assert_null(websocket_take_dirty());
+    assert_false(conns[0].dirty);
+
+    free_server(&server);
+}
+
+// Payload of a frame that fills half of the byte budget
+#define HALF_BUDGET (WEBSOCKET_OUT_QUEUE_BYTES / 2)
+
+static void test__websocket_queue_frame__drops_newest_frame_over_byte_budget(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+    struct websocket_connection *conn = &conns[0];
+
+    assert_int_equal(queue_helper(conn, 'a', HALF_BUDGET), 0);
+    assert_int_equal(queue_helper(conn, 'b', HALF_BUDGET), -1);
+
+    assert_int_equal(conn->out->count, 1);
+    assert_int_equal(conn->out->frames[conn->out->head]->data[4], 'a');
+    assert_int_equal(conn->out->bytes, conn->out->frames[conn->out->head]->length);
+
+    free_server(&server);
+}
+
+static void test__websocket_queue_frame__accepts_a_large_frame_into_an_empty_queue(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+    struct websocket_connection *conn = &conns[0];
+
+    assert_int_equal(queue_helper(conn, 'a', 2 * WEBSOCKET_OUT_QUEUE_BYTES), 0);
+    assert_int_equal(conn->out->count, 1);
+
+    free_server(&server);
+}
+
+static void test__websocket_queue_frame__drops_oldest_frame(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+    struct websocket_connection *conn = &conns[0];
+    conn->overflow_policy = WEBSOCKET_OVERFLOW_DROP_OLDEST;
+
+    assert_int_equal(queue_helper(conn, 'a', HALF_BUDGET), 0);
+    assert_int_equal(queue_helper(conn, 'b', HALF_BUDGET), 0);
+
+    assert_int_equal(conn->out->count, 1);
+    assert_int_equal(conn->out->frames[conn->out->head]->data[4], 'b');
+    assert_int_equal(conn->out->bytes, conn->out->frames[conn->out->head]->length);
+
+    free_server(&server);
+}
+
+static void test__websocket_queue_frame__never_drops_a_partly_sent_frame(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+    struct websocket_connection *conn = &conns[0];
+    conn->overflow_policy = WEBSOCKET_OVERFLOW_DROP_OLDEST;
+
+    assert_int_equal(queue_helper(conn, 'a', HALF_BUDGET), 0);
+    conn->out->offset = 1;
+
+    assert_int_equal(queue_helper(conn, 'b', HALF_BUDGET), -1);
+
+    assert_int_equal(conn->out->count, 1);
+    assert_int_equal(conn->out->frames[conn->out->head]->data[4], 'a');
+
+    free_server(&server);
+}
+
+static void test__websocket_queue_frame__coalesces_to_the_latest_frame(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+    struct websocket_connection *conn = &conns[0];
+    conn->overflow_policy = WEBSOCKET_OVERFLOW_COALESCE;
+
+    for(int i = 0; i < WEBSOCKET_OUT_QUEUE_LEN; i++) {
+        assert_int_equal(queue_helper(conn, 'a' + i, 1), 0);
+    }
+    assert_int_equal(queue_helper(conn, 'z', 1), 0);
+
+    assert_int_equal(conn->out->count, 1);
+    assert_int_equal(conn->out->frames[conn->out->head]->data[2], 'z');
+    assert_int_equal(conn->out->bytes, 3);
+
+    free_server(&server);
+}
+
+static void test__websocket_queue_frame__flags_connection_for_close(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+    struct websocket_connection *conn = &conns[0];
+    conn->overflow_policy = WEBSOCKET_OVERFLOW_CLOSE;
+
+    assert_int_equal(queue_helper(conn, 'a', HALF_BUDGET), 0);
+    assert_int_equal(queue_helper(conn, 'b', HALF_BUDGET), -1);
+
+    assert_true(conn->out_overflow);
+    assert_int_equal(websocket_send(conn, "x", 1, WEBSOCKET_FRAME_OPCODE_TEXT), -1);
+
+    free_server(&server);
+}
+
+static void test__websocket_queue_frame__closes_instead_of_dropping_a_compressed_frame(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+    struct websocket_connection *conn = &conns[0];
+    struct websocket_deflate deflate = {
+        .server_no_context_takeover = 0,
+    };
+    conn->deflate = &deflate;
+    conn->overflow_policy = WEBSOCKET_OVERFLOW_COALESCE;
+
+    assert_int_equal(queue_opcode_helper(conn, 'a', HALF_BUDGET, WEBSOCKET_FRAME_OPCODE_BIN | WEBSOCKET_FRAME_RSV1), 0);
+    assert_int_equal(queue_helper(conn, 'b', HALF_BUDGET), -1);
+
+    assert_true(conn->out_overflow);
+    assert_int_equal(conn->out->count, 1);
+    assert_int_equal(conn->out->frames[conn->out->head]->data[4], 'a');
+
+    conn->deflate = NULL;
+    free_server(&server);
+}
+
+static void test__websocket_queue_frame__drops_compressed_frames_without_context_takeover(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+    struct websocket_connection *conn = &conns[0];
+    struct websocket_deflate deflate = {
+        .server_no_context_takeover = 1,
+    };
+    conn->deflate = &deflate;
+    conn->overflow_policy = WEBSOCKET_OVERFLOW_COALESCE;
+
+    assert_int_equal(queue_opcode_helper(conn, 'a', HALF_BUDGET, WEBSOCKET_FRAME_OPCODE_BIN | WEBSOCKET_FRAME_RSV1), 0);
+    assert_int_equal(queue_opcode_helper(conn, 'b', HALF_BUDGET, WEBSOCKET_FRAME_OPCODE_BIN | WEBSOCKET_FRAME_RSV1), 0);
+
+    assert_false(conn->out_overflow);
+    assert_int_equal(conn->out->count, 1);
+    assert_int_equal(conn->out->frames[conn->out->head]->data[4], 'b');
+
+    conn->deflate = NULL;
+    free_server(&server);
+}
+
+static void test__websocket_send__does_not_block_when_the_reader_is_stuck(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+    struct websocket_connection *conn = &conns[0];
+
+    char buf[1000];
+    memset(buf, 'x', sizeof(buf));
+
+    // Nobody reads peer_fd[0], so the socket fills up and frames start to queue
+    int i;
+    for(i = 0; (i < 100000) && (websocket_queue_count(conn) < WEBSOCKET_OUT_QUEUE_LEN); i++) {
+        assert_int_equal(websocket_send(conn, buf, sizeof(buf), WEBSOCKET_FRAME_OPCODE_BIN), sizeof(buf));
+    }
+
+    assert_true(conn->out->count > 0);
+    assert_true(conn->out->bytes <= WEBSOCKET_OUT_QUEUE_BYTES);
+
+    free_server(&server);
+}
+
+static void test__websocket_send_continue__does_not_block_when_the_reader_is_stuck(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+    struct websocket_connection *conn = &conns[0];
+    conn->overflow_policy = WEBSOCKET_OVERFLOW_DROP_NEWEST;
+
+    char buf[1000];
+    memset(buf, 'x', sizeof(buf));
+
+    assert_int_equal(websocket_send_begin(conn, buf, sizeof(buf), WEBSOCKET_FRAME_OPCODE_BIN), sizeof(buf));
+
+    // A fragment can not be dropped, so once the queue is full it is refused and has to be sent again later
+    int i;
+    for(i = 0; (i < 100000) && (websocket_send_continue(conn, buf, sizeof(buf)) == sizeof(buf)); i++) {
+    }
+
+    assert_true(i < 100000);
+    assert_true(conn->out->count > 0);
+    assert_false(conn->out_overflow);
+    assert_true(conn->send_fragmented);
+
+    free_server(&server);
+}
+
+static void test__websocket_send_continue__closes_instead_of_dropping_queued_fragments(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+    struct websocket_connection *conn = &conns[0];
+    conn->overflow_policy = WEBSOCKET_OVERFLOW_DROP_OLDEST;
+
+    char buf[1000];
+    memset(buf, 'x', sizeof(buf));
+
+    assert_int_equal(websocket_send_begin(conn, buf, sizeof(buf), WEBSOCKET_FRAME_OPCODE_BIN), sizeof(buf));
+
+    int i;
+    for(i = 0; (i < 100000) && (websocket_send_continue(conn, buf, sizeof(buf)) == sizeof(buf)); i++) {
+    }
+
+    assert_true(i < 100000);
+    assert_true(conn->out_overflow);
+
+    free_server(&server);
+}
+
+static void test__websocket_send__queues_data_frames_in_the_middle_of_a_fragmented_message(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+    struct websocket_connection *conn = &conns[0];
+
+    websocket_subscribe(conn, "news");
+
+    assert_int_equal(websocket_send_begin(conn, "ab", 2, WEBSOCKET_FRAME_OPCODE_TEXT), 2);
+    assert_null(conn->out);
+
+    // The queue is empty, but neither frame may go out before the message has ended
+    assert_int_equal(websocket_send(conn, "x", 1, WEBSOCKET_FRAME_OPCODE_BIN), 1);
+    websocket_publish("news", "y", 1, WEBSOCKET_FRAME_OPCODE_TEXT);
+    websocket_channel_dispatch(&server);
+    assert_int_equal(websocket_queue_count(conn), 2);
+
+    assert_int_equal(websocket_send_end(conn, "cd", 2), 2);
+    assert_int_equal(websocket_queue_flush(conn), 0);
+
+    const uint8_t expected[] = { 0x01, 0x02, 'a', 'b', 0x80, 0x02, 'c', 'd', 0x82, 0x01, 'x', 0x81, 0x01, 'y' };
+    uint8_t buf[sizeof(expected) + 1];
+    assert_int_equal(read(peer_fd[0], buf, sizeof(buf)), sizeof(expected));
+    assert_memory_equal(buf, expected, sizeof(expected));
+
+    websocket_unsubscribe(conn, "news");
+    free_server(&server);
+}
+
+static void *publish_thread(void *arg)
+{
+    for(int i = 0; i < 10; i++) {
+        char c = '0' + i;
+        websocket_publish("news", &c, 1, WEBSOCKET_FRAME_OPCODE_TEXT);
+    }
+    return NULL;
+}
+
+static void test__websocket_publish__wakes_the_server_loop_from_another_thread(void **states)
+{
+    struct http_server server;
+    init_server(&server);
+
+    assert_int_equal(websocket_channel_init(), 0);
+    int wake_fd = websocket_channel_wake_fd();
+    assert_true(wake_fd >= 0);
+
+    websocket_subscribe(&conns[0], "news");
+
+    pthread_t thread;
+    assert_int_equal(pthread_create(&thread, NULL, publish_thread, NULL), 0);
+    pthread_join(thread, NULL);
+
+    fd_set set;
+    struct timeval t = { 0, 0 };
+    FD_ZERO(&set);
+    FD_SET(wake_fd, &set);
+    assert_int_equal(select(wake_fd + 1, &set, NULL, NULL, &t), 1);
+
+    websocket_channel_dispatch(&server);
+
+    assert_int_equal(conns[0].out->count, 10);
+    for(int i = 0; i < 10; i++) {
+        assert_int_equal(conns[0].out->frames[i]->data[2], '0' + i);
+    }
+
+    // The wake pipe is drained by the dispatch
+    FD_ZERO(&set);
+    FD_SET(wake_fd, &set);
+    assert_int_equal(select(wake_fd + 1, &set, NULL, NULL, &t), 0);
+
+    free_server(&server);
+}
+
+// Main ////////////////////////////////////////////////////////////////////////
+
+const struct CMUnitTest tests_for_websocket_channel[] = {
+    cmocka_unit_test(test__websocket_publish__queues_the_same_frame_for_all_subscribers),
+    cmocka_unit_test(test__websocket_queue_flush__sends_queued_frames_in_order),
+    cmocka_unit_test(test__websocket_publish__does_nothing_for_channel_without_subscribers),
+    cmocka_unit_test(test__websocket_unsubscribe__stops_delivery),
+    cmocka_unit_test(test__websocket_unsubscribe__frees_the_channel_after_its_last_subscriber),
+    cmocka_unit_test(test__websocket_subscribe__keeps_the_channel_while_it_has_subscribers),
+    cmocka_unit_test(test__websocket_subscribe__grows_the_channel_table_on_demand),
+    cmocka_unit_test(test__websocket_channel_leave__frees_the_channels_of_a_connection),
+    cmocka_unit_test(test__websocket_queue_frame__drops_frames_when_queue_is_full),
+    cmocka_unit_test(test__websocket_queue_frame__marks_the_connection_dirty_once),
+    cmocka_unit_test(test__websocket_queue_frame__drops_newest_frame_over_byte_budget),
+    cmocka_unit_test(test__websocket_queue_frame__accepts_a_large_frame_into_an_empty_queue),
+    cmocka_unit_test(test__websocket_queue_frame__drops_oldest_frame),
+    cmocka_unit_test(test__websocket_queue_frame__never_drops_a_partly_sent_frame),
+    cmocka_unit_test(test__websocket_queue_frame__coalesces_to_the_latest_frame),
+    cmocka_unit_test(test__websocket_queue_frame__flags_connection_for_close),
+    cmocka_unit_test(test__websocket_queue_frame__closes_instead_of_dropping_a_compressed_frame),
+    cmocka_unit_test(test__websocket_queue_frame__drops_compressed_frames_without_context_takeover),
+    cmocka_unit_test(test__websocket_send__does_not_block_when_the_reader_is_stuck),
+    cmocka_unit_test(test__websocket_send_continue__does_not_block_when_the_reader_is_stuck),
+    cmocka_unit_test(test__websocket_send_continue__closes_instead_of_dropping_queued_fragments),
+    cmocka_unit_test(test__websocket_send__queues_data_frames_in_the_middle_of_a_fragmented_message),
+    cmocka_unit_test(test__websocket_publish__wakes_the_server_loop_from_another_thread),
+};
+
+int main(void)
+{
+    int fails = 0;
+    fails += cmocka_run_group_tests(tests_for_websocket_channel, NULL, NULL);
+
+    return fails;
+}
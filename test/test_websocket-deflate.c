@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <cmocka.h>
+
+#include "http-sm/http.h"
+#include "http-sm/websocket.h"
+#include "http-private.h"
+
+static void negotiate_helper(const char *offer, const char *expected_response, struct websocket_deflate *params)
+{
+    char response[WEBSOCKET_EXTENSIONS_LEN];
+
+    assert_int_equal(0, websocket_deflate_negotiate(offer, params, response, sizeof(response)));
+    assert_string_equal(expected_response, response);
+}
+
+static void test__websocket_deflate_negotiate__accepts_plain_offer(void **states)
+{
+    struct websocket_deflate params;
+
+    negotiate_helper("permessage-deflate", "permessage-deflate", &params);
+
+    assert_int_equal(WEBSOCKET_DEFLATE_WINDOW_BITS, params.server_window_bits);
+    assert_int_equal(15, params.client_window_bits);
+    assert_int_equal(0, params.server_no_context_takeover);
+    assert_int_equal(0, params.client_no_context_takeover);
+}
+
+static void test__websocket_deflate_negotiate__accepts_client_max_window_bits_without_value(void **states)
+{
+    struct websocket_deflate params;
+
+    negotiate_helper("permessage-deflate; client_max_window_bits", "permessage-deflate", &params);
+
+    assert_int_equal(WEBSOCKET_DEFLATE_WINDOW_BITS, params.client_window_bits);
+}
+
+static void test__websocket_deflate_negotiate__limits_server_window(void **states)
+{
+    struct websocket_deflate params;
+
+    negotiate_helper("permessage-deflate; server_max_window_bits=10", "permessage-deflate; server_max_window_bits=10", &params);
+
+    assert_int_equal(10, params.server_window_bits);
+}
+
+static void test__websocket_deflate_negotiate__accepts_quoted_window_bits(void **states)
+{
+    struct websocket_deflate params;
+
+    negotiate_helper("permessage-deflate; client_max_window_bits=\"12\"", "permessage-deflate; client_max_window_bits=12", &params);
+
+    assert_int_equal(12, params.client_window_bits);
+}
+
+static void test__websocket_deflate_negotiate__accepts_no_context_takeover(void **states)
+{
+    struct websocket_deflate params;
+
+    negotiate_helper("permessage-deflate; server_no_context_takeover; client_no_context_takeover",
+                     "permessage-deflate; server_no_context_takeover; client_no_context_takeover", &params);
+
+    assert_int_equal(1, params.server_no_context_takeover);
+    assert_int_equal(1, params.client_no_context_takeover);
+}
+
+static void test__websocket_deflate_negotiate__falls_back_to_second_offer(void **states)
+{
+    struct websocket_deflate params;
+
+    negotiate_helper("permessage-deflate; server_max_window_bits=8, permessage-deflate", "permessage-deflate", &params);
+
+    assert_int_equal(WEBSOCKET_DEFLATE_WINDOW_BITS, params.server_window_bits);
+}
+
+static void test__websocket_deflate_negotiate__declines_bad_offers(void **states)
+{
+    const char *offers[] = {
+        "x-webkit-deflate-frame",
+        "permessage-deflate; server_max_window_bits=8",
+        "permessage-deflate; server_max_window_bits",
+        "permessage-deflate; client_max_window_bits=16",
+        "permessage-deflate; foo",
+        "permessage-deflate; server_no_context_takeover; server_no_context_takeover",
+        "permessage-deflate; server_no_context_takeover=1",
+    };
+
+    for(int i = 0; i < sizeof(offers) / sizeof(offers[0]); i++) {
+        struct websocket_deflate params;
+        char response[WEBSOCKET_EXTENSIONS_LEN];
+
+        if(websocket_deflate_negotiate(offers[i], &params, response, sizeof(response)) == 0) {
+            fail_msg("Accepted offer \"%s\"", offers[i]);
+        }
+    }
+}
+
+static void test__websocket_deflate_negotiate__declines_missing_header(void **states)
+{
+    struct websocket_deflate params;
+    char response[WEBSOCKET_EXTENSIONS_LEN];
+
+    assert_int_equal(-1, websocket_deflate_negotiate(NULL, &params, response, sizeof(response)));
+}
+
+static struct websocket_deflate *create_deflate(int no_context_takeover)
+{
+    struct websocket_deflate *d = calloc(1, sizeof(*d));
+    assert_non_null(d);
+
+    d->server_window_bits = 15;
+    d->client_window_bits = 15;
+    d->server_no_context_takeover = no_context_takeover;
+    d->client_no_context_takeover = no_context_takeover;
+
+    return d;
+}
+
+static void test__websocket_deflate_compress__matches_rfc_example(void **states)
+{
+    // RFC 7692 section 7.2.3.1
+    const uint8_t expected[] = { 0xf2, 0x48, 0xcd, 0xc9, 0xc9, 0x07, 0x00 };
+    struct websocket_deflate *d = create_deflate(0);
+    uint8_t *out;
+    size_t out_len;
+
+    assert_int_equal(0, websocket_deflate_compress(d, "Hello", 5, 1, &out, &out_len));
+
+    assert_int_equal(sizeof(expected), out_len);
+    assert_memory_equal(expected, out, out_len);
+
+    free(out);
+    websocket_deflate_free(d);
+}
+
+static void test__websocket_deflate_decompress__inflates_rfc_example(void **states)
+{
+    const uint8_t frame[] = { 0xf2, 0x48, 0xcd, 0xc9, 0xc9, 0x07, 0x00 };
+    struct websocket_deflate *d = create_deflate(0);
+    uint8_t *out;
+    size_t out_len;
+
+    assert_int_equal(0, websocket_deflate_decompress(d, frame, sizeof(frame), 1, &out, &out_len));
+
+    assert_int_equal(5, out_len);
+    assert_memory_equal("Hello", out, out_len);
+
+    free(out);
+    websocket_deflate_free(d);
+}
+
+static void roundtrip_helper(int no_context_takeover)
+{
+    char message[1000];
+    struct websocket_deflate *d = create_deflate(no_context_takeover);
+
+    for(int i = 0; i < sizeof(message); i++) {
+        message[i] = 'a' + (i * 7) % 13;
+    }
+
+    // Several messages, so a shared context is exercised
+    for(int n = 0; n < 3; n++) {
+        uint8_t *compressed;
+        size_t compressed_len;
+        uint8_t *inflated;
+        size_t inflated_len;
+
+        assert_int_equal(0, websocket_deflate_compress(d, message, sizeof(message), 1, &compressed, &compressed_len));
+        assert_true(compressed_len < sizeof(message));
+
+        assert_int_equal(0, websocket_deflate_decompress(d, compressed, compressed_len, 1, &inflated, &inflated_len));
+        assert_int_equal(sizeof(message), inflated_len);
+        assert_memory_equal(message, inflated, inflated_len);
+
+        free(compressed);
+        free(inflated);
+    }
+
+    websocket_deflate_free(d);
+}
+
+static void test__websocket_deflate__roundtrips_with_context_takeover(void **states)
+{
+    roundtrip_helper(0);
+}
+
+static void test__websocket_deflate__roundtrips_without_context_takeover(void **states)
+{
+    roundtrip_helper(1);
+}
+
+static void test__websocket_deflate_decompress__returns_error_for_bad_data(void **states)
+{
+    const uint8_t frame[] = { 0xff, 0xff, 0xff, 0xff };
+    struct websocket_deflate *d = create_deflate(0);
+    uint8_t *out;
+    size_t out_len;
+
+    assert_int_equal(-1, websocket_deflate_decompress(d, frame, sizeof(frame), 1, &out, &out_len));
+    assert_null(out);
+
+    websocket_deflate_free(d);
+}
+
+const struct CMUnitTest tests_for_websocket_deflate[] = {
+    cmocka_unit_test(test__websocket_deflate_negotiate__accepts_plain_offer),
+    cmocka_unit_test(test__websocket_deflate_negotiate__accepts_client_max_window_bits_without_value),
+    cmocka_unit_test(test__websocket_deflate_negotiate__limits_server_window),
+    cmocka_unit_test(test__websocket_deflate_negotiate__accepts_quoted_window_bits),
+    cmocka_unit_test(test__websocket_deflate_negotiate__accepts_no_context_takeover),
+    cmocka_unit_test(test__websocket_deflate_negotiate__falls_back_to_second_offer),
+    cmocka_unit_test(test__websocket_deflate_negotiate__declines_bad_offers),
+    cmocka_unit_test(test__websocket_deflate_negotiate__declines_missing_header),
+
+    cmocka_unit_test(test__websocket_deflate_compress__matches_rfc_example),
+    cmocka_unit_test(test__websocket_deflate_decompress__inflates_rfc_example),
+    cmocka_unit_test(test__websocket_deflate__roundtrips_with_context_takeover),
+    cmocka_unit_test(test__websocket_deflate__roundtrips_without_context_takeover),
+    cmocka_unit_test(test__websocket_deflate_decompress__returns_error_for_bad_data),
+};
+
+int main(void)
+{
+    int fails = 0;
+    fails += cmocka_run_group_tests(tests_for_websocket_deflate, NULL, NULL);
+
+    return fails;
+}
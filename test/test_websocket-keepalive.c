@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <cmocka.h>
+
+#include "http-sm/http.h"
+#include "http-private.h"
+
+#include "test-util.h"
+
+// Mocks ///////////////////////////////////////////////////////////////////////
+
+void websocket_close(struct websocket_connection *conn, uint8_t *buf, int len)
+{
+    check_expected(len);
+
+    websocket_timer_cancel(&conn->timer);
+    conn->state = WEBSOCKET_STATE_CLOSED;
+}
+
+// Helpers /////////////////////////////////////////////////////////////////////
+
+// The wheel keeps its clock between tests, so each test starts well after the last one
+static uint32_t base_time = 1000;
+
+static int peer_fd;
+
+static void init_conn(struct websocket_connection *conn, struct websocket_url_handler *handler, int ping_interval, int pong_timeout, int idle_timeout)
+{
+    memset(handler, 0, sizeof(*handler));
+    handler->ping_interval = ping_interval;
+    handler->pong_timeout = pong_timeout;
+    handler->idle_timeout = idle_timeout;
+
+    int fds[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fds[0];
+    conn->handler = handler;
+    websocket_queue_init(conn);
+    peer_fd = fds[1];
+
+    base_time += 1000;
+    websocket_keepalive_run(base_time);
+    websocket_keepalive_start(conn);
+}
+
+static void free_conn(struct websocket_connection *conn)
+{
+    websocket_timer_cancel(&conn->timer);
+    websocket_queue_clear(conn);
+    close(conn->fd);
+    close(peer_fd);
+}
+
+static int peer_received(void)
+{
+    char buf[16];
+    int n = recv(peer_fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if(n == 2 && (uint8_t)buf[0] == (WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_PING)) {
+        return 1;
+    }
+    return (n > 0) ? -1 : 0;
+}
+
+// Tests ///////////////////////////////////////////////////////////////////////
+
+static void test__websocket_timer__expires_in_order_across_laps(void **states)
+{
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+
+    // Longer than one lap of the wheel
+    init_conn(&conn, &handler, WEBSOCKET_TIMER_SLOTS + 5, -1, -1);
+
+    assert_int_equal(websocket_timer_next(base_time), 5);
+
+    websocket_keepalive_run(base_time + 5);
+    assert_int_equal(peer_received(), 0);
+
+    websocket_keepalive_run(base_time + WEBSOCKET_TIMER_SLOTS + 4);
+    assert_int_equal(peer_received(), 0);
+
+    websocket_keepalive_run(base_time + WEBSOCKET_TIMER_SLOTS + 5);
+    assert_int_equal(peer_received(), 1);
+
+    free_conn(&conn);
+}
+
+static void test__websocket_timer_cancel__disarms_the_timer(void **states)
+{
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+
+    init_conn(&conn, &handler, 3, -1, -1);
+    assert_int_equal(websocket_timer_next(base_time), 3);
+
+    websocket_timer_cancel(&conn.timer);
+    assert_int_equal(websocket_timer_next(base_time), -1);
+
+    websocket_keepalive_run(base_time + 10);
+    assert_int_equal(peer_received(), 0);
+
+    free_conn(&conn);
+}
+
+static void test__websocket_keepalive__pings_quiet_connection(void **states)
+{
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+
+    init_conn(&conn, &handler, 10, 5, -1);
+
+    websocket_keepalive_run(base_time + 9);
+    assert_int_equal(peer_received(), 0);
+
+    websocket_keepalive_run(base_time + 10);
+    assert_int_equal(peer_received(), 1);
+    assert_true(conn.ping_outstanding);
+
+    free_conn(&conn);
+}
+
+static void test__websocket_keepalive__received_frames_postpone_the_ping(void **states)
+{
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+
+    init_conn(&conn, &handler, 10, 5, -1);
+
+    websocket_keepalive_run(base_time + 6);
+    conn.frame_opcode = WEBSOCKET_FRAME_OPCODE_TEXT;
+    websocket_keepalive_frame(&conn);
+
+    websocket_keepalive_run(base_time + 10);
+    assert_int_equal(peer_received(), 0);
+
+    websocket_keepalive_run(base_time + 16);
+    assert_int_equal(peer_received(), 1);
+
+    free_conn(&conn);
+}
+
+static void test__websocket_keepalive__closes_when_pong_does_not_arrive(void **states)
+{
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+
+    init_conn(&conn, &handler, 10, 5, -1);
+
+    websocket_keepalive_run(base_time + 10);
+    assert_int_equal(peer_received(), 1);
+
+    websocket_keepalive_run(base_time + 14);
+
+    expect_value(websocket_close, len, 2);
+    websocket_keepalive_run(base_time + 15);
+
+    free_conn(&conn);
+}
+
+static void test__websocket_keepalive__pong_keeps_connection_open(void **states)
+{
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+
+    init_conn(&conn, &handler, 10, 5, -1);
+
+    websocket_keepalive_run(base_time + 10);
+    assert_int_equal(peer_received(), 1);
+
+    websocket_keepalive_run(base_time + 12);
+    conn.frame_opcode = WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_PONG;
+    websocket_keepalive_frame(&conn);
+    assert_false(conn.ping_outstanding);
+
+    websocket_keepalive_run(base_time + 15);
+    websocket_keepalive_run(base_time + 21);
+    assert_int_equal(peer_received(), 0);
+
+    websocket_keepalive_run(base_time + 22);
+    assert_int_equal(peer_received(), 1);
+
+    free_conn(&conn);
+}
+
+static void test__websocket_keepalive__closes_idle_connection(void **states)
+{
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+
+    init_conn(&conn, &handler, 10, 5, 25);
+
+    // Pongs keep the connection alive, but do not count as activity
+    for(int t = 10; t < 25; t += 10) {
+        websocket_keepalive_run(base_time + t);
+        assert_int_equal(peer_received(), 1);
+        conn.frame_opcode = WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_PONG;
+        websocket_keepalive_frame(&conn);
+    }
+
+    expect_value(websocket_close, len, 2);
+    websocket_keepalive_run(base_time + 25);
+
+    free_conn(&conn);
+}
+
+static void test__websocket_keepalive__can_be_disabled(void **states)
+{
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+
+    init_conn(&conn, &handler, -1, -1, -1);
+
+    assert_int_equal(websocket_timer_next(base_time), -1);
+
+    free_conn(&conn);
+}
+
+// Main ////////////////////////////////////////////////////////////////////////
+
+const struct CMUnitTest tests_for_websocket_keepalive[] = {
+    cmocka_unit_test(test__websocket_timer__expires_in_order_across_laps),
+    cmocka_unit_test(test__websocket_timer_cancel__disarms_the_timer),
+    cmocka_unit_test(test__websocket_keepalive__pings_quiet_connection),
+    cmocka_unit_test(test__websocket_keepalive__received_frames_postpone_the_ping),
+    cmocka_unit_test(test__websocket_keepalive__closes_when_pong_does_not_arrive),
+    cmocka_unit_test(test__websocket_keepalive__pong_keeps_connection_open),
+    cmocka_unit_test(test__websocket_keepalive__closes_idle_connection),
+    cmocka_unit_test(test__websocket_keepalive__can_be_disabled),
+};
+
+int main(void)
+{
+    int fails = 0;
+    fails += cmocka_run_group_tests(tests_for_websocket_keepalive, NULL, NULL);
+
+    return fails;
+}
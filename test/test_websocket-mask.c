@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <cmocka.h>
+
+#include "http-private.h"
+
+#define MAX_ALIGN 32
+#define MAX_LEN 200
+
+static void mask_reference(uint8_t *buf, size_t len, const uint8_t *mask, uint64_t offset)
+{
+    for(size_t i = 0; i < len; i++) {
+        buf[i] ^= mask[(offset + i) % 4];
+    }
+}
+
+static void fill_pattern(uint8_t *buf, size_t len)
+{
+    for(size_t i = 0; i < len; i++) {
+        buf[i] = (uint8_t)(i * 31 + 7);
+    }
+}
+
+static void check_mask(size_t align, size_t len, uint64_t offset)
+{
+    static const uint8_t mask[4] = { 0x12, 0x34, 0xA5, 0xFE };
+    uint8_t expected[MAX_ALIGN + MAX_LEN + MAX_ALIGN];
+    uint8_t actual[MAX_ALIGN + MAX_LEN + MAX_ALIGN];
+
+    fill_pattern(expected, sizeof(expected));
+    fill_pattern(actual, sizeof(actual));
+
+    mask_reference(expected + align, len, mask, offset);
+    websocket_mask(actual + align, len, mask, offset);
+
+    if(memcmp(expected, actual, sizeof(expected))) {
+        fail_msg("Mismatch for align %zu, len %zu, offset %llu", align, len, (unsigned long long)offset);
+    }
+}
+
+static void test__websocket_mask__matches_bytewise_mask_for_all_alignments_and_lengths(void **states)
+{
+    for(size_t align = 0; align < MAX_ALIGN; align++) {
+        for(size_t len = 0; len <= MAX_LEN; len++) {
+            for(uint64_t offset = 0; offset < 4; offset++) {
+                check_mask(align, len, offset);
+            }
+        }
+    }
+}
+
+static void test__websocket_mask__handles_large_frame_offsets(void **states)
+{
+    for(uint64_t offset = 0xFFFFFFFCull; offset < 0x100000004ull; offset++) {
+        for(size_t len = 0; len <= 40; len++) {
+            check_mask(3, len, offset);
+        }
+    }
+}
+
+static void test__websocket_mask__applying_twice_restores_data(void **states)
+{
+    const uint8_t mask[4] = { 'a', 'b', 'c', 'd' };
+    uint8_t buf[100];
+    uint8_t orig[100];
+
+    fill_pattern(orig, sizeof(orig));
+    memcpy(buf, orig, sizeof(buf));
+
+    // Mask in pieces of uneven size, as websocket_read would
+    websocket_mask(buf, 13, mask, 0);
+    websocket_mask(buf + 13, 50, mask, 13);
+    websocket_mask(buf + 63, 37, mask, 63);
+
+    websocket_mask(buf, sizeof(buf), mask, 0);
+
+    assert_memory_equal(buf, orig, sizeof(buf));
+}
+
+const struct CMUnitTest tests_for_websocket_mask[] = {
+    cmocka_unit_test(test__websocket_mask__matches_bytewise_mask_for_all_alignments_and_lengths),
+    cmocka_unit_test(test__websocket_mask__handles_large_frame_offsets),
+    cmocka_unit_test(test__websocket_mask__applying_twice_restores_data),
+};
+
+int main(void)
+{
+    int fails = 0;
+    fails += cmocka_run_group_tests(tests_for_websocket_mask, NULL, NULL);
+
+    return fails;
+}
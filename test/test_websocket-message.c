@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <cmocka.h>
+
+#include "http-sm/http.h"
+#include "http-sm/websocket.h"
+#include "http-private.h"
+
+#include "test-util.h"
+
+// Mocks ///////////////////////////////////////////////////////////////////////
+
+void websocket_close(struct websocket_connection *conn, uint8_t *buf, int len)
+{
+    assert_int_equal(len, 2);
+
+    int code = (buf[0] << 8) | buf[1];
+    check_expected(code);
+
+    websocket_message_free(conn);
+    conn->state = WEBSOCKET_STATE_CLOSED;
+}
+
+// Helpers /////////////////////////////////////////////////////////////////////
+
+static uint8_t received[256];
+static size_t received_len;
+static int received_opcode;
+static const uint8_t *received_data;
+static int received_count;
+
+static void message_full(struct websocket_connection *conn, const uint8_t *data, size_t len, enum websocket_frame_opcode opcode)
+{
+    assert_true(len <= sizeof(received));
+
+    memcpy(received, data, len);
+    received_len = len;
+    received_opcode = opcode;
+    received_data = data;
+    received_count++;
+}
+
+static void init_conn(struct websocket_connection *conn, struct websocket_url_handler *handler, size_t max_message_len)
+{
+    memset(handler, 0, sizeof(*handler));
+    handler->cb_message_full = message_full;
+    handler->max_message_len = max_message_len;
+
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = -1;
+    conn->handler = handler;
+    websocket_queue_init(conn);
+
+    received_len = 0;
+    received_opcode = -1;
+    received_data = NULL;
+    received_count = 0;
+}
+
+// Feed one masked frame through the header parser and the message layer
+static void feed_frame(struct websocket_connection *conn, uint8_t opcode, const char *payload)
+{
+    const uint8_t mask[4] = { 0x0a, 0x1b, 0x2c, 0x3d };
+    size_t len = strlen(payload);
+
+    assert_true(len < 0x7e);
+
+    conn->state = WEBSOCKET_STATE_OPCODE;
+    conn->buf[0] = opcode;
+    conn->buf[1] = 0x80 | len;
+    memcpy(conn->buf + 2, mask, 4);
+    for(int i = 0; i < len; i++) {
+        conn->buf[6 + i] = payload[i] ^ mask[i % 4];
+    }
+    conn->buf_length = 6 + len;
+    conn->buf_index = websocket_parse_frame_header_buf(conn, conn->buf, conn->buf_length);
+
+    assert_int_equal(conn->state, WEBSOCKET_STATE_BODY);
+
+    websocket_message_frame(conn);
+}
+
+// Tests ///////////////////////////////////////////////////////////////////////
+
+static void test__websocket_message_frame__delivers_unfragmented_message_in_place(void **states)
+{
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+    init_conn(&conn, &handler, 0);
+
+    feed_frame(&conn, WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_TEXT, "Hello");
+
+    assert_int_equal(received_count, 1);
+    assert_int_equal(received_opcode, WEBSOCKET_FRAME_OPCODE_TEXT);
+    assert_int_equal(received_len, 5);
+    assert_memory_equal(received, "Hello", 5);
+    assert_ptr_equal(received_data, conn.buf + 6);
+    assert_int_equal(conn.state, WEBSOCKET_STATE_DONE);
+    assert_null(conn.message);
+}
+
+static void test__websocket_message_frame__reassembles_fragments(void **states)
+{
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+    init_conn(&conn, &handler, 0);
+
+    feed_frame(&conn, WEBSOCKET_FRAME_OPCODE_BIN, "Hel");
+    assert_int_equal(received_count, 0);
+    assert_non_null(conn.message);
+
+    feed_frame(&conn, WEBSOCKET_FRAME_OPCODE_CONT, "lo, ");
+    assert_int_equal(received_count, 0);
+
+    feed_frame(&conn, WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_CONT, "world");
+
+    assert_int_equal(received_count, 1);
+    assert_int_equal(received_opcode, WEBSOCKET_FRAME_OPCODE_BIN);
+    assert_int_equal(received_len, 12);
+    assert_memory_equal(received, "Hello, world", 12);
+    assert_null(conn.message);
+}
+
+static void test__websocket_message_frame__reuses_message_buffers(void **states)
+{
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+    init_conn(&conn, &handler, 0);
+
+    feed_frame(&conn, WEBSOCKET_FRAME_OPCODE_TEXT, "abc");
+    struct websocket_message *first = conn.message;
+    feed_frame(&conn, WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_CONT, "def");
+
+    feed_frame(&conn, WEBSOCKET_FRAME_OPCODE_TEXT, "ghi");
+    assert_ptr_equal(conn.message, first);
+    feed_frame(&conn, WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_CONT, "jkl");
+
+    assert_int_equal(received_count, 2);
+    assert_int_equal(received_len, 6);
+    assert_memory_equal(received, "ghijkl", 6);
+}
+
+static void test__websocket_message_frame__closes_on_continuation_without_message(void **states)
+{
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+    init_conn(&conn, &handler, 0);
+
+    expect_value(websocket_close, code, 1002);
+    feed_frame(&conn, WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_CONT, "abc");
+
+    assert_int_equal(received_count, 0);
+    assert_int_equal(conn.state, WEBSOCKET_STATE_CLOSED);
+}
+
+static void test__websocket_message_frame__closes_on_new_message_inside_fragmented_one(void **states)
+{
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+    init_conn(&conn, &handler, 0);
+
+    feed_frame(&conn, WEBSOCKET_FRAME_OPCODE_TEXT, "abc");
+
+    expect_value(websocket_close, code, 1002);
+    feed_frame(&conn, WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_TEXT, "def");
+
+    assert_int_equal(received_count, 0);
+    assert_null(conn.message);
+}
+
+static void test__websocket_message_frame__closes_when_message_is_too_long(void **states)
+{
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+    init_conn(&conn, &handler, 8);
+
+    feed_frame(&conn, WEBSOCKET_FRAME_OPCODE_BIN, "12345");
+
+    expect_value(websocket_close, code, 1009);
+    feed_frame(&conn, WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_CONT, "6789");
+
+    assert_int_equal(received_count, 0);
+    assert_null(conn.message);
+
+    init_conn(&conn, &handler, 8);
+
+    expect_value(websocket_close, code, 1009);
+    feed_frame(&conn, WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_BIN, "123456789");
+
+    assert_int_equal(received_count, 0);
+}
+
+static void test__websocket_message_frame__closes_on_invalid_utf8_text(void **states)
+{
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+    init_conn(&conn, &handler, 0);
+
+    // A code point split over two fragments is fine
+    feed_frame(&conn, WEBSOCKET_FRAME_OPCODE_TEXT, "caf\xc3");
+    feed_frame(&conn, WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_CONT, "\xa9");
+    assert_int_equal(received_count, 1);
+
+    expect_value(websocket_close, code, 1007);
+    feed_frame(&conn, WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_TEXT, "caf\xc3");
+    assert_int_equal(received_count, 1);
+
+    // Binary messages are not checked
+    init_conn(&conn, &handler, 0);
+    feed_frame(&conn, WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_BIN, "caf\xc3");
+    assert_int_equal(received_count, 1);
+}
+
+// Main ////////////////////////////////////////////////////////////////////////
+
+const struct CMUnitTest tests_for_websocket_message[] = {
+    cmocka_unit_test(test__websocket_message_frame__delivers_unfragmented_message_in_place),
+    cmocka_unit_test(test__websocket_message_frame__reassembles_fragments),
+    cmocka_unit_test(test__websocket_message_frame__reuses_message_buffers),
+    cmocka_unit_test(test__websocket_message_frame__closes_on_continuation_without_message),
+    cmocka_unit_test(test__websocket_message_frame__closes_on_new_message_inside_fragmented_one),
+    cmocka_unit_test(test__websocket_message_frame__closes_when_message_is_too_long),
+    cmocka_unit_test(test__websocket_message_frame__closes_on_invalid_utf8_text),
+};
+
+int main(void)
+{
+    int fails = 0;
+    fails += cmocka_run_group_tests(tests_for_websocket_message, NULL, NULL);
+
+    return fails;
+}
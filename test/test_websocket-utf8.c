@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <cmocka.h>
+
+#include "http-private.h"
+
+static int utf8_valid(const char *s)
+{
+    return websocket_utf8_valid((const uint8_t *)s, strlen(s));
+}
+
+static void test__websocket_utf8_valid__accepts_valid_strings(void **states)
+{
+    const char *strings[] = {
+        "",
+        "Hello, world",
+        "\xc2\x80",
+        "caf\xc3\xa9",
+        "\xe0\xa0\x80",
+        "\xed\x9f\xbf",
+        "\xee\x80\x80",
+        "\xef\xbf\xbf",
+        "\xf0\x90\x80\x80",
+        "\xf4\x8f\xbf\xbf",
+        "\xce\xba\xe1\xbd\xb9\xcf\x83\xce\xbc\xce\xb5",
+    };
+
+    for(int i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+        if(!utf8_valid(strings[i])) {
+            fail_msg("Rejected string %d", i);
+        }
+    }
+}
+
+static void test__websocket_utf8_valid__rejects_invalid_strings(void **states)
+{
+    const char *strings[] = {
+        "\x80",
+        "\xbf",
+        "\xc0\x80",
+        "\xc1\xbf",
+        "\xc3",
+        "\xc3\x28",
+        "\xe0\x80\x80",
+        "\xe0\x9f\xbf",
+        "\xed\xa0\x80",
+        "\xed\xbf\xbf",
+        "\xe1\x80",
+        "\xf0\x80\x80\x80",
+        "\xf0\x8f\xbf\xbf",
+        "\xf4\x90\x80\x80",
+        "\xf5\x80\x80\x80",
+        "\xf0\x90\x80",
+        "\xf0\x90\x80\x28",
+        "\xfe",
+        "\xff",
+    };
+
+    for(int i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+        if(utf8_valid(strings[i])) {
+            fail_msg("Accepted string %d", i);
+        }
+    }
+}
+
+static void test__websocket_utf8_valid__finds_error_at_every_position(void **states)
+{
+    uint8_t buf[100];
+
+    // Covers the vector, word and byte loops, and sequences straddling their boundaries
+    for(int pos = 0; pos < sizeof(buf) - 1; pos++) {
+        memset(buf, 'a', sizeof(buf));
+
+        buf[pos] = 0xc3;
+        buf[pos + 1] = 0xa9;
+        assert_true(websocket_utf8_valid(buf, sizeof(buf)));
+
+        buf[pos + 1] = 'a';
+        assert_false(websocket_utf8_valid(buf, sizeof(buf)));
+        assert_true(websocket_utf8_valid(buf, pos));
+    }
+}
+
+const struct CMUnitTest tests_for_websocket_utf8[] = {
+    cmocka_unit_test(test__websocket_utf8_valid__accepts_valid_strings),
+    cmocka_unit_test(test__websocket_utf8_valid__rejects_invalid_strings),
+    cmocka_unit_test(test__websocket_utf8_valid__finds_error_at_every_position),
+};
+
+int main(void)
+{
+    int fails = 0;
+    fails += cmocka_run_group_tests(tests_for_websocket_utf8, NULL, NULL);
+
+    return fails;
+}
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <cmocka.h>
+
+#include "http-sm/http.h"
+#include "http-sm/websocket.h"
+#include "http-private.h"
+
+#include "test-util.h"
+
+// Helpers /////////////////////////////////////////////////////////////////////
+
+static int peer_fd;
+
+// Answers with the message in upper case, so replies can be told from the messages
+static void upper_case(struct websocket_connection *conn, const uint8_t *data, size_t len, enum websocket_frame_opcode opcode)
+{
+    char buf[64];
+    assert_true(len <= sizeof(buf));
+
+    for(int i = 0; i < len; i++) {
+        buf[i] = (data[i] >= 'a' && data[i] <= 'z') ? data[i] - 'a' + 'A' : data[i];
+    }
+
+    // Take a little time, so messages pile up behind each other
+    usleep(100);
+
+    websocket_reply(conn, buf, len, opcode);
+}
+
+static void init_conn(struct http_server *server, struct websocket_connection *conn, struct websocket_url_handler *handler)
+{
+    memset(handler, 0, sizeof(*handler));
+    handler->cb_message_full = upper_case;
+    handler->threaded = 1;
+
+    int fds[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = fds[0];
+    conn->handler = handler;
+    websocket_queue_init(conn);
+    peer_fd = fds[1];
+
+    memset(server, 0, sizeof(*server));
+    server->websocket_connections = conn;
+    conn->pprev = &server->websocket_connections;
+
+    assert_int_equal(websocket_channel_init(), 0);
+}
+
+// Run the part of the server loop that hands replies over until the workers are done with conn
+static void wait_for_jobs(struct http_server *server, struct websocket_connection *conn)
+{
+    for(int i = 0; conn->jobs && (i < 1000); i++) {
+        struct pollfd pfd = { .fd = websocket_channel_wake_fd(), .events = POLLIN };
+        poll(&pfd, 1, 10);
+
+        websocket_channel_dispatch(server);
+        websocket_worker_dispatch(server);
+    }
+
+    assert_int_equal(conn->jobs, 0);
+}
+
+// Tests ///////////////////////////////////////////////////////////////////////
+
+static void test__websocket_worker__replies_in_message_order(void **states)
+{
+    struct http_server server;
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+    init_conn(&server, &conn, &handler);
+
+    const int count = 50;
+
+    for(int i = 0; i < count; i++) {
+        char msg[16];
+        int len = snprintf(msg, sizeof(msg), "msg%02d", i);
+        assert_int_equal(websocket_worker_submit(&conn, (const uint8_t *)msg, len, WEBSOCKET_FRAME_OPCODE_TEXT), 0);
+    }
+
+    wait_for_jobs(&server, &conn);
+
+    // Each reply is a 7 byte frame
+    char buf[7 * 50 + 1];
+    int n = 0;
+    while(n < 7 * count) {
+        int ret = recv(peer_fd, buf + n, sizeof(buf) - n, MSG_DONTWAIT);
+        assert_true(ret > 0);
+        n += ret;
+    }
+    assert_int_equal(n, 7 * count);
+
+    for(int i = 0; i < count; i++) {
+        char expected[16];
+        snprintf(expected, sizeof(expected), "MSG%02d", i);
+
+        assert_int_equal((uint8_t)buf[7 * i], WEBSOCKET_FRAME_FIN | WEBSOCKET_FRAME_OPCODE_TEXT);
+        assert_int_equal(buf[7 * i + 1], 5);
+        assert_memory_equal(buf + 7 * i + 2, expected, 5);
+    }
+
+    websocket_queue_clear(&conn);
+    close(conn.fd);
+    close(peer_fd);
+}
+
+static void test__websocket_worker__refuses_messages_over_the_job_limit(void **states)
+{
+    struct http_server server;
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+    init_conn(&server, &conn, &handler);
+
+    conn.jobs = WEBSOCKET_WORKER_MAX_JOBS;
+    assert_int_equal(websocket_worker_submit(&conn, (const uint8_t *)"x", 1, WEBSOCKET_FRAME_OPCODE_TEXT), -2);
+    conn.jobs = 0;
+
+    close(conn.fd);
+    close(peer_fd);
+}
+
+static void test__websocket_worker__hands_back_closed_connection_when_done(void **states)
+{
+    struct http_server server;
+    struct websocket_connection conn;
+    struct websocket_url_handler handler;
+    init_conn(&server, &conn, &handler);
+
+    assert_int_equal(websocket_worker_submit(&conn, (const uint8_t *)"abc", 3, WEBSOCKET_FRAME_OPCODE_TEXT), 0);
+    assert_int_equal(conn.jobs, 1);
+
+    // Closed while the worker has it, so the reply is dropped
+    close(conn.fd);
+    conn.fd = -1;
+
+    wait_for_jobs(&server, &conn);
+
+    assert_ptr_equal(websocket_take_dirty(), &conn);
+    assert_null(websocket_take_dirty());
+
+    char buf[16];
+    assert_int_equal(recv(peer_fd, buf, sizeof(buf), MSG_DONTWAIT), 0);
+
+    close(peer_fd);
+}
+
+// Main ////////////////////////////////////////////////////////////////////////
+
+const struct CMUnitTest tests_for_websocket_worker[] = {
+    cmocka_unit_test(test__websocket_worker__replies_in_message_order),
+    cmocka_unit_test(test__websocket_worker__refuses_messages_over_the_job_limit),
+    cmocka_unit_test(test__websocket_worker__hands_back_closed_connection_when_done),
+};
+
+int main(void)
+{
+    int fails = 0;
+    fails += cmocka_run_group_tests(tests_for_websocket_worker, NULL, NULL);
+
+    return fails;
+}